@@ -0,0 +1,482 @@
+//
+//  BoardFinder.cpp
+//  zoomboard_server
+//
+//  Finds the aruco markers on the corners of the board, and tracks them between detections.
+//
+
+#include "BoardFinder.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+#include <log4cxx/logger.h>
+#include "opencv2/imgproc.hpp"
+#include "opencv2/video/tracking.hpp"
+
+namespace
+{
+    static constexpr std::size_t N_MARKERS = 4;                    ///< number of markers on the board
+    static constexpr int MIN_DETECTION_WIDTH = 480;                ///< the markers are detected on the image halved until it would be narrower than this
+    static constexpr int EDGE_SEARCH_RANGE = 2;                    ///< how far the marker edges are searched for, in pixels at the detection level
+    static constexpr int EDGE_SEARCH_MARGIN = 2;                   ///< extra distance the marker edges are searched for, in full resolution pixels
+    static constexpr float EDGE_MARGIN = 0.15f;                    ///< fraction of each end of a marker side that is not searched, as the corners blur it
+    static constexpr float EDGE_SAMPLE_STEP = 2.f;                 ///< distance between the points the marker edges are searched for at, in pixels
+    static constexpr int MIN_EDGE_SAMPLES = 4;                     ///< fewest points found on a marker edge to fit a line to it
+    static constexpr float MIN_EDGE_CONTRAST = 10.f;               ///< smallest brightness step across a marker edge, over 2 pixels
+    static const cv::Size TRACKING_WINDOW(15, 15);                 ///< window the marker corners are tracked in, at each optical flow level
+    static constexpr int TRACKING_LEVELS = 3;                      ///< number of halved images the optical flow uses, to follow fast moves
+    static constexpr float MAX_TRACKING_ERROR = 0.5f;              ///< largest forward-backward tracking error, in pixels at the detection level
+
+    // Initialize logger
+    log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd.perspective"));
+
+    /// @return number of times an image is halved before the markers are detected on it
+    /// @param[in] imgSize size of the image
+    int getDetectionLevel(const cv::Size& imgSize)
+    {
+        int level = 0;
+        while ( (imgSize.width >> (level + 1)) >= MIN_DETECTION_WIDTH )
+        {
+            ++level;
+        }
+        return level;
+    }
+
+    /// @return the location of a point at the detection level in the full resolution image
+    /// @param[in] pt point at the detection level
+    /// @param[in] level detection level
+    cv::Point2f toFullResolution(const cv::Point2f& pt, int level)
+    {
+        // pixel x of each level is centered on pixel 2x + 0.5 of the level below
+        return level == 0 ? pt : (pt + cv::Point2f(0.5f, 0.5f)) * (float) (1 << level) - cv::Point2f(0.5f, 0.5f);
+    }
+
+    /// @return the location of a point of the full resolution image at the detection level
+    /// @param[in] pt point in the full resolution image
+    /// @param[in] level detection level
+    cv::Point2f toDetectionLevel(const cv::Point2f& pt, int level)
+    {
+        return level == 0 ? pt : (pt + cv::Point2f(0.5f, 0.5f)) * (1.f / (1 << level)) - cv::Point2f(0.5f, 0.5f);
+    }
+
+    /// Samples a grayscale image between pixels, with bilinear interpolation
+    /// @param[in] img grayscale image
+    /// @param[in] pt location to sample
+    /// @return the sampled value, or a negative value if the location is not inside the image
+    float sampleBilinear(const cv::Mat& img, const cv::Point2f& pt)
+    {
+        const int x = (int) std::floor(pt.x), y = (int) std::floor(pt.y);
+        if ( (x < 0) || (y < 0) || (x + 1 >= img.cols) || (y + 1 >= img.rows) )
+        {
+            return -1.f;
+        }
+        const float fx = pt.x - x, fy = pt.y - y;
+        const std::uint8_t* row0 = img.ptr<std::uint8_t>(y) + x;
+        const std::uint8_t* row1 = img.ptr<std::uint8_t>(y + 1) + x;
+        return (row0[0] * (1.f - fx) + row0[1] * fx) * (1.f - fy) + (row1[0] * (1.f - fx) + row1[1] * fx) * fy;
+    }
+
+    /// Finds the outer edge of a marker along one of its sides, where the black border of the marker meets the white margin around it.
+    /// The edge is searched for along the normal of the side at points spread over it, and a line is fit to the points found.
+    /// Only steps from dark to light going outwards are taken, so the edges of the marker's bits, which are further in, or go from
+    /// light to dark, are not mistaken for it.
+    /// @param[in] img full resolution grayscale image
+    /// @param[in] p0 corner the side starts at
+    /// @param[in] p1 corner the side ends at
+    /// @param[in] center center of the marker
+    /// @param[in] range distance from the side that the edge is searched up to, in pixels
+    /// @param[out] line the edge, as (vx, vy, x0, y0) from cv::fitLine
+    /// @return true if the edge is found
+    bool findEdge(const cv::Mat& img, const cv::Point2f& p0, const cv::Point2f& p1, const cv::Point2f& center, int range, cv::Vec4f& line)
+    {
+        const cv::Point2f side = p1 - p0;
+        const float length = (float) cv::norm(side);
+        if (length < 1.f)
+        {
+            return false;
+        }
+        cv::Point2f normal(side.y / length, -side.x / length);
+        if (normal.dot(0.5f * (p0 + p1) - center) < 0.f)
+        {
+            normal = -normal;   //point out of the marker
+        }
+        const int nSamples = std::max(MIN_EDGE_SAMPLES, (int) ((1.f - 2.f * EDGE_MARGIN) * length / EDGE_SAMPLE_STEP));
+        std::vector<float> profile(2 * range + 3);  //brightness from range + 1 pixels inside the side to range + 1 pixels outside
+        std::vector<cv::Point2f> edgePoints;
+        edgePoints.reserve(nSamples);
+        for (int s = 0; s < nSamples; ++s)
+        {
+            const cv::Point2f pt = p0 + side * (EDGE_MARGIN + (1.f - 2.f * EDGE_MARGIN) * (s + 0.5f) / nSamples);
+            bool isInside = true;
+            for (int k = 0; (k < (int) profile.size()) && isInside; ++k)
+            {
+                profile[k] = sampleBilinear(img, pt + normal * (float) (k - range - 1));
+                isInside = (profile[k] >= 0.f);
+            }
+            if (!isInside)
+            {
+                continue;
+            }
+            int best = 0;
+            float bestStep = 0.f;
+            for (int k = 1; k <= 2 * range + 1; ++k)
+            {
+                const float step = profile[k + 1] - profile[k - 1];
+                if (step > bestStep)
+                {
+                    bestStep = step;
+                    best = k;
+                }
+            }
+            if (bestStep < MIN_EDGE_CONTRAST)
+            {
+                continue;
+            }
+            // The sub-pixel location of the step is the peak of a parabola through the steps around it
+            float offset = 0.f;
+            if ( (best > 1) && (best < 2 * range + 1) )
+            {
+                const float prevStep = profile[best] - profile[best - 2], nextStep = profile[best + 2] - profile[best];
+                const float curvature = prevStep - 2.f * bestStep + nextStep;
+                if (curvature < 0.f)
+                {
+                    offset = 0.5f * (prevStep - nextStep) / curvature;
+                }
+            }
+            edgePoints.push_back(pt + normal * ((float) (best - range - 1) + offset));
+        }
+        if ((int) edgePoints.size() < MIN_EDGE_SAMPLES)
+        {
+            return false;
+        }
+        cv::fitLine(edgePoints, line, cv::DIST_HUBER, 0, 0.01, 0.01);
+        return true;
+    }
+
+    /// Intersects two lines
+    /// @param[in] a first line, as (vx, vy, x0, y0)
+    /// @param[in] b second line, as (vx, vy, x0, y0)
+    /// @param[out] pt the intersection
+    /// @return false if the lines are parallel
+    bool intersect(const cv::Vec4f& a, const cv::Vec4f& b, cv::Point2f& pt)
+    {
+        const float det = a[0] * b[1] - a[1] * b[0];
+        if (std::abs(det) < 1E-6f)
+        {
+            return false;
+        }
+        const float t = ((b[2] - a[2]) * b[1] - (b[3] - a[3]) * b[0]) / det;
+        pt = cv::Point2f(a[2] + t * a[0], a[3] + t * a[1]);
+        return true;
+    }
+
+    /// Refines the corners of a marker to the intersections of its outer edges
+    /// @param[in] img full resolution grayscale image
+    /// @param[in, out] quad the 4 corners of the marker, in order around it. They are not changed if any edge is not found.
+    /// @param[in] range distance from the sides of the marker that its edges are searched up to, in pixels
+    /// @return true if the corners are refined
+    bool refineMarker(const cv::Mat& img, cv::Point2f* quad, int range)
+    {
+        const cv::Point2f center = 0.25f * (quad[0] + quad[1] + quad[2] + quad[3]);
+        cv::Vec4f edges[4];
+        for (int j = 0; j < 4; ++j)
+        {
+            if (!findEdge(img, quad[j], quad[(j + 1) % 4], center, range, edges[j]))
+            {
+                return false;
+            }
+        }
+        cv::Point2f refined[4];
+        for (int j = 0; j < 4; ++j)
+        {
+            // corner j is where the side ending at it meets the side starting at it
+            if (!intersect(edges[(j + 3) % 4], edges[j], refined[j]) || (cv::norm(refined[j] - quad[j]) > 2 * range))
+            {
+                return false;
+            }
+        }
+        std::copy(refined, refined + 4, quad);
+        return true;
+    }
+}   //::<anon>
+
+BoardFinder::BoardFinder(const std::string& calibrationFile):
+pDict_(nullptr),
+pParams_(cv::aruco::DetectorParameters::create()),
+pQuadDetector_(nullptr),
+isTracking_(false),
+trackingLevel_(0)
+{
+    corners_.reserve(16);
+    ids_.reserve(4);
+    cv::Mat markers;
+    int markerSz=0;
+    try
+    {
+        cv::FileStorage fs(calibrationFile, cv::FileStorage::READ);
+        fs["markers"] >> markers;
+        fs["marker_size"] >> markerSz;
+        if ( !fs["camera_matrix"].empty() )
+        {
+            LOG4CXX_DEBUG(logger, "Initializing camera matrix");
+            fs["camera_matrix"] >> cameraMatrix_;
+        }
+        else
+        {
+            assert(cameraMatrix_.empty());
+        }
+        if ( !fs["distortion_coefficients"].empty() )
+        {
+            fs["distortion_coefficients"] >> distCoeffs_;
+        }
+        else
+        {
+            assert(distCoeffs_.empty());
+        }
+    }
+    catch (std::exception& err)
+    {
+        std::throw_with_nested( std::runtime_error("Unable to read calibration information from " + calibrationFile) );
+    }
+    assert( !markers.empty() && (markerSz > 0) );
+    pDict_ = cv::makePtr<cv::aruco::Dictionary>(markers, markerSz);
+    if (QuadMarkerDetector::isSupported(*pDict_))
+    {
+        pQuadDetector_.reset(new QuadMarkerDetector(*pDict_));
+        LOG4CXX_DEBUG(logger, "Detecting the " << markerSz << "x" << markerSz << " markers with a lookup table");
+    }
+    else
+    {
+        LOG4CXX_DEBUG(logger, "Detecting the " << markerSz << "x" << markerSz << " markers with cv::aruco");
+    }
+}
+
+int BoardFinder::prepare(const cv::Mat& img)
+{
+    if (img.channels() == 1)
+    {
+        gray_ = img;
+    }
+    else
+    {
+        cv::cvtColor(img, gray_, cv::COLOR_BGR2GRAY);
+    }
+    const int level = getDetectionLevel(gray_.size());
+    pyramid_.resize(level);
+    for (int l = 0; l < level; ++l)
+    {
+        cv::pyrDown(l == 0 ? gray_ : pyramid_[l - 1], pyramid_[l]);
+    }
+    return level;
+}
+
+void BoardFinder::refine(std::vector<cv::Point2f>& points, int level) const
+{
+    assert(points.size() % 4 == 0);
+    const int range = (EDGE_SEARCH_RANGE << level) + EDGE_SEARCH_MARGIN;   //the coarse corners can be off by a pixel or two at the detection level
+    for (std::size_t n = 0; n < points.size(); n += 4)
+    {
+        refineMarker(gray_, &points[n], range);
+    }
+}
+
+void BoardFinder::startTracking(const std::vector< std::vector<cv::Point2f> >& sortedCorners, int level)
+{
+    isTracking_ = std::all_of(sortedCorners.begin(), sortedCorners.end(), [](const std::vector<cv::Point2f>& c){return !c.empty();});
+    if (!isTracking_)
+    {
+        return;
+    }
+    trackingLevel_ = level;
+    trackingSize_ = gray_.size();
+    trackedPoints_.clear();
+    for (const auto& markerCorners: sortedCorners)
+    {
+        for (const auto& pt: markerCorners)
+        {
+            trackedPoints_.push_back(toDetectionLevel(pt, level));
+        }
+    }
+    cv::buildOpticalFlowPyramid(getLevelImage(level), prevFlowPyramid_, TRACKING_WINDOW, TRACKING_LEVELS,
+                                true, cv::BORDER_REFLECT_101, cv::BORDER_CONSTANT, false);
+}
+
+void BoardFinder::detect(const cv::Mat& img, double scale, bool isGeneric)
+{
+    corners_.clear();
+    ids_.clear();
+    if (pQuadDetector_ && !isGeneric)
+    {
+        pQuadDetector_->detect(img, corners_, ids_);
+        return;
+    }
+    cv::Mat K;
+    if (!cameraMatrix_.empty())
+    {
+        cameraMatrix_.convertTo(K, CV_64F);
+        K.rowRange(0, 2) *= scale;
+    }
+    cv::aruco::detectMarkers(img, pDict_, corners_, ids_, pParams_, cv::noArray(),
+                             K.empty() ? cv::noArray() : K,
+                             distCoeffs_.empty() ? cv::noArray() : distCoeffs_
+                             );
+    assert(corners_.size() == ids_.size());
+}
+
+std::vector< std::vector<cv::Point2f> > BoardFinder::sortById(const std::vector<cv::Point2f>& points) const
+{
+    assert(points.size() == 4 * ids_.size());
+    std::vector< std::vector<cv::Point2f> > sortedCorners(N_MARKERS);
+    for (std::size_t n = 0; n < ids_.size(); ++n)
+    {
+        if ( (ids_[n] >= 0) && (ids_[n] < (int) N_MARKERS) )
+        {
+            sortedCorners[ids_[n]].assign(points.begin() + 4 * n, points.begin() + 4 * (n + 1));
+        }
+    }
+    return sortedCorners;
+}
+
+std::vector< std::vector<cv::Point2f> > BoardFinder::getCorners(const cv::Mat& img)
+{
+    int level = prepare(img);
+    //Find markers
+    detect(getLevelImage(level), 1. / (1 << level));
+    // Small markers may not be found at the detection level, so the missing ones are searched for at twice the resolution
+    for (int finerLevel = level - 1; (finerLevel >= 0) && (ids_.size() < N_MARKERS); --finerLevel)
+    {
+        auto corners = std::move(corners_);
+        auto ids = std::move(ids_);
+        detect(getLevelImage(finerLevel), 1. / (1 << finerLevel));
+        if (ids_.size() > ids.size())
+        {
+            LOG4CXX_DEBUG(logger, "Found " << ids_.size() << " markers at 1/" << (1 << finerLevel) << " resolution, "
+                          << ids.size() << " at 1/" << (1 << level));
+            level = finerLevel;
+        }
+        else
+        {
+            corners_ = std::move(corners);
+            ids_ = std::move(ids);
+        }
+    }
+
+    // Move the corners to the full resolution image & refine them there
+    std::vector<cv::Point2f> points;
+    points.reserve(4 * corners_.size());
+    for (const auto& markerCorners: corners_)
+    {
+        for (const auto& pt: markerCorners)
+        {
+            points.push_back(toFullResolution(pt, level));
+        }
+    }
+    if (!points.empty())
+    {
+        const std::vector<cv::Point2f> coarsePoints = points;
+        refine(points, level);
+        float shift = 0.f;
+        for (std::size_t i = 0; i < points.size(); ++i)
+        {
+            shift += (float) cv::norm(points[i] - coarsePoints[i]);
+        }
+        LOG4CXX_DEBUG(logger, "Detected " << corners_.size() << " markers at 1/" << (1 << level) << " resolution, corners moved by "
+                      << shift / points.size() << " pixels on average when refined");
+    }
+    /// Sort markers
+    std::vector< std::vector<cv::Point2f> > sortedCorners = sortById(points);
+#ifdef CHECK_MARKER_CORNERS
+    // Compare with the corners cv::aruco detects at full resolution, which are themselves only accurate to about a pixel
+    if (!points.empty())
+    {
+        const auto arucoCorners = getArucoCorners(gray_);
+        float maxError = 0.f;
+        for (std::size_t i = 0; i < N_MARKERS; ++i)
+        {
+            if (arucoCorners[i].empty() != sortedCorners[i].empty())
+            {
+                LOG4CXX_INFO(logger, "Marker " << i << " is only found by " << (sortedCorners[i].empty() ? "cv::aruco" : "the board finder"));
+                continue;
+            }
+            for (std::size_t j = 0; j < arucoCorners[i].size(); ++j)
+            {
+                maxError = std::max(maxError, (float) cv::norm(arucoCorners[i][j] - sortedCorners[i][j]));
+            }
+        }
+        LOG4CXX_INFO(logger, "Largest difference from the corners cv::aruco detects at full resolution: " << maxError << " pixels");
+    }
+#endif
+    startTracking(sortedCorners, level);
+    return sortedCorners;
+}
+
+std::vector< std::vector<cv::Point2f> > BoardFinder::trackCorners(const cv::Mat& img)
+{
+    assert(isTracking_);
+    std::vector< std::vector<cv::Point2f> > sortedCorners;
+    const int level = prepare(img);
+    if ( (trackingLevel_ > level) || (gray_.size() != trackingSize_) )
+    {
+        LOG4CXX_DEBUG(logger, "Image size changed, cannot track the markers");
+        isTracking_ = false;
+        return sortedCorners;
+    }
+    cv::buildOpticalFlowPyramid(getLevelImage(trackingLevel_), flowPyramid_, TRACKING_WINDOW, TRACKING_LEVELS,
+                                true, cv::BORDER_REFLECT_101, cv::BORDER_CONSTANT, false);
+    cv::calcOpticalFlowPyrLK(prevFlowPyramid_, flowPyramid_, trackedPoints_, flowPoints_, status_, errors_, TRACKING_WINDOW, TRACKING_LEVELS);
+    cv::calcOpticalFlowPyrLK(flowPyramid_, prevFlowPyramid_, flowPoints_, backPoints_, backStatus_, errors_, TRACKING_WINDOW, TRACKING_LEVELS);
+    float maxError = 0.f;
+    for (std::size_t i = 0; (i < trackedPoints_.size()) && isTracking_; ++i)
+    {
+        const float error = (float) cv::norm(backPoints_[i] - trackedPoints_[i]);
+        maxError = std::max(maxError, error);
+        isTracking_ = status_[i] && backStatus_[i] && (error <= MAX_TRACKING_ERROR);
+    }
+    if (!isTracking_)
+    {
+        LOG4CXX_DEBUG(logger, "Lost track of the markers, largest forward-backward error: " << maxError << " pixels");
+        return sortedCorners;
+    }
+    std::vector<cv::Point2f> points;
+    points.reserve(flowPoints_.size());
+    for (const auto& pt: flowPoints_)
+    {
+        points.push_back(toFullResolution(pt, trackingLevel_));
+    }
+    refine(points, trackingLevel_);
+    sortedCorners.resize(N_MARKERS);
+    for (std::size_t n = 0; n < N_MARKERS; ++n)
+    {
+        sortedCorners[n].assign(points.begin() + 4 * n, points.begin() + 4 * (n + 1));
+    }
+    // Track the refined corners from this image on, so that the flow errors do not add up
+    std::swap(prevFlowPyramid_, flowPyramid_);
+    for (std::size_t i = 0; i < points.size(); ++i)
+    {
+        trackedPoints_[i] = toDetectionLevel(points[i], trackingLevel_);
+    }
+    return sortedCorners;
+}
+
+std::vector< std::vector<cv::Point2f> > BoardFinder::getArucoCorners(const cv::Mat& img)
+{
+    if (img.channels() == 1)
+    {
+        gray_ = img;
+    }
+    else
+    {
+        cv::cvtColor(img, gray_, cv::COLOR_BGR2GRAY);
+    }
+    detect(gray_, 1., true);
+    std::vector<cv::Point2f> points;
+    points.reserve(4 * corners_.size());
+    for (const auto& markerCorners: corners_)
+    {
+        points.insert(points.end(), markerCorners.begin(), markerCorners.end());
+    }
+    return sortById(points);
+}
@@ -0,0 +1,118 @@
+//
+//  BoardFinder.hpp
+//  zoomboard_server
+//
+//  Finds the aruco markers on the corners of the board, and tracks them between detections.
+//
+
+#ifndef BoardFinder_hpp
+#define BoardFinder_hpp
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/aruco.hpp>
+#include "QuadMarkerDetector.hpp"
+
+/// @class Finds the 4 aruco markers on the corners of the board in the camera images. The markers are detected on a reduced
+/// resolution image, and their corners are then refined in the full resolution image by fitting lines to the outer edges of each
+/// marker. Once all 4 markers are found, they can be tracked in the following images with optical flow, which is much cheaper.
+class BoardFinder
+{
+public:
+    /// Ctor, reads the markers & the camera calibration
+    /// @param[in] calibrationFile calibration file that contains info re: camera calibration and aruco markers
+    /// @throw std::runtime_error if the calibration file cannot be read
+    explicit BoardFinder(const std::string& calibrationFile);
+
+    /// @return the camera matrix, or an empty matrix if the calibration file does not have one
+    inline const cv::Mat& cameraMatrix() const {return cameraMatrix_;}
+
+    /// @return the lens distortion coefficients, or an empty matrix if the calibration file does not have them
+    inline const cv::Mat& distCoeffs() const {return distCoeffs_;}
+
+    /// Finds and returns the corners of the aruco markers seen in the image.
+    /// The markers are large, so they are detected on a grayscale image that is halved while it is at least twice
+    /// MIN_DETECTION_WIDTH wide. Markers that are not found there are searched for at twice the resolution, up to the full resolution,
+    /// so that small markers are still found. The corners are then refined to sub-pixel accuracy in the full resolution image.
+    /// If all 4 markers are found, they are tracked from this image on; see trackCorners().
+    /// @param[in] img input image to search for markers, BGR or grayscale
+    /// @return a vector of markers
+    /// There should be 4 markers, and the returned vector _corners_ is always of size 4
+    /// The markers are sorted such that _corners_[i] always corresponds to the i'th marker.
+    /// If a marker i is not visible, than _corners_[i] is empty.
+    std::vector< std::vector<cv::Point2f> > getCorners(const cv::Mat& img);
+
+    /// @return true if the markers found by the last call to getCorners() are being tracked
+    inline bool isTracking() const {return isTracking_;}
+
+    /// Follows the markers from the previous image with pyramidal Lucas-Kanade optical flow, which is much cheaper than
+    /// finding them again. The flow is calculated at the resolution the markers were found at, and the corners are then refined at
+    /// full resolution. Each corner is also tracked back to the previous image; if any of them is lost or does not come back to
+    /// within MAX_TRACKING_ERROR pixels of where it started, tracking stops until the markers are found again with getCorners().
+    /// @param[in] img input image following the previous one, BGR or grayscale
+    /// @return the corners of the 4 markers, sorted by id as in getCorners(), or an empty vector if tracking is lost
+    std::vector< std::vector<cv::Point2f> > trackCorners(const cv::Mat& img);
+
+    /// Detects the markers with cv::aruco in the full resolution image, without the reduced resolution search, the lookup table
+    /// detector or the corner refinement of getCorners(), to check its results. The tracking state is not changed.
+    /// @param[in] img input image to search for markers, BGR or grayscale
+    /// @return the corners of the markers, sorted by id as in getCorners()
+    std::vector< std::vector<cv::Point2f> > getArucoCorners(const cv::Mat& img);
+
+private:
+    std::vector< std::vector<cv::Point2f> > corners_;   ///< detected corners of the markers
+    std::vector<int> ids_;                              ///< id's of the detected markers
+    cv::Mat cameraMatrix_;                              ///< camera matrix
+    cv::Mat distCoeffs_;                                ///< distortion coefficients
+    cv::Ptr<cv::aruco::Dictionary> pDict_;              ///< pointer to the dictionary of aruco markers
+    cv::Ptr<cv::aruco::DetectorParameters> pParams_;    ///< marker detection parameters
+    std::unique_ptr<QuadMarkerDetector> pQuadDetector_; ///< detector for small dictionaries, or null to use cv::aruco
+    cv::Mat gray_;                                      ///< buffer for the full resolution grayscale image
+    std::vector<cv::Mat> pyramid_;                      ///< buffers for the halved grayscale images
+    bool isTracking_;                                   ///< whether the markers are tracked from the previous image
+    int trackingLevel_;                                 ///< level the markers are tracked at, i.e. the finest level any was found at
+    cv::Size trackingSize_;                             ///< size of the images the markers are tracked in
+    std::vector<cv::Mat> prevFlowPyramid_;              ///< optical flow pyramid of the previous image
+    std::vector<cv::Mat> flowPyramid_;                  ///< optical flow pyramid of the current image
+    std::vector<cv::Point2f> trackedPoints_;            ///< corners of the 4 markers in the previous image, at the detection level
+    std::vector<cv::Point2f> flowPoints_;               ///< buffer for the corners tracked to the current image
+    std::vector<cv::Point2f> backPoints_;               ///< buffer for the corners tracked back to the previous image
+    std::vector<std::uint8_t> status_;                  ///< buffer for the forward tracking status
+    std::vector<std::uint8_t> backStatus_;              ///< buffer for the backward tracking status
+    std::vector<float> errors_;                         ///< buffer for the tracking errors, unused
+
+    /// Makes the grayscale image & its halved images
+    /// @param[in] img input image, BGR or grayscale
+    /// @return the detection level, i.e. the number of halved images
+    int prepare(const cv::Mat& img);
+
+    /// @return the grayscale image halved a number of times
+    /// @param[in] level number of times the image is halved, up to the level returned by prepare()
+    inline const cv::Mat& getLevelImage(int level) const {return level == 0 ? gray_ : pyramid_[level - 1];}
+
+    /// Refines the corners of the markers to sub-pixel accuracy in the full resolution image. The corners of a marker are left as
+    /// they are if any of its outer edges cannot be found.
+    /// @param[in, out] points corners in the full resolution image, 4 for each marker
+    /// @param[in] level level the corners were found at, which sets how far from the corners the edges are searched for
+    void refine(std::vector<cv::Point2f>& points, int level) const;
+
+    /// Starts tracking the markers from the current image if all of them are found, stops tracking otherwise
+    /// @param[in] sortedCorners corners of the markers in the full resolution image, sorted by id
+    /// @param[in] level level to track the markers at
+    void startTracking(const std::vector< std::vector<cv::Point2f> >& sortedCorners, int level);
+
+    /// Detects the markers
+    /// @param[in] img grayscale image
+    /// @param[in] scale scale of the image relative to the full resolution image, for the camera matrix
+    /// @param[in] isGeneric if true, cv::aruco is used even if the dictionary is small enough for the lookup table detector
+    void detect(const cv::Mat& img, double scale, bool isGeneric=false);
+
+    /// @return the corners of the markers sorted by id: one entry for each of the 4 markers, empty if the marker is not found
+    /// @param[in] points corners of the detected markers, 4 for each of ids_
+    std::vector< std::vector<cv::Point2f> > sortById(const std::vector<cv::Point2f>& points) const;
+};  //::BoardFinder
+
+#endif /* BoardFinder_hpp */
@@ -0,0 +1,515 @@
+//
+//  EncodeScheduler.cpp
+//  zoomboard_server
+//
+//  Encodes all outputs on a fixed number of threads, instead of a thread per output.
+//
+
+#include "EncodeScheduler.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <log4cxx/logger.h>
+#include <log4cxx/mdc.h>
+#include "common.hpp"
+#include "ThreadManager.hpp"
+
+extern ThreadManager g_ThreadMan;
+
+namespace
+{
+    static const std::size_t STATS_INTERVAL = 300;                      ///< log the statistics of an output every this many frames
+    static constexpr double COST_SMOOTHING = 0.1;                       ///< weight of the newest frame in the running mean of an output's encode time
+    static constexpr std::chrono::milliseconds POLL_INTERVAL{100};      ///< how often idle workers check whether the program has ended
+
+    // Initialize logger
+    log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd"));
+
+    typedef std::chrono::steady_clock Clock;
+
+    /// @return a duration in ms
+    /// @param[in] duration duration to convert
+    inline double toMs(Clock::duration duration)
+    {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    /// @class Throughput, encode time & latency of an output
+    class OutputStats
+    {
+    private:
+        std::size_t nFrames_;                   ///< number of frames encoded
+        double totalCost_;                      ///< total encode time in ms
+        double meanCost_;                       ///< running mean of the encode time in ms, weighted towards the recent frames
+        double maxLatency_;                     ///< longest latency in ms
+        std::vector<double> latencies_;         ///< latencies in ms since the last log
+        Clock::time_point first_;               ///< time the first frame was ready
+        Clock::time_point last_;                ///< time the last frame was encoded
+    public:
+        /// Ctor
+        OutputStats(): nFrames_(0), totalCost_(0.), meanCost_(0.), maxLatency_(0.), latencies_(), first_(), last_()
+        {
+            latencies_.reserve(STATS_INTERVAL);
+        }
+
+        /// Adds an encoded frame
+        /// @param[in] ready time the frame was ready to be encoded
+        /// @param[in] start time the encode started
+        /// @param[in] end time the encode finished
+        void add(Clock::time_point ready, Clock::time_point start, Clock::time_point end)
+        {
+            const double cost = toMs(end - start), latency = toMs(end - ready);
+            meanCost_ = (nFrames_ == 0 ? cost : (1. - COST_SMOOTHING) * meanCost_ + COST_SMOOTHING * cost);
+            if (nFrames_++ == 0)
+            {
+                first_ = ready;
+            }
+            last_ = end;
+            totalCost_ += cost;
+            maxLatency_ = std::max(maxLatency_, latency);
+            latencies_.push_back(latency);
+        }
+
+        /// @return true if the latencies of STATS_INTERVAL frames were added since the last log
+        inline bool isDue() const { return latencies_.size() >= STATS_INTERVAL; }
+
+        /// @return running mean of the encode time in ms
+        inline double meanCost() const { return meanCost_; }
+
+        /// @return total encode time in ms
+        inline double totalCost() const { return totalCost_; }
+
+        /// @return number of frames encoded
+        inline std::size_t nFrames() const { return nFrames_; }
+
+        /// @return number of frames encoded per second, from the first frame to the last one
+        double getThroughput() const
+        {
+            const double t = toMs(last_ - first_);
+            return (t > 0. ? 1000. * nFrames_ / t : 0.);
+        }
+
+        /// @return the statistics as text. The latency percentiles are over the frames since the last call, which start a new window.
+        std::string report()
+        {
+            std::ostringstream stream;
+            stream << "frames=" << nFrames_ << ", fps=" << getThroughput() << ", encode mean=" << (nFrames_ > 0 ? totalCost_ / nFrames_ : 0.)
+                << "ms, latency";
+            if (!latencies_.empty())
+            {
+                std::sort(latencies_.begin(), latencies_.end());
+                const auto getPercentile = [this](double p){
+                    return latencies_[std::min(latencies_.size() - 1, (std::size_t) std::ceil(p * latencies_.size()) - 1)];
+                };
+                stream << " p50=" << getPercentile(0.5) << "ms, p95=" << getPercentile(0.95) << "ms, p99=" << getPercentile(0.99)
+                    << "ms over the last " << latencies_.size() << " frames,";
+                latencies_.clear();
+            }
+            stream << " max=" << maxLatency_ << "ms";
+            return stream.str();
+        }
+    };  //::<anon>::OutputStats
+}   //::<anon>
+
+//=====================================================
+//
+//EncodeScheduler Implementation
+//
+//=====================================================
+class EncodeScheduler::Implementation:
+public std::enable_shared_from_this<EncodeScheduler::Implementation>
+{
+private:
+    /// @class An output, and its scheduling state
+    struct Output
+    {
+        std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pSub;  ///< subscription to the frames of the output
+        avtools::MediaWriter* pWriter;                                  ///< writer of the output
+        std::string name;                                               ///< name of the output, used in the logs
+        double interval;                                                ///< frame interval of the output in ms, or 0 if unknown
+        int nEncoderThreads;                                            ///< number of threads of the output's encoder
+        bool isReady;                                                   ///< true if the output has a frame, or its input is closed
+        bool isRunning;                                                 ///< true if a worker is encoding the output
+        bool isClosed;                                                  ///< true if the writer is closed
+        Clock::time_point readyTime;                                    ///< time the output became ready
+        OutputStats stats;                                              ///< output statistics. Only accessed by the worker that runs the output
+    };
+
+    const int nWorkers_;                        ///< maximum number of workers
+    std::vector<Output> outputs_;               ///< outputs, not resized once started
+    std::size_t nClosed_;                       ///< number of closed outputs
+    bool isStarted_;                            ///< true once the workers are started
+    Clock::time_point startTime_;               ///< time the workers were started
+    std::mutex mutex_;                          ///< guards the scheduling state of the outputs
+    std::condition_variable cv_;                ///< signals the workers when an output becomes ready, or all outputs are closed
+
+    /// Marks an output as ready, if it is not already. Called on the producer's thread when a frame is pushed to the output.
+    /// @param[in] index index of the output
+    void setReady(std::size_t index)
+    {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            Output& out = outputs_[index];
+            if (out.isReady || out.isClosed)
+            {
+                return;
+            }
+            out.isReady = true;
+            out.readyTime = Clock::now();
+        }
+        cv_.notify_one();
+    }
+
+    /// Waits for an output to be ready, and claims it. If the program has ended, every open output is claimed so it can be closed.
+    /// @param[out] readyTime time the claimed output became ready
+    /// @return the index of the claimed output, or -1 if all outputs are closed
+    int claim(Clock::time_point& readyTime)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        while (nClosed_ < outputs_.size())
+        {
+            const bool isEnded = g_ThreadMan.isEnded();
+            const auto now = Clock::now();
+            int best = -1;
+            double bestSlack = 0.;
+            for (std::size_t i = 0; i < outputs_.size(); ++i)
+            {
+                const Output& out = outputs_[i];
+                if (out.isRunning || out.isClosed || !(out.isReady || isEnded))
+                {
+                    continue;
+                }
+                // Time left until the frame misses its interval, once it is encoded
+                const double slack = toMs(out.readyTime - now) + out.interval - out.stats.meanCost();
+                if ( (best < 0) || (slack < bestSlack) )
+                {
+                    best = (int) i;
+                    bestSlack = slack;
+                }
+            }
+            if (best >= 0)
+            {
+                Output& out = outputs_[best];
+                out.isRunning = true;
+                out.isReady = false;
+                readyTime = out.readyTime;
+                return best;
+            }
+            cv_.wait_for(lk, POLL_INTERVAL);
+        }
+        return -1;
+    }
+
+    /// Releases an output claimed by a worker
+    /// @param[in] index index of the output
+    /// @param[in] isClosed true if the worker closed the output
+    void release(std::size_t index, bool isClosed)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        Output& out = outputs_[index];
+        assert(out.isRunning);
+        out.isRunning = false;
+        if (isClosed)
+        {
+            out.isClosed = true;
+            if (++nClosed_ == outputs_.size())
+            {
+                logSummary();
+            }
+            lk.unlock();
+            cv_.notify_all();
+            return;
+        }
+        // Frames that arrived while the output was being encoded are ready as of now
+        if (!out.isReady && out.pSub->isReady())
+        {
+            out.isReady = true;
+            out.readyTime = Clock::now();
+        }
+        const bool isReady = out.isReady;
+        lk.unlock();
+        if (isReady)
+        {
+            cv_.notify_one();
+        }
+    }
+
+    /// Encodes the next frame of an output, or closes it if its input is closed or the program has ended
+    /// @param[in] out claimed output
+    /// @param[in] readyTime time the output became ready
+    /// @return true if the output was closed
+    bool run(Output& out, Clock::time_point readyTime)
+    {
+        log4cxx::MDC::put("threadname", out.name);
+        try
+        {
+            if (!g_ThreadMan.isEnded())
+            {
+                std::uint64_t seq = 0;
+                auto pInFrame = out.pSub->tryPop(seq);
+                if (pInFrame)
+                {
+                    LOG4CXX_DEBUG(logger, "Writer received frame " << seq << ":\n" << pInFrame->info(1));
+                    //Push frame to filtergraph. The frame snapshot is ours, so the reader is free to publish new frames meanwhile.
+                    const auto start = Clock::now();
+                    out.pWriter->write(*pInFrame);
+                    out.stats.add(readyTime, start, Clock::now());
+                    if (out.stats.isDue())
+                    {
+                        LOG4CXX_INFO(logger, "Writer frame queue: " << out.pSub->stats());
+                        LOG4CXX_INFO(logger, "Encoder stats: " << out.stats.report());
+                    }
+                    return false;
+                }
+                if (!out.pSub->isReady())
+                {
+                    return false;
+                }
+                LOG4CXX_DEBUG(logger, "Writer input closed.");
+            }
+        }
+        catch (std::exception& err)
+        {
+            LOG4CXX_ERROR(logger, "Caught writer exception: " << err.what());
+            try
+            {
+                std::throw_with_nested( std::runtime_error("writer " + out.name + " error") );
+            }
+            catch (...)
+            {
+                g_ThreadMan.addException(std::current_exception());
+                g_ThreadMan.end();
+            }
+        }
+        close(out);
+        return true;
+    }
+
+    /// Closes an output
+    /// @param[in] out claimed output
+    void close(Output& out)
+    {
+        LOG4CXX_INFO(logger, "Writer frame queue: " << out.pSub->stats());
+        out.pSub->cancel();                 //do not let the producer wait on us anymore
+        out.pSub->setListener(nullptr);
+        try
+        {
+            LOG4CXX_DEBUG(logger, "Closing writer");
+            out.pWriter->write(nullptr, avtools::TimeBaseType{});
+        }
+        catch (std::exception& err)
+        {
+            LOG4CXX_ERROR(logger, "Caught writer exception: " << err.what());
+            try
+            {
+                std::throw_with_nested( std::runtime_error("Unable to close writer " + out.name) );
+            }
+            catch (...)
+            {
+                g_ThreadMan.addException(std::current_exception());
+                g_ThreadMan.end();
+            }
+        }
+    }
+
+    /// Logs the statistics of all outputs. Should be called with mutex_ held, once all outputs are closed.
+    void logSummary()
+    {
+        double totalCost = 0.;
+        std::size_t nFrames = 0;
+        int nEncoderThreads = 0;
+        for (const auto& out: outputs_)
+        {
+            totalCost += out.stats.totalCost();
+            nFrames += out.stats.nFrames();
+            nEncoderThreads += out.nEncoderThreads;
+        }
+        const double elapsed = toMs(Clock::now() - startTime_);
+        LOG4CXX_INFO(logger, "Encoded " << nFrames << " frames of " << outputs_.size() << " outputs on " << getWorkerCount()
+                     << " threads in " << elapsed / 1000. << "s (" << (elapsed > 0. ? 1000. * nFrames / elapsed : 0.) << " fps)");
+        for (auto& out: outputs_)
+        {
+            LOG4CXX_INFO(logger, "Output " << out.name << ": " << out.stats.report() << ", share of encode time=" << (totalCost > 0. ? 100. * out.stats.totalCost() / totalCost : 0.)
+                         << "%, encoder threads=" << out.nEncoderThreads << " of " << nEncoderThreads);
+        }
+    }
+
+    /// Worker thread loop
+    /// @param[in] index index of the worker, used in the logs
+    void work(int index)
+    {
+        const std::string name = "encoder" + std::to_string(index);
+        try
+        {
+            log4cxx::MDC::put("threadname", name);
+            Clock::time_point readyTime;
+            int i;
+            while ( (i = claim(readyTime)) >= 0 )
+            {
+                const bool isClosed = run(outputs_[i], readyTime);
+                release(i, isClosed);
+                log4cxx::MDC::put("threadname", name);
+            }
+        }
+        catch (std::exception& err)
+        {
+            try
+            {
+                std::throw_with_nested( std::runtime_error("Encoder thread error") );
+            }
+            catch (...)
+            {
+                g_ThreadMan.addException(std::current_exception());
+                g_ThreadMan.end();
+            }
+        }
+        LOG4CXX_DEBUG(logger, "Exiting thread: isEnded=" << std::boolalpha << g_ThreadMan.isEnded());
+    }
+
+public:
+    /// Ctor
+    /// @param[in] nWorkers maximum number of workers
+    explicit Implementation(int nWorkers):
+    nWorkers_(nWorkers),
+    outputs_(),
+    nClosed_(0),
+    isStarted_(false),
+    startTime_(),
+    mutex_(),
+    cv_()
+    {
+    }
+
+    /// @return number of worker threads
+    inline int getWorkerCount() const
+    {
+        return std::min(nWorkers_, (int) outputs_.size());
+    }
+
+    /// Adds an output
+    void addOutput(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pSub, avtools::MediaWriter& writer, int nEncoderThreads)
+    {
+        assert(pSub);
+        if (isStarted_)
+        {
+            throw std::logic_error("Cannot add outputs to an encode scheduler that is already started");
+        }
+        const AVRational frameRate = writer.getStream()->avg_frame_rate;
+        const double interval = ( (frameRate.num > 0) && (frameRate.den > 0) ? 1000. * frameRate.den / frameRate.num : 0. );
+        outputs_.push_back(Output{std::move(pSub), &writer, fs::path(writer.url()).stem().string() + " writer", interval, nEncoderThreads,
+            false, false, false, Clock::time_point(), OutputStats()});
+    }
+
+    /// Launches the worker threads
+    std::vector<std::thread> start()
+    {
+        if (isStarted_)
+        {
+            throw std::logic_error("Encode scheduler is already started");
+        }
+        isStarted_ = true;
+        startTime_ = Clock::now();
+        // The outputs are not added or removed from now on, so the listeners can refer to them by index
+        std::weak_ptr<Implementation> pWeak = shared_from_this();
+        for (std::size_t i = 0; i < outputs_.size(); ++i)
+        {
+            outputs_[i].pSub->setListener([pWeak, i](){
+                if (auto pImpl = pWeak.lock())
+                {
+                    pImpl->setReady(i);
+                }
+            });
+        }
+        LOG4CXX_INFO(logger, "Encoding " << outputs_.size() << " outputs on " << getWorkerCount() << " threads");
+        std::vector<std::thread> threads;
+        auto pImpl = shared_from_this();
+        for (int i = 0; i < getWorkerCount(); ++i)
+        {
+            threads.emplace_back([pImpl, i](){
+                pImpl->work(i);
+            });
+        }
+        return threads;
+    }
+};  //::EncodeScheduler::Implementation
+
+//=====================================================
+//
+//EncodeScheduler Definitions
+//
+//=====================================================
+std::vector<int> EncodeScheduler::splitThreads(const std::vector<double>& costs, int nThreads)
+{
+    std::vector<int> threads(costs.size(), 1);
+    const double totalCost = std::accumulate(costs.begin(), costs.end(), 0.);
+    if ( (nThreads <= (int) costs.size()) || (totalCost <= 0.) )
+    {
+        return threads;
+    }
+    // Each output gets its share of the threads rounded down, but at least one, and the rest go to the largest remainders
+    std::vector<double> remainders(costs.size());
+    int nLeft = nThreads;
+    for (std::size_t i = 0; i < costs.size(); ++i)
+    {
+        const double share = nThreads * costs[i] / totalCost;
+        threads[i] = std::max(1, (int) std::floor(share));
+        remainders[i] = share - threads[i];
+        nLeft -= threads[i];
+    }
+    for (; nLeft > 0; --nLeft)
+    {
+        const auto it = std::max_element(remainders.begin(), remainders.end());
+        ++threads[it - remainders.begin()];
+        *it -= 1.;
+    }
+    // Outputs that were raised to one thread take them from the outputs with the smallest remainders
+    for (; nLeft < 0; ++nLeft)
+    {
+        std::size_t iMin = costs.size();
+        for (std::size_t i = 0; i < costs.size(); ++i)
+        {
+            if ( (threads[i] > 1) && ((iMin == costs.size()) || (remainders[i] < remainders[iMin])) )
+            {
+                iMin = i;
+            }
+        }
+        assert(iMin < costs.size());
+        --threads[iMin];
+        remainders[iMin] += 1.;
+    }
+    return threads;
+}
+
+EncodeScheduler::EncodeScheduler(int nWorkers):
+pImpl_(nullptr)
+{
+    if (nWorkers < 1)
+    {
+        throw std::invalid_argument("Number of encode threads should be positive, found " + std::to_string(nWorkers));
+    }
+    pImpl_ = std::make_shared<Implementation>(nWorkers);
+    assert(pImpl_);
+}
+
+EncodeScheduler::~EncodeScheduler() = default;
+
+void EncodeScheduler::addOutput(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pSub, avtools::MediaWriter& writer, int nEncoderThreads)
+{
+    assert(pImpl_);
+    pImpl_->addOutput(std::move(pSub), writer, nEncoderThreads);
+}
+
+std::vector<std::thread> EncodeScheduler::start()
+{
+    assert(pImpl_);
+    return pImpl_->start();
+}
@@ -0,0 +1,60 @@
+//
+//  EncodeScheduler.hpp
+//  zoomboard_server
+//
+//  Encodes all outputs on a fixed number of threads, instead of a thread per output.
+//
+
+#ifndef EncodeScheduler_hpp
+#define EncodeScheduler_hpp
+
+#include <memory>
+#include <thread>
+#include <vector>
+#include "ThreadsafeFrame.hpp"
+#include "MediaWriter.hpp"
+
+/// @class Encodes the outputs on a fixed number of worker threads. Each output is a task that becomes ready when a frame
+/// arrives on its subscription, and workers sleep until an output is ready. A free worker takes the ready output with the
+/// least slack, i.e. the one whose frame is closest to missing its frame interval, given the measured time its frames take
+/// to encode. An output is only encoded by one worker at a time, so its frames stay in order. The throughput, encode time
+/// & latency (from when a frame is ready to when it is encoded) of each output are logged periodically, and when all
+/// outputs are closed, along with each output's share of the total encode time.
+class EncodeScheduler
+{
+public:
+    /// Splits a budget of threads between outputs in proportion to their cost, giving each output at least one thread
+    /// @param[in] costs estimated cost of each output, e.g. the number of pixels it encodes per second
+    /// @param[in] nThreads number of threads to split
+    /// @return number of threads for each output
+    static std::vector<int> splitThreads(const std::vector<double>& costs, int nThreads);
+
+    /// Ctor
+    /// @param[in] nWorkers maximum number of outputs that are encoded at the same time
+    /// @throw std::invalid_argument if nWorkers is not positive
+    explicit EncodeScheduler(int nWorkers);
+
+    /// Dtor
+    ~EncodeScheduler();
+
+    EncodeScheduler(const EncodeScheduler&) = delete;
+    EncodeScheduler& operator=(const EncodeScheduler&) = delete;
+
+    /// Adds an output. Should be called before start().
+    /// @param[in] pSub subscription to the frames of the output
+    /// @param[in] writer writer of the output. It should outlive the worker threads, which close it.
+    /// @param[in] nEncoderThreads number of threads the output's encoder was opened with, to log along with its measured cost
+    /// @throw std::logic_error if the scheduler is already started
+    void addOutput(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pSub, avtools::MediaWriter& writer, int nEncoderThreads);
+
+    /// Launches the worker threads
+    /// @return the worker threads, which run in the background until all outputs are closed. There are no more workers than outputs.
+    /// @throw std::logic_error if the scheduler is already started
+    std::vector<std::thread> start();
+
+private:
+    class Implementation;
+    std::shared_ptr<Implementation> pImpl_;     ///< implementation, shared with the worker threads
+};  //::EncodeScheduler
+
+#endif /* EncodeScheduler_hpp */
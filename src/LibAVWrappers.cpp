@@ -9,9 +9,14 @@
 #include "Media.hpp"
 #include "log4cxx/logger.h"
 #include <sstream>
+#include <map>
+#include <mutex>
+#include <tuple>
 extern "C" {
 #include <libavutil/frame.h>
 #include <libavutil/mem.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
 }
 
@@ -24,7 +29,6 @@ namespace
 {
     using avtools::MediaError;
     log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd.LibAVWrappers"));
-//    static const int ALIGNMENT = 32;
 
     std::string getPacketInfo(const AVPacket* pPkt, int indent)
     {
@@ -165,6 +169,15 @@ namespace avtools
         }
     }
 
+    Frame::Frame(Frame&& frame) noexcept:
+    pFrame_(frame.pFrame_),
+    type(frame.type),
+    timebase(frame.timebase)
+    {
+        frame.pFrame_ = nullptr;
+        frame.type = AVMediaType::AVMEDIA_TYPE_UNKNOWN;
+    }
+
     Frame Frame::clone() const
     {
         Frame out(pFrame_->width, pFrame_->height, (AVPixelFormat) pFrame_->format, timebase, pFrame_->colorspace);
@@ -204,6 +217,10 @@ namespace avtools
         {
             av_frame_unref(pFrame_);
         }
+        else if ( !(pFrame_ = av_frame_alloc()) )   //this frame was moved from
+        {
+            throw MediaError("Frame: Unable to allocate frame data.");
+        }
         type = AVMediaType::AVMEDIA_TYPE_UNKNOWN;
         int ret = av_frame_ref(pFrame_, frame.get());
         if (ret < 0)
@@ -215,6 +232,23 @@ namespace avtools
         return *this;
     }
 
+    Frame& Frame::operator=(Frame&& frame) noexcept
+    {
+        if (this != &frame)
+        {
+            if (pFrame_)
+            {
+                av_frame_free(&pFrame_);
+            }
+            pFrame_ = frame.pFrame_;
+            type = frame.type;
+            timebase = frame.timebase;
+            frame.pFrame_ = nullptr;
+            frame.type = AVMediaType::AVMEDIA_TYPE_UNKNOWN;
+        }
+        return *this;
+    }
+
     std::string Frame::info(int indent/*=0*/) const
     {
         assert(pFrame_);
@@ -223,6 +257,103 @@ namespace avtools
         + "s [timebase=" + std::to_string(timebase) + "]\n";
     }
 
+    // -------------------------------------------------
+    // Frame pool
+    // -------------------------------------------------
+    FramePool::FramePool(int width, int height, AVPixelFormat format, int align):
+    width_(width),
+    height_(height),
+    format_(format),
+    nPlanes_(av_pix_fmt_count_planes(format)),
+    linesizes_{0},
+    pPools_{nullptr}
+    {
+        const AVPixFmtDescriptor* pDesc = av_pix_fmt_desc_get(format);
+        if ( !pDesc || (pDesc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) || (nPlanes_ <= 0) || (nPlanes_ > 4) )
+        {
+            throw MediaError("FramePool: Unsupported pixel format " + std::to_string(format));
+        }
+        assert( (align > 0) && ((align & (align - 1)) == 0) );  //alignment should be a power of 2
+        int ret = av_image_fill_linesizes(linesizes_, format, FFALIGN(width, align));
+        if (ret < 0)
+        {
+            throw MediaError("FramePool: Unable to calculate line sizes", ret);
+        }
+        for (int i = 0; i < nPlanes_; ++i)
+        {
+            linesizes_[i] = FFALIGN(linesizes_[i], align);
+            const int h = ( (i == 1) || (i == 2) ) ? AV_CEIL_RSHIFT(height, pDesc->log2_chroma_h) : height;
+            // Pad each plane so that SIMD code reading slightly past the last line stays within the buffer
+            pPools_[i] = av_buffer_pool_init(linesizes_[i] * h + align, av_buffer_alloc);
+            if (!pPools_[i])
+            {
+                for (int j = 0; j < i; ++j)
+                {
+                    av_buffer_pool_uninit(&pPools_[j]);
+                }
+                throw MediaError("FramePool: Unable to initialize buffer pool.");
+            }
+        }
+        LOG4CXX_DEBUG(logger, "Initialized frame pool for " << width << "x" << height << " " << format << " frames with alignment " << align);
+    }
+
+    FramePool::~FramePool()
+    {
+        for (int i = 0; i < nPlanes_; ++i)
+        {
+            av_buffer_pool_uninit(&pPools_[i]);
+        }
+    }
+
+    Frame FramePool::getFrame(TimeBaseType tb/*=TimeBaseType{}*/, AVColorSpace cs/*=AVColorSpace::AVCOL_SPC_RGB*/)
+    {
+        Frame frame(nullptr, AVMediaType::AVMEDIA_TYPE_VIDEO, tb);
+        frame->colorspace = cs;
+        getFrame(frame);
+        return frame;
+    }
+
+    void FramePool::getFrame(Frame& frame)
+    {
+        assert(frame);
+        const AVColorSpace cs = frame->colorspace;
+        av_frame_unref(frame.get());
+        frame->colorspace = cs;
+        frame->width = width_;
+        frame->height = height_;
+        frame->format = format_;
+        frame->pts = frame->best_effort_timestamp = AV_NOPTS_VALUE;
+        frame.type = AVMediaType::AVMEDIA_TYPE_VIDEO;
+        for (int i = 0; i < nPlanes_; ++i)
+        {
+            frame->buf[i] = av_buffer_pool_get(pPools_[i]);
+            if (!frame->buf[i])
+            {
+                av_frame_unref(frame.get());
+                throw MediaError("FramePool: Unable to get buffer from pool.");
+            }
+            frame->data[i] = frame->buf[i]->data;
+            frame->linesize[i] = linesizes_[i];
+        }
+        frame->extended_data = frame->data;
+    }
+
+    std::shared_ptr<FramePool> FramePool::Get(int width, int height, AVPixelFormat format, int align/*=DEFAULT_ALIGNMENT*/)
+    {
+        typedef std::tuple<int, int, int, int> key_t;
+        static std::mutex mutex;
+        static std::map< key_t, std::weak_ptr<FramePool> > pools;
+        std::lock_guard<std::mutex> lk(mutex);
+        auto& pPool = pools[key_t(width, height, format, align)];
+        auto pShared = pPool.lock();
+        if (!pShared)
+        {
+            pShared = std::shared_ptr<FramePool>(new FramePool(width, height, format, align));
+            pPool = pShared;
+        }
+        return pShared;
+    }
+
     // -------------------------------------------------
     // AVPacket wrapper
     // -------------------------------------------------
@@ -260,6 +391,12 @@ namespace avtools
         }
     }
 
+    Packet::Packet(Packet&& pkt) noexcept:
+    pPkt_(pkt.pPkt_)
+    {
+        pkt.pPkt_ = nullptr;
+    }
+
     Packet::~Packet()
     {
         if (pPkt_)
@@ -267,6 +404,20 @@ namespace avtools
             av_packet_free(&pPkt_);
         }
     }
+
+    Packet& Packet::operator=(Packet&& pkt) noexcept
+    {
+        if (this != &pkt)
+        {
+            if (pPkt_)
+            {
+                av_packet_free(&pPkt_);
+            }
+            pPkt_ = pkt.pPkt_;
+            pkt.pPkt_ = nullptr;
+        }
+        return *this;
+    }
     
     void Packet::unref()
     {
@@ -410,6 +561,20 @@ namespace avtools
         return *this;
     }
 
+    Dictionary& Dictionary::operator=(Dictionary&& dict) noexcept
+    {
+        if (this != &dict)
+        {
+            if (pDict_)
+            {
+                av_dict_free(&pDict_);
+            }
+            pDict_ = dict.pDict_;
+            dict.pDict_ = nullptr;
+        }
+        return *this;
+    }
+
     int Dictionary::size() const
     {
         return (pDict_ ? av_dict_count(pDict_) : 0);
@@ -12,6 +12,7 @@
 
 #include <string>
 #include <iostream>
+#include <memory>
 
 #include "Media.hpp"
 extern "C" {
@@ -26,6 +27,7 @@ struct AVCodecContext;
 struct AVCodecParameters;
 struct AVFormatContext;
 struct AVDictionary;
+struct AVBufferPool;
 struct SwsContext;
 
 namespace avtools
@@ -85,6 +87,10 @@ namespace avtools
         /// @param[in] frame source frame. Note that the data buffers are not cloned, but this frame refers
         /// to the same buffers as frame
         Frame(const Frame& frame);
+
+        /// Move ctor
+        /// @param[in] frame source frame. Its references are moved to this frame, and it is left empty.
+        Frame(Frame&& frame) noexcept;
         
         /// Dtor
         virtual ~Frame();
@@ -109,6 +115,11 @@ namespace avtools
         /// @return a reference to this frame.
         Frame& operator=(const Frame& frame);
 
+        /// Move operator. The references of the source frame are moved to this frame, and the source is left empty.
+        /// @param[in] frame source frame.
+        /// @return a reference to this frame.
+        Frame& operator=(Frame&& frame) noexcept;
+
         /// Clone operator.
         /// @return a new frame that has the same data and metadata as this one
         Frame clone() const;
@@ -123,6 +134,64 @@ namespace avtools
         std::string info(int indent=0) const;
     }; //avtools::Frame
 
+    /// @class Pool of video frames of a given size & format
+    /// The data buffers of the frames are obtained from AVBufferPools, and are returned to the pool when the last reference
+    /// to them is released, so steady-state use does not allocate new picture buffers.
+    /// Frames obtained from the pool are reference counted, and can be passed on to filtergraphs & encoders without copying.
+    class FramePool
+    {
+    public:
+        static const int DEFAULT_ALIGNMENT = 32;                ///< default line size & plane alignment, in bytes
+    private:
+        const int width_;                                       ///< frame width
+        const int height_;                                      ///< frame height
+        const AVPixelFormat format_;                            ///< pixel format
+        int nPlanes_;                                           ///< number of planes
+        int linesizes_[4];                                      ///< line size for each plane
+        AVBufferPool* pPools_[4];                               ///< buffer pool for each plane
+
+        /// Ctor
+        /// @param[in] width width of the frames
+        /// @param[in] height height of the frames
+        /// @param[in] format pixel format of the frames
+        /// @param[in] align alignment of the line sizes & planes in bytes
+        /// @throw MediaError if the format is not supported or the pools could not be initialized
+        FramePool(int width, int height, AVPixelFormat format, int align);
+    public:
+        inline FramePool(const FramePool&) = delete;
+
+        /// Dtor. Buffers that are still referenced are freed when they are released.
+        ~FramePool();
+
+        /// @return width of the frames in the pool
+        inline int width() const noexcept { return width_; }
+        /// @return height of the frames in the pool
+        inline int height() const noexcept { return height_; }
+        /// @return pixel format of the frames in the pool
+        inline AVPixelFormat format() const noexcept { return format_; }
+
+        /// Returns a new frame whose data buffers are from the pool
+        /// @param[in] tb timebase of the frame if known
+        /// @param[in] cs color space type
+        /// @return a writable video frame
+        /// @throw MediaError if there was an error obtaining buffers
+        Frame getFrame(TimeBaseType tb=TimeBaseType{}, AVColorSpace cs=AVColorSpace::AVCOL_SPC_RGB);
+
+        /// Replaces the data buffers of an existing frame with buffers from the pool, reusing the frame
+        /// @param[in, out] frame frame to fill in. Any previous references are released and its properties are reset.
+        /// @throw MediaError if there was an error obtaining buffers
+        void getFrame(Frame& frame);
+
+        /// Returns a frame pool. Frame pools are shared, so the same pool is returned for the same parameters
+        /// as long as a previously returned pool is still in use.
+        /// @param[in] width width of the frames
+        /// @param[in] height height of the frames
+        /// @param[in] format pixel format of the frames
+        /// @param[in] align alignment of the line sizes & planes in bytes
+        /// @return a pointer to the pool for frames with the given parameters
+        static std::shared_ptr<FramePool> Get(int width, int height, AVPixelFormat format, int align=DEFAULT_ALIGNMENT);
+    };  //avtools::FramePool
+
     /// @class wrapper around AVPacket
     class Packet
     {
@@ -138,11 +207,20 @@ namespace avtools
         /// @param[in] source packet. Note that this packet references the same data as pkt.
         Packet(const Packet& pkt);
 
+        /// Move ctor
+        /// @param[in] source packet. Its references are moved to this packet, and it is left empty.
+        Packet(Packet&& pkt) noexcept;
+
         /// Ctor that initializes a packet referring to existing data
         Packet(std::uint8_t* data, int len);
 
         /// Dtor
         ~Packet();
+
+        /// Move operator
+        /// @param[in] source packet. Its references are moved to this packet, and it is left empty.
+        /// @return a reference to this packet
+        Packet& operator=(Packet&& pkt) noexcept;
         
         /// @return a pointer to the wrapped AVPacket
         inline AVPacket* get() noexcept { return pPkt_;}
@@ -180,6 +258,9 @@ namespace avtools
         /// Ctor
         /// @param[in] dict a dictionary to clone. All entries are copied here as a separate dictionary
         inline Dictionary(const Dictionary& dict): Dictionary(dict.get()) {};
+        /// Move ctor
+        /// @param[in] dict a dictionary whose entries are moved to this one. It is left empty.
+        inline Dictionary(Dictionary&& dict) noexcept: pDict_(dict.pDict_) {dict.pDict_ = nullptr;}
         /// Dtor
         ~Dictionary();
         ///< @return pointer to the wrapper dictionary
@@ -274,6 +355,8 @@ namespace avtools
         bool empty() const;
 
         Dictionary& operator=(const Dictionary& dict);
+
+        Dictionary& operator=(Dictionary&& dict) noexcept;
     };  //avtools::Dictionary
 
     inline std::ostream& operator<<(std::ostream& stream, const Dictionary& dict)
@@ -303,6 +386,10 @@ namespace avtools
         /// @param[in] cc source codec context. Entries are cloned
         CodecContext(const CodecContext& cc);
 
+        /// Move ctor
+        /// @param[in] cc source codec context. It is left empty.
+        inline CodecContext(CodecContext&& cc) noexcept: pCC_(cc.pCC_) {cc.pCC_ = nullptr;}
+
         /// Dtor
         ~CodecContext();
         
@@ -352,6 +439,10 @@ namespace avtools
         /// Copy ctor
         /// @param[in] cp codec parameters to copy
         CodecParameters(const CodecParameters& cp);
+
+        /// Move ctor
+        /// @param[in] cp codec parameters to move. It is left empty.
+        inline CodecParameters(CodecParameters&& cp) noexcept: pParam_(cp.pParam_) {cp.pParam_ = nullptr;}
         
         /// Dtor
         ~CodecParameters();
@@ -451,6 +542,7 @@ namespace avtools
         /// @param[in] n length of buffer
         inline CharBuf(size_t n): p_((char*) av_malloc_array(n, sizeof(char))) {}
         inline CharBuf(const CharBuf& cb): p_(av_strdup(cb.get())) {};
+        inline CharBuf(CharBuf&& cb) noexcept: p_(cb.p_) {cb.p_ = nullptr;}
         inline void free() {if (p_) av_freep(&p_);}
         inline ~CharBuf() {free();}    ///< Dtor
         inline char*& get() {return p_;}            ///< @return a reference to the underlying ptr
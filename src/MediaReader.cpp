@@ -9,9 +9,26 @@
 #include "MediaReader.hpp"
 #include "Media.hpp"
 #include "LibAVWrappers.hpp"
+#include "V4L2Capture.hpp"
+#include "PacketQueue.hpp"
+#include "ThreadsafeFrame.hpp"
+#include "common.hpp"
 #include "log4cxx/logger.h"
 #include <memory>
 #include <stdexcept>
+#include <chrono>
+#include <ctime>
+#include <limits>
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <climits>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <mutex>
+#include <exception>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -20,6 +37,8 @@ extern "C" {
 #include <libavutil/pixdesc.h>
 #include <libavutil/frame.h>
 #include <libavdevice/avdevice.h>
+#include <libavutil/parseutils.h>
+#include <libswscale/swscale.h>
 }
 
 using avtools::MediaError;
@@ -38,6 +57,325 @@ namespace
 
     log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd.MediaReader"));
 
+    static const int CALIBRATION_WARMUP_FRAMES = 5;     ///< number of frames to skip when timing a capture format, while the camera settles
+    static const int CALIBRATION_FRAMES = 30;           ///< number of frames to time for each capture format
+    static constexpr double MIN_FRAME_RATE_RATIO = 0.95;///< a capture format sustains a frame rate if it achieves at least this fraction of it
+    static const unsigned MAX_DECODER_THREADS = 4;      ///< default maximum number of decoder threads. Frame threading delays each frame by one frame per extra thread.
+    static const std::size_t REDUCED_QUEUE_SIZE = 2;    ///< number of packets that can wait for the reduced-resolution decoder before the reader waits for it
+
+    /// @class Keeps track of how long the reader waits in the decoder calls for each frame, and logs it periodically. With frame
+    /// threading, the decoding itself happens on the decoder's threads, so this is the time the reader is held up by the decoder
+    /// rather than the cost of decoding a frame.
+    class DecoderWaitStats
+    {
+    private:
+        static const int N_FRAMES = 300;                ///< number of frames to accumulate statistics over before logging
+        int nFrames_;                                   ///< number of frames since last log
+        std::chrono::steady_clock::duration total_;     ///< total decoder wait since last log
+        std::chrono::steady_clock::duration max_;       ///< maximum decoder wait since last log
+    public:
+        /// Ctor
+        DecoderWaitStats(): nFrames_(0), total_(0), max_(0) {}
+
+        /// Adds the decoder wait of a frame, and logs the statistics every N_FRAMES frames
+        /// @param[in] duration time spent in the decoder calls for the frame
+        void add(std::chrono::steady_clock::duration duration)
+        {
+            total_ += duration;
+            max_ = std::max(max_, duration);
+            if (++nFrames_ == N_FRAMES)
+            {
+                using std::chrono::microseconds;
+                using std::chrono::duration_cast;
+                LOG4CXX_INFO(logger, "Decoder wait over " << nFrames_ << " frames: mean = "
+                             << duration_cast<microseconds>(total_).count() / nFrames_ << "us, max = "
+                             << duration_cast<microseconds>(max_).count() << "us");
+                nFrames_ = 0;
+                total_ = max_ = std::chrono::steady_clock::duration(0);
+            }
+        }
+    };  //::<anon>::DecoderWaitStats
+
+    /// Reads an entry of the probe cache
+    /// @param[in] path path to the cache file
+    /// @param[out] entry parameters in the cache file
+    /// @return false if there is no cache file at path
+    /// @throw MediaError if the cache file could not be parsed
+    bool readCacheEntry(const fs::path& path, avtools::Dictionary& entry)
+    {
+        std::ifstream file(path.string());
+        if (!file)
+        {
+            return false;
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        int ret = av_dict_parse_string(&entry.get(), contents.str().c_str(), "=", "\n", 0);
+        if (ret < 0)
+        {
+            throw avtools::MediaError("Unable to parse " + path.string(), ret);
+        }
+        return true;
+    }
+
+    /// Writes an entry of the probe cache, creating its folder if needed
+    /// @param[in] path path to the cache file
+    /// @param[in] entry parameters to save
+    /// @throw std::runtime_error if the cache file could not be written
+    void writeCacheEntry(const fs::path& path, const avtools::Dictionary& entry)
+    {
+        avtools::CharBuf buf;
+        int ret = av_dict_get_string(entry.get(), &buf.get(), '=', '\n');
+        if (ret < 0)
+        {
+            throw avtools::MediaError("Unable to serialize " + path.string(), ret);
+        }
+        fs::create_directories(path.parent_path());
+        std::ofstream file(path.string(), std::ios::trunc);
+        file << buf.get();
+        if (!file)
+        {
+            throw std::runtime_error("Unable to write " + path.string());
+        }
+    }
+
+    /// @class Cache of the stream parameters found by probing an input, so that later starts can skip avformat_find_stream_info(),
+    /// which reads & decodes frames for up to a few seconds. Each input url & set of options has its own file in the cache folder.
+    class ProbeCache
+    {
+    private:
+        const std::string key_;     ///< url & options that the cached parameters are for
+        const fs::path path_;       ///< path to the cache file
+
+        /// Parses a rational number
+        /// @param[in] str string of the form num/den
+        /// @return parsed value
+        /// @throw std::runtime_error if the string could not be parsed
+        static AVRational parseRational(const std::string& str)
+        {
+            AVRational q;
+            if (av_parse_ratio(&q, str.c_str(), INT_MAX, 0, nullptr) < 0)
+            {
+                throw std::runtime_error("Unable to parse " + str);
+            }
+            return q;
+        }
+
+        /// @param[in] q a rational number
+        /// @return q as a string of the form num/den
+        static std::string toString(AVRational q)
+        {
+            return std::to_string(q.num) + "/" + std::to_string(q.den);
+        }
+    public:
+        /// Ctor
+        /// @param[in] folder folder to keep the cache files in
+        /// @param[in] url input url
+        /// @param[in] opts options the input is opened with
+        ProbeCache(const std::string& folder, const std::string& url, const avtools::Dictionary& opts):
+        key_(url + "?" + (std::string) opts),
+        path_( fs::path(folder) / ("probe_" + std::to_string(std::hash<std::string>()(key_)) + ".txt") )
+        {
+        }
+
+        /// Fills the streams of an opened input with the cached parameters
+        /// @param[in, out] pFormatCtx opened input format context
+        /// @return true if the cached parameters were applied, false if there are no valid cached parameters for this input
+        bool load(AVFormatContext* pFormatCtx) const
+        {
+            assert(pFormatCtx);
+            try
+            {
+                avtools::Dictionary entry;
+                if (!readCacheEntry(path_, entry))
+                {
+                    LOG4CXX_DEBUG(logger, "No probe cache found at " << path_);
+                    return false;
+                }
+                if (entry["key"] != key_)
+                {
+                    LOG4CXX_DEBUG(logger, "Probe cache at " << path_ << " is for a different input.");
+                    return false;
+                }
+                const int index = std::stoi(entry["stream_index"]);
+                if ( (index < 0) || (index >= (int) pFormatCtx->nb_streams) )
+                {
+                    LOG4CXX_INFO(logger, "Cached stream " << index << " not found in input.");
+                    return false;
+                }
+                AVStream* pStr = pFormatCtx->streams[index];
+                AVCodecParameters* pPar = pStr->codecpar;
+                const AVCodecID codecId = (AVCodecID) std::stoi(entry["codec_id"]);
+                const AVRational timebase = parseRational(entry["time_base"]);
+                // The demuxer sets these when opening the input, and they should not have changed
+                if ( (pPar->codec_type != AVMEDIA_TYPE_VIDEO) || ((pPar->codec_id != AV_CODEC_ID_NONE) && (pPar->codec_id != codecId))
+                    || (0 != av_cmp_q(pStr->time_base, timebase)) )
+                {
+                    LOG4CXX_INFO(logger, "Input does not match the probe cache at " << path_);
+                    return false;
+                }
+                pPar->codec_id = codecId;
+                pPar->width = std::stoi(entry["width"]);
+                pPar->height = std::stoi(entry["height"]);
+                pPar->format = std::stoi(entry["format"]);
+                pPar->sample_aspect_ratio = parseRational(entry["sample_aspect_ratio"]);
+                pStr->sample_aspect_ratio = pPar->sample_aspect_ratio;
+                pStr->r_frame_rate = parseRational(entry["r_frame_rate"]);
+                pStr->avg_frame_rate = parseRational(entry["avg_frame_rate"]);
+                const std::string extradata = (entry.has("extradata") ? entry["extradata"] : std::string());
+                av_freep(&pPar->extradata);
+                pPar->extradata_size = 0;
+                if (!extradata.empty())
+                {
+                    const int size = (int) extradata.size() / 2;
+                    pPar->extradata = (std::uint8_t*) av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+                    if (!pPar->extradata)
+                    {
+                        throw avtools::MediaError("Unable to allocate extradata");
+                    }
+                    for (int i = 0; i < size; ++i)
+                    {
+                        pPar->extradata[i] = (std::uint8_t) std::stoi(extradata.substr(2 * i, 2), nullptr, 16);
+                    }
+                    pPar->extradata_size = size;
+                }
+                LOG4CXX_DEBUG(logger, "Loaded stream parameters from probe cache at " << path_);
+                return true;
+            }
+            catch (std::exception& err)
+            {
+                LOG4CXX_WARN(logger, "Unable to use probe cache at " << path_ << ": " << err.what());
+                return false;
+            }
+        }
+
+        /// Saves the parameters of a probed stream. Errors are logged, since the cache is only an optimization.
+        /// @param[in] pStr probed stream
+        void save(const AVStream* pStr) const
+        {
+            assert(pStr && pStr->codecpar);
+            const AVCodecParameters* pPar = pStr->codecpar;
+            try
+            {
+                avtools::Dictionary entry;
+                entry.add("key", key_);
+                entry.add("stream_index", std::to_string(pStr->index));
+                entry.add("codec_id", std::to_string(pPar->codec_id));
+                entry.add("width", std::to_string(pPar->width));
+                entry.add("height", std::to_string(pPar->height));
+                entry.add("format", std::to_string(pPar->format));
+                entry.add("sample_aspect_ratio", toString(pPar->sample_aspect_ratio));
+                entry.add("time_base", toString(pStr->time_base));
+                entry.add("r_frame_rate", toString(pStr->r_frame_rate));
+                entry.add("avg_frame_rate", toString(pStr->avg_frame_rate));
+                if (pPar->extradata_size > 0)
+                {
+                    std::string extradata(2 * pPar->extradata_size, '0');
+                    for (int i = 0; i < pPar->extradata_size; ++i)
+                    {
+                        std::snprintf(&extradata[2 * i], 3, "%02x", pPar->extradata[i]);
+                    }
+                    entry.add("extradata", extradata);
+                }
+                writeCacheEntry(path_, entry);
+                LOG4CXX_DEBUG(logger, "Saved stream parameters to probe cache at " << path_);
+            }
+            catch (std::exception& err)
+            {
+                LOG4CXX_WARN(logger, "Unable to save probe cache: " << err.what());
+            }
+        }
+
+        /// Removes the cached parameters, e.g. if they turn out not to match the input
+        void remove() const
+        {
+            try
+            {
+                fs::remove(path_);
+            }
+            catch (std::exception& err)
+            {
+                LOG4CXX_WARN(logger, "Unable to remove probe cache: " << err.what());
+            }
+        }
+    };  //::<anon>::ProbeCache
+
+    /// @class Cache of the capture format picked by negotiation when "pixel_format" is "auto", kept in the probe cache
+    /// folder. Each device, set of options (e.g. size & frame rate) and output pixel format has its own file, so the
+    /// formats are only timed again when one of these changes, or if the cached format can no longer be opened.
+    class FormatCache
+    {
+    private:
+        const std::string key_;     ///< url, options & output format that the cached capture format is for
+        const fs::path path_;       ///< path to the cache file
+    public:
+        /// Ctor
+        /// @param[in] folder folder to keep the cache files in
+        /// @param[in] url device url
+        /// @param[in] opts options the device is opened with, other than its pixel format
+        /// @param[in] outFormat pixel format frames are converted to
+        FormatCache(const std::string& folder, const std::string& url, const avtools::Dictionary& opts, AVPixelFormat outFormat):
+        key_(url + "?" + (std::string) opts + "->" + (outFormat == AV_PIX_FMT_NONE ? "none" : av_get_pix_fmt_name(outFormat))),
+        path_( fs::path(folder) / ("format_" + std::to_string(std::hash<std::string>()(key_)) + ".txt") )
+        {
+        }
+
+        /// Loads the cached capture format
+        /// @param[out] option name of the muxer option that selects the format ("pixel_format" or "input_format")
+        /// @param[out] format cached capture format
+        /// @return true if a capture format was cached for this device
+        bool load(std::string& option, std::string& format) const
+        {
+            try
+            {
+                avtools::Dictionary entry;
+                if (!readCacheEntry(path_, entry))
+                {
+                    LOG4CXX_DEBUG(logger, "No capture format cache found at " << path_);
+                    return false;
+                }
+                if (entry["key"] != key_)
+                {
+                    LOG4CXX_DEBUG(logger, "Capture format cache at " << path_ << " is for a different input.");
+                    return false;
+                }
+                option = entry["option"];
+                format = entry["format"];
+                if ( ((option != "pixel_format") && (option != "input_format")) || format.empty() )
+                {
+                    throw std::runtime_error("Invalid capture format " + option + "=" + format);
+                }
+                LOG4CXX_DEBUG(logger, "Loaded capture format from cache at " << path_);
+                return true;
+            }
+            catch (std::exception& err)
+            {
+                LOG4CXX_WARN(logger, "Unable to use capture format cache at " << path_ << ": " << err.what());
+                return false;
+            }
+        }
+
+        /// Saves the negotiated capture format. Errors are logged, since the cache is only an optimization.
+        /// @param[in] option name of the muxer option that selects the format ("pixel_format" or "input_format")
+        /// @param[in] format negotiated capture format
+        void save(const std::string& option, const std::string& format) const
+        {
+            try
+            {
+                avtools::Dictionary entry;
+                entry.add("key", key_);
+                entry.add("option", option);
+                entry.add("format", format);
+                writeCacheEntry(path_, entry);
+                LOG4CXX_DEBUG(logger, "Saved capture format to cache at " << path_);
+            }
+            catch (std::exception& err)
+            {
+                LOG4CXX_WARN(logger, "Unable to save capture format cache: " << err.what());
+            }
+        }
+    };  //::<anon>::FormatCache
+
 }
 
 namespace avtools
@@ -56,22 +394,98 @@ namespace avtools
     class MediaReader::Implementation
     {
     private:
+        /// How the capture format was chosen
+        enum class FormatSource
+        {
+            GIVEN,      ///< the capture format was set in the options, or left to the device
+            CACHED,     ///< the negotiated capture format was loaded from the probe cache
+            TIMED       ///< the capture formats were timed to pick one
+        };
+
         FormatContext               formatCtx_;        ///< Format I/O context
         CodecContext                codecCtx_;         ///< codec context for the video codec context of opened stream
         Packet                      pkt_;              ///< packet to be used for reading from file
         int                         stream_;           ///< Index of the opened video stream
+        bool                        isFlushing_;       ///< true once the input has ended and the decoder is being drained
+        std::chrono::steady_clock::duration decoderWait_;///< time spent in the decoder calls since the last decoded frame
+        DecoderWaitStats            decoderWaitStats_; ///< decoder wait statistics
+        std::unique_ptr<CodecContext> pReducedCtx_;    ///< decoder context for the reduced-resolution output, if one is opened
+        std::shared_ptr<PacketQueue> pReducedPackets_; ///< packets waiting for the reduced-resolution decoder thread
+        std::thread                 reducedThread_;    ///< thread that decodes the reduced-resolution frames alongside read()
+        std::weak_ptr<ThreadsafeFrame> pReducedFrame_; ///< frame bus the reduced-resolution decoder thread publishes to
+        std::mutex                  reducedMutex_;     ///< guards the decoding error
+        std::exception_ptr          reducedError_;     ///< error the reduced-resolution decoder thread stopped with, if any
+        std::vector< std::shared_ptr<PacketQueue> > packetQueues_; ///< queues that receive the compressed video packets as they are read
+        std::unique_ptr<ProbeCache> pProbeCache_;      ///< cache of the probed stream parameters, if one is used
+        bool                        isProbeCached_;    ///< true if the stream parameters were loaded from the probe cache instead of probing the input
+        Frame                       firstFrame_;       ///< first frame, if it was decoded while validating the probe cache
+        std::chrono::steady_clock::time_point openTime_;///< time the input was first opened, to measure the time to the first frame
+        FormatSource                formatSource_;     ///< how the capture format was chosen
+        std::chrono::steady_clock::duration negotiationTime_;///< time spent choosing the capture format
+        bool                        hasReadFrames_;    ///< true once a frame is read
+#ifdef __gnu_linux__
+        std::unique_ptr<V4L2Capture> pCapture_;        ///< Native capture backend, if one is used instead of libavdevice
+#endif
 
     public:
         /// Ctor
         /// @param[in] url url or filename to open
         /// @param[in] pFmt ptr to input format. If none is provided, it is guessed from the url
         /// @param[in] opts a ddictionary that has entries used for opening the url, such as framerate.
-        Implementation(const std::string& url, avtools::Dictionary& muxerOpts):
+        /// @param[in] codecOpts decoder options. Unless specified, the decoder uses frame & slice threads.
+        /// @param[in] doLoadProbeCache if false, the input is always probed, even if there is a "probe_cache" option
+        Implementation(const std::string& url, avtools::Dictionary& muxerOpts, const avtools::Dictionary& codecOpts, bool doLoadProbeCache=true):
         formatCtx_(FormatContext::INPUT),
         codecCtx_((AVCodec*) nullptr),
         pkt_(),
-        stream_(-1)
+        stream_(-1),
+        isFlushing_(false),
+        decoderWait_(0),
+        decoderWaitStats_(),
+        pReducedCtx_(),
+        pReducedPackets_(),
+        reducedThread_(),
+        pReducedFrame_(),
+        reducedMutex_(),
+        reducedError_(),
+        packetQueues_(),
+        pProbeCache_(),
+        isProbeCached_(false),
+        firstFrame_(nullptr, AVMEDIA_TYPE_VIDEO),
+        openTime_(std::chrono::steady_clock::now()),
+        formatSource_(FormatSource::GIVEN),
+        negotiationTime_(0),
+        hasReadFrames_(false)
         {
+            // See if the probed stream parameters should be cached
+            if (muxerOpts.has("probe_cache"))
+            {
+                const std::string folder = muxerOpts["probe_cache"];
+                av_dict_set(&muxerOpts.get(), "probe_cache", nullptr, 0);   //not a libav option
+                pProbeCache_.reset( new ProbeCache(folder, url, muxerOpts) );
+            }
+            // See if the native capture backend is requested
+            if (muxerOpts.has("capture_backend"))
+            {
+                const std::string backend = muxerOpts["capture_backend"];
+                av_dict_set(&muxerOpts.get(), "capture_backend", nullptr, 0);   //not a libav option
+                if (backend == "native")
+                {
+#ifdef __gnu_linux__
+                    LOG4CXX_DEBUG(logger, "Opening " << url << " with the native V4L2 capture backend");
+                    pCapture_.reset( new V4L2Capture(url, muxerOpts) );
+                    stream_ = 0;
+                    return;
+#else
+                    throw MediaError("The native capture backend is only available on Linux.");
+#endif
+                }
+                else if (backend != "libav")
+                {
+                    throw MediaError("Unknown capture backend " + backend + ", should be \"native\" or \"libav\"");
+                }
+            }
+
             avdevice_register_all();
             AVInputFormat* pFormat = nullptr;
             if (muxerOpts.has("name"))
@@ -114,11 +528,15 @@ namespace avtools
             }
 #endif
 
-            // Retrieve stream information
-            ret = avformat_find_stream_info(formatCtx_.get(), nullptr);
-            if( ret < 0 ) // Couldn't find stream information
+            // Retrieve stream information, from the probe cache if possible, since probing reads & decodes frames for a while
+            isProbeCached_ = ( pProbeCache_ && doLoadProbeCache && pProbeCache_->load(formatCtx_.get()) );
+            if (!isProbeCached_)
             {
-                throw MediaError("Could not find stream information", ret);
+                ret = avformat_find_stream_info(formatCtx_.get(), nullptr);
+                if( ret < 0 ) // Couldn't find stream information
+                {
+                    throw MediaError("Could not find stream information", ret);
+                }
             }
             const int nStreams = formatCtx_->nb_streams;
             LOG4CXX_DEBUG(logger, "MediaReader: Format context found.\n\tStart time = " << formatCtx_->start_time << "\n\t#streams = " << nStreams);
@@ -147,16 +565,25 @@ namespace avtools
                     throw MediaError("Unable to initialize decoder context " , ret);
                 }
 
-                Dictionary codecOpts;
-                codecOpts.add("refcounted_frames", 1);
-                ret = avcodec_open2(codecCtx_.get(), pCodec, &codecOpts.get());
+                Dictionary decoderOpts(codecOpts.get());
+                decoderOpts.add("refcounted_frames", 1);
+                if (!decoderOpts.has("threads"))
+                {
+                    const unsigned nThreads = std::max(1u, std::min(std::thread::hardware_concurrency(), MAX_DECODER_THREADS));
+                    decoderOpts.add("threads", std::to_string(nThreads));
+                }
+                if (!decoderOpts.has("thread_type"))
+                {
+                    decoderOpts.add("thread_type", "frame+slice");
+                }
+                ret = avcodec_open2(codecCtx_.get(), pCodec, &decoderOpts.get());
                 if (ret < 0)
                 {
                     throw MediaError("Unable to open decoder" , ret);
                 }
                 codecCtx_->time_base = pStream->time_base;
 #ifndef NDEBUG
-                LOG4CXX_DEBUG(logger, "Unused decoder options: " << codecOpts);
+                LOG4CXX_DEBUG(logger, "Unused decoder options: " << decoderOpts);
                 {
                     avtools::CharBuf buf;
                     ret = av_opt_serialize(codecCtx_.get(), AV_OPT_FLAG_DECODING_PARAM, 0, &buf.get(), ':', '\n');
@@ -166,7 +593,7 @@ namespace avtools
                     }
                     LOG4CXX_DEBUG(logger, "Available decoder options:\n" << buf.get());
                 }
-                LOG4CXX_DEBUG(logger, "Unused decoder private options: " << codecOpts);
+                LOG4CXX_DEBUG(logger, "Unused decoder private options: " << decoderOpts);
                 {
                     avtools::CharBuf buf;
                     ret = av_opt_serialize(codecCtx_->priv_data, AV_OPT_FLAG_DECODING_PARAM, 0, &buf.get(), ':', '\n');
@@ -179,6 +606,8 @@ namespace avtools
 #endif
 
                 LOG4CXX_DEBUG(logger, "MediaReader: Opened decoder for stream:\n" << *pStream);
+                LOG4CXX_INFO(logger, "Decoding " << pCodec->name << " with " << codecCtx_->thread_count << " threads ("
+                             << (codecCtx_->active_thread_type & FF_THREAD_FRAME ? "frame" : (codecCtx_->active_thread_type & FF_THREAD_SLICE ? "slice" : "no")) << " threading)");
                 stream_ = i;
                 break;
             }
@@ -186,80 +615,726 @@ namespace avtools
             {
                 throw MediaError("Unable to open any video streams");
             }
+            if (pProbeCache_ && !isProbeCached_)
+            {
+                pProbeCache_->save(formatCtx_->streams[stream_]);
+            }
+        }
+
+        /// Opens an input, negotiating its capture format if requested, and using the probe cache if there is one. If
+        /// the cached capture format cannot be opened, it is negotiated again. If the first frame does not match the
+        /// cached stream parameters, the input is reopened and probed.
+        /// @param[in] url url or filename to open
+        /// @param[in, out] muxerOpts a dictionary that has entries used for opening the url, such as framerate.
+        /// @param[in] codecOpts decoder options
+        /// @param[in] outFormat pixel format frames will be converted to
+        /// @return the opened input
+        static Implementation* Open(const std::string& url, avtools::Dictionary& muxerOpts, const avtools::Dictionary& codecOpts, AVPixelFormat outFormat)
+        {
+            const auto openTime = std::chrono::steady_clock::now();    //before negotiating, so that the time to the first frame includes it
+            const Dictionary negotiationOpts(muxerOpts);   //in case the cached capture format cannot be opened
+            FormatSource formatSource = negotiateFormat(url, muxerOpts, codecOpts, outFormat);
+            std::chrono::steady_clock::duration negotiationTime = std::chrono::steady_clock::now() - openTime;
+            Dictionary opts(muxerOpts);   //in case the input has to be reopened
+            std::unique_ptr<Implementation> pImpl;
+            try
+            {
+                pImpl.reset(new Implementation(url, muxerOpts, codecOpts));
+            }
+            catch (std::exception& err)
+            {
+                if (formatSource != FormatSource::CACHED)
+                {
+                    throw;
+                }
+                LOG4CXX_WARN(logger, "Unable to open " << url << " with the cached capture format, negotiating it again: " << err.what());
+                muxerOpts = negotiationOpts;
+                formatSource = negotiateFormat(url, muxerOpts, codecOpts, outFormat, false);
+                negotiationTime = std::chrono::steady_clock::now() - openTime;
+                opts = muxerOpts;
+                pImpl.reset(new Implementation(url, muxerOpts, codecOpts));
+            }
+            if ( pImpl->isProbeCached_ && !pImpl->validateProbeCache() )
+            {
+                pImpl->pProbeCache_->remove();
+                pImpl.reset();  //close the input before reopening it
+                muxerOpts = opts;
+                pImpl.reset(new Implementation(url, muxerOpts, codecOpts, false));
+            }
+            pImpl->openTime_ = openTime;
+            pImpl->formatSource_ = formatSource;
+            pImpl->negotiationTime_ = negotiationTime;
+            return pImpl.release();
+        }
+
+        /// Decodes the first frame, and checks that it matches the stream parameters loaded from the probe cache.
+        /// The frame is kept to be returned by the first read().
+        /// @return true if the first frame matches the cached stream parameters
+        bool validateProbeCache()
+        {
+            assert(isProbeCached_);
+            const AVCodecParameters* pPar = stream()->codecpar;
+            hasReadFrames_ = true;  //so that read() does not take this for the first frame handed out
+            try
+            {
+                if (!read(firstFrame_))
+                {
+                    LOG4CXX_WARN(logger, "Input ended before the probe cache could be validated.");
+                    return false;
+                }
+            }
+            catch (std::exception& err)
+            {
+                LOG4CXX_WARN(logger, "Unable to decode the first frame with the cached stream parameters: " << err.what());
+                return false;
+            }
+            if ( (firstFrame_->width != pPar->width) || (firstFrame_->height != pPar->height) || (firstFrame_->format != pPar->format) )
+            {
+                LOG4CXX_WARN(logger, "First frame (" << firstFrame_->width << "x" << firstFrame_->height << ", " << (AVPixelFormat) firstFrame_->format
+                             << ") does not match the cached stream parameters (" << pPar->width << "x" << pPar->height << ", " << (AVPixelFormat) pPar->format
+                             << "), probing the input.");
+                return false;
+            }
+            hasReadFrames_ = false; //the first frame has not been handed out yet
+            return true;
         }
 
         /// @return a list of opened streams
         const AVStream* stream() const
         {
+#ifdef __gnu_linux__
+            if (pCapture_)
+            {
+                return pCapture_->stream();
+            }
+#endif
             assert(formatCtx_);
             assert( (stream_ >= 0) && (stream_ < formatCtx_->nb_streams) );
             return formatCtx_->streams[stream_];
         }
 
         /// Dtor
-        ~Implementation() = default;
+        ~Implementation()
+        {
+            closePacketQueues();
+            if (pReducedPackets_)
+            {
+                pReducedPackets_->cancel();     //the input did not end, so the frames still in the reduced-resolution decoder are not needed
+            }
+            if (reducedThread_.joinable())
+            {
+                reducedThread_.join();
+            }
+            if (auto pReducedFrame = pReducedFrame_.lock())
+            {
+                pReducedFrame->close();
+            }
+        }
 
-        /// Reads a frame
-        /// @param[out] pFrame pointer to frame. Will contain new frame upon return
+        /// Adds a queue that receives the compressed video packets as they are read
+        /// @param[in] capacity maximum number of packets in the queue
+        /// @return a new packet queue
+        /// @throw MediaError if the input does not have compressed packets
+        std::shared_ptr<PacketQueue> subscribePackets(std::size_t capacity)
+        {
+#ifdef __gnu_linux__
+            if (pCapture_)
+            {
+                throw MediaError("The native capture backend does not provide compressed packets.");
+            }
+#endif
+            if (stream()->codecpar->codec_id == AV_CODEC_ID_RAWVIDEO)
+            {
+                throw MediaError("The input stream is not compressed, its packets cannot be remuxed.");
+            }
+            packetQueues_.push_back(std::make_shared<PacketQueue>(capacity));
+            return packetQueues_.back();
+        }
+
+        /// Lets the packet queues know that no more packets are coming
+        void closePacketQueues()
+        {
+            for (auto& pQueue: packetQueues_)
+            {
+                pQueue->close();
+            }
+        }
+
+        /// Opens a decoder that decodes the same packets at a reduced resolution, using the decoder's lowres option
+        /// (e.g. DCT-domain scaling for MJPEG).
+        /// @param[in, out] width minimum width needed. On return, the width of the reduced frames.
+        /// @param[in, out] height minimum height needed. On return, the height of the reduced frames.
+        /// @return true if the reduced-resolution decoder was opened, false if the input cannot be decoded at a reduced resolution
+        bool openReducedOutput(int& width, int& height)
+        {
+            assert(!pReducedCtx_);
+#ifdef __gnu_linux__
+            if (pCapture_)
+            {
+                LOG4CXX_INFO(logger, "Reduced-resolution decoding is not available with the native capture backend.");
+                return false;
+            }
+#endif
+            const AVStream* pStr = stream();
+            const AVCodec* pCodec = codecCtx_->codec;
+            assert(pCodec);
+            const int inWidth = pStr->codecpar->width;
+            const int inHeight = pStr->codecpar->height;
+            int lowres = 0;
+            while ( (lowres < pCodec->max_lowres) && (AV_CEIL_RSHIFT(inWidth, lowres+1) >= width) && (AV_CEIL_RSHIFT(inHeight, lowres+1) >= height) )
+            {
+                ++lowres;
+            }
+            if (0 == lowres)
+            {
+                LOG4CXX_INFO(logger, "Unable to decode " << pCodec->name << " at a reduced resolution of at least " << width << "x" << height);
+                return false;
+            }
+            pReducedCtx_.reset(new CodecContext(pCodec));
+            int ret = avcodec_parameters_to_context(pReducedCtx_->get(), pStr->codecpar);
+            if (ret < 0)
+            {
+                throw MediaError("Unable to initialize reduced-resolution decoder context", ret);
+            }
+            Dictionary opts;
+            opts.add("refcounted_frames", 1);
+            opts.add("lowres", lowres);
+            opts.add("threads", "1");   //so that each packet is decoded right away, on the reduced-resolution decoder thread
+            ret = avcodec_open2(pReducedCtx_->get(), pCodec, &opts.get());
+            if (ret < 0)
+            {
+                throw MediaError("Unable to open reduced-resolution decoder", ret);
+            }
+            (*pReducedCtx_)->time_base = pStr->time_base;
+            width = AV_CEIL_RSHIFT(inWidth, lowres);
+            height = AV_CEIL_RSHIFT(inHeight, lowres);
+            LOG4CXX_INFO(logger, "Opened reduced-resolution decoder at 1/" << (1 << lowres) << " scale: " << width << "x" << height);
+            return true;
+        }
+
+        /// Starts the thread that decodes the packets read by read() at the reduced resolution, and publishes the frames to a frame bus
+        /// @param[in] pFrame frame bus to publish the reduced-resolution frames to
+        void publishReduced(const std::shared_ptr<ThreadsafeFrame>& pFrame)
+        {
+            assert(pReducedCtx_ && pFrame && !reducedThread_.joinable());
+            pReducedFrame_ = pFrame;
+            pReducedPackets_ = std::make_shared<PacketQueue>(REDUCED_QUEUE_SIZE, true);
+            reducedThread_ = std::thread(&Implementation::runReducedDecoder, this);
+        }
+
+        /// Lets the reduced-resolution decoder thread drain the decoder once the input has ended, waits for it, and closes its frame bus
+        /// @throw std::exception if there was a problem decoding the reduced-resolution frames.
+        void finishReduced()
+        {
+            if (!reducedThread_.joinable())
+            {
+                return;
+            }
+            pReducedPackets_->close();
+            reducedThread_.join();
+            LOG4CXX_DEBUG(logger, "Reduced-resolution packets: " << pReducedPackets_->stats());
+            if (auto pReducedFrame = pReducedFrame_.lock())
+            {
+                pReducedFrame->close();
+            }
+            std::lock_guard<std::mutex> lk(reducedMutex_);
+            if (reducedError_)
+            {
+                std::rethrow_exception(reducedError_);
+            }
+        }
+
+        /// Reads a frame at the reduced resolution only, decoding it on this thread
+        /// @param[out] frame reduced-resolution frame
         /// @return pointer to the stream that the frame is from. Will be nullptr when finished reading without errors.
-        /// @throw MMError if there was a problem reading frames.
-        const AVStream* read(Frame& frame)
+        /// @throw MediaError if there was a problem reading or decoding frames.
+        const AVStream* readReducedOnly(Frame& frame)
         {
-            assert(stream_ >= 0);    //Otherwise stream is closed and we shouldn't be calling this
-            int ret;
-            int stream = pkt_->stream_index;
-            if (stream < 0)    //read more packets
+            assert(pReducedCtx_ && !reducedThread_.joinable());  //read() and readReducedOnly() should not be mixed
+            logTimeToFirstFrame();
+            while (true)
             {
-                ret = av_read_frame(formatCtx_.get(), pkt_.get()); //read a new packet
-                if (AVERROR_EOF == ret)
+                int ret = avcodec_receive_frame(pReducedCtx_->get(), frame.get());
+                if (0 == ret)
                 {
-                    LOG4CXX_DEBUG(logger, "Reached end of file. Closing.");
+                    setReducedFrameInfo(frame);
+                    return stream();
+                }
+                else if (AVERROR_EOF == ret)
+                {
+                    LOG4CXX_INFO(logger, "End of file or stream.");
                     return nullptr;
                 }
+                else if (ret != AVERROR(EAGAIN))
+                {
+                    throw MediaError("Reduced-resolution decoding error.", ret);
+                }
+                // The decoder needs more packets
+                ret = av_read_frame(formatCtx_.get(), pkt_.get());
+                if (AVERROR_EOF == ret)
+                {
+                    ret = avcodec_send_packet(pReducedCtx_->get(), nullptr);
+                    if (ret < 0)
+                    {
+                        throw MediaError("Unable to flush reduced-resolution decoder", ret);
+                    }
+                    continue;
+                }
                 else if (ret < 0)
                 {
                     throw MediaError("Error reading packets", ret);
                 }
-                stream = pkt_->stream_index;
-                if ( stream != stream_ )   //no decoder open for this stream. Skip & read more packets
+                if (pkt_->stream_index == stream_)
                 {
-                    LOG4CXX_DEBUG(logger, "Skipping packet from undecoded stream.");
-                    pkt_.unref();
-                    return read(frame);
+                    publishPacket();
+                    ret = avcodec_send_packet(pReducedCtx_->get(), pkt_.get());
+                    if (ret < 0)
+                    {
+                        pkt_.unref();
+                        throw MediaError("Unable to decode packet at reduced resolution", ret);
+                    }
                 }
-                //Valid packet & decoder - send packet to decoder
-                ret = avcodec_send_packet(codecCtx_.get(), pkt_.get());
-                if (ret < 0)
+                pkt_.unref();
+            }
+        }
+
+        /// Sets the timestamp, type & timebase of a decoded reduced-resolution frame
+        /// @param[in, out] frame reduced-resolution frame
+        void setReducedFrameInfo(Frame& frame) const
+        {
+            if (frame->pts == AV_NOPTS_VALUE)
+            {
+                frame->pts = frame->best_effort_timestamp;
+            }
+            frame.type = AVMEDIA_TYPE_VIDEO;
+            frame.timebase = stream()->time_base;
+        }
+
+        /// Picks the capture format to use if "pixel_format" is "auto". Each format the device offers at the requested
+        /// size & frame rate is opened, and a short burst of frames is read and converted to the output format. The format
+        /// with the lowest CPU time per frame that sustains the frame rate is picked. If there is a "probe_cache" option,
+        /// the picked format is saved there, and later starts with the same options use it without timing the formats.
+        /// @param[in] url url of the device
+        /// @param[in, out] muxerOpts muxer options. On return, the automatic pixel format is replaced by the chosen one.
+        /// @param[in] codecOpts decoder options
+        /// @param[in] outFormat pixel format frames will be converted to
+        /// @param[in] doLoadCache if false, the formats are timed even if one was cached
+        /// @return how the capture format was chosen
+        static FormatSource negotiateFormat(const std::string& url, Dictionary& muxerOpts, const Dictionary& codecOpts, AVPixelFormat outFormat, bool doLoadCache=true)
+        {
+            if ( !muxerOpts.has("pixel_format") || (muxerOpts["pixel_format"] != "auto") )
+            {
+                return FormatSource::GIVEN;
+            }
+            av_dict_set(&muxerOpts.get(), "pixel_format", nullptr, 0);
+#ifdef __gnu_linux__
+            int width = 0, height = 0;
+            if ( !muxerOpts.has("video_size") || (av_parse_video_size(&width, &height, muxerOpts["video_size"].c_str()) < 0) )
+            {
+                throw MediaError("Automatic pixel format selection requires a video_size");
+            }
+            std::unique_ptr<FormatCache> pCache;
+            if (muxerOpts.has("probe_cache"))
+            {
+                Dictionary deviceOpts(muxerOpts);
+                av_dict_set(&deviceOpts.get(), "probe_cache", nullptr, 0);  //not a device option
+                pCache.reset( new FormatCache(muxerOpts["probe_cache"], url, deviceOpts, outFormat) );
+                std::string option, format;
+                if ( doLoadCache && pCache->load(option, format) )
+                {
+                    LOG4CXX_INFO(logger, "Using cached capture format " << format);
+                    muxerOpts.add(option, format);
+                    return FormatSource::CACHED;
+                }
+            }
+            AVRational fps = {30, 1};
+            if ( muxerOpts.has("framerate") && (av_parse_video_rate(&fps, muxerOpts["framerate"].c_str()) < 0) )
+            {
+                throw MediaError("Unable to parse frame rate " + muxerOpts["framerate"]);
+            }
+            const bool isNative = ( muxerOpts.has("capture_backend") && (muxerOpts["capture_backend"] == "native") );
+
+            std::string bestFormat;
+            bool isBestCompressed = false;
+            double bestCost = std::numeric_limits<double>::max();
+            double bestFps = 0;
+            for (const auto& fmt: V4L2Capture::GetFormats(url, width, height))
+            {
+                if ( fmt.isCompressed && isNative )
+                {
+                    LOG4CXX_DEBUG(logger, "Native capture backend cannot decode " << fmt.name << ", skipping.");
+                    continue;
+                }
+                if (av_cmp_q(fmt.maxFrameRate, fps) < 0)
                 {
-                    throw MediaError("Unable to decode packet", ret);
+                    LOG4CXX_DEBUG(logger, fmt.name << " is only offered up to " << fmt.maxFrameRate << " fps, skipping.");
+                    continue;
+                }
+                Dictionary opts(muxerOpts);
+                opts.add(fmt.isCompressed ? "input_format" : "pixel_format", fmt.name);
+                double cost, achievedFps;
+                try
+                {
+                    timeFormat(url, opts, codecOpts, outFormat, cost, achievedFps);
                 }
+                catch (std::exception& err)
+                {
+                    LOG4CXX_WARN(logger, "Unable to capture " << fmt.name << " from " << url << ": " << err.what());
+                    continue;
+                }
+                const bool isSustained = (achievedFps >= MIN_FRAME_RATE_RATIO * av_q2d(fps));
+                LOG4CXX_INFO(logger, "Capture format " << fmt.name << ": " << cost * 1000 << " ms/frame to read & convert, "
+                             << achievedFps << " fps" << (isSustained ? "" : " (too slow)"));
+                const bool isBestSustained = (bestFps >= MIN_FRAME_RATE_RATIO * av_q2d(fps));
+                // Prefer formats that sustain the frame rate, and then the cheapest one
+                if ( bestFormat.empty() || (isSustained && (!isBestSustained || (cost < bestCost))) || (!isSustained && !isBestSustained && (achievedFps > bestFps)) )
+                {
+                    bestFormat = fmt.name;
+                    isBestCompressed = fmt.isCompressed;
+                    bestCost = cost;
+                    bestFps = achievedFps;
+                }
+            }
+            if (bestFormat.empty())
+            {
+                throw MediaError("Unable to find a usable capture format for " + url + " at " + muxerOpts["video_size"]);
             }
-            // Receive decoded frame if available
-            assert (stream == stream_);
-            ret = avcodec_receive_frame(codecCtx_.get(), frame.get());
-            switch (ret)
+            LOG4CXX_INFO(logger, "Using capture format " << bestFormat << " (" << bestCost * 1000 << " ms/frame, " << bestFps << " fps)");
+            const std::string option = (isBestCompressed ? "input_format" : "pixel_format");
+            muxerOpts.add(option, bestFormat);
+            if (pCache)
             {
-                case 0:
+                pCache->save(option, bestFormat);
+            }
+            return FormatSource::TIMED;
+#else
+            LOG4CXX_WARN(logger, "Automatic pixel format selection is only available on Linux, using the device default.");
+            return FormatSource::GIVEN;
+#endif
+        }
+
+        /// Times reading & converting frames with a set of options
+        /// @param[in] url url of the device
+        /// @param[in] opts muxer options to open the device with
+        /// @param[in] codecOpts decoder options
+        /// @param[in] outFormat pixel format frames will be converted to
+        /// @param[out] cost CPU time spent per frame, in seconds
+        /// @param[out] fps achieved frame rate
+        static void timeFormat(const std::string& url, const Dictionary& opts, const Dictionary& codecOpts, AVPixelFormat outFormat, double& cost, double& fps)
+        {
+            // The trial opens share the probe cache, so the stream parameters of the chosen format are cached by the time it is opened for good
+            Dictionary muxerOpts(opts);
+            Implementation impl(url, muxerOpts, codecOpts);
+            impl.hasReadFrames_ = true;     //only the input that is kept logs its startup time
+            const AVStream* pStr = impl.stream();
+            Frame frame(nullptr, AVMEDIA_TYPE_VIDEO);
+            Frame outFrame;
+            SwsContext* pConvCtx = nullptr;
+            std::clock_t cpuTime = 0;
+            std::chrono::steady_clock::time_point start;
+            try
+            {
+                for (int n = 0; n < CALIBRATION_WARMUP_FRAMES + CALIBRATION_FRAMES; ++n)
                 {
-                    if (frame->pts == AV_NOPTS_VALUE)
+                    if (n == CALIBRATION_WARMUP_FRAMES)
                     {
-                        frame->pts = frame->best_effort_timestamp;
+                        start = std::chrono::steady_clock::now();
                     }
-                    frame.type = AVMEDIA_TYPE_VIDEO;
-                    const AVStream* pStr = formatCtx_->streams[stream_];
-                    frame.timebase = pStr->time_base;
-                    return pStr;
-                }
-                case AVERROR(EAGAIN):   //more packets need to be read & sent to the decoder before decoding
-                    pkt_.unref();
-                    return read(frame);
-                case AVERROR(EOF):
+                    // CPU time, rather than wall time, so that time spent waiting for the camera is not counted
+                    const std::clock_t cpuStart = std::clock();
+                    if (!impl.read(frame))
+                    {
+                        throw MediaError("Input ended while timing capture format");
+                    }
+                    if ( (outFormat != AV_PIX_FMT_NONE) && (outFormat != frame->format) )
+                    {
+                        if (!outFrame->data[0])
+                        {
+                            outFrame = Frame(frame->width, frame->height, outFormat);
+                        }
+                        pConvCtx = sws_getCachedContext(pConvCtx, frame->width, frame->height, (AVPixelFormat) frame->format,
+                                                        outFrame->width, outFrame->height, outFormat, SWS_BILINEAR, nullptr, nullptr, nullptr);
+                        if (!pConvCtx)
+                        {
+                            throw MediaError("Unable to create conversion context");
+                        }
+                        sws_scale(pConvCtx, frame->data, frame->linesize, 0, frame->height, outFrame->data, outFrame->linesize);
+                    }
+                    if (n >= CALIBRATION_WARMUP_FRAMES)
+                    {
+                        cpuTime += std::clock() - cpuStart;
+                    }
+                }
+            }
+            catch (...)
+            {
+                sws_freeContext(pConvCtx);
+                throw;
+            }
+            sws_freeContext(pConvCtx);
+            const double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            cost = (double) cpuTime / CLOCKS_PER_SEC / CALIBRATION_FRAMES;
+            fps = (duration > 0 ? CALIBRATION_FRAMES / duration : 0);
+            LOG4CXX_DEBUG(logger, "Timed " << CALIBRATION_FRAMES << " frames of " << *pStr);
+        }
+
+        /// Passes the current packet to the reduced-resolution decoder thread, waiting for it if it is behind
+        /// @throw std::exception if the decoder thread stopped with an error
+        void decodeReduced()
+        {
+            assert(pReducedPackets_);
+            {
+                std::lock_guard<std::mutex> lk(reducedMutex_);
+                if (reducedError_)
+                {
+                    std::rethrow_exception(reducedError_);
+                }
+            }
+            pReducedPackets_->push(pkt_.get());
+        }
+
+        /// Decodes the packets passed by decodeReduced() at the reduced resolution, and publishes the frames that are wanted
+        /// to the reduced-resolution frame bus. Runs on its own thread until the packet queue is closed, and then drains the
+        /// decoder, or until it is cancelled. If decoding fails, the error is passed to the reader via decodeReduced() or finishReduced().
+        void runReducedDecoder()
+        {
+            Packet pkt;
+            Frame frame(nullptr, AVMEDIA_TYPE_VIDEO);
+            const std::int64_t startTime = (stream()->start_time != AV_NOPTS_VALUE ? stream()->start_time : 0);
+            // Publishes the frames the decoder has ready
+            auto publishFrames = [this, &frame, startTime]() {
+                int ret;
+                while ( 0 == (ret = avcodec_receive_frame(pReducedCtx_->get(), frame.get())) )
+                {
+                    setReducedFrameInfo(frame);
+                    frame->best_effort_timestamp -= startTime;
+                    frame->pts -= startTime;
+                    auto pReducedFrame = pReducedFrame_.lock();
+                    if (pReducedFrame && pReducedFrame->isWanted(frame->pts))
+                    {
+                        pReducedFrame->update(frame);
+                    }
+                    av_frame_unref(frame.get());
+                }
+                if ( (ret != AVERROR(EAGAIN)) && (ret != AVERROR_EOF) )
+                {
+                    throw MediaError("Reduced-resolution decoding error.", ret);
+                }
+            };
+            try
+            {
+                while (pReducedPackets_->pop(pkt))
+                {
+                    int ret = avcodec_send_packet(pReducedCtx_->get(), pkt.get());
+                    pkt.unref();
+                    if (ret < 0)
+                    {
+                        throw MediaError("Unable to decode packet at reduced resolution", ret);
+                    }
+                    publishFrames();
+                }
+                if (!pReducedPackets_->isCancelled())
+                {
+                    // The input has ended, so the frames still in the decoder are flushed
+                    int ret = avcodec_send_packet(pReducedCtx_->get(), nullptr);
+                    if (ret < 0)
+                    {
+                        throw MediaError("Unable to flush reduced-resolution decoder", ret);
+                    }
+                    publishFrames();
+                }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lk(reducedMutex_);
+                reducedError_ = std::current_exception();
+                pReducedPackets_->cancel();
+            }
+        }
+
+        /// Pushes the current packet to the packet queues
+        void publishPacket()
+        {
+            auto it = packetQueues_.begin();
+            while (it != packetQueues_.end())
+            {
+                if ( (*it)->isCancelled() )
+                {
+                    it = packetQueues_.erase(it);
+                }
+                else
+                {
+                    (*it)->push(pkt_.get());
+                    ++it;
+                }
+            }
+        }
+
+        /// Reads a video packet without decoding it, and pushes it to the packet queues
+        /// @return pointer to the stream that the packet is from. Will be nullptr when finished reading without errors.
+        /// @throw MediaError if there was a problem reading packets.
+        const AVStream* readPacket()
+        {
+            assert(stream_ >= 0);
+#ifdef __gnu_linux__
+            if (pCapture_)
+            {
+                throw MediaError("The native capture backend does not provide compressed packets.");
+            }
+#endif
+            while (true)
+            {
+                int ret = av_read_frame(formatCtx_.get(), pkt_.get());
+                if (AVERROR_EOF == ret)
+                {
                     LOG4CXX_INFO(logger, "End of file or stream.");
                     return nullptr;
-                case AVERROR(EINVAL):
-                    throw MediaError("Codec not opened, or it is an encoder");
-                default:
-                    throw MediaError("Decoding error.", ret);
+                }
+                else if (ret < 0)
+                {
+                    throw MediaError("Error reading packets", ret);
+                }
+                const bool isVideo = (pkt_->stream_index == stream_);
+                if (isVideo)
+                {
+                    publishPacket();
+                }
+                pkt_.unref();
+                if (isVideo)
+                {
+                    return formatCtx_->streams[stream_];
+                }
+            }
+        }
+
+        /// Logs the time to the first frame, if no frames were read yet
+        /// @return true if this is the first frame
+        bool logTimeToFirstFrame()
+        {
+            if (hasReadFrames_)
+            {
+                return false;
+            }
+            hasReadFrames_ = true;
+            // A cold start times the capture formats and/or probes the input, a cached start loads what it can from the probe cache
+            using std::chrono::milliseconds;
+            using std::chrono::duration_cast;
+            const bool isCold = ( (formatSource_ == FormatSource::TIMED) || !isProbeCached_ );
+            std::ostringstream details;
+            if (formatSource_ == FormatSource::TIMED)
+            {
+                details << "capture format timed in " << duration_cast<milliseconds>(negotiationTime_).count() << " ms, ";
+            }
+            else if (formatSource_ == FormatSource::CACHED)
+            {
+                details << "capture format from probe cache, ";
+            }
+            details << (isProbeCached_ ? "stream parameters from probe cache" : "input probed");
+            LOG4CXX_INFO(logger, "Time to first frame: " << duration_cast<milliseconds>(std::chrono::steady_clock::now() - openTime_).count()
+                         << " ms, " << (isCold ? "cold" : "cached") << " start (" << details.str() << ")");
+            return true;
+        }
+
+        /// Reads a frame
+        /// @param[out] pFrame pointer to frame. Will contain new frame upon return
+        /// @return pointer to the stream that the frame is from. Will be nullptr when finished reading without errors.
+        /// @throw MMError if there was a problem reading frames.
+        const AVStream* read(Frame& frame)
+        {
+            assert(stream_ >= 0);    //Otherwise stream is closed and we shouldn't be calling this
+            if (logTimeToFirstFrame())
+            {
+                if (firstFrame_->data[0])   //decoded while validating the probe cache
+                {
+                    av_frame_unref(frame.get());
+                    av_frame_move_ref(frame.get(), firstFrame_.get());
+                    frame.type = AVMEDIA_TYPE_VIDEO;
+                    frame.timebase = stream()->time_base;
+                    return stream();
+                }
+            }
+#ifdef __gnu_linux__
+            if (pCapture_)  //raw frames straight from the driver, no decoding needed
+            {
+                pCapture_->read(frame);
+                return pCapture_->stream();
+            }
+#endif
+            int ret;
+            while (true)
+            {
+                if ( (pkt_->stream_index < 0) && !isFlushing_ )    //read more packets
+                {
+                    ret = av_read_frame(formatCtx_.get(), pkt_.get()); //read a new packet
+                    if (AVERROR_EOF == ret)
+                    {
+                        // With frame threading, several frames may still be in the decoder
+                        LOG4CXX_DEBUG(logger, "Reached end of file. Flushing decoder.");
+                        isFlushing_ = true;
+                        ret = avcodec_send_packet(codecCtx_.get(), nullptr);
+                        if (ret < 0)
+                        {
+                            throw MediaError("Unable to flush decoder", ret);
+                        }
+                    }
+                    else if (ret < 0)
+                    {
+                        throw MediaError("Error reading packets", ret);
+                    }
+                    else if ( pkt_->stream_index != stream_ )   //no decoder open for this stream. Skip & read more packets
+                    {
+                        LOG4CXX_DEBUG(logger, "Skipping packet from undecoded stream.");
+                        pkt_.unref();
+                        continue;
+                    }
+                    else
+                    {
+                        publishPacket();
+                        //Valid packet & decoder - send packet to decoder. With frame threading, this returns as soon as a thread picks it up.
+                        const auto start = std::chrono::steady_clock::now();
+                        ret = avcodec_send_packet(codecCtx_.get(), pkt_.get());
+                        decoderWait_ += std::chrono::steady_clock::now() - start;
+                        if (ret < 0)
+                        {
+                            throw MediaError("Unable to decode packet", ret);
+                        }
+                        if (pReducedPackets_)
+                        {
+                            decodeReduced();
+                        }
+                    }
+                }
+                // Receive decoded frame if available
+                const auto start = std::chrono::steady_clock::now();
+                ret = avcodec_receive_frame(codecCtx_.get(), frame.get());
+                decoderWait_ += std::chrono::steady_clock::now() - start;
+                switch (ret)
+                {
+                    case 0:
+                    {
+                        if (frame->pts == AV_NOPTS_VALUE)
+                        {
+                            frame->pts = frame->best_effort_timestamp;
+                        }
+                        frame.type = AVMEDIA_TYPE_VIDEO;
+                        const AVStream* pStr = formatCtx_->streams[stream_];
+                        frame.timebase = pStr->time_base;
+                        decoderWaitStats_.add(decoderWait_);
+                        decoderWait_ = std::chrono::steady_clock::duration(0);
+                        return pStr;
+                    }
+                    case AVERROR(EAGAIN):   //more packets need to be read & sent to the decoder before decoding
+                        pkt_.unref();
+                        continue;
+                    case AVERROR_EOF:
+                        LOG4CXX_INFO(logger, "End of file or stream.");
+                        finishReduced();
+                        return nullptr;
+                    case AVERROR(EINVAL):
+                        throw MediaError("Codec not opened, or it is an encoder");
+                    default:
+                        throw MediaError("Decoding error.", ret);
+                }
             }
         }
     };  // avtools::MediaReader::Implementation
@@ -270,8 +1345,8 @@ namespace avtools
     //
     //==========================================
 
-    MediaReader::MediaReader(const std::string& url, Dictionary& opts):
-    pImpl_( new Implementation(url, opts) )
+    MediaReader::MediaReader(const std::string& url, Dictionary& opts, const Dictionary& codecOpts, AVPixelFormat outFormat/*=AV_PIX_FMT_NONE*/):
+    pImpl_( Implementation::Open(url, opts, codecOpts, outFormat) )
     {
         assert( pImpl_ );
     }
@@ -298,6 +1373,72 @@ namespace avtools
         }
     }
 
+    const AVStream* MediaReader::readPacket()
+    {
+        assert(pImpl_);
+        try
+        {
+            const AVStream* pStr = pImpl_->readPacket();
+            if (!pStr) //eof
+            {
+                LOG4CXX_DEBUG(logger, "End of stream reached. closing MediaReader.");
+                pImpl_.reset(nullptr);
+            }
+            return pStr;
+        }
+        catch (std::exception& err)
+        {
+            pImpl_.reset(nullptr);
+            std::throw_with_nested( MediaError("MediaReader: Unable to read packets.") );
+        }
+    }
+
+    std::shared_ptr<PacketQueue> MediaReader::subscribePackets(std::size_t capacity)
+    {
+        assert(pImpl_);
+        return pImpl_->subscribePackets(capacity);
+    }
+
+    void MediaReader::closePacketQueues()
+    {
+        if (pImpl_)
+        {
+            pImpl_->closePacketQueues();
+        }
+    }
+
+    bool MediaReader::openReducedOutput(int& width, int& height)
+    {
+        assert(pImpl_);
+        return pImpl_->openReducedOutput(width, height);
+    }
+
+    void MediaReader::publishReduced(const std::shared_ptr<ThreadsafeFrame>& pFrame)
+    {
+        assert(pImpl_);
+        pImpl_->publishReduced(pFrame);
+    }
+
+    const AVStream* MediaReader::readReducedOnly(Frame& frame)
+    {
+        assert(pImpl_);
+        try
+        {
+            const AVStream* pStr = pImpl_->readReducedOnly(frame);
+            if (!pStr) //eof
+            {
+                LOG4CXX_DEBUG(logger, "End of stream reached. closing MediaReader.");
+                pImpl_.reset(nullptr);
+            }
+            return pStr;
+        }
+        catch (std::exception& err)
+        {
+            pImpl_.reset(nullptr);
+            std::throw_with_nested( MediaError("MediaReader: Unable to read reduced-resolution frames.") );
+        }
+    }
+
     const AVStream* MediaReader::getVideoStream() const
     {
         assert(pImpl_);
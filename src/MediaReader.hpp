@@ -9,6 +9,7 @@
 #ifndef __MediaReader_hpp__
 #define __MediaReader_hpp__
 
+#include <cstddef>
 #include <memory>
 #include <string>
 #include "LibAVWrappers.hpp"
@@ -19,6 +20,9 @@ struct AVDictionary;
 
 namespace avtools
 {
+    class PacketQueue;
+    class ThreadsafeFrame;
+
     /// @class media reader clss that opens a multimedia file for input
     /// See https://ffmpeg.org/doxygen/2.4/demuxing_decoding_8c-example.html#_a19
     class MediaReader
@@ -29,8 +33,13 @@ namespace avtools
         /// @param[in] url url of media file to open
         /// @param[in, out] opts stream options to use, such as resolution & frame rate.
         /// On return, this dictionary should contain the actual values used in opening.
+        /// If it has "capture_backend" set to "native", the device is opened directly via V4L2 instead of libavdevice (Linux only).
+        /// If it has "pixel_format" set to "auto", the capture formats offered by the device are timed, and the cheapest one
+        /// that sustains the requested frame rate is used (Linux only).
+        /// @param[in] codecOpts decoder options, such as "threads" & "thread_type". Unless specified, the decoder uses frame & slice threading.
+        /// @param[in] outFormat pixel format the frames will be converted to after reading, used to time the capture formats.
         /// @throw std::runtime_exception if there was an error opening the stream.
-        MediaReader(const std::string& url, Dictionary& opts);
+        MediaReader(const std::string& url, Dictionary& opts, const Dictionary& codecOpts=Dictionary(), AVPixelFormat outFormat=AV_PIX_FMT_NONE);
 
         /// Dtor
         ~MediaReader();
@@ -45,6 +54,45 @@ namespace avtools
         /// @throw std::exception if there was a problem reading frames.
         const AVStream* read(Frame &frame);
 
+        /// Reads a video packet without decoding it, and pushes it to the packet queues. Should be used instead of read()
+        /// when only compressed packets are needed.
+        /// @return pointer to the stream that the packet is from. Will be nullptr when finished reading without errors.
+        /// @throw std::exception if there was a problem reading packets.
+        const AVStream* readPacket();
+
+        /// Adds a queue that receives the compressed video packets as they are read by read() or readPacket(), e.g. to remux
+        /// them without decoding. The queue is closed when the input ends.
+        /// @param[in] capacity maximum number of packets in the queue
+        /// @return a new packet queue
+        /// @throw MediaError if the input is not compressed, or is opened with the native capture backend.
+        std::shared_ptr<PacketQueue> subscribePackets(std::size_t capacity);
+
+        /// Closes the packet queues, so that their consumers do not wait for more packets.
+        void closePacketQueues();
+
+        /// Opens a second, reduced-resolution output. The same packets are decoded directly at a fraction of the input
+        /// resolution (e.g. 1/2, 1/4 or 1/8 via DCT-domain scaling for MJPEG), which is much cheaper than decoding at
+        /// full resolution and scaling down. Should be called before reading any frames.
+        /// @param[in, out] width minimum width needed. On return, the width of the reduced frames.
+        /// @param[in, out] height minimum height needed. On return, the height of the reduced frames.
+        /// @return true if the reduced output was opened, false if the input cannot be decoded at a reduced resolution of at least width x height.
+        bool openReducedOutput(int& width, int& height);
+
+        /// Publishes the reduced-resolution version of the frames read via read() to a frame bus. These are decoded on a
+        /// separate thread, in parallel with the full-resolution frames, and every frame that the bus wants is published, with
+        /// its timestamp relative to the start of the stream. read() waits for this thread if it falls behind. When the input
+        /// ends, the frames still in the decoder are published before read() returns nullptr, and the bus is then closed.
+        /// Should be called before reading any frames, after the reduced output is opened. Decoding errors are thrown by read().
+        /// @param[in] pFrame frame bus to publish the reduced-resolution frames to
+        void publishReduced(const std::shared_ptr<ThreadsafeFrame>& pFrame);
+
+        /// Reads a frame at the reduced resolution only, without decoding it at full resolution. Should be used instead of
+        /// read() when nothing uses the full-resolution frames. The reduced output should be opened first.
+        /// @param[out] frame reduced-resolution frame
+        /// @return pointer to the stream that the frame is from. Will be nullptr when finished reading without errors.
+        /// @throw std::exception if there was a problem reading frames.
+        const AVStream* readReducedOnly(Frame& frame);
+
     private:
         class Implementation;
         std::unique_ptr<Implementation> pImpl_;
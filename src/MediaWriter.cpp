@@ -8,7 +8,11 @@
 
 #include "MediaWriter.hpp"
 #include "Media.hpp"
+#include <algorithm>
+#include <cstdint>
 #include <string>
+#include <chrono>
+#include <cstring>
 #include "log4cxx/logger.h"
 
 extern "C" {
@@ -16,6 +20,7 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavdevice/avdevice.h>
 #include <libavutil/parseutils.h>
+#include <libavutil/opt.h>
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
 #include <libavfilter/buffersrc.h>
@@ -63,6 +68,125 @@ namespace
 
         return pCtx;
     }
+
+    /// @class Keeps track of how long it takes a writer to produce output after it is opened, and logs it once.
+    /// For segmented outputs, this is the time until the first segment is complete, i.e., until it can be served.
+    class StartupStats
+    {
+    private:
+        const std::chrono::steady_clock::time_point openTime_;  ///< time the writer was opened
+        std::chrono::steady_clock::time_point firstFrameTime_;  ///< time the first frame was written
+        double segmentDuration_;                                ///< target segment duration in seconds if the output is segmented, 0 otherwise
+        std::int64_t firstPts_;                                 ///< timestamp of the first muxed packet
+        bool isDone_;                                           ///< true once the statistics are logged
+
+        /// @param[in] t a time point
+        /// @return milliseconds elapsed since t
+        static long long msSince(std::chrono::steady_clock::time_point t)
+        {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t).count();
+        }
+    public:
+        /// Ctor
+        StartupStats(): openTime_(std::chrono::steady_clock::now()), firstFrameTime_(), segmentDuration_(0), firstPts_(AV_NOPTS_VALUE), isDone_(false) {}
+
+        /// Sets the target segment duration for segmented outputs
+        /// @param[in] duration target segment duration in seconds
+        void setSegmentDuration(double duration) { segmentDuration_ = duration; }
+
+        /// Marks the time the first frame or packet is written to the writer
+        void addFrame()
+        {
+            if (firstFrameTime_ == std::chrono::steady_clock::time_point())
+            {
+                firstFrameTime_ = std::chrono::steady_clock::now();
+            }
+        }
+
+        /// Updates the statistics with a muxed packet, and logs them once the first packet or segment is out
+        /// @param[in] pPkt muxed packet
+        /// @param[in] timebase timebase of the packet's timestamps
+        void addPacket(const AVPacket* pPkt, avtools::TimeBaseType timebase)
+        {
+            if (isDone_)
+            {
+                return;
+            }
+            if (AV_NOPTS_VALUE == firstPts_)
+            {
+                firstPts_ = pPkt->pts;
+                LOG4CXX_INFO(logger, "Time to first packet: " << msSince(openTime_) << " ms since the writer was opened, "
+                             << msSince(firstFrameTime_) << " ms since the first frame");
+                isDone_ = (segmentDuration_ <= 0);
+                return;
+            }
+            // A segmenting muxer starts a new segment at the first keyframe past the target duration, which completes the first one
+            if ( (pPkt->flags & AV_PKT_FLAG_KEY) && (av_q2d(timebase) * (pPkt->pts - firstPts_) >= segmentDuration_) )
+            {
+                LOG4CXX_INFO(logger, "Time to first segment: " << msSince(openTime_) << " ms since the writer was opened, "
+                             << msSince(firstFrameTime_) << " ms since the first frame");
+                isDone_ = true;
+            }
+        }
+    };  //::<anon>::StartupStats
+
+    /// @class Keeps track of the size of the muxed packets, to see how much bitrate changes to the picture (e.g. a new perspective
+    /// transform, which moves the whole image) cost.
+    class BitrateStats
+    {
+    private:
+        std::size_t nPackets_;          ///< number of muxed packets
+        std::size_t nKeyPackets_;       ///< number of muxed keyframe packets
+        std::uint64_t bytes_;           ///< total size of the muxed packets
+        std::uint64_t keyBytes_;        ///< total size of the muxed keyframe packets
+        int maxPacketSize_;             ///< size of the largest muxed packet
+        std::int64_t firstPts_;         ///< timestamp of the first muxed packet
+        std::int64_t lastPts_;          ///< timestamp of the last muxed packet
+        avtools::TimeBaseType timebase_;    ///< timebase of the timestamps
+
+    public:
+        /// Ctor
+        BitrateStats(): nPackets_(0), nKeyPackets_(0), bytes_(0), keyBytes_(0), maxPacketSize_(0), firstPts_(AV_NOPTS_VALUE), lastPts_(AV_NOPTS_VALUE), timebase_{} {}
+
+        /// Updates the statistics with a muxed packet
+        /// @param[in] pPkt muxed packet
+        /// @param[in] timebase timebase of the packet's timestamps
+        void addPacket(const AVPacket* pPkt, avtools::TimeBaseType timebase)
+        {
+            ++nPackets_;
+            bytes_ += pPkt->size;
+            maxPacketSize_ = std::max(maxPacketSize_, pPkt->size);
+            if (pPkt->flags & AV_PKT_FLAG_KEY)
+            {
+                ++nKeyPackets_;
+                keyBytes_ += pPkt->size;
+            }
+            if (pPkt->pts != AV_NOPTS_VALUE)
+            {
+                if (AV_NOPTS_VALUE == firstPts_)
+                {
+                    firstPts_ = pPkt->pts;
+                }
+                lastPts_ = std::max(lastPts_, pPkt->pts);
+            }
+            timebase_ = timebase;
+        }
+
+        /// Logs the statistics
+        /// @param[in] url url of the output
+        void log(const std::string& url) const
+        {
+            if (0 == nPackets_)
+            {
+                return;
+            }
+            const double duration = (AV_NOPTS_VALUE == firstPts_ ? 0. : av_q2d(timebase_) * (lastPts_ - firstPts_));
+            LOG4CXX_INFO(logger, "Output bitrate of " << url << ": packets=" << nPackets_ << ", mean bitrate="
+                         << (duration > 0. ? 8e-3 * bytes_ / duration : 0.) << "kbps, mean packet=" << bytes_ / nPackets_
+                         << " bytes, largest packet=" << maxPacketSize_ << " bytes, keyframes=" << nKeyPackets_
+                         << " (" << (bytes_ > 0 ? 100. * keyBytes_ / bytes_ : 0.) << "% of the bytes)");
+        }
+    };  //::<anon>::BitrateStats
 }   //::<anon>
 
 namespace avtools
@@ -81,14 +205,22 @@ namespace avtools
         Packet pkt_;                                ///< Packet to use for encoding frames
         AVFilterInOut *pIn_, *pOut_;                ///< filtergraph inputs/outputs
         AVFilterGraph *pGraph_;                     ///< filtergraph
+        const bool isPassthrough_;                  ///< true if compressed packets are remuxed without re-encoding
+        avtools::TimeBaseType inTimebase_;          ///< timebase of the incoming packets, or of the frames the filter graph is built for
+        std::int64_t startTs_;                      ///< timestamp of the first remuxed packet, in the incoming timebase
+        Frame graphInput_;                          ///< properties of the frames the filter graph is built for, without any data
+        StartupStats startupStats_;                 ///< time to first packet/segment
+        BitrateStats bitrateStats_;                 ///< sizes of the muxed packets
 
         /// Initializes the filter graph
-        /// @param[in] pFrame input frame
+        /// @param[in] pFrame input frame. Only its properties are used.
         /// @param[in] timebase timebase for the incoming frame's timestamps
         void initFilterGraph(const AVFrame* pFrame, avtools::TimeBaseType timebase)
         {
             assert( pIn_ && pOut_ && pGraph_);
             assert(pFrame);
+            assert(!pIn_->filter_ctx);
+            const auto start = std::chrono::steady_clock::now();
             const AVStream* pStr = stream();
             assert(pStr);
             const AVCodecParameters *pCodecPar = pStr->codecpar;
@@ -209,6 +341,55 @@ namespace avtools
             LOG4CXX_DEBUG(logger, "Filter graph initialized:\n" << graphDesc);
             av_freep( &graphDesc);
 #endif
+            graphInput_->width = pFrame->width;
+            graphInput_->height = pFrame->height;
+            graphInput_->format = pFrame->format;
+            graphInput_->sample_aspect_ratio = pFrame->sample_aspect_ratio;
+            inTimebase_ = timebase;
+            LOG4CXX_DEBUG(logger, "Built filter graph in " << std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() << "us");
+        }
+
+        /// Releases the filter graph, so that it can be rebuilt
+        void resetFilterGraph()
+        {
+            avfilter_graph_free(&pGraph_);
+            pGraph_ = avfilter_graph_alloc();
+            if ( !pGraph_)
+            {
+                throw std::runtime_error("Unable to initialize filtergraph");
+            }
+            av_freep(&pIn_->name);
+            av_freep(&pOut_->name);
+            pIn_->filter_ctx = pOut_->filter_ctx = nullptr;
+        }
+
+        /// @param[in] pFrame input frame
+        /// @param[in] timebase timebase for the incoming frame's timestamps
+        /// @return true if the filter graph is built for frames such as this one
+        bool isGraphInput(const AVFrame* pFrame, avtools::TimeBaseType timebase) const
+        {
+            return ( pIn_->filter_ctx && (pFrame->width == graphInput_->width) && (pFrame->height == graphInput_->height)
+                    && (pFrame->format == graphInput_->format) && (0 == av_cmp_q(pFrame->sample_aspect_ratio, graphInput_->sample_aspect_ratio))
+                    && (0 == av_cmp_q(timebase, inTimebase_)) );
+        }
+
+        /// Finds the target segment duration of segmented (HLS) outputs for the startup statistics
+        void initStartupStats()
+        {
+            if ( 0 != std::strcmp(formatCtx_->oformat->name, "hls") )
+            {
+                return;
+            }
+            const AVOption* pOpt = av_opt_find(formatCtx_->priv_data, "hls_time", nullptr, 0, 0);
+            double duration = 0;
+            if ( pOpt && (av_opt_get_double(formatCtx_->priv_data, "hls_time", 0, &duration) >= 0) )
+            {
+                if (pOpt->type == AV_OPT_TYPE_DURATION) //newer libavformat versions store it in microseconds
+                {
+                    duration /= AV_TIME_BASE;
+                }
+                startupStats_.setSegmentDuration(duration);
+            }
         }
 
         /// Encoders & multiplexes a video frame
@@ -265,34 +446,16 @@ namespace avtools
                     throw MediaError("Error muxing packet", ret);
                 }
                 assert(0 == ret);
+                startupStats_.addPacket(pkt_.get(), timebase);
+                bitrateStats_.addPacket(pkt_.get(), timebase);
             }
         }
 
-    public:
-
-        Implementation(
-            const std::string& url,
-            Dictionary& codecOpts,
-            Dictionary& muxerOpts
-        ):
-        formatCtx_(FormatContext::OUTPUT),
-        codecCtx_((AVCodec*) nullptr),
-        filtFrame_(),
-        pkt_(),
-        pIn_(avfilter_inout_alloc()),
-        pOut_(avfilter_inout_alloc()),
-        pGraph_( avfilter_graph_alloc() )
+        /// Allocates the output format context, sets the muxer options, and opens the output file or stream
+        /// @param[in] url output url
+        /// @param[in, out] muxerOpts muxer options. On return, contains the options that were not used.
+        void openMuxer(const std::string& url, Dictionary& muxerOpts)
         {
-            // Initialize filtergraph
-            if (!pIn_ || !pOut_)
-            {
-                throw std::runtime_error("Unable to initialize filtergraph inputs");
-            }
-            if ( !pGraph_)
-            {
-                throw std::runtime_error("Unable to initialize filtergraph");
-            }
-
             //Init output format context, open output file or stream
             int ret = avformat_alloc_output_context2(&formatCtx_.get(), nullptr, nullptr, url.c_str());
             if (ret < 0)
@@ -300,7 +463,6 @@ namespace avtools
                 throw MediaError("Unable to allocate output context.", ret);
             }
 
-            //Test that container can store this codec.
             AVOutputFormat* pOutFormat = formatCtx_->oformat;
             assert(pOutFormat);
 
@@ -346,6 +508,58 @@ namespace avtools
             }
             LOG4CXX_DEBUG(logger, "MediaWriter: Opened output file " << url << " in " << pOutFormat->long_name << " format.");
             LOG4CXX_DEBUG(logger, "Format context compliance: " << formatCtx_->strict_std_compliance);
+        }
+
+        /// Writes the output stream header
+        void writeHeader()
+        {
+            assert( (formatCtx_->nb_streams == 1) );
+            LOG4CXX_DEBUG(logger, "MediaWriter: Opened " << *stream());
+            int ret = avformat_write_header(formatCtx_.get(), nullptr);
+            if (ret < 0)
+            {
+                throw MediaError("Error occurred when writing output stream header.", ret);
+            }
+            LOG4CXX_DEBUG(logger, "MediaWriter: Opened output file " << formatCtx_->url);
+        }
+
+    public:
+
+        Implementation(
+            const std::string& url,
+            Dictionary& codecOpts,
+            Dictionary& muxerOpts
+        ):
+        formatCtx_(FormatContext::OUTPUT),
+        codecCtx_((AVCodec*) nullptr),
+        filtFrame_(),
+        pkt_(),
+        pIn_(avfilter_inout_alloc()),
+        pOut_(avfilter_inout_alloc()),
+        pGraph_( avfilter_graph_alloc() ),
+        isPassthrough_(false),
+        inTimebase_{0, 1},
+        startTs_(AV_NOPTS_VALUE),
+        graphInput_(nullptr, AVMEDIA_TYPE_VIDEO),
+        startupStats_()
+        {
+            // Initialize filtergraph
+            if (!pIn_ || !pOut_)
+            {
+                throw std::runtime_error("Unable to initialize filtergraph inputs");
+            }
+            if ( !pGraph_)
+            {
+                throw std::runtime_error("Unable to initialize filtergraph");
+            }
+
+            openMuxer(url, muxerOpts);
+            initStartupStats();
+
+            //Test that container can store this codec.
+            AVOutputFormat* pOutFormat = formatCtx_->oformat;
+            assert(pOutFormat);
+            int ret;
 
             // Find encoder
             const AVCodecDescriptor* pCodecDesc = nullptr;
@@ -460,17 +674,73 @@ namespace avtools
 
             assert( pStr->codecpar && (pStr->codecpar->codec_id == pCodecDesc->id) && (pStr->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) );
             assert( (formatCtx_->nb_streams == 1) && (pStr == formatCtx_->streams[0]) );
-            LOG4CXX_DEBUG(logger, "MediaWriter: Opened " << *pStr);
-            // Write stream header
-            ret = avformat_write_header(formatCtx_.get(), nullptr);
-            if (ret < 0)
+            writeHeader();
+
+            // Initialize output frame. Its data buffers come from the filtergraph, so none are allocated here.
+            filtFrame_ = Frame(nullptr, AVMediaType::AVMEDIA_TYPE_VIDEO);
+#ifndef NDEBUG
+            formatCtx_.dumpContainerInfo();
+#endif
+        }
+
+        /// Ctor that remuxes compressed packets from an input stream without re-encoding them
+        /// @param[in] url stream URL
+        /// @param[in] pInStr input stream whose packets will be written
+        /// @param[in] muxerOpts video-related multiplexer options
+        Implementation(
+            const std::string& url,
+            const AVStream* pInStr,
+            Dictionary& muxerOpts
+        ):
+        formatCtx_(FormatContext::OUTPUT),
+        codecCtx_((AVCodec*) nullptr),
+        filtFrame_(),
+        pkt_(),
+        pIn_(nullptr),
+        pOut_(nullptr),
+        pGraph_(nullptr),
+        isPassthrough_(true),
+        inTimebase_(pInStr->time_base),
+        startTs_(AV_NOPTS_VALUE),
+        graphInput_(nullptr, AVMEDIA_TYPE_VIDEO),
+        startupStats_()
+        {
+            assert(pInStr && pInStr->codecpar);
+            openMuxer(url, muxerOpts);
+            initStartupStats();
+
+            //Test that container can store this codec.
+            AVOutputFormat* pOutFormat = formatCtx_->oformat;
+            assert(pOutFormat);
+            const AVCodecParameters* pInPar = pInStr->codecpar;
+            const AVCodecDescriptor* pCodecDesc = avcodec_descriptor_get(pInPar->codec_id);
+            if (!pCodecDesc)
             {
-                throw MediaError("Error occurred when writing output stream header.", ret);
+                throw std::runtime_error("Unable to find a descriptor for codec " + std::to_string(pInPar->codec_id));
             }
-            LOG4CXX_DEBUG(logger, "MediaWriter: Opened output file " << formatCtx_->url);
+            int ret = avformat_query_codec(pOutFormat, pInPar->codec_id, formatCtx_->strict_std_compliance);
+            if ( ret <= 0 )
+            {
+                throw MediaError("File format " + std::string(pOutFormat->name) + " is unable to store " + std::string(pCodecDesc->name) + " streams without re-encoding.", ret);
+            }
+            LOG4CXX_DEBUG(logger, "MediaWriter will remux " << pCodecDesc->name << " encoded video into a " << pOutFormat->name << " container." );
 
-            // Initialize output frame
-            filtFrame_ = Frame(pStr->codecpar->width, pStr->codecpar->height, (AVPixelFormat) pStr->codecpar->format);
+            // Add stream
+            AVStream* pStr = avformat_new_stream(formatCtx_.get(), nullptr);
+            if ( !pStr )
+            {
+                throw MediaError("Unable to add stream for " + std::string(pCodecDesc->name));
+            }
+            ret = avcodec_parameters_copy(pStr->codecpar, pInPar);
+            if (ret < 0)
+            {
+                throw MediaError("Unable to copy codec parameters from input stream", ret);
+            }
+            pStr->codecpar->codec_tag = 0;  //the input's tag may not be valid in this container, let the muxer pick one
+            pStr->avg_frame_rate = pInStr->avg_frame_rate;
+            pStr->time_base = pInStr->time_base;
+            pStr->start_time = AV_NOPTS_VALUE;
+            writeHeader();
 #ifndef NDEBUG
             formatCtx_.dumpContainerInfo();
 #endif
@@ -480,15 +750,19 @@ namespace avtools
         ~Implementation()
         {
             assert(formatCtx_);
-            try
+            if (!isPassthrough_)    //no encoder to flush when remuxing
             {
-                LOG4CXX_DEBUG(logger, "Flushing writer")
-                write(nullptr, TimeBaseType{});
-            }
-            catch (std::exception& err)
-            {
-                LOG4CXX_ERROR(logger, "Error while flushing packets and closing encoder: " << err.what());
+                try
+                {
+                    LOG4CXX_DEBUG(logger, "Flushing writer")
+                    write(nullptr, TimeBaseType{});
+                }
+                catch (std::exception& err)
+                {
+                    LOG4CXX_ERROR(logger, "Error while flushing packets and closing encoder: " << err.what());
+                }
             }
+            bitrateStats_.log(url());
             //Write trailer
             LOG4CXX_DEBUG(logger, "Writing trailer")
             int ret = av_write_trailer(formatCtx_.get());
@@ -530,6 +804,10 @@ namespace avtools
         void write(const AVFrame* pFrame, avtools::TimeBaseType timebase)
         {
             assert( formatCtx_ );
+            if (isPassthrough_)
+            {
+                throw MediaError("Cannot write frames to a writer that remuxes packets.");
+            }
             // send frame to encoder
             AVStream* pStr = formatCtx_->streams[0];
             if (pFrame)
@@ -538,7 +816,16 @@ namespace avtools
                 {
                     pStr->start_time = pFrame->best_effort_timestamp;
                     LOG4CXX_DEBUG(logger, "Setting stream start time to " << pStr->start_time);
-                    initFilterGraph(pFrame, timebase);
+                    startupStats_.addFrame();
+                    if ( pIn_->filter_ctx && !isGraphInput(pFrame, timebase) )
+                    {
+                        LOG4CXX_WARN(logger, "Frames differ from the ones the filter graph was prepared for, rebuilding it.");
+                        resetFilterGraph();
+                    }
+                    if (!pIn_->filter_ctx)
+                    {
+                        initFilterGraph(pFrame, timebase);
+                    }
                 }
             }
             else if (AV_NOPTS_VALUE == pStr->start_time)
@@ -547,9 +834,10 @@ namespace avtools
                 return; //no frames written
             }
 
-            /// Push frame to filtergraph
+            /// Push frame to filtergraph. The graph takes a new reference to the buffers of the frame, which stays with the caller,
+            /// so frames with reference-counted buffers (e.g. from a frame bus) are not copied; only frames without are.
             LOG4CXX_DEBUG(logger, "Writer pushing frame to filtergraph");
-            int ret = av_buffersrc_write_frame(pIn_->filter_ctx, pFrame);
+            int ret = av_buffersrc_add_frame_flags(pIn_->filter_ctx, const_cast<AVFrame*>(pFrame), AV_BUFFERSRC_FLAG_KEEP_REF);
             if (ret < 0)
             {
                 throw MediaError("Unable to write frame to filtergraph", ret);
@@ -575,7 +863,85 @@ namespace avtools
                 filtFrame_->pict_type = AV_PICTURE_TYPE_NONE;   //to let the encoder figure this out
                 //encode frame
                 encodeFrame(filtFrame_.get());
+                av_frame_unref(filtFrame_.get());   //release the buffers back to the filtergraph
+            }
+        }
+
+        /// Builds the filter graph ahead of the first frame
+        /// @param[in] width width of the incoming frames
+        /// @param[in] height height of the incoming frames
+        /// @param[in] format pixel format of the incoming frames
+        /// @param[in] timebase timebase of the incoming frames
+        /// @param[in] sampleAspectRatio sample aspect ratio of the incoming frames
+        void prepare(int width, int height, AVPixelFormat format, avtools::TimeBaseType timebase, AVRational sampleAspectRatio)
+        {
+            if (isPassthrough_)
+            {
+                return; //nothing to prepare
+            }
+            if (AV_NOPTS_VALUE != stream()->start_time)
+            {
+                throw MediaError("Cannot prepare a writer after frames are written.");
+            }
+            Frame frame(nullptr, AVMEDIA_TYPE_VIDEO, timebase);
+            frame->width = width;
+            frame->height = height;
+            frame->format = format;
+            frame->sample_aspect_ratio = sampleAspectRatio;
+            if (pIn_->filter_ctx)
+            {
+                resetFilterGraph();
             }
+            initFilterGraph(frame.get(), timebase);
+        }
+
+        /// Remuxes a compressed packet. The first packet written is the first keyframe, so that the output starts decodable.
+        /// Segmenting muxers such as HLS can only split the output at keyframes, so segments are aligned with the input's keyframes.
+        /// @param[in] pPkt packet to write, with timestamps in the input stream's timebase
+        void writePacket(const AVPacket* pPkt)
+        {
+            assert( formatCtx_ && pPkt );
+            if (!isPassthrough_)
+            {
+                throw MediaError("Cannot remux packets to a writer that encodes frames.");
+            }
+            if (AV_NOPTS_VALUE == startTs_) //first packet, set start time
+            {
+                if ( !(pPkt->flags & AV_PKT_FLAG_KEY) )
+                {
+                    LOG4CXX_DEBUG(logger, "Skipping packet until the first keyframe.");
+                    return;
+                }
+                startTs_ = (pPkt->dts != AV_NOPTS_VALUE ? pPkt->dts : pPkt->pts);
+                LOG4CXX_DEBUG(logger, "Setting stream start time to " << startTs_);
+                startupStats_.addFrame();
+            }
+            int ret = av_packet_ref(pkt_.get(), pPkt);
+            if (ret < 0)
+            {
+                throw MediaError("Unable to reference packet", ret);
+            }
+            // start the output at 0, and convert to the stream timebase, which the muxer may have changed when writing the header
+            if (pkt_->pts != AV_NOPTS_VALUE)
+            {
+                pkt_->pts -= startTs_;
+            }
+            if (pkt_->dts != AV_NOPTS_VALUE)
+            {
+                pkt_->dts -= startTs_;
+            }
+            av_packet_rescale_ts(pkt_.get(), inTimebase_, stream()->time_base);
+            pkt_->stream_index = 0; //only one output stream
+            pkt_->pos = -1;
+            LOG4CXX_DEBUG(logger, "Muxing packet to " << url() << ":\n " << pkt_.info(1));
+            ret = av_write_frame(formatCtx_.get(), pkt_.get()); //only one stream
+            if (ret < 0)
+            {
+                throw MediaError("Error muxing packet", ret);
+            }
+            startupStats_.addPacket(pkt_.get(), stream()->time_base);
+            bitrateStats_.addPacket(pkt_.get(), stream()->time_base);
+            pkt_.unref();
         }
 
         std::string url() const
@@ -599,6 +965,16 @@ namespace avtools
         assert( pImpl_);
     }
 
+    MediaWriter::MediaWriter(
+        const std::string& url,
+        const AVStream* pInStr,
+        Dictionary& muxerOpts
+    ):
+    pImpl_( std::make_unique<Implementation>(url, pInStr, muxerOpts) )
+    {
+        assert( pImpl_);
+    }
+
     MediaWriter::MediaWriter(MediaWriter&& writer):
     pImpl_(std::move(writer.pImpl_))
     {}
@@ -637,6 +1013,39 @@ namespace avtools
         write(frame.get(), frame.timebase);
     }
 
+    void MediaWriter::prepare(int width, int height, AVPixelFormat format, TimeBaseType timebase, AVRational sampleAspectRatio/*={0, 1}*/)
+    {
+        assert( pImpl_ );
+        try
+        {
+            pImpl_->prepare(width, height, format, timebase, sampleAspectRatio);
+        }
+        catch (std::exception& e)
+        {
+            std::throw_with_nested(MediaError("MediaWriter: Unable to prepare filter graph"));
+        }
+    }
+
+    void MediaWriter::writePacket(const AVPacket* pPkt)
+    {
+        assert( pImpl_ );
+        try
+        {
+            if (pPkt)
+            {
+                pImpl_->writePacket(pPkt);
+            }
+            else
+            {
+                pImpl_.reset(nullptr);  //close stream
+            }
+        }
+        catch (std::exception& e)
+        {
+            std::throw_with_nested(MediaError("MediaWriter: Error remuxing video stream"));
+        }
+    }
+
     std::string MediaWriter::url() const
     {
         assert(pImpl_);
@@ -17,6 +17,7 @@
 
 struct AVCodecParameters;
 struct AVFrame;
+struct AVPacket;
 struct AVStream;
 
 namespace avtools
@@ -37,6 +38,17 @@ namespace avtools
             Dictionary& muxerOpts
         );
 
+        /// Ctor that opens a stream that remuxes the compressed packets of an input stream, without re-encoding them
+        /// @param[in] url stream URL
+        /// @param[in] pInStr input stream whose packets will be written
+        /// @param[in] muxerOpts video-related multiplexer options
+        /// @throw MediaError if unable to open the writer, or if the container cannot store the input codec
+        MediaWriter(
+            const std::string& url,
+            const AVStream* pInStr,
+            Dictionary& muxerOpts
+        );
+
         /// Move ctor
         MediaWriter(MediaWriter&& writer);
 
@@ -46,6 +58,17 @@ namespace avtools
         /// @return opened video stream
         const AVStream* getStream() const;
         
+        /// Builds the filter graph for incoming frames with the given properties ahead of time, so that the first frame
+        /// does not have to wait for it. Should be called before writing any frames. If the frames turn out to be different,
+        /// the filter graph is rebuilt when the first frame is written.
+        /// @param[in] width width of the incoming frames
+        /// @param[in] height height of the incoming frames
+        /// @param[in] format pixel format of the incoming frames
+        /// @param[in] timebase timebase of the incoming frames
+        /// @param[in] sampleAspectRatio sample aspect ratio of the incoming frames
+        /// @throw MediaError if the filter graph could not be built
+        void prepare(int width, int height, AVPixelFormat format, TimeBaseType timebase, AVRational sampleAspectRatio=AVRational{0, 1});
+
         /// Writes a video frame to the stream. Write nullptr to close the stream
         /// @param[in] pFrame frame data to write
         /// @param[in] timebase for the incoming frames
@@ -55,6 +78,10 @@ namespace avtools
         /// @param[in] Frame frame data to write
         void write(const Frame& frame);
 
+        /// Remuxes a compressed packet from the input stream the writer was opened with. Write nullptr to close the stream
+        /// @param[in] pPkt packet to write, with timestamps in the input stream's timebase
+        void writePacket(const AVPacket* pPkt);
+
         /// Returns the url this writer is writing to
         std::string url() const;
     private:
@@ -0,0 +1,132 @@
+//
+//  PacketQueue.cpp
+//  zoomboard_server
+//
+
+#include "PacketQueue.hpp"
+#include "log4cxx/logger.h"
+#include <algorithm>
+#include <stdexcept>
+#include <ostream>
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+namespace
+{
+    log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd"));
+}
+
+namespace avtools
+{
+    PacketQueue::PacketQueue(std::size_t cap, bool lossless):
+    capacity(cap),
+    isLossless(lossless),
+    queue_(),
+    isWaitingForKeyframe_(true),
+    isClosed_(false),
+    isCancelled_(false),
+    stats_{0, 0, 0, 0, 0},
+    mutex_(),
+    cv_()
+    {
+        if (capacity == 0)
+        {
+            throw std::invalid_argument("Packet queue capacity should be at least 1.");
+        }
+    }
+
+    void PacketQueue::push(const AVPacket* pPkt)
+    {
+        assert(pPkt);
+        std::unique_lock<std::mutex> lk(mutex_);
+        if (isLossless)
+        {
+            cv_.wait(lk, [this](){return (queue_.size() < capacity) || isCancelled_;});
+        }
+        if (isCancelled_ || isClosed_)
+        {
+            return;
+        }
+        ++stats_.nPushed;
+        if (queue_.size() >= capacity)
+        {
+            LOG4CXX_DEBUG(logger, "Packet queue is full, dropping " << queue_.size() << " packets until the next keyframe.");
+            stats_.nDropped += queue_.size();
+            queue_.clear();
+            isWaitingForKeyframe_ = true;
+        }
+        if (isWaitingForKeyframe_)
+        {
+            if ( !(pPkt->flags & AV_PKT_FLAG_KEY) )
+            {
+                ++stats_.nDropped;
+                return;
+            }
+            isWaitingForKeyframe_ = false;
+        }
+        queue_.emplace_back(pPkt);
+        stats_.maxDepth = std::max(stats_.maxDepth, queue_.size());
+        lk.unlock();
+        cv_.notify_all();
+    }
+
+    bool PacketQueue::pop(Packet& pkt)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        cv_.wait(lk, [this](){return !queue_.empty() || isClosed_ || isCancelled_;});
+        if (queue_.empty() || isCancelled_)
+        {
+            return false;
+        }
+        pkt = std::move(queue_.front());
+        queue_.pop_front();
+        ++stats_.nPopped;
+        lk.unlock();
+        if (isLossless)
+        {
+            cv_.notify_all();   //the producer may be waiting for room
+        }
+        return true;
+    }
+
+    void PacketQueue::close()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            isClosed_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    void PacketQueue::cancel()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            isCancelled_ = true;
+            queue_.clear();
+        }
+        cv_.notify_all();
+    }
+
+    bool PacketQueue::isCancelled() const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        return isCancelled_;
+    }
+
+    PacketQueue::Stats PacketQueue::stats() const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        Stats stats = stats_;
+        stats.depth = queue_.size();
+        return stats;
+    }
+
+    std::ostream& operator<<(std::ostream& stream, const PacketQueue::Stats& stats)
+    {
+        return ( stream << "pushed = " << stats.nPushed << ", popped = " << stats.nPopped << ", dropped = " << stats.nDropped
+                << ", depth = " << stats.depth << " (max " << stats.maxDepth << ")" );
+    }
+
+}   //::avtools
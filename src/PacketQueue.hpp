@@ -0,0 +1,92 @@
+//
+//  PacketQueue.hpp
+//  zoomboard_server
+//
+//  Bounded queue of compressed packets, used to pass packets from the reader to writers that remux them as is.
+//
+
+#ifndef PacketQueue_hpp
+#define PacketQueue_hpp
+
+#include "LibAVWrappers.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <iosfwd>
+
+struct AVPacket;
+
+namespace avtools
+{
+    /// @class Thread-safe bounded queue of compressed packets, with a single producer & a single consumer.
+    /// By default, the producer never waits: if the queue is full, the queued packets are dropped. Since the packets that follow
+    /// cannot be decoded without the dropped ones, packets are then dropped until the next keyframe. A lossless queue instead
+    /// makes the producer wait until the consumer makes room. The queue also starts at a keyframe, so that the consumer
+    /// always receives a decodable stream.
+    class PacketQueue
+    {
+    public:
+        /// @class Queue statistics
+        struct Stats
+        {
+            std::uint64_t nPushed;      ///< number of packets pushed to this queue
+            std::uint64_t nDropped;     ///< number of packets dropped because the queue was full, or while waiting for a keyframe
+            std::uint64_t nPopped;      ///< number of packets read by the consumer
+            std::size_t depth;          ///< number of packets currently waiting in the queue
+            std::size_t maxDepth;       ///< maximum number of packets that were waiting in the queue
+        };
+
+        const std::size_t capacity;     ///< maximum number of packets in the queue
+        const bool isLossless;          ///< true if the producer waits for room in the queue, rather than dropping packets
+
+        /// Ctor
+        /// @param[in] capacity maximum number of packets in the queue
+        /// @param[in] isLossless if true, the producer waits for room in the queue rather than dropping packets
+        /// @throw std::invalid_argument if capacity is 0
+        PacketQueue(std::size_t capacity, bool isLossless=false);
+
+        PacketQueue(const PacketQueue&) = delete;
+
+        /// Pushes a packet to the queue. The queue refers to the packet's data, without copying it if it is reference counted.
+        /// If the queue is lossless and full, waits until the consumer pops a packet, or cancels the queue.
+        /// @param[in] pPkt packet to push
+        void push(const AVPacket* pPkt);
+
+        /// Waits until a packet is available in the queue, and pops it.
+        /// @param[out] pkt the oldest packet in the queue
+        /// @return true if a packet was popped, false if the queue was closed and all packets were consumed, or if it was cancelled.
+        bool pop(Packet& pkt);
+
+        /// Signals the consumer that no more packets will be pushed
+        void close();
+
+        /// Cancels the queue. Should be called by the consumer when it will not read any more packets.
+        void cancel();
+
+        /// @return true if the queue was cancelled
+        bool isCancelled() const;
+
+        /// @return a snapshot of the queue statistics
+        Stats stats() const;
+
+    private:
+        std::deque<Packet> queue_;                  ///< packets waiting to be consumed
+        bool isWaitingForKeyframe_;                 ///< true if packets are dropped until the next keyframe
+        bool isClosed_;                             ///< true if the producer will not push any more packets
+        bool isCancelled_;                          ///< true if the consumer will not pop any more packets
+        Stats stats_;                               ///< queue statistics
+        mutable std::mutex mutex_;                  ///< Mutex that guards the queue
+        std::condition_variable cv_;                ///< Condition variable signaled when the queue changes
+    };  //::avtools::PacketQueue
+
+    /// Prints packet queue statistics
+    /// @param[in] stream output stream
+    /// @param[in] stats queue statistics
+    /// @return a reference to the output stream
+    std::ostream& operator<<(std::ostream& stream, const PacketQueue::Stats& stats);
+
+}   //::avtools
+
+#endif /* PacketQueue_hpp */
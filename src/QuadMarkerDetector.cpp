@@ -0,0 +1,247 @@
+//
+//  QuadMarkerDetector.cpp
+//  zoomboard_server
+//
+//  Detector for small aruco dictionaries, such as the one create_markers makes, using a lookup table of the marker codes.
+//
+
+#include "QuadMarkerDetector.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+#include <log4cxx/logger.h>
+#include "opencv2/imgproc.hpp"
+
+namespace
+{
+    // The thresholds follow the defaults of cv::aruco::DetectorParameters, so that the same markers are found
+    static constexpr int MAX_MARKER_BITS = 16;                      ///< largest number of bits in a marker the lookup table is built for
+    static constexpr int ADAPTIVE_THRESHOLD_DIVISOR = 40;           ///< the adaptive threshold window is this many times smaller than the image
+    static constexpr double ADAPTIVE_THRESHOLD_CONSTANT = 7;        ///< constant subtracted from the mean in the adaptive threshold
+    static constexpr double MIN_PERIMETER_RATE = 0.03;              ///< minimum marker perimeter, relative to the larger image dimension
+    static constexpr double MAX_PERIMETER_RATE = 4.;                ///< maximum marker perimeter, relative to the larger image dimension
+    static constexpr double POLYGONAL_APPROX_RATE = 0.03;           ///< accuracy of the quad approximation, relative to the contour perimeter
+    static constexpr double MIN_CORNER_DISTANCE_RATE = 0.05;        ///< minimum side of a quad, relative to its perimeter
+    static constexpr int MIN_DISTANCE_TO_BORDER = 3;                ///< minimum distance of the quad corners to the image border
+    static constexpr double ERROR_CORRECTION_RATE = 0.6;            ///< fraction of the dictionary's error correction capacity that is used
+    static constexpr double MAX_BORDER_ERROR_RATE = 0.35;           ///< maximum fraction of wrong border bits, relative to the number of marker bits
+    static constexpr double CELL_MARGIN = 0.13;                     ///< margin of each cell that is not sampled, relative to the cell size
+    static constexpr int CELL_SAMPLES = 3;                          ///< each cell is sampled at this many points in each direction
+    static constexpr double MIN_CELL_CONTRAST = 20;                 ///< minimum difference between the darkest & brightest cells of a marker
+
+    // Initialize logger
+    log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd.markers"));
+
+    /// @return the code of a grid of bits, read row by row with the first bit as the most significant
+    /// @param[in] bits grid of bits, CV_8UC1 with values of 0 or 1
+    int getCode(const cv::Mat& bits)
+    {
+        int code = 0;
+        for (int r = 0; r < bits.rows; ++r)
+        {
+            for (int c = 0; c < bits.cols; ++c)
+            {
+                code = (code << 1) | (bits.at<std::uint8_t>(r, c) ? 1 : 0);
+            }
+        }
+        return code;
+    }
+
+    /// @return a grid of bits rotated clockwise by 90 degrees
+    /// @param[in] bits square grid of bits
+    cv::Mat rotateClockwise(const cv::Mat& bits)
+    {
+        cv::Mat rotated(bits.size(), bits.type());
+        const int n = bits.rows;
+        for (int r = 0; r < n; ++r)
+        {
+            for (int c = 0; c < n; ++c)
+            {
+                rotated.at<std::uint8_t>(r, c) = bits.at<std::uint8_t>(n - 1 - c, r);
+            }
+        }
+        return rotated;
+    }
+
+    /// @return number of bits that differ between two codes
+    inline int getHammingDistance(int a, int b)
+    {
+        return __builtin_popcount((unsigned) (a ^ b));
+    }
+
+    /// Orders the corners of a quad clockwise, as seen in the image
+    /// @param[in, out] quad corners of the quad
+    void orderClockwise(std::vector<cv::Point2f>& quad)
+    {
+        const cv::Point2f d1 = quad[1] - quad[0], d2 = quad[2] - quad[0];
+        if (d1.x * d2.y - d1.y * d2.x < 0)  //y points down, so this is counterclockwise
+        {
+            std::swap(quad[1], quad[3]);
+        }
+    }
+}   //::<anon>
+
+bool QuadMarkerDetector::isSupported(const cv::aruco::Dictionary& dict)
+{
+    return (dict.markerSize > 0) && (dict.markerSize * dict.markerSize <= MAX_MARKER_BITS);
+}
+
+QuadMarkerDetector::QuadMarkerDetector(const cv::aruco::Dictionary& dict):
+markerSize_(dict.markerSize),
+lookup_(),
+binary_(),
+contours_()
+{
+    if (!isSupported(dict))
+    {
+        throw std::invalid_argument("Marker lookup tables are only built for markers with up to 4x4 bits");
+    }
+    // The marker a candidate is read as has its top left corner at candidate corner k, if the candidate's code is the marker's
+    // code rotated clockwise k times
+    const int nMarkers = dict.bytesList.rows;
+    std::vector< std::vector<int> > markerCodes(nMarkers);
+    for (int id = 0; id < nMarkers; ++id)
+    {
+        cv::Mat bits = cv::aruco::Dictionary::getBitsFromByteList(dict.bytesList.rowRange(id, id + 1), markerSize_);
+        for (int k = 0; k < 4; ++k)
+        {
+            markerCodes[id].push_back(getCode(bits));
+            bits = rotateClockwise(bits);
+        }
+    }
+    // As in cv::aruco, a code belongs to the first marker that is within the correction distance, in its closest rotation
+    const int maxCorrection = (int) std::floor(dict.maxCorrectionBits * ERROR_CORRECTION_RATE);
+    lookup_.assign(std::size_t(1) << (markerSize_ * markerSize_), -1);
+    for (int code = 0; code < (int) lookup_.size(); ++code)
+    {
+        for (int id = 0; (id < nMarkers) && (lookup_[code] < 0); ++id)
+        {
+            int bestDistance = maxCorrection + 1;
+            for (int k = 0; k < 4; ++k)
+            {
+                const int distance = getHammingDistance(code, markerCodes[id][k]);
+                if (distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    lookup_[code] = (std::int16_t) (4 * id + k);
+                }
+            }
+        }
+    }
+    LOG4CXX_DEBUG(logger, "Built marker lookup table for " << nMarkers << " markers of " << markerSize_ << "x" << markerSize_
+                  << " bits, correcting up to " << maxCorrection << " bits");
+}
+
+void QuadMarkerDetector::detect(const cv::Mat& img, std::vector< std::vector<cv::Point2f> >& corners, std::vector<int>& ids)
+{
+    assert(img.type() == CV_8UC1);
+    corners.clear();
+    ids.clear();
+    const int maxDim = std::max(img.cols, img.rows);
+    const int winSize = std::max(3, (maxDim / ADAPTIVE_THRESHOLD_DIVISOR) | 1);
+    cv::adaptiveThreshold(img, binary_, 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY_INV, winSize, ADAPTIVE_THRESHOLD_CONSTANT);
+    cv::findContours(binary_, contours_, cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+
+    const double minPerimeter = MIN_PERIMETER_RATE * maxDim, maxPerimeter = MAX_PERIMETER_RATE * maxDim;
+    std::vector<cv::Point> approx;
+    std::vector<std::size_t> perimeters;    //perimeter of each marker found, to keep the outer contour of a marker's border
+    for (const auto& contour: contours_)
+    {
+        const double perimeter = (double) contour.size();
+        if ( (perimeter < minPerimeter) || (perimeter > maxPerimeter) )
+        {
+            continue;
+        }
+        cv::approxPolyDP(contour, approx, perimeter * POLYGONAL_APPROX_RATE, true);
+        if ( (approx.size() != 4) || !cv::isContourConvex(approx) )
+        {
+            continue;
+        }
+        const double minSide = MIN_CORNER_DISTANCE_RATE * perimeter;
+        bool isValid = true;
+        for (int j = 0; (j < 4) && isValid; ++j)
+        {
+            const cv::Point d = approx[j] - approx[(j + 1) % 4];
+            isValid = (d.dot(d) >= minSide * minSide)
+                && (approx[j].x >= MIN_DISTANCE_TO_BORDER) && (approx[j].y >= MIN_DISTANCE_TO_BORDER)
+                && (approx[j].x < img.cols - 1 - MIN_DISTANCE_TO_BORDER) && (approx[j].y < img.rows - 1 - MIN_DISTANCE_TO_BORDER);
+        }
+        if (!isValid)
+        {
+            continue;
+        }
+        std::vector<cv::Point2f> quad(approx.begin(), approx.end());
+        orderClockwise(quad);
+        const int id = identify(img, quad);
+        if (id < 0)
+        {
+            continue;
+        }
+        const auto it = std::find(ids.begin(), ids.end(), id);
+        if (it == ids.end())
+        {
+            ids.push_back(id);
+            corners.push_back(quad);
+            perimeters.push_back(contour.size());
+        }
+        else if (perimeters[it - ids.begin()] < contour.size())
+        {
+            corners[it - ids.begin()] = quad;
+            perimeters[it - ids.begin()] = contour.size();
+        }
+    }
+}
+
+int QuadMarkerDetector::identify(const cv::Mat& img, std::vector<cv::Point2f>& quad) const
+{
+    // Map the grid of cells, including the black border, onto the quad
+    const int nCells = markerSize_ + 2;
+    const std::vector<cv::Point2f> grid = {
+        cv::Point2f(0.f, 0.f), cv::Point2f((float) nCells, 0.f), cv::Point2f((float) nCells, (float) nCells), cv::Point2f(0.f, (float) nCells)
+    };
+    const cv::Matx33d H(cv::getPerspectiveTransform(grid, quad));
+    cv::Mat cells(nCells, nCells, CV_8UC1);
+    const double step = (1. - 2. * CELL_MARGIN) / CELL_SAMPLES;
+    for (int r = 0; r < nCells; ++r)
+    {
+        for (int c = 0; c < nCells; ++c)
+        {
+            int sum = 0;
+            for (int i = 0; i < CELL_SAMPLES; ++i)
+            {
+                for (int j = 0; j < CELL_SAMPLES; ++j)
+                {
+                    const double x = c + CELL_MARGIN + (j + 0.5) * step, y = r + CELL_MARGIN + (i + 0.5) * step;
+                    const double w = H(2, 0) * x + H(2, 1) * y + H(2, 2);
+                    const int u = cvRound( (H(0, 0) * x + H(0, 1) * y + H(0, 2)) / w );
+                    const int v = cvRound( (H(1, 0) * x + H(1, 1) * y + H(1, 2)) / w );
+                    sum += img.at<std::uint8_t>(std::max(0, std::min(img.rows - 1, v)), std::max(0, std::min(img.cols - 1, u)));
+                }
+            }
+            cells.at<std::uint8_t>(r, c) = (std::uint8_t) (sum / (CELL_SAMPLES * CELL_SAMPLES));
+        }
+    }
+    double minVal, maxVal;
+    cv::minMaxLoc(cells, &minVal, &maxVal);
+    if (maxVal - minVal < MIN_CELL_CONTRAST)
+    {
+        return -1;
+    }
+    cv::Mat bits;
+    cv::threshold(cells, bits, 0, 1, cv::THRESH_BINARY | cv::THRESH_OTSU);
+
+    // The border cells should be black
+    const int nBorderErrors = cv::countNonZero(bits) - cv::countNonZero(bits(cv::Rect(1, 1, markerSize_, markerSize_)));
+    if (nBorderErrors > (int) (markerSize_ * markerSize_ * MAX_BORDER_ERROR_RATE))
+    {
+        return -1;
+    }
+    const int entry = lookup_[getCode(bits(cv::Rect(1, 1, markerSize_, markerSize_)))];
+    if (entry < 0)
+    {
+        return -1;
+    }
+    std::rotate(quad.begin(), quad.begin() + (entry % 4), quad.end());
+    return entry / 4;
+}
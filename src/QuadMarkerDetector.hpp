@@ -0,0 +1,51 @@
+//
+//  QuadMarkerDetector.hpp
+//  zoomboard_server
+//
+//  Detector for small aruco dictionaries, such as the one create_markers makes, using a lookup table of the marker codes.
+//
+
+#ifndef QuadMarkerDetector_hpp
+#define QuadMarkerDetector_hpp
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/aruco.hpp>
+
+/// @class Detects the markers of an aruco dictionary that has at most 4x4 bits per marker, such as the 4 marker dictionary
+/// create_markers makes. Candidate quads are found with a single adaptive threshold pass, and each is identified by looking up
+/// its code in a table that maps every possible code, under all four rotations and within the dictionary's error correction
+/// distance, straight to a marker id. The ids & corner order are the same as cv::aruco::detectMarkers with its default parameters.
+class QuadMarkerDetector
+{
+public:
+    /// @return true if the markers of a dictionary are small enough for this detector
+    /// @param[in] dict dictionary of the markers
+    static bool isSupported(const cv::aruco::Dictionary& dict);
+
+    /// Ctor, builds the lookup table
+    /// @param[in] dict dictionary of the markers
+    /// @throw std::invalid_argument if the markers have more than 4x4 bits
+    explicit QuadMarkerDetector(const cv::aruco::Dictionary& dict);
+
+    /// Finds the markers in an image
+    /// @param[in] img grayscale image, CV_8UC1
+    /// @param[out] corners corners of each marker found, clockwise from the top left corner of the marker
+    /// @param[out] ids id of each marker found
+    void detect(const cv::Mat& img, std::vector< std::vector<cv::Point2f> >& corners, std::vector<int>& ids);
+
+private:
+    const int markerSize_;                              ///< number of bits in each row of a marker
+    std::vector<std::int16_t> lookup_;                  ///< 4 * id + rotation of the marker each code belongs to, or -1
+    cv::Mat binary_;                                    ///< buffer for the thresholded image
+    std::vector< std::vector<cv::Point> > contours_;    ///< buffer for the contours of the thresholded image
+
+    /// Identifies a candidate quad
+    /// @param[in] img grayscale image
+    /// @param[in, out] quad corners of the candidate, clockwise. On return, rotated to start at the top left corner of the marker.
+    /// @return the id of the marker, or -1 if the candidate is not a marker
+    int identify(const cv::Mat& img, std::vector<cv::Point2f>& quad) const;
+};  //::QuadMarkerDetector
+
+#endif /* QuadMarkerDetector_hpp */
@@ -0,0 +1,425 @@
+//
+//  ScalingLadder.cpp
+//  zoomboard_server
+//
+//  Renders the frames of a frame bus once at every output size, so that the writers do not each scale the same frames.
+//
+
+#include "ScalingLadder.hpp"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <log4cxx/logger.h>
+#include <log4cxx/mdc.h>
+#include "Media.hpp"
+#include "ThreadManager.hpp"
+extern "C" {
+#include <libswscale/swscale.h>
+}
+
+extern ThreadManager g_ThreadMan;
+
+namespace
+{
+    static constexpr std::uint8_t LUMA_BLACK = 16;                 ///< luma of black in yuv420p, which has limited range
+    static constexpr std::uint8_t CHROMA_NEUTRAL = 128;            ///< chroma of black & gray in yuv420p
+    static constexpr int SCALE_FLAGS = SWS_BICUBIC;                ///< scaling filter, the same as the writers' scale filters use
+
+    // Initialize logger
+    log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd.ladder"));
+
+    /// @class Time spent in a stage of the ladder
+    struct StageStats
+    {
+        std::size_t nFrames;    ///< number of frames
+        double time;            ///< total time in ms
+        double maxTime;         ///< longest time for a frame in ms
+
+        /// Ctor
+        StageStats(): nFrames(0), time(0.), maxTime(0.) {}
+
+        /// Adds the time spent on a frame
+        /// @param[in] start time the stage started on the frame
+        void add(std::chrono::steady_clock::time_point start)
+        {
+            const double t = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            ++nFrames;
+            time += t;
+            maxTime = std::max(maxTime, t);
+        }
+
+        /// Output to stream
+        friend std::ostream& operator<<(std::ostream& stream, const StageStats& stats)
+        {
+            return stream << "frames=" << stats.nFrames << ", mean=" << (stats.nFrames > 0 ? stats.time / stats.nFrames : 0.)
+                << "ms, max=" << stats.maxTime << "ms";
+        }
+    };  //::<anon>::StageStats
+
+    /// @class A rectangle in an image
+    struct Region
+    {
+        int x, y, width, height;
+    };  //::<anon>::Region
+
+    /// Calculates where an image is placed when it is scaled into an output image, preserving its aspect ratio and padding
+    /// the rest, the same way the writers' filter graphs do. The region is aligned to the chroma samples of yuv420p.
+    /// @param[in] inWidth width of the image
+    /// @param[in] inHeight height of the image
+    /// @param[in] outWidth width of the output image
+    /// @param[in] outHeight height of the output image
+    /// @return the part of the output image the scaled image covers
+    Region getLetterbox(int inWidth, int inHeight, int outWidth, int outHeight)
+    {
+        Region roi{0, 0, outWidth, outHeight};
+        const double cW = (double) outWidth / inWidth;
+        const double cH = (double) outHeight / inHeight;
+        if (cW > cH)
+        {
+            roi.width = std::min(outWidth, (int) std::lround(cH * inWidth));
+            roi.x = (outWidth - roi.width) / 2;
+        }
+        else if (cW < cH)
+        {
+            roi.height = std::min(outHeight, (int) std::lround(cW * inHeight));
+            roi.y = (outHeight - roi.height) / 2;
+        }
+        return Region{roi.x & ~1, roi.y & ~1, roi.width & ~1, roi.height & ~1};
+    }
+
+    /// Sets the parts of a yuv420p frame outside a region to black
+    /// @param[in, out] pFrame yuv420p frame
+    /// @param[in] roi region to leave as is, aligned to the chroma samples
+    void setBordersToBlack(AVFrame* pFrame, const Region& roi)
+    {
+        for (int plane = 0; plane < 3; ++plane)
+        {
+            const int shift = (plane == 0 ? 0 : 1);
+            const std::uint8_t black = (plane == 0 ? LUMA_BLACK : CHROMA_NEUTRAL);
+            const int width = pFrame->width >> shift, height = pFrame->height >> shift;
+            const int x0 = roi.x >> shift, y0 = roi.y >> shift, x1 = (roi.x + roi.width) >> shift, y1 = (roi.y + roi.height) >> shift;
+            for (int y = 0; y < height; ++y)
+            {
+                std::uint8_t* pRow = pFrame->data[plane] + y * pFrame->linesize[plane];
+                if ( (y < y0) || (y >= y1) )
+                {
+                    std::memset(pRow, black, width);
+                }
+                else
+                {
+                    std::memset(pRow, black, x0);
+                    std::memset(pRow + x1, black, width - x1);
+                }
+            }
+        }
+    }
+}   //::<anon>
+
+//=====================================================
+//
+//ScalingLadder Implementation
+//
+//=====================================================
+class ScalingLadder::Implementation
+{
+private:
+    /// @class A rendition of the source frames
+    struct Rung
+    {
+        std::shared_ptr<avtools::ThreadsafeFrame> pFrame;   ///< frame bus the rendition is published on
+        int parent;                                         ///< index of the rung it is scaled from, or -1 to scale from the source
+        Region roi;                                         ///< part of the frame the scaled image covers
+        SwsContext* pSwsCtx;                                ///< scaling context
+        StageStats stats;                                   ///< time spent scaling
+        std::size_t nSkipped;                               ///< number of source frames no writer wanted at this size
+    };  //::ScalingLadder::Implementation::Rung
+
+    const int width_;                                       ///< width of the source frames
+    const int height_;                                      ///< height of the source frames
+    const AVPixelFormat format_;                            ///< pixel format of the source frames
+    const avtools::TimeBaseType timebase_;                  ///< timebase of the source frames
+    std::vector<Rung> rungs_;                               ///< renditions, largest first once the ladder is built
+    SwsContext* pConvCtx_;                                  ///< context that converts the source frames to yuv420p, if needed
+    avtools::Frame converted_;                              ///< buffer for the source frames converted to yuv420p
+    StageStats convStats_;                                  ///< time spent converting the source frames
+    bool isBuilt_;                                          ///< true once the scaling contexts are built
+
+public:
+    /// Ctor
+    Implementation(int width, int height, AVPixelFormat format, avtools::TimeBaseType timebase):
+    width_(width),
+    height_(height),
+    format_(format),
+    timebase_(timebase),
+    rungs_(),
+    pConvCtx_(nullptr),
+    converted_(),
+    convStats_(),
+    isBuilt_(false)
+    {
+    }
+
+    /// Dtor
+    ~Implementation()
+    {
+        for (auto& rung: rungs_)
+        {
+            sws_freeContext(rung.pSwsCtx);
+        }
+        sws_freeContext(pConvCtx_);
+    }
+
+    /// @return the frame bus of a rendition, which is added if it is new
+    std::shared_ptr<avtools::ThreadsafeFrame> getRendition(int width, int height)
+    {
+        if (isBuilt_)
+        {
+            throw std::logic_error("Cannot add renditions to a scaling ladder that is already started");
+        }
+        if (!canRender(width, height, AV_PIX_FMT_YUV420P))
+        {
+            throw std::invalid_argument("Scaling ladder renditions should have even dimensions, found "
+                                        + std::to_string(width) + "x" + std::to_string(height));
+        }
+        for (const auto& rung: rungs_)
+        {
+            if ( (rung.pFrame->width() == width) && (rung.pFrame->height() == height) )
+            {
+                return rung.pFrame;
+            }
+        }
+        rungs_.push_back(Rung{avtools::ThreadsafeFrame::Get(width, height, AV_PIX_FMT_YUV420P, timebase_), -1, Region{0, 0, width, height}, nullptr, StageStats(), 0});
+        return rungs_.back().pFrame;
+    }
+
+    /// @return true if there are no renditions
+    inline bool empty() const {return rungs_.empty();}
+
+    /// Orders the renditions from the largest to the smallest, picks the image each is scaled from, and builds the scaling contexts
+    void build()
+    {
+        assert(!isBuilt_);
+        isBuilt_ = true;
+        std::stable_sort(rungs_.begin(), rungs_.end(), [](const Rung& a, const Rung& b){
+            return a.pFrame->width() * a.pFrame->height() > b.pFrame->width() * b.pFrame->height();
+        });
+        for (std::size_t i = 0; i < rungs_.size(); ++i)
+        {
+            auto& rung = rungs_[i];
+            const int width = rung.pFrame->width(), height = rung.pFrame->height();
+            // Scale from the smallest larger rendition of the same aspect ratio, whose letterbox is then the same
+            for (std::size_t j = 0; j < i; ++j)
+            {
+                const int parentWidth = rungs_[j].pFrame->width(), parentHeight = rungs_[j].pFrame->height();
+                if ( (parentWidth >= width) && (parentHeight >= height) && (width * parentHeight == height * parentWidth) )
+                {
+                    rung.parent = (int) j;
+                }
+            }
+            int inWidth = width_, inHeight = height_;
+            if (rung.parent < 0)
+            {
+                rung.roi = getLetterbox(width_, height_, width, height);
+            }
+            else
+            {
+                inWidth = rungs_[rung.parent].pFrame->width();
+                inHeight = rungs_[rung.parent].pFrame->height();
+            }
+            rung.pSwsCtx = sws_getContext(inWidth, inHeight, AV_PIX_FMT_YUV420P, rung.roi.width, rung.roi.height, AV_PIX_FMT_YUV420P,
+                                          SCALE_FLAGS, nullptr, nullptr, nullptr);
+            if (!rung.pSwsCtx)
+            {
+                throw avtools::MediaError("Unable to scale from " + std::to_string(inWidth) + "x" + std::to_string(inHeight)
+                                          + " to " + std::to_string(width) + "x" + std::to_string(height));
+            }
+            LOG4CXX_INFO(logger, "Rendering " << width << "x" << height << " from "
+                         << (rung.parent < 0 ? "the source at " : "the rendition at ") << inWidth << "x" << inHeight);
+        }
+        if (format_ != AV_PIX_FMT_YUV420P)
+        {
+            pConvCtx_ = sws_getContext(width_, height_, format_, width_, height_, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+            if (!pConvCtx_)
+            {
+                throw avtools::MediaError("Unable to convert the source frames to yuv420p");
+            }
+            converted_ = avtools::Frame(width_, height_, AV_PIX_FMT_YUV420P, timebase_);
+        }
+    }
+
+    /// Renders a source frame at the renditions that want it, and publishes them. A rendition that no writer wants the frame from
+    /// (e.g. as its writers encode at a lower frame rate) is skipped, unless a smaller rendition that is wanted is scaled from it.
+    /// @param[in] inFrame source frame
+    void render(const avtools::Frame& inFrame)
+    {
+        assert(isBuilt_);
+        assert( (inFrame->width == width_) && (inFrame->height == height_) && (inFrame->format == format_) );
+        // The renditions are ordered largest first, so each is scaled from an earlier one, and the smaller ones are checked first
+        std::vector<bool> isNeeded(rungs_.size(), false);
+        bool isSourceNeeded = false;
+        for (std::size_t i = rungs_.size(); i-- > 0; )
+        {
+            const auto& rung = rungs_[i];
+            isNeeded[i] = isNeeded[i] || rung.pFrame->isWanted(inFrame->pts);
+            if (isNeeded[i])
+            {
+                if (rung.parent < 0)
+                {
+                    isSourceNeeded = true;
+                }
+                else
+                {
+                    isNeeded[rung.parent] = true;
+                }
+            }
+        }
+        const AVFrame* pSrc = inFrame.get();
+        if (pConvCtx_ && isSourceNeeded)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            int ret = sws_scale(pConvCtx_, pSrc->data, pSrc->linesize, 0, height_, converted_->data, converted_->linesize);
+            if (ret < 0)
+            {
+                throw avtools::MediaError("Error converting frame to yuv420p", ret);
+            }
+            pSrc = converted_.get();
+            convStats_.add(start);
+        }
+        std::vector<const AVFrame*> outputs(rungs_.size(), nullptr);   //published renditions, read by the smaller renditions
+        for (std::size_t i = 0; i < rungs_.size(); ++i)
+        {
+            auto& rung = rungs_[i];
+            if (!isNeeded[i])
+            {
+                ++rung.nSkipped;
+                continue;
+            }
+            const auto start = std::chrono::steady_clock::now();
+            const AVFrame* pIn = (rung.parent < 0 ? pSrc : outputs[rung.parent]);
+            avtools::Frame& outFrame = rung.pFrame->getWritableFrame();
+            if ( (rung.roi.width != outFrame->width) || (rung.roi.height != outFrame->height) )
+            {
+                setBordersToBlack(outFrame.get(), rung.roi);
+            }
+            std::uint8_t* const dst[4] = {
+                outFrame->data[0] + rung.roi.y * outFrame->linesize[0] + rung.roi.x,
+                outFrame->data[1] + (rung.roi.y / 2) * outFrame->linesize[1] + rung.roi.x / 2,
+                outFrame->data[2] + (rung.roi.y / 2) * outFrame->linesize[2] + rung.roi.x / 2,
+                nullptr
+            };
+            int ret = sws_scale(rung.pSwsCtx, pIn->data, pIn->linesize, 0, pIn->height, dst, outFrame->linesize);
+            if (ret < 0)
+            {
+                throw avtools::MediaError("Error scaling frame", ret);
+            }
+            ret = av_frame_copy_props(outFrame.get(), inFrame.get());
+            if (ret < 0)
+            {
+                throw avtools::MediaError("Unable to copy frame properties", ret);
+            }
+            outputs[i] = outFrame.get();   //published frames are not overwritten until the next call
+            rung.stats.add(start);
+            rung.pFrame->publish();
+        }
+    }
+
+    /// Signals the writers that no more frames are coming
+    void close()
+    {
+        for (auto& rung: rungs_)
+        {
+            rung.pFrame->close();
+        }
+    }
+
+    /// Logs the time spent in each stage
+    void logStats() const
+    {
+        if (pConvCtx_)
+        {
+            LOG4CXX_INFO(logger, "Scaling ladder conversion to yuv420p: " << convStats_);
+        }
+        for (const auto& rung: rungs_)
+        {
+            LOG4CXX_INFO(logger, "Scaling ladder rendition " << rung.pFrame->width() << "x" << rung.pFrame->height() << ": " << rung.stats
+                         << ", skipped=" << rung.nSkipped);
+        }
+    }
+};  //::ScalingLadder::Implementation
+
+//=====================================================
+//
+//ScalingLadder Definitions
+//
+//=====================================================
+bool ScalingLadder::canRender(int width, int height, AVPixelFormat format)
+{
+    return (format == AV_PIX_FMT_YUV420P) && (width > 0) && (height > 0) && (width % 2 == 0) && (height % 2 == 0);
+}
+
+ScalingLadder::ScalingLadder(int width, int height, AVPixelFormat format, avtools::TimeBaseType timebase):
+pImpl_(std::make_shared<Implementation>(width, height, format, timebase))
+{
+    assert(pImpl_);
+}
+
+ScalingLadder::~ScalingLadder() = default;
+
+std::shared_ptr<avtools::ThreadsafeFrame> ScalingLadder::getRendition(int width, int height)
+{
+    assert(pImpl_);
+    return pImpl_->getRendition(width, height);
+}
+
+bool ScalingLadder::empty() const
+{
+    assert(pImpl_);
+    return pImpl_->empty();
+}
+
+std::thread ScalingLadder::start(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pInSub)
+{
+    assert(pImpl_ && pInSub);
+    pImpl_->build();
+    auto pImpl = pImpl_;
+    return std::thread([pInSub, pImpl](){
+        try
+        {
+            log4cxx::MDC::put("threadname", "ladder");
+            std::uint64_t seq = 0;
+            while (!g_ThreadMan.isEnded())
+            {
+                auto pFrame = pInSub->pop(seq);   //wait until fresh frame is available
+                if (!pFrame || g_ThreadMan.isEnded())  //if the wait ended because program ended, quit
+                {
+                    break;
+                }
+                pImpl->render(*pFrame);
+            }
+        }
+        catch (std::exception& err)
+        {
+            try
+            {
+                std::throw_with_nested( std::runtime_error("Scaling ladder thread error") );
+            }
+            catch (...)
+            {
+                g_ThreadMan.addException(std::current_exception());
+                g_ThreadMan.end();
+            }
+        }
+        LOG4CXX_INFO(logger, "Scaling ladder frame queue: " << pInSub->stats());
+        pImpl->logStats();
+        pInSub->cancel();   //do not let the producer wait on us anymore
+        pImpl->close();     //let the writers know that no more frames are coming
+        LOG4CXX_DEBUG(logger, "Exiting thread: isEnded=" << std::boolalpha << g_ThreadMan.isEnded());
+    });
+}
@@ -0,0 +1,63 @@
+//
+//  ScalingLadder.hpp
+//  zoomboard_server
+//
+//  Renders the frames of a frame bus once at every output size, so that the writers do not each scale the same frames.
+//
+
+#ifndef ScalingLadder_hpp
+#define ScalingLadder_hpp
+
+#include <memory>
+#include <thread>
+#include "ThreadsafeFrame.hpp"
+
+/// @class Renders the frames of a source bus at every size the writers need, in yuv420p, so that the writers' filter graphs
+/// neither scale nor convert them. The source is converted to yuv420p once, and each rendition is then scaled from the smallest
+/// larger rendition with the same aspect ratio (e.g. 1080p -> 540p -> 216p), or from the source if there is none. Renditions
+/// are letterboxed the same way the writers would pad them, and each is published on its own frame bus, so the writers get
+/// reference-counted frames that are already the right size. A rendition is only rendered for the frames its writers want, or that
+/// a smaller rendition scaled from it needs. The time spent in each stage is logged when the ladder stops.
+class ScalingLadder
+{
+public:
+    /// @return true if the ladder can render frames for an output
+    /// @param[in] width output width
+    /// @param[in] height output height
+    /// @param[in] format output pixel format
+    static bool canRender(int width, int height, AVPixelFormat format);
+
+    /// Ctor
+    /// @param[in] width width of the source frames
+    /// @param[in] height height of the source frames
+    /// @param[in] format pixel format of the source frames
+    /// @param[in] timebase timebase of the source frames
+    ScalingLadder(int width, int height, AVPixelFormat format, avtools::TimeBaseType timebase);
+
+    /// Dtor
+    ~ScalingLadder();
+
+    ScalingLadder(const ScalingLadder&) = delete;
+    ScalingLadder& operator=(const ScalingLadder&) = delete;
+
+    /// Returns the frame bus of a rendition, adding the rendition if it is new. Should be called before start().
+    /// @param[in] width rendition width, should be even
+    /// @param[in] height rendition height, should be even
+    /// @return the frame bus the rendition is published on, shared by all writers of the same size
+    /// @throw std::logic_error if the ladder is already started, or std::invalid_argument if the size cannot be rendered
+    std::shared_ptr<avtools::ThreadsafeFrame> getRendition(int width, int height);
+
+    /// @return true if the ladder has no renditions
+    bool empty() const;
+
+    /// Launches the thread that renders the source frames
+    /// @param[in] pInSub subscription to the source frames
+    /// @return a new thread that runs in the background, publishes the wanted renditions when a new source frame is available
+    std::thread start(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pInSub);
+
+private:
+    class Implementation;
+    std::shared_ptr<Implementation> pImpl_;     ///< implementation, shared with the thread
+};  //::ScalingLadder
+
+#endif /* ScalingLadder_hpp */
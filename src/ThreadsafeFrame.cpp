@@ -8,6 +8,10 @@
 #include "ThreadsafeFrame.hpp"
 #include "Media.hpp"
 #include "log4cxx/logger.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <ostream>
 extern "C" {
 #include <libswscale/swscale.h>
 #include <libavutil/avutil.h>
@@ -16,6 +20,12 @@ extern "C" {
 namespace
 {
     log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd"));
+
+    /// Number of frames in the ring initially. Three frames are enough for the producer to never wait
+    /// as long as each consumer holds on to at most one frame at a time.
+    static const int RING_SIZE = 3;
+    /// If the ring grows beyond this many frames, we warn that consumers are holding on to too many frames
+    static const int RING_SIZE_WARN = 16;
 }
 
 namespace avtools
@@ -24,75 +34,483 @@ namespace avtools
     // Threadsafe Frame Definitions
     // ---------------------------
     ThreadsafeFrame::ThreadsafeFrame(int width, int height, AVPixelFormat format, TimeBaseType tb):
-    Frame(width, height, format, tb),
+    width_(width),
+    height_(height),
+    format_(format),
     pConvCtx_(nullptr),
-    mutex(),
-    cv()
+    pPool_(FramePool::Get(width, height, format)),
+    ring_(),
+    pPending_(nullptr),
+    pLatest_(nullptr),
+    seq_(0),
+    isClosed_(false),
+    mutex_(),
+    cv_(),
+    subscriptions_(),
+    subscriptionsMutex_(),
+    timebase(tb)
     {
+        ring_.reserve(RING_SIZE);
+        for (int i = 0; i < RING_SIZE; ++i)
+        {
+            ring_.push_back(std::make_shared<Entry>(avtools::Frame(nullptr, AVMediaType::AVMEDIA_TYPE_VIDEO, timebase)));
+        }
     }
 
     ThreadsafeFrame::~ThreadsafeFrame()
     {
-        LOG4CXX_DEBUG(logger, "Releasing threadsafe frame from thread at " << (void*) pFrame_->data[0] );
+        LOG4CXX_DEBUG(logger, "Releasing threadsafe frame with " << ring_.size() << " recycled frames");
+        if (pConvCtx_)
+        {
+            sws_freeContext(pConvCtx_);
+        }
+        close();    //If there was anyone waiting on this frame, signal them before disappearing
+    };
+
+    void ThreadsafeFrame::notify()
+    {
+        {
+            // Waiters check their predicate while holding the mutex, so this ensures that a waiter is either
+            // waiting on the condition variable, or will see the new state when it checks its predicate.
+            std::lock_guard<std::mutex> lk(mutex_);
+        }
+        cv_.notify_all();
+    }
+
+    avtools::Frame& ThreadsafeFrame::getPendingFrame()
+    {
+        if (!pPending_)
         {
-            auto lk = getWriteLock();
-            if (pConvCtx_)
+            for (auto& pEntry: ring_)
             {
-                sws_freeContext(pConvCtx_);
+                // A frame is free if the ring holds the only reference to it, i.e., it is neither the latest frame,
+                // nor held by any consumer. Its data buffers may still be referenced elsewhere, which is fine since
+                // we only release our reference to them, and they go back to the pool once everyone else is done.
+                if (pEntry.use_count() == 1)
+                {
+                    std::atomic_thread_fence(std::memory_order_acquire);    //make sure the consumers are done reading before we reuse the frame
+                    pPending_ = pEntry;
+                    break;
+                }
             }
+            if (!pPending_)
+            {
+                ring_.push_back(std::make_shared<Entry>(avtools::Frame(nullptr, AVMediaType::AVMEDIA_TYPE_VIDEO, timebase)));
+                pPending_ = ring_.back();
+                if (ring_.size() == RING_SIZE_WARN)
+                {
+                    LOG4CXX_WARN(logger, "Consumers are holding on to " << ring_.size() << " frames.");
+                }
+            }
+            av_frame_unref(pPending_->frame.get());
         }
-        cv.notify_all();    //If there was anyone waiting on this frame, signal them before disappearing
-    };
+        assert(pPending_);
+        return pPending_->frame;
+    }
 
-    void ThreadsafeFrame::update(const avtools::Frame &frm)
+    avtools::Frame& ThreadsafeFrame::getWritableFrame()
     {
-        assert(pFrame_);
-        assert(frm.type == AVMediaType::AVMEDIA_TYPE_VIDEO);
-        assert( 0 == av_cmp_q(frm.timebase, timebase) );
-        int ret;
-        if (frm)
+        avtools::Frame& frame = getPendingFrame();
+        if (!frame->buf[0])
         {
+            frame->colorspace = AVColorSpace::AVCOL_SPC_RGB;
+            pPool_->getFrame(frame);
+        }
+        assert(av_frame_is_writable(frame.get()));
+        return frame;
+    }
+
+    void ThreadsafeFrame::publish()
+    {
+        assert(pPending_);
+        pPending_->seq = ++seq_;
+        const entry_ptr_t pEntry(pPending_);
+        pPending_.reset();
+        std::atomic_store(&pLatest_, pEntry);
+        notify();
+
+        // Push to the subscriptions outside the lock, since a lossless subscription may make us wait
+        std::vector< std::shared_ptr<Subscription> > subscriptions;
+        {
+            std::lock_guard<std::mutex> lk(subscriptionsMutex_);
+            subscriptions.reserve(subscriptions_.size());
+            auto it = subscriptions_.begin();
+            while (it != subscriptions_.end())
             {
-                auto lock = getWriteLock();
-                assert(frm->data[0] && pFrame_->data[0]);
-                if ( (pFrame_->width != frm->width) || (pFrame_->height != frm->height) || (pFrame_->format != frm->format) )
+                auto pSub = it->lock();
+                if (!pSub || pSub->isCancelled())
                 {
-                    LOG4CXX_DEBUG(logger, "Converting frame...");
-                    pConvCtx_ = sws_getCachedContext(pConvCtx_, frm->width, frm->height, (AVPixelFormat) frm->format, pFrame_->width, pFrame_->height, (AVPixelFormat) pFrame_->format, SWS_LANCZOS | SWS_ACCURATE_RND, nullptr, nullptr, nullptr);
-                    ret = sws_scale(pConvCtx_, frm->data, frm->linesize, 0, frm->height, pFrame_->data, pFrame_->linesize);
-                    if (ret < 0)
-                    {
-                        throw avtools::MediaError("Error converting frame to output format.", ret);
-                    }
+                    it = subscriptions_.erase(it);
                 }
                 else
                 {
-                    ret = av_frame_copy(pFrame_, frm.get());
-                    if (ret < 0)
-                    {
-                        throw avtools::MediaError("Error copying frame.", ret);
-                    }
+                    subscriptions.push_back(std::move(pSub));
+                    ++it;
                 }
-                ret = av_frame_copy_props(pFrame_, frm.get());
-                if (ret < 0)
+            }
+        }
+        for (auto& pSub: subscriptions)
+        {
+            pSub->push(pEntry);
+        }
+    }
+
+    bool ThreadsafeFrame::isWanted(std::int64_t pts) const
+    {
+        std::lock_guard<std::mutex> lk(subscriptionsMutex_);
+        bool hasSubscriptions = false;
+        for (const auto& pSub: subscriptions_)
+        {
+            auto ppSub = pSub.lock();
+            if (!ppSub || ppSub->isCancelled())
+            {
+                continue;
+            }
+            if (ppSub->wants(pts))
+            {
+                return true;
+            }
+            hasSubscriptions = true;
+        }
+        return !hasSubscriptions;
+    }
+
+    bool ThreadsafeFrame::hasSubscriptions() const
+    {
+        std::lock_guard<std::mutex> lk(subscriptionsMutex_);
+        return std::any_of(subscriptions_.begin(), subscriptions_.end(), [](const std::weak_ptr<Subscription>& pSub){
+            auto ppSub = pSub.lock();
+            return (ppSub && !ppSub->isCancelled());
+        });
+    }
+
+    void ThreadsafeFrame::close()
+    {
+        isClosed_.store(true);
+        notify();
+        std::lock_guard<std::mutex> lk(subscriptionsMutex_);
+        for (auto& pSub: subscriptions_)
+        {
+            if (auto ppSub = pSub.lock())
+            {
+                ppSub->close();
+            }
+        }
+    }
+
+    void ThreadsafeFrame::cancel()
+    {
+        {
+            std::lock_guard<std::mutex> lk(subscriptionsMutex_);
+            for (auto& pSub: subscriptions_)
+            {
+                if (auto ppSub = pSub.lock())
                 {
-                    throw avtools::MediaError("Error copying frame properties.", ret);
+                    ppSub->cancel();
                 }
             }
         }
+        close();    //also wakes the consumers that listen for the subscription to be ready
+    }
+
+    std::shared_ptr<ThreadsafeFrame::Subscription> ThreadsafeFrame::subscribe(std::size_t capacity, QueuePolicy policy, AVRational frameRate)
+    {
+        if (capacity == 0)
+        {
+            throw std::invalid_argument("Frame subscription capacity should be at least 1.");
+        }
+        if ( (frameRate.num < 0) || (frameRate.den < 0) )
+        {
+            throw std::invalid_argument("Frame subscription rate should be non-negative.");
+        }
+        std::shared_ptr<Subscription> pSub(new Subscription(capacity, policy, frameRate, timebase));
+        std::lock_guard<std::mutex> lk(subscriptionsMutex_);
+        if (isClosed_.load())
+        {
+            pSub->close();
+        }
+        subscriptions_.push_back(pSub);
+        return pSub;
+    }
+
+    ThreadsafeFrame::frame_ptr_t ThreadsafeFrame::waitForNewer(std::uint64_t& seq) const
+    {
+        entry_ptr_t pEntry;
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            cv_.wait(lk, [this, &pEntry, seq](){
+                pEntry = std::atomic_load(&pLatest_);
+                return isClosed_.load() || (pEntry && (pEntry->seq > seq));
+            });
+        }
+        if (isClosed_.load())
+        {
+            return nullptr;
+        }
+        assert(pEntry && (pEntry->seq > seq));
+        seq = pEntry->seq;
+        return frame_ptr_t(pEntry, &pEntry->frame); //shares ownership of the entry
+    }
+
+    void ThreadsafeFrame::update(const avtools::Frame &frm)
+    {
+        if (!frm)
+        {
+            close();
+            return;
+        }
+        assert(frm.type == AVMediaType::AVMEDIA_TYPE_VIDEO);
+        assert( 0 == av_cmp_q(frm.timebase, timebase) );
+        assert(frm->data[0]);
+        int ret;
+        if ( (width_ == frm->width) && (height_ == frm->height) && (format_ == frm->format) && frm->buf[0] )
+        {
+            // Zero-copy: the source frame is reference counted, so its buffers will not be overwritten while we refer to them
+            avtools::Frame& frame = getPendingFrame();
+            ret = av_frame_ref(frame.get(), frm.get());
+            if (ret < 0)
+            {
+                throw avtools::MediaError("Error adding reference to frame.", ret);
+            }
+            publish();
+            return;
+        }
+        avtools::Frame& frame = getWritableFrame();
+        assert(frame->data[0]);
+        if ( (frame->width != frm->width) || (frame->height != frm->height) || (frame->format != frm->format) )
+        {
+            LOG4CXX_DEBUG(logger, "Converting frame...");
+            // The expensive filter is only worth it when scaling; a pixel format conversion at the same size does not need it
+            const bool isScaling = (frame->width != frm->width) || (frame->height != frm->height);
+            const int flags = (isScaling ? SWS_LANCZOS | SWS_ACCURATE_RND : SWS_BILINEAR);
+            pConvCtx_ = sws_getCachedContext(pConvCtx_, frm->width, frm->height, (AVPixelFormat) frm->format, frame->width, frame->height, (AVPixelFormat) frame->format, flags, nullptr, nullptr, nullptr);
+            ret = sws_scale(pConvCtx_, frm->data, frm->linesize, 0, frm->height, frame->data, frame->linesize);
+            if (ret < 0)
+            {
+                throw avtools::MediaError("Error converting frame to output format.", ret);
+            }
+        }
         else
         {
+            ret = av_frame_copy(frame.get(), frm.get());
+            if (ret < 0)
+            {
+                throw avtools::MediaError("Error copying frame.", ret);
+            }
+        }
+        ret = av_frame_copy_props(frame.get(), frm.get());
+        if (ret < 0)
+        {
+            throw avtools::MediaError("Error copying frame properties.", ret);
+        }
+        publish();
+    }
+
+    // ---------------------------
+    // Subscription Definitions
+    // ---------------------------
+    ThreadsafeFrame::Subscription::Subscription(std::size_t cap, QueuePolicy pol, AVRational rate, TimeBaseType tb):
+    capacity(cap),
+    policy(pol),
+    frameRate(rate),
+    queue_(),
+    isClosed_(false),
+    isCancelled_(false),
+    nDroppedSincePop_(0),
+    timebase_(tb),
+    firstPts_(AV_NOPTS_VALUE),
+    lastSlot_(-1),
+    stats_{0, 0, 0, 0, 0, 0, 0},
+    listener_(),
+    mutex_(),
+    cv_()
+    {
+        assert(capacity > 0);
+    }
+
+    std::int64_t ThreadsafeFrame::Subscription::getSlot(std::int64_t pts) const
+    {
+        assert( (firstPts_ != AV_NOPTS_VALUE) && (pts >= firstPts_) );
+        // A quarter of a frame interval of slack, so that the jitter in the input timestamps does not make us skip a frame we need
+        const double t = (double) (pts - firstPts_) * av_q2d(timebase_) * av_q2d(frameRate);
+        return (std::int64_t) std::floor(t + 0.25);
+    }
+
+    bool ThreadsafeFrame::Subscription::isDue(std::int64_t pts) const
+    {
+        // Without a cadence or timestamps every frame is due, and a timestamp going back restarts the cadence
+        if ( !hasCadence() || (pts == AV_NOPTS_VALUE) || (firstPts_ == AV_NOPTS_VALUE) || (pts < firstPts_) )
+        {
+            return true;
+        }
+        return getSlot(pts) > lastSlot_;
+    }
+
+    bool ThreadsafeFrame::Subscription::wants(std::int64_t pts) const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        return !isCancelled_ && isDue(pts);
+    }
+
+    void ThreadsafeFrame::Subscription::push(const entry_ptr_t& pEntry)
+    {
+        assert(pEntry);
+        std::unique_lock<std::mutex> lk(mutex_);
+        if (isCancelled_)
+        {
+            return;
+        }
+        const std::int64_t pts = pEntry->frame->pts;
+        if (!isDue(pts))
+        {
+            ++stats_.nSkipped;
+            return;
+        }
+        if ( hasCadence() && (pts != AV_NOPTS_VALUE) )
+        {
+            if ( (firstPts_ == AV_NOPTS_VALUE) || (pts < firstPts_) )
             {
-                auto lk = getWriteLock();
-                // Put frame in uninitialized state
-                if (pFrame_)
+                firstPts_ = pts;
+            }
+            lastSlot_ = getSlot(pts);
+        }
+        if (queue_.size() >= capacity)
+        {
+            if (policy == QueuePolicy::LOSSLESS)
+            {
+                cv_.wait(lk, [this](){return (queue_.size() < capacity) || isCancelled_;});
+                if (isCancelled_)
                 {
-                    av_freep(&pFrame_);
+                    return;
+                }
+            }
+            else
+            {
+                assert(policy == QueuePolicy::LATEST);
+                while (queue_.size() >= capacity)
+                {
+                    queue_.pop_front();
+                    ++stats_.nDropped;
+                    ++nDroppedSincePop_;
                 }
-                type = AVMediaType::AVMEDIA_TYPE_UNKNOWN;
             }
         }
-        cv.notify_all();
+        queue_.push_back(pEntry);
+        ++stats_.nPushed;
+        stats_.maxDepth = std::max(stats_.maxDepth, queue_.size());
+        const std::function<void()> listener = listener_;
+        lk.unlock();
+        cv_.notify_all();
+        if (listener)
+        {
+            listener();
+        }
+    }
+
+    ThreadsafeFrame::frame_ptr_t ThreadsafeFrame::Subscription::popFront(std::uint64_t& seq)
+    {
+        assert(!queue_.empty());
+        entry_ptr_t pEntry = std::move(queue_.front());
+        queue_.pop_front();
+        seq = pEntry->seq;
+        nDroppedSincePop_ = 0;
+        ++stats_.nPopped;
+        return frame_ptr_t(pEntry, &pEntry->frame);
+    }
+
+    ThreadsafeFrame::frame_ptr_t ThreadsafeFrame::Subscription::pop(std::uint64_t& seq)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        cv_.wait(lk, [this](){return !queue_.empty() || isClosed_ || isCancelled_;});
+        if (queue_.empty() || isCancelled_)
+        {
+            return nullptr;
+        }
+        frame_ptr_t pFrame = popFront(seq);
+        lk.unlock();
+        cv_.notify_all();   //let the producer know there is room in the queue
+        return pFrame;
+    }
+
+    ThreadsafeFrame::frame_ptr_t ThreadsafeFrame::Subscription::tryPop(std::uint64_t& seq)
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        if (queue_.empty() || isCancelled_)
+        {
+            return nullptr;
+        }
+        frame_ptr_t pFrame = popFront(seq);
+        lk.unlock();
+        cv_.notify_all();   //let the producer know there is room in the queue
+        return pFrame;
+    }
+
+    bool ThreadsafeFrame::Subscription::isReady() const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        return !queue_.empty() || isClosed_ || isCancelled_;
+    }
+
+    void ThreadsafeFrame::Subscription::setListener(std::function<void()> listener)
+    {
+        bool isReady = false;
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            listener_ = listener;
+            isReady = !queue_.empty() || isClosed_;
+        }
+        // Frames that were pushed before the listener was set would otherwise go unnoticed
+        if (isReady && listener)
+        {
+            listener();
+        }
+    }
+
+    void ThreadsafeFrame::Subscription::close()
+    {
+        std::function<void()> listener;
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            isClosed_ = true;
+            listener = listener_;
+        }
+        cv_.notify_all();
+        if (listener)
+        {
+            listener();
+        }
+    }
+
+    void ThreadsafeFrame::Subscription::cancel()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            isCancelled_ = true;
+            queue_.clear();
+        }
+        cv_.notify_all();
+    }
+
+    bool ThreadsafeFrame::Subscription::isCancelled() const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        return isCancelled_;
+    }
+
+    ThreadsafeFrame::Subscription::Stats ThreadsafeFrame::Subscription::stats() const
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        Stats stats = stats_;
+        stats.depth = queue_.size();
+        // Counted in the frames pushed to this queue, so the frames skipped for being off the consumer's cadence do not count
+        stats.lag = queue_.size() + nDroppedSincePop_;
+        return stats;
+    }
+
+    std::ostream& operator<<(std::ostream& stream, const ThreadsafeFrame::Subscription::Stats& stats)
+    {
+        return ( stream << "pushed = " << stats.nPushed << ", skipped = " << stats.nSkipped << ", popped = " << stats.nPopped << ", dropped = " << stats.nDropped
+                << ", lag = " << stats.lag << ", depth = " << stats.depth << " (max " << stats.maxDepth << ")" );
     }
 
 }   //::avtools
@@ -9,26 +9,177 @@
 #define ThreadsafeFrame_hpp
 
 #include "LibAVWrappers.hpp"
-#include <shared_mutex>
+#include <mutex>
 #include <condition_variable>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <iosfwd>
 #include <memory>
+#include <vector>
 
 struct SWSContect;
 namespace avtools
 {
-    /// @class Thread-safe frame wrapper
-    /// See https://stackoverflow.com/questions/39516416/using-weak-ptr-to-implement-the-observer-pattern
-    /// This frame employes a single writer/multiple reader paradigm
-    /// Only one thread can write at a time, using update()
-    /// Multiple threads can read at the same time, accessing the underlying frame via get()
-    /// Threads subscribe to this frame via subscribe(). When a new frame is available (After an update()),
-    /// all subscribers are called with notify() to give them access to the underlying frame.
-    /// Also see https://en.cppreference.com/w/cpp/thread/shared_mutex for single writer/multiple reader example
-    class ThreadsafeFrame: 
-    public avtools::Frame, public std::enable_shared_from_this<ThreadsafeFrame>
+    /// @class Thread-safe frame bus
+    /// This frame bus employs a single producer/multiple consumer paradigm.
+    /// The producer fills a frame via update(), or via getWritableFrame() followed by publish(). Published frames
+    /// are immutable, and are handed out to consumers as reference-counted snapshots, so a consumer can hold on to a
+    /// frame for as long as it needs to (e.g., while encoding or warping) without holding any locks. Publication is an
+    /// atomic pointer swap, so the producer never waits on a consumer.
+    /// Frames are recycled from a small ring, and their data buffers come from a FramePool. The producer only reuses
+    /// a frame that no consumer refers to, and grows the ring if all frames are held by consumers. Buffers still referenced
+    /// elsewhere (e.g. by a writer's filtergraph) are not reused until they are released.
+    /// Consumers either wait for the latest frame via waitForNewer(), or subscribe to get their own bounded queue of frames
+    /// via subscribe(). Each published frame has a monotonically increasing sequence number.
+    /// A subscriber may declare the frame rate it consumes frames at, in which case only the frames on its cadence are pushed
+    /// to it. Producers can ask isWanted() before doing any work on a frame, and skip the frames that no subscriber will use.
+    class ThreadsafeFrame:
+    public std::enable_shared_from_this<ThreadsafeFrame>
     {
+    public:
+        typedef std::shared_ptr<const avtools::Frame> frame_ptr_t;         ///< Snapshot of a published frame
+    private:
+        /// @class A frame and its sequence number
+        struct Entry
+        {
+            std::uint64_t seq;                                              ///< sequence number the frame was published with
+            avtools::Frame frame;                                           ///< frame data
+            /// Ctor
+            /// @param[in] frm frame to publish
+            inline Entry(avtools::Frame&& frm): seq(0), frame(std::move(frm)) {}
+        };
+        typedef std::shared_ptr<const Entry> entry_ptr_t;                   ///< Type of a published entry
+    public:
+        /// What to do when a new frame is published to a subscription whose queue is full
+        enum class QueuePolicy
+        {
+            LOSSLESS,   ///< The producer waits until the consumer makes room in the queue (backpressure). For offline & archival outputs.
+            LATEST      ///< The oldest frame in the queue is dropped to make room for the new one. For live outputs.
+        };
+
+        /// @class A bounded queue of published frames for a single consumer.
+        /// The producer pushes every published frame on the subscription's cadence to it, and the consumer pops them in order.
+        class Subscription
+        {
+        public:
+            /// @class Queue statistics
+            struct Stats
+            {
+                std::uint64_t nPushed;      ///< number of frames published to this queue
+                std::uint64_t nSkipped;     ///< number of frames not pushed because they were off the consumer's cadence
+                std::uint64_t nDropped;     ///< number of frames dropped because the queue was full
+                std::uint64_t nPopped;      ///< number of frames read by the consumer
+                std::uint64_t lag;          ///< number of frames on the consumer's cadence pushed after the last one it popped, i.e. waiting or dropped since
+                std::size_t depth;          ///< number of frames currently waiting in the queue
+                std::size_t maxDepth;       ///< maximum number of frames that were waiting in the queue
+            };
+
+            const std::size_t capacity;     ///< maximum number of frames in the queue
+            const QueuePolicy policy;       ///< what to do when the queue is full
+            const AVRational frameRate;     ///< rate the consumer uses frames at, or 0 if it uses every frame
+
+            inline Subscription(const Subscription&) = delete;
+
+            /// Waits until a frame is available in the queue, and pops it.
+            /// @param[out] seq sequence number of the returned frame
+            /// @return the oldest frame in the queue, or nullptr if the bus was closed and all frames were consumed, or if the subscription was cancelled.
+            frame_ptr_t pop(std::uint64_t& seq);
+
+            /// Pops a frame if one is available, without waiting.
+            /// @param[out] seq sequence number of the returned frame
+            /// @return the oldest frame in the queue, or nullptr if the queue is empty
+            frame_ptr_t tryPop(std::uint64_t& seq);
+
+            /// @return true if pop() would return without waiting, i.e. there is a frame in the queue, or no more frames will be pushed
+            bool isReady() const;
+
+            /// Sets a function that is called when the subscription becomes ready, i.e. after a frame is pushed, or when the bus
+            /// is closed. It is called on the producer's thread, without any locks held, so it should return quickly. This lets a
+            /// consumer that serves many subscriptions wait on all of them at once.
+            /// @param[in] listener function to call, or an empty function to stop listening
+            void setListener(std::function<void()> listener);
+
+            /// Cancels the subscription. Should be called by the consumer when it will not read any more frames, so that
+            /// the producer does not wait on it.
+            void cancel();
+
+            /// @return true if the subscription was cancelled
+            bool isCancelled() const;
+
+            /// @return a snapshot of the queue statistics
+            Stats stats() const;
+        private:
+            friend class ThreadsafeFrame;
+            std::deque<entry_ptr_t> queue_;                                 ///< frames waiting to be consumed
+            bool isClosed_;                                                 ///< true if the producer will not push any more frames
+            bool isCancelled_;                                              ///< true if the consumer will not pop any more frames
+            std::uint64_t nDroppedSincePop_;                                ///< number of frames dropped since the last pop
+            const TimeBaseType timebase_;                                   ///< timebase of the frame timestamps
+            std::int64_t firstPts_;                                         ///< timestamp of the first pushed frame, which the cadence is counted from
+            std::int64_t lastSlot_;                                         ///< cadence slot of the last pushed frame
+            Stats stats_;                                                   ///< queue statistics
+            std::function<void()> listener_;                                ///< function called when the subscription becomes ready
+            mutable std::mutex mutex_;                                      ///< Mutex that guards the queue
+            std::condition_variable cv_;                                    ///< Condition variable signaled when the queue changes
+
+            /// Ctor
+            /// @param[in] capacity maximum number of frames in the queue
+            /// @param[in] policy what to do when the queue is full
+            /// @param[in] frameRate rate the consumer uses frames at, or 0 if it uses every frame
+            /// @param[in] timebase timebase of the frame timestamps
+            Subscription(std::size_t capacity, QueuePolicy policy, AVRational frameRate, TimeBaseType timebase);
+
+            /// @return true if the consumer declared a frame rate, and the frame timestamps can be converted to time
+            inline bool hasCadence() const noexcept
+            {
+                return (frameRate.num > 0) && (frameRate.den > 0) && (timebase_.num > 0) && (timebase_.den > 0);
+            }
+
+            /// @return the cadence slot a timestamp falls in. A frame is on the consumer's cadence if its slot is after
+            /// the slot of the last pushed frame. Should be called with mutex_ held.
+            /// @param[in] pts presentation timestamp of a frame, after the first pushed frame
+            std::int64_t getSlot(std::int64_t pts) const;
+
+            /// @return true if a frame with the given timestamp is on the consumer's cadence. Should be called with mutex_ held.
+            /// @param[in] pts presentation timestamp of the frame
+            bool isDue(std::int64_t pts) const;
+
+            /// @return true if a frame with the given timestamp would be pushed to the queue
+            /// @param[in] pts presentation timestamp of the frame
+            bool wants(std::int64_t pts) const;
+
+            /// Pushes a frame to the queue if it is on the consumer's cadence. Depending on the policy, either waits until
+            /// there is room in the queue, or drops the oldest frame.
+            /// @param[in] pEntry published frame
+            void push(const entry_ptr_t& pEntry);
+
+            /// Signals the consumer that no more frames will be pushed
+            void close();
+
+            /// Pops the oldest frame in the queue. Should be called with mutex_ held, and the queue not empty.
+            /// @param[out] seq sequence number of the returned frame
+            /// @return the oldest frame in the queue
+            frame_ptr_t popFront(std::uint64_t& seq);
+        };  //::avtools::ThreadsafeFrame::Subscription
     private:
+
+        const int width_;                                                   ///< width of the published frames
+        const int height_;                                                  ///< height of the published frames
+        const AVPixelFormat format_;                                        ///< format of the published frames
         SwsContext* pConvCtx_;                                              ///< Image conversion context used if the update images are different than the declared frame dimensions or format
+        std::shared_ptr<avtools::FramePool> pPool_;                         ///< Pool that the data buffers of the published frames come from
+        std::vector< std::shared_ptr<Entry> > ring_;                        ///< Recycled frames. Only accessed by the producer
+        std::shared_ptr<Entry> pPending_;                                   ///< Frame being written by the producer, not yet published
+        entry_ptr_t pLatest_;                                               ///< Most recently published frame. Only accessed via std::atomic_load/std::atomic_store
+        std::uint64_t seq_;                                                 ///< Sequence number of the last published frame. Only accessed by the producer
+        std::atomic_bool isClosed_;                                         ///< True if the producer will not publish any more frames
+        mutable std::mutex mutex_;                                          ///< Mutex used only for waiting on cv_
+        mutable std::condition_variable cv_;                                ///< Condition variable to let consumers know when a new frame has arrived
+        std::vector< std::weak_ptr<Subscription> > subscriptions_;          ///< Queues that published frames are pushed to
+        mutable std::mutex subscriptionsMutex_;                             ///< Mutex that guards subscriptions_
 
         /// Ctor
         /// @param[in] width width of the frame
@@ -36,26 +187,71 @@ namespace avtools
         /// @param[in] format frame format
         /// @param[in] timebase the timebase the frame timestamps are presented in, if known
         ThreadsafeFrame(int width, int height, AVPixelFormat format, TimeBaseType tb);
-        mutable std::shared_timed_mutex mutex;                              ///< Mutex used for single writer/multiple reader access TODO: Update to c++17 and std::shared_mutex
+
+        /// Wakes up any waiting consumers
+        void notify();
+
+        /// Finds a frame in the ring that is not referred to by any consumer, and sets it as the pending frame
+        /// @return the pending frame, with its data buffers released
+        avtools::Frame& getPendingFrame();
     public:
-        typedef std::shared_lock<std::shared_timed_mutex> read_lock_t;      ///< Read lock type, allows for multi-threaded read
-        typedef std::unique_lock<std::shared_timed_mutex> write_lock_t;     ///< Write lock type, only one thread can write
+        const TimeBaseType timebase;                                        ///< timebase of the published frames
 
-        mutable std::condition_variable_any cv;                             ///< Condition variable to let observers know when a new frame has arrived
         /// Dtor
         virtual ~ThreadsafeFrame();
-        /// Updates the frame in a thread-safe manner
-        /// @param[in] frame new frame that will replace the existing frame
+
+        /// @return width of the published frames
+        inline int width() const noexcept { return width_; }
+        /// @return height of the published frames
+        inline int height() const noexcept { return height_; }
+        /// @return pixel format of the published frames
+        inline AVPixelFormat format() const noexcept { return format_; }
+
+        /// Updates the frame in a thread-safe manner. Should only be called by the producer.
+        /// @param[in] frame new frame to publish. If it is reference counted and has the dimensions & format of this bus, it is published
+        /// without copying, by adding a reference to its data buffers. Otherwise, it is converted to a new frame from the pool.
+        /// If this frame is empty, the bus is closed.
         void update(const avtools::Frame& frame);
 
-        /// @return a read lock, blocks until it is acquired
-        inline read_lock_t getReadLock() const { return read_lock_t(mutex); }
-        /// @return an attempted read lock. The receiver must test to see if the returned lock is acquired
-        inline read_lock_t tryReadLock() const { return read_lock_t(mutex, std::try_to_lock); }
-        /// @return a write lock, blocks until it is acquired
-        inline write_lock_t getWriteLock() { return write_lock_t(mutex); }
-        /// @return an attempted write lock. The receiver must test to see if the returned lock is acquired
-        inline write_lock_t tryWriteLock() { return write_lock_t(mutex, std::try_to_lock); }
+        /// Returns a frame that the producer can fill in. It will not be visible to consumers until publish() is called.
+        /// Should only be called by the producer.
+        /// @return a writable frame with the dimensions & format of this bus
+        avtools::Frame& getWritableFrame();
+
+        /// Publishes the frame returned by the last call to getWritableFrame(). Should only be called by the producer.
+        /// The frame is pushed to every subscription it is on the cadence of, so this may wait on consumers with a lossless subscription.
+        void publish();
+
+        /// Signals consumers that no more frames will be published
+        void close();
+
+        /// Cancels all subscriptions, dropping the frames waiting in them, and closes the bus. After this, neither the producer
+        /// nor any consumer waits on the bus, so this stops the threads using it, e.g. when the program ends.
+        void cancel();
+
+        /// @return true if the bus has been closed
+        inline bool isClosed() const noexcept { return isClosed_.load(); }
+
+        /// Waits until a frame newer than a given sequence number is published.
+        /// @param[in, out] seq sequence number of the last frame seen by the caller. On return, updated to the sequence number of the returned frame.
+        /// @return a snapshot of the latest frame, or nullptr if the bus was closed.
+        frame_ptr_t waitForNewer(std::uint64_t& seq) const;
+
+        /// Subscribes to the frames published after this call.
+        /// @param[in] capacity maximum number of frames that can wait in the queue
+        /// @param[in] policy what to do when the queue is full
+        /// @param[in] frameRate rate the consumer uses frames at. Frames that are closer to the previous pushed frame than
+        /// the frame interval are not pushed to it. If 0 or unknown, every frame is pushed.
+        /// @return a new subscription. Frames are pushed to it as long as it is alive and not cancelled.
+        std::shared_ptr<Subscription> subscribe(std::size_t capacity, QueuePolicy policy, AVRational frameRate=AVRational{0, 1});
+
+        /// Lets the producer skip the work on a frame that no consumer will use. Should only be called by the producer.
+        /// @param[in] pts presentation timestamp of the next frame, in the timebase of this bus
+        /// @return true if the frame is on the cadence of at least one live subscription, or if there are no subscriptions
+        bool isWanted(std::int64_t pts) const;
+
+        /// @return true if there is at least one live subscription, i.e. someone will use the published frames
+        bool hasSubscriptions() const;
 
         /// Factory method
         /// @param[in] width width of the frame
@@ -81,5 +277,11 @@ namespace avtools
         }
     }; //::<anon>::ThreadsafeFrame
 
+    /// Prints subscription statistics
+    /// @param[in] stream output stream
+    /// @param[in] stats subscription statistics
+    /// @return a reference to the output stream
+    std::ostream& operator<<(std::ostream& stream, const ThreadsafeFrame::Subscription::Stats& stats);
+
 }   //::avtools
 #endif /* ThreadsafeFrame_hpp */
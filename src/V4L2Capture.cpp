@@ -0,0 +1,688 @@
+//
+//  V4L2Capture.cpp
+//  zoomboard_server
+//
+//  Native Video4Linux2 capture backend.
+//
+
+#include "V4L2Capture.hpp"
+
+#ifdef __gnu_linux__
+
+#include "Media.hpp"
+#include "log4cxx/logger.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/buffer.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+using avtools::MediaError;
+
+namespace
+{
+    log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd.V4L2Capture"));
+
+    static const int DEFAULT_N_BUFFERS = 6;         ///< number of buffers to request from the driver, unless specified
+    static const int MIN_QUEUED_BUFFERS = 2;        ///< if fewer buffers than this are left with the driver, frames are copied so the buffer can be returned immediately
+    static const int POLL_TIMEOUT_MS = 1000;        ///< how long to wait for a frame at a time
+    static const int MAX_POLL_TIMEOUTS = 5;         ///< number of consecutive timeouts after which we give up on the device
+    static const AVRational TIMEBASE = {1, 1000000};///< V4L2 timestamps are in microseconds
+
+    /// Correspondence between V4L2 & libav raw pixel formats
+    static const std::pair<std::uint32_t, AVPixelFormat> PIXEL_FORMATS[] = {
+        {V4L2_PIX_FMT_YUYV,     AV_PIX_FMT_YUYV422},
+        {V4L2_PIX_FMT_UYVY,     AV_PIX_FMT_UYVY422},
+        {V4L2_PIX_FMT_YUV420,   AV_PIX_FMT_YUV420P},
+        {V4L2_PIX_FMT_YUV422P,  AV_PIX_FMT_YUV422P},
+        {V4L2_PIX_FMT_NV12,     AV_PIX_FMT_NV12},
+        {V4L2_PIX_FMT_NV21,     AV_PIX_FMT_NV21},
+        {V4L2_PIX_FMT_RGB24,    AV_PIX_FMT_RGB24},
+        {V4L2_PIX_FMT_BGR24,    AV_PIX_FMT_BGR24},
+        {V4L2_PIX_FMT_GREY,     AV_PIX_FMT_GRAY8}
+    };
+
+    /// @return the libav pixel format corresponding to a V4L2 pixel format, or AV_PIX_FMT_NONE if it is not a supported raw format
+    AVPixelFormat toAVPixelFormat(std::uint32_t v4l2Format)
+    {
+        for (const auto& fmt: PIXEL_FORMATS)
+        {
+            if (fmt.first == v4l2Format)
+            {
+                return fmt.second;
+            }
+        }
+        return AV_PIX_FMT_NONE;
+    }
+
+    /// @return the V4L2 pixel format corresponding to a libav pixel format, or 0 if it is not a supported raw format
+    std::uint32_t toV4L2PixelFormat(AVPixelFormat format)
+    {
+        for (const auto& fmt: PIXEL_FORMATS)
+        {
+            if (fmt.second == format)
+            {
+                return fmt.first;
+            }
+        }
+        return 0;
+    }
+
+    /// Correspondence between V4L2 compressed formats & libav codecs
+    static const std::pair<std::uint32_t, const char*> COMPRESSED_FORMATS[] = {
+        {V4L2_PIX_FMT_MJPEG,    "mjpeg"},
+        {V4L2_PIX_FMT_JPEG,     "mjpeg"},
+        {V4L2_PIX_FMT_H264,     "h264"}
+    };
+
+    /// ioctl that is retried if interrupted by a signal
+    int xioctl(int fd, unsigned long request, void* arg)
+    {
+        int ret;
+        do
+        {
+            ret = ioctl(fd, request, arg);
+        } while ( (ret == -1) && (errno == EINTR) );
+        return ret;
+    }
+
+    /// @class An open V4L2 device and its memory-mapped buffers.
+    /// This is shared by the capture and the frames referring to its buffers, so that the buffers stay mapped as long as
+    /// any frame refers to them, even if the capture is closed.
+    struct Device
+    {
+        int fd;                                                 ///< file descriptor of the device
+        std::vector< std::pair<void*, std::size_t> > buffers;   ///< mapped buffers & their lengths
+        std::atomic_int nQueued;                                ///< number of buffers queued with the driver
+        std::atomic_bool isStreaming;                           ///< true while capture is on
+
+        /// Ctor
+        /// @param[in] path path to the device
+        Device(const std::string& path):
+        fd(open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC)),
+        buffers(),
+        nQueued(0),
+        isStreaming(false)
+        {
+            if (fd < 0)
+            {
+                throw MediaError("Unable to open " + path, AVERROR(errno));
+            }
+        }
+
+        Device(const Device&) = delete;
+
+        /// Dtor
+        ~Device()
+        {
+            for (auto& buf: buffers)
+            {
+                munmap(buf.first, buf.second);
+            }
+            close(fd);
+        }
+
+        /// Returns a buffer to the driver
+        /// @param[in] index index of the buffer
+        /// @return true if successful, false otherwise, with errno set
+        bool queue(int index)
+        {
+            v4l2_buffer buf = {};
+            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buf.memory = V4L2_MEMORY_MMAP;
+            buf.index = index;
+            if (xioctl(fd, VIDIOC_QBUF, &buf) < 0)
+            {
+                return false;
+            }
+            ++nQueued;
+            return true;
+        }
+    };  //::<anon>::Device
+
+    /// @class Reference from a frame to a dequeued buffer, passed as the opaque data of the frame's AVBufferRef
+    struct BufferRef
+    {
+        std::shared_ptr<Device> pDevice;    ///< device the buffer belongs to
+        int index;                          ///< index of the buffer
+    };  //::<anon>::BufferRef
+
+    /// Called by libav when the last reference to a frame referring to a driver buffer is released. Returns the buffer to the driver.
+    /// @param[in] opaque BufferRef for the buffer
+    /// @param[in] data buffer data, unused
+    void releaseBuffer(void* opaque, std::uint8_t* data)
+    {
+        std::unique_ptr<BufferRef> pRef(static_cast<BufferRef*>(opaque));
+        assert(pRef && pRef->pDevice);
+        if ( pRef->pDevice->isStreaming.load() && !pRef->pDevice->queue(pRef->index) )
+        {
+            LOG4CXX_WARN(logger, "Unable to return buffer " << pRef->index << " to the driver: " << av_err2str(AVERROR(errno)));
+        }
+    }
+}   //::<anon>
+
+namespace avtools
+{
+    //==========================================
+    //
+    // V4L2Capture Implementation
+    //
+    //==========================================
+    class V4L2Capture::Implementation
+    {
+    private:
+        std::shared_ptr<Device>     pDevice_;           ///< capture device
+        FormatContext               formatCtx_;         ///< format context that holds the stream description. No I/O is done through it.
+        AVStream*                   pStream_;           ///< captured stream
+        int                         width_;             ///< frame width
+        int                         height_;            ///< frame height
+        AVPixelFormat               format_;            ///< frame pixel format
+        int                         linesizes_[4];      ///< line sizes of the planes in the driver buffers
+        std::shared_ptr<FramePool>  pPool_;             ///< pool of buffers to copy frames into when the driver is running out of buffers
+        std::uint32_t               lastSequence_;      ///< sequence number of the last captured buffer
+        std::uint64_t               nFrames_;           ///< number of captured frames
+        std::uint64_t               nDropped_;          ///< number of frames dropped by the driver
+        std::uint64_t               nCopied_;           ///< number of copied frames
+
+        /// Sets the capture format
+        /// @param[in] opts capture options
+        void setFormat(Dictionary& opts)
+        {
+            v4l2_format fmt = {};
+            fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if (xioctl(pDevice_->fd, VIDIOC_G_FMT, &fmt) < 0)
+            {
+                throw MediaError("Unable to get capture format", AVERROR(errno));
+            }
+            if (opts.has("video_size"))
+            {
+                int w, h;
+                int ret = av_parse_video_size(&w, &h, opts["video_size"].c_str());
+                if (ret < 0)
+                {
+                    throw MediaError("Unable to parse video size " + opts["video_size"], ret);
+                }
+                fmt.fmt.pix.width = w;
+                fmt.fmt.pix.height = h;
+            }
+            if (opts.has("pixel_format"))
+            {
+                const AVPixelFormat pixFmt = av_get_pix_fmt(opts["pixel_format"].c_str());
+                fmt.fmt.pix.pixelformat = toV4L2PixelFormat(pixFmt);
+                if (!fmt.fmt.pix.pixelformat)
+                {
+                    throw MediaError("Pixel format " + opts["pixel_format"] + " is not supported by the native capture backend");
+                }
+            }
+            fmt.fmt.pix.field = V4L2_FIELD_ANY;
+            if (xioctl(pDevice_->fd, VIDIOC_S_FMT, &fmt) < 0)
+            {
+                throw MediaError("Unable to set capture format", AVERROR(errno));
+            }
+            // The driver may have adjusted the format to what it supports
+            width_ = fmt.fmt.pix.width;
+            height_ = fmt.fmt.pix.height;
+            format_ = toAVPixelFormat(fmt.fmt.pix.pixelformat);
+            if (AV_PIX_FMT_NONE == format_)
+            {
+                throw MediaError("Device does not support the requested raw pixel format");
+            }
+            int ret = av_image_fill_linesizes(linesizes_, format_, width_);
+            if (ret < 0)
+            {
+                throw MediaError("Unable to calculate line sizes", ret);
+            }
+            // The driver may pad the lines; the chroma planes are padded proportionally
+            const int bytesPerLine = fmt.fmt.pix.bytesperline;
+            if (bytesPerLine > linesizes_[0])
+            {
+                for (int i = 3; i >= 0; --i)
+                {
+                    linesizes_[i] = (int) ((std::int64_t) linesizes_[i] * bytesPerLine / linesizes_[0]);
+                }
+            }
+            opts.add("video_size", std::to_string(width_) + "x" + std::to_string(height_));
+            opts.add("pixel_format", av_get_pix_fmt_name(format_));
+            LOG4CXX_DEBUG(logger, "Capture format: " << width_ << "x" << height_ << " " << format_ << ", " << bytesPerLine << " bytes per line");
+        }
+
+        /// Sets the capture frame rate
+        /// @param[in] opts capture options
+        /// @return the frame rate the driver uses, or {0, 1} if it cannot be set
+        AVRational setFrameRate(Dictionary& opts)
+        {
+            v4l2_streamparm parm = {};
+            parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if (opts.has("framerate"))
+            {
+                AVRational fps;
+                int ret = av_parse_video_rate(&fps, opts["framerate"].c_str());
+                if (ret < 0)
+                {
+                    throw MediaError("Unable to parse frame rate " + opts["framerate"], ret);
+                }
+                parm.parm.capture.timeperframe.numerator = fps.den;
+                parm.parm.capture.timeperframe.denominator = fps.num;
+                if (xioctl(pDevice_->fd, VIDIOC_S_PARM, &parm) < 0)
+                {
+                    LOG4CXX_WARN(logger, "Unable to set frame rate to " << fps << ": " << av_err2str(AVERROR(errno)));
+                }
+            }
+            if ( (xioctl(pDevice_->fd, VIDIOC_G_PARM, &parm) < 0) || (parm.parm.capture.timeperframe.numerator == 0) )
+            {
+                LOG4CXX_WARN(logger, "Unable to determine the capture frame rate.");
+                return AVRational{0, 1};
+            }
+            const AVRational fps = {(int) parm.parm.capture.timeperframe.denominator, (int) parm.parm.capture.timeperframe.numerator};
+            opts.add("framerate", fps);
+            return fps;
+        }
+
+        /// Requests buffers from the driver, maps them, and queues them for capture
+        /// @param[in] nBuffers number of buffers to request
+        void initBuffers(int nBuffers)
+        {
+            v4l2_requestbuffers req = {};
+            req.count = nBuffers;
+            req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            req.memory = V4L2_MEMORY_MMAP;
+            if (xioctl(pDevice_->fd, VIDIOC_REQBUFS, &req) < 0)
+            {
+                throw MediaError("Device does not support memory-mapped capture", AVERROR(errno));
+            }
+            if (req.count < MIN_QUEUED_BUFFERS + 1)
+            {
+                throw MediaError("Insufficient buffer memory on the device: got " + std::to_string(req.count) + " buffers.");
+            }
+            for (std::uint32_t i = 0; i < req.count; ++i)
+            {
+                v4l2_buffer buf = {};
+                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.memory = V4L2_MEMORY_MMAP;
+                buf.index = i;
+                if (xioctl(pDevice_->fd, VIDIOC_QUERYBUF, &buf) < 0)
+                {
+                    throw MediaError("Unable to query buffer " + std::to_string(i), AVERROR(errno));
+                }
+                void* pData = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, pDevice_->fd, buf.m.offset);
+                if (MAP_FAILED == pData)
+                {
+                    throw MediaError("Unable to map buffer " + std::to_string(i), AVERROR(errno));
+                }
+                pDevice_->buffers.emplace_back(pData, buf.length);
+                if (!pDevice_->queue(i))
+                {
+                    throw MediaError("Unable to queue buffer " + std::to_string(i), AVERROR(errno));
+                }
+            }
+            LOG4CXX_DEBUG(logger, "Mapped " << pDevice_->buffers.size() << " capture buffers.");
+        }
+
+        /// Fills in the plane pointers of a driver buffer
+        /// @param[in] pData start of the buffer
+        /// @param[out] data plane pointers
+        void fillPointers(std::uint8_t* pData, std::uint8_t* data[4]) const
+        {
+            int ret = av_image_fill_pointers(data, format_, height_, pData, linesizes_);
+            if (ret < 0)
+            {
+                throw MediaError("Unable to determine plane pointers", ret);
+            }
+        }
+
+    public:
+        /// Ctor
+        /// @param[in] device path to the device
+        /// @param[in, out] opts capture options
+        Implementation(const std::string& device, Dictionary& opts):
+        pDevice_(std::make_shared<Device>(device)),
+        formatCtx_(FormatContext::INPUT),
+        pStream_(nullptr),
+        width_(0),
+        height_(0),
+        format_(AV_PIX_FMT_NONE),
+        linesizes_{0},
+        pPool_(),
+        lastSequence_(0),
+        nFrames_(0),
+        nDropped_(0),
+        nCopied_(0)
+        {
+            v4l2_capability cap = {};
+            if (xioctl(pDevice_->fd, VIDIOC_QUERYCAP, &cap) < 0)
+            {
+                throw MediaError(device + " is not a V4L2 device", AVERROR(errno));
+            }
+            const std::uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+            if ( !(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING) )
+            {
+                throw MediaError(device + " does not support streaming video capture");
+            }
+            LOG4CXX_DEBUG(logger, "Opened " << cap.card << " (" << cap.driver << ") at " << device);
+
+            setFormat(opts);
+            const AVRational fps = setFrameRate(opts);
+            int nBuffers = DEFAULT_N_BUFFERS;
+            if (opts.has("capture_buffers"))
+            {
+                nBuffers = std::stoi(opts["capture_buffers"]);
+            }
+            initBuffers(nBuffers);
+            opts.add("capture_buffers", std::to_string(pDevice_->buffers.size()));
+            pPool_ = FramePool::Get(width_, height_, format_);
+
+            // Describe the stream, so that the rest of the pipeline can treat this like any other input
+            formatCtx_->url = av_strdup(device.c_str());
+            pStream_ = avformat_new_stream(formatCtx_.get(), nullptr);
+            if (!pStream_)
+            {
+                throw MediaError("Unable to create capture stream");
+            }
+            pStream_->time_base = TIMEBASE;
+            pStream_->avg_frame_rate = pStream_->r_frame_rate = fps;
+            pStream_->start_time = AV_NOPTS_VALUE;  //set when the first frame is captured
+            pStream_->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+            pStream_->codecpar->codec_id = AV_CODEC_ID_RAWVIDEO;
+            pStream_->codecpar->format = format_;
+            pStream_->codecpar->width = width_;
+            pStream_->codecpar->height = height_;
+
+            v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if (xioctl(pDevice_->fd, VIDIOC_STREAMON, &type) < 0)
+            {
+                throw MediaError("Unable to start capture", AVERROR(errno));
+            }
+            pDevice_->isStreaming.store(true);
+            LOG4CXX_INFO(logger, "Capturing " << width_ << "x" << height_ << " " << format_ << " at " << fps << " fps from " << device
+                         << " using " << pDevice_->buffers.size() << " buffers.");
+        }
+
+        /// Dtor
+        ~Implementation()
+        {
+            pDevice_->isStreaming.store(false);
+            v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            if (xioctl(pDevice_->fd, VIDIOC_STREAMOFF, &type) < 0)
+            {
+                LOG4CXX_WARN(logger, "Unable to stop capture: " << av_err2str(AVERROR(errno)));
+            }
+            LOG4CXX_INFO(logger, "Captured " << nFrames_ << " frames, driver dropped " << nDropped_ << ", copied " << nCopied_ << ".");
+            // The device is closed once all frames referring to its buffers are released
+        }
+
+        /// @return the captured stream
+        inline const AVStream* stream() const
+        {
+            return pStream_;
+        }
+
+        /// @return number of buffers shared with the driver
+        inline int nBuffers() const noexcept { return (int) pDevice_->buffers.size(); }
+
+        /// @return number of frames dropped by the driver
+        inline std::uint64_t nDropped() const noexcept { return nDropped_; }
+
+        /// @return number of copied frames
+        inline std::uint64_t nCopied() const noexcept { return nCopied_; }
+
+        /// Captures a frame
+        /// @param[out] frame captured frame
+        void read(Frame& frame)
+        {
+            v4l2_buffer buf = {};
+            int nTimeouts = 0;
+            while (true)
+            {
+                pollfd pfd = {pDevice_->fd, POLLIN, 0};
+                const int ret = poll(&pfd, 1, POLL_TIMEOUT_MS);
+                if (ret < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    throw MediaError("Error waiting for frames", AVERROR(errno));
+                }
+                else if (ret == 0)
+                {
+                    if (++nTimeouts == MAX_POLL_TIMEOUTS)
+                    {
+                        throw MediaError("No frames captured in " + std::to_string(MAX_POLL_TIMEOUTS * POLL_TIMEOUT_MS) + " ms");
+                    }
+                    LOG4CXX_DEBUG(logger, "Timed out waiting for a frame, " << pDevice_->nQueued.load() << " buffers queued.");
+                    continue;
+                }
+                buf = {};
+                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                buf.memory = V4L2_MEMORY_MMAP;
+                if (xioctl(pDevice_->fd, VIDIOC_DQBUF, &buf) < 0)
+                {
+                    if (errno == EAGAIN)
+                    {
+                        continue;
+                    }
+                    throw MediaError("Unable to dequeue buffer", AVERROR(errno));
+                }
+                --pDevice_->nQueued;
+                if (buf.flags & V4L2_BUF_FLAG_ERROR)
+                {
+                    LOG4CXX_WARN(logger, "Driver reported a corrupted frame, skipping.");
+                    if (!pDevice_->queue(buf.index))
+                    {
+                        throw MediaError("Unable to requeue buffer", AVERROR(errno));
+                    }
+                    continue;
+                }
+                break;
+            }
+
+            // Detect frames dropped by the driver
+            if ( (nFrames_ > 0) && (buf.sequence > lastSequence_ + 1) )
+            {
+                const std::uint32_t nDropped = buf.sequence - lastSequence_ - 1;
+                nDropped_ += nDropped;
+                LOG4CXX_WARN(logger, "Driver dropped " << nDropped << " frames (" << nDropped_ << " total).");
+            }
+            lastSequence_ = buf.sequence;
+            ++nFrames_;
+
+            assert(buf.index < pDevice_->buffers.size());
+            std::uint8_t* pData = static_cast<std::uint8_t*>(pDevice_->buffers[buf.index].first);
+            std::uint8_t* data[4] = {nullptr};
+            fillPointers(pData, data);
+            if (pDevice_->nQueued.load() >= MIN_QUEUED_BUFFERS)
+            {
+                // Hand out the driver buffer. It is returned to the driver when the last reference to it is released.
+                av_frame_unref(frame.get());
+                BufferRef* pRef = new BufferRef{pDevice_, (int) buf.index};
+                frame->buf[0] = av_buffer_create(pData, buf.length, &releaseBuffer, pRef, AV_BUFFER_FLAG_READONLY);
+                if (!frame->buf[0])
+                {
+                    delete pRef;
+                    pDevice_->queue(buf.index);
+                    throw MediaError("Unable to wrap capture buffer");
+                }
+                for (int i = 0; i < 4; ++i)
+                {
+                    frame->data[i] = data[i];
+                    frame->linesize[i] = linesizes_[i];
+                }
+                frame->extended_data = frame->data;
+                frame->width = width_;
+                frame->height = height_;
+                frame->format = format_;
+            }
+            else
+            {
+                // Too many buffers are held downstream, copy this frame and return the buffer right away
+                pPool_->getFrame(frame);
+                av_image_copy(frame->data, frame->linesize, const_cast<const std::uint8_t**>(data), linesizes_, format_, width_, height_);
+                if (!pDevice_->queue(buf.index))
+                {
+                    throw MediaError("Unable to requeue buffer", AVERROR(errno));
+                }
+                if (++nCopied_ == 1)
+                {
+                    LOG4CXX_WARN(logger, "Capture buffers are running low, copying frames. Consider increasing capture_buffers.");
+                }
+            }
+            frame.type = AVMEDIA_TYPE_VIDEO;
+            frame.timebase = TIMEBASE;
+            frame->key_frame = 1;
+            frame->pict_type = AV_PICTURE_TYPE_I;
+            frame->pts = frame->best_effort_timestamp = (std::int64_t) buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+            if (AV_NOPTS_VALUE == pStream_->start_time)
+            {
+                pStream_->start_time = frame->pts;
+                LOG4CXX_DEBUG(logger, "Capture timestamps are from the "
+                              << ( (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC ? "monotonic clock" : "driver's clock") );
+            }
+        }
+    };  //::avtools::V4L2Capture::Implementation
+
+    //==========================================
+    //
+    // V4L2Capture Definitions
+    //
+    //==========================================
+    std::vector<V4L2Capture::Format> V4L2Capture::GetFormats(const std::string& device, int width, int height)
+    {
+        Device dev(device);
+        std::vector<Format> formats;
+        v4l2_fmtdesc desc = {};
+        desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        for (desc.index = 0; xioctl(dev.fd, VIDIOC_ENUM_FMT, &desc) == 0; ++desc.index)
+        {
+            Format fmt{"", false, AVRational{0, 1}};
+            const AVPixelFormat pixFmt = toAVPixelFormat(desc.pixelformat);
+            if (AV_PIX_FMT_NONE != pixFmt)
+            {
+                fmt.name = av_get_pix_fmt_name(pixFmt);
+            }
+            else
+            {
+                for (const auto& codec: COMPRESSED_FORMATS)
+                {
+                    if (codec.first == desc.pixelformat)
+                    {
+                        fmt.name = codec.second;
+                        fmt.isCompressed = true;
+                    }
+                }
+            }
+            if (fmt.name.empty())
+            {
+                LOG4CXX_DEBUG(logger, "Skipping unsupported format " << desc.description);
+                continue;
+            }
+
+            // See if the frame size is offered
+            bool hasSize = false;
+            v4l2_frmsizeenum size = {};
+            size.pixel_format = desc.pixelformat;
+            for (size.index = 0; !hasSize && (xioctl(dev.fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0); ++size.index)
+            {
+                if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+                {
+                    hasSize = ( ((int) size.discrete.width == width) && ((int) size.discrete.height == height) );
+                }
+                else    //stepwise or continuous
+                {
+                    const auto& sw = size.stepwise;
+                    hasSize = ( (width >= (int) sw.min_width) && (width <= (int) sw.max_width) && ((width - sw.min_width) % std::max(sw.step_width, 1u) == 0)
+                               && (height >= (int) sw.min_height) && (height <= (int) sw.max_height) && ((height - sw.min_height) % std::max(sw.step_height, 1u) == 0) );
+                    break;  //only one entry for non-discrete sizes
+                }
+            }
+            if (!hasSize)
+            {
+                LOG4CXX_DEBUG(logger, fmt.name << " is not offered at " << width << "x" << height);
+                continue;
+            }
+
+            // Find the maximum frame rate at this size
+            v4l2_frmivalenum ival = {};
+            ival.pixel_format = desc.pixelformat;
+            ival.width = width;
+            ival.height = height;
+            for (ival.index = 0; xioctl(dev.fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ++ival.index)
+            {
+                // the minimum frame interval has the maximum frame rate
+                const v4l2_fract& interval = (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE ? ival.discrete : ival.stepwise.min);
+                if (interval.numerator == 0)
+                {
+                    continue;
+                }
+                const AVRational fps = {(int) interval.denominator, (int) interval.numerator};
+                if (av_cmp_q(fps, fmt.maxFrameRate) > 0)
+                {
+                    fmt.maxFrameRate = fps;
+                }
+                if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+                {
+                    break;  //only one entry for non-discrete intervals
+                }
+            }
+            LOG4CXX_DEBUG(logger, "Device offers " << fmt.name << " at " << width << "x" << height << " up to " << fmt.maxFrameRate << " fps");
+            formats.push_back(fmt);
+        }
+        return formats;
+    }
+
+    V4L2Capture::V4L2Capture(const std::string& device, Dictionary& opts):
+    pImpl_( new Implementation(device, opts) )
+    {
+        assert(pImpl_);
+    }
+
+    V4L2Capture::~V4L2Capture() = default;
+
+    const AVStream* V4L2Capture::stream() const
+    {
+        assert(pImpl_);
+        return pImpl_->stream();
+    }
+
+    void V4L2Capture::read(Frame& frame)
+    {
+        assert(pImpl_);
+        pImpl_->read(frame);
+    }
+
+    int V4L2Capture::nBuffers() const noexcept
+    {
+        assert(pImpl_);
+        return pImpl_->nBuffers();
+    }
+
+    std::uint64_t V4L2Capture::nDropped() const noexcept
+    {
+        assert(pImpl_);
+        return pImpl_->nDropped();
+    }
+
+    std::uint64_t V4L2Capture::nCopied() const noexcept
+    {
+        assert(pImpl_);
+        return pImpl_->nCopied();
+    }
+
+}   //::avtools
+
+#endif  /* __gnu_linux__ */
@@ -0,0 +1,84 @@
+//
+//  V4L2Capture.hpp
+//  zoomboard_server
+//
+//  Native Video4Linux2 capture backend.
+//  Also see https://www.kernel.org/doc/html/latest/media/uapi/v4l/capture.c.html
+//
+
+#ifndef V4L2Capture_hpp
+#define V4L2Capture_hpp
+
+#ifdef __gnu_linux__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "LibAVWrappers.hpp"
+
+struct AVStream;
+
+namespace avtools
+{
+    /// @class Captures frames from a V4L2 device using memory-mapped buffers, bypassing libavdevice.
+    /// Captured buffers are handed out as reference-counted frames without copying, and are returned to the driver
+    /// once the last reference to them is released. If consumers hold on to too many buffers, so that the driver is about
+    /// to run out, frames are instead copied into pooled buffers so that capture never stalls.
+    /// Only raw (uncompressed) pixel formats are supported.
+    class V4L2Capture
+    {
+    public:
+        /// @class A capture format offered by a device
+        struct Format
+        {
+            std::string name;           ///< libav pixel format name for raw formats, or codec name for compressed formats
+            bool isCompressed;          ///< true if frames need to be decoded
+            AVRational maxFrameRate;    ///< maximum frame rate the device offers this format at
+        };
+
+        /// Lists the formats a device offers at a given frame size
+        /// @param[in] device path to the device, e.g. /dev/video0
+        /// @param[in] width frame width
+        /// @param[in] height frame height
+        /// @return formats offered at the given size that libav can handle, with their maximum frame rates
+        /// @throw MediaError if the device cannot be opened
+        static std::vector<Format> GetFormats(const std::string& device, int width, int height);
+
+        /// Ctor
+        /// @param[in] device path to the device, e.g. /dev/video0
+        /// @param[in, out] opts capture options. "video_size", "framerate" and "pixel_format" are used as in libavdevice's v4l2 demuxer,
+        /// and "capture_buffers" is the number of buffers to request from the driver.
+        /// On return, these contain the values the driver actually uses.
+        /// @throw MediaError if the device cannot be opened or does not support the requested options.
+        V4L2Capture(const std::string& device, Dictionary& opts);
+
+        /// Dtor
+        ~V4L2Capture();
+
+        /// @return the captured video stream. Timestamps are the kernel capture timestamps, in microseconds.
+        const AVStream* stream() const;
+
+        /// Reads a frame
+        /// @param[out] frame captured frame. Its data refers to a driver buffer if possible, and is read-only.
+        /// @throw MediaError if there was a problem capturing frames.
+        void read(Frame& frame);
+
+        /// @return number of buffers shared with the driver
+        int nBuffers() const noexcept;
+
+        /// @return number of frames that the driver dropped, as detected from gaps in the buffer sequence numbers
+        std::uint64_t nDropped() const noexcept;
+
+        /// @return number of frames that were copied since the driver was running out of buffers
+        std::uint64_t nCopied() const noexcept;
+
+    private:
+        class Implementation;
+        std::unique_ptr<Implementation> pImpl_;
+    };  //::avtools::V4L2Capture
+
+}   //::avtools
+
+#endif  /* __gnu_linux__ */
+#endif  /* V4L2Capture_hpp */
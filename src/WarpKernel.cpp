@@ -0,0 +1,612 @@
+//
+//  WarpKernel.cpp
+//  zoomboard_server
+//
+//  Bilinear warp kernels for BGR24 images & single-channel planes, in fixed point, with SIMD variants chosen at runtime.
+//
+
+#include "WarpKernel.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define WARP_HAS_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WARP_HAS_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+    static constexpr int FRAC_BITS = 16;                            ///< fractional bits of the source coordinates
+    static constexpr int WEIGHT_BITS = 7;                           ///< bits of the bilinear weights in each direction, so that their products fit in 16 bits
+    static constexpr std::int32_t WEIGHT_ONE = 1 << WEIGHT_BITS;    ///< bilinear weight of 1
+    static constexpr std::int32_t WEIGHT_ROUND = 1 << (2 * WEIGHT_BITS - 1);   ///< rounding term of the blended value
+    static constexpr int SPAN = 16;                                 ///< pixels between exact divisions along a row
+    static constexpr std::int32_t MAX_SPAN_ERROR = 1 << (FRAC_BITS - 6);  ///< largest error of the interpolated source coordinates, 1/64 pixel
+    static constexpr double MAX_COORD = 1 << 13;                    ///< source coordinates are clamped to +/- this, far outside any image
+    static constexpr std::int32_t OUTSIDE = std::numeric_limits<std::int32_t>::min();  ///< source coordinate of pixels that map nowhere
+
+    /// @class View of a BGR24 or single-channel source image
+    struct Source
+    {
+        const std::uint8_t* data;   ///< pixel data
+        std::size_t step;           ///< bytes per row
+        int cols;                   ///< width
+        int rows;                   ///< height
+        std::uint8_t border[3];     ///< value of each channel outside the image
+    };
+
+    /// Function that interpolates a row of pixels
+    /// @param[in] src source image, BGR24 or single-channel depending on the function
+    /// @param[in] coords 16.16 fixed point source coordinates of each pixel, interleaved as u, v
+    /// @param[in] n number of pixels
+    /// @param[out] out output pixels
+    typedef void (*RowFunction)(const Source& src, const std::int32_t* coords, int n, std::uint8_t* out);
+
+    /// @return integer part of a source coordinate
+    inline int integerPart(std::int32_t coord)
+    {
+        return coord >> FRAC_BITS;
+    }
+
+    /// @return bilinear weight of the fractional part of a source coordinate
+    inline std::int32_t weight(std::int32_t coord)
+    {
+        return (coord >> (FRAC_BITS - WEIGHT_BITS)) & (WEIGHT_ONE - 1);
+    }
+
+    /// @class Weights of the four neighbors of a source location
+    struct Weights
+    {
+        std::int32_t w00;   ///< weight of the top left neighbor
+        std::int32_t w01;   ///< weight of the top right neighbor
+        std::int32_t w10;   ///< weight of the bottom left neighbor
+        std::int32_t w11;   ///< weight of the bottom right neighbor
+
+        /// Ctor
+        /// @param[in] u, v fixed point source coordinates
+        Weights(std::int32_t u, std::int32_t v)
+        {
+            const std::int32_t fx = weight(u), fy = weight(v);
+            w00 = (WEIGHT_ONE - fx) * (WEIGHT_ONE - fy);
+            w01 = fx * (WEIGHT_ONE - fy);
+            w10 = (WEIGHT_ONE - fx) * fy;
+            w11 = fx * fy;
+        }
+    };
+
+    /// @return true if the pixel at (x, y) and its neighbors can be loaded 8 bytes at a time, without reading outside the image
+    inline bool isSimdInterior(const Source& src, int x, int y)
+    {
+        return (x >= 0) && (y >= 0) && (x + 2 < src.cols) && (y + 1 < src.rows);
+    }
+
+    /// Writes a packed pixel as a single 4 byte store. The extra byte spills into the next pixel, so this cannot be used
+    /// for the last pixel of a row.
+    inline void storePixel(std::uint8_t* out, std::uint32_t pixel)
+    {
+        std::memcpy(out, &pixel, 4);
+    }
+
+    /// @return the bilinear blend of four neighboring values. This is the arithmetic all kernels reproduce exactly;
+    /// the weights sum to 2^14, so each product fits in 16 x 16 bit multiplies.
+    inline std::uint8_t blend(std::int32_t p00, std::int32_t p01, std::int32_t p10, std::int32_t p11, const Weights& w)
+    {
+        return (std::uint8_t) ((p00 * w.w00 + p01 * w.w01 + p10 * w.w10 + p11 * w.w11 + WEIGHT_ROUND) >> (2 * WEIGHT_BITS));
+    }
+
+    /// Interpolates a pixel. Neighbors outside the source image have the border value.
+    /// @tparam CN number of channels, 3 or 1
+    /// @param[in] src source image
+    /// @param[in] u, v fixed point source coordinates
+    /// @param[out] out output pixel
+    template <int CN>
+    inline void interpolatePixel(const Source& src, std::int32_t u, std::int32_t v, std::uint8_t* out)
+    {
+        const int x = integerPart(u), y = integerPart(v);
+        const Weights w(u, v);
+        if ( (x >= 0) && (y >= 0) && (x + 1 < src.cols) && (y + 1 < src.rows) )
+        {
+            const std::uint8_t* p0 = src.data + y * src.step + CN * x;
+            const std::uint8_t* p1 = p0 + src.step;
+            for (int c = 0; c < CN; ++c)
+            {
+                out[c] = blend(p0[c], p0[c + CN], p1[c], p1[c + CN], w);
+            }
+        }
+        else if ( (x < -1) || (y < -1) || (x >= src.cols) || (y >= src.rows) )
+        {
+            std::memcpy(out, src.border, CN);
+        }
+        else
+        {
+            // On the image border, only some of the neighbors are inside
+            auto pixel = [&src](int xx, int yy) -> const std::uint8_t* {
+                return ( (xx >= 0) && (yy >= 0) && (xx < src.cols) && (yy < src.rows) ) ? src.data + yy * src.step + CN * xx : src.border;
+            };
+            const std::uint8_t* p00 = pixel(x, y);
+            const std::uint8_t* p01 = pixel(x + 1, y);
+            const std::uint8_t* p10 = pixel(x, y + 1);
+            const std::uint8_t* p11 = pixel(x + 1, y + 1);
+            for (int c = 0; c < CN; ++c)
+            {
+                out[c] = blend(p00[c], p01[c], p10[c], p11[c], w);
+            }
+        }
+    }
+
+    /// Reference implementation of the row interpolation
+    /// @tparam CN number of channels, 3 or 1
+    template <int CN>
+    void interpolateRowScalar(const Source& src, const std::int32_t* coords, int n, std::uint8_t* out)
+    {
+        for (int i = 0; i < n; ++i, coords += 2, out += CN)
+        {
+            interpolatePixel<CN>(src, coords[0], coords[1], out);
+        }
+    }
+
+#ifdef WARP_HAS_X86
+    /// @return the bytes of a pixel, each followed by the same byte of its right neighbor
+    __attribute__((target("sse4.1")))
+    inline __m128i interleave(const std::uint8_t* p)
+    {
+        const __m128i r = _mm_loadl_epi64((const __m128i*) p);
+        return _mm_unpacklo_epi8(r, _mm_srli_si128(r, 3));
+    }
+
+    /// @return a pair of weights, packed as two 16 bit values for a multiply-add
+    inline std::int32_t packWeights(std::int32_t left, std::int32_t right)
+    {
+        return (right << 16) | left;
+    }
+
+    /// Interpolates an interior pixel with SSE4.1. Each row is blended by a multiply-add of each channel with its
+    /// right neighbor, as in blend().
+    __attribute__((target("sse4.1")))
+    inline void interpolatePixelSSE41(const Source& src, std::int32_t u, std::int32_t v, std::uint8_t* out)
+    {
+        const std::uint8_t* p0 = src.data + integerPart(v) * src.step + 3 * integerPart(u);
+        const Weights w(u, v);
+        const __m128i h0 = _mm_cvtepu8_epi16(interleave(p0));      //b00 b01 g00 g01 r00 r01 ...
+        const __m128i h1 = _mm_cvtepu8_epi16(interleave(p0 + src.step));
+        __m128i res = _mm_add_epi32( _mm_madd_epi16(h0, _mm_set1_epi32(packWeights(w.w00, w.w01))),
+                                     _mm_madd_epi16(h1, _mm_set1_epi32(packWeights(w.w10, w.w11))) );
+        res = _mm_srli_epi32( _mm_add_epi32(res, _mm_set1_epi32(WEIGHT_ROUND)), 2 * WEIGHT_BITS );
+        res = _mm_packus_epi32(res, res);
+        res = _mm_packus_epi16(res, res);
+        storePixel(out, (std::uint32_t) _mm_cvtsi128_si32(res));
+    }
+
+    /// SSE4.1 implementation of the row interpolation
+    __attribute__((target("sse4.1")))
+    void interpolateRowSSE41(const Source& src, const std::int32_t* coords, int n, std::uint8_t* out)
+    {
+        for (int i = 0; i < n; ++i, coords += 2, out += 3)
+        {
+            if ( (i + 1 < n) && isSimdInterior(src, integerPart(coords[0]), integerPart(coords[1])) )
+            {
+                interpolatePixelSSE41(src, coords[0], coords[1], out);
+            }
+            else
+            {
+                interpolatePixel<3>(src, coords[0], coords[1], out);
+            }
+        }
+    }
+
+    /// @return a vector that has a in the low 128 bits, and b in the high 128 bits
+    __attribute__((target("avx2")))
+    inline __m256i pair(std::int32_t a, std::int32_t b)
+    {
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_set1_epi32(a)), _mm_set1_epi32(b), 1);
+    }
+
+    /// AVX2 implementation of the row interpolation, two pixels at a time
+    __attribute__((target("avx2")))
+    void interpolateRowAVX2(const Source& src, const std::int32_t* coords, int n, std::uint8_t* out)
+    {
+        int i = 0;
+        for (; i + 2 < n; i += 2, coords += 4, out += 6)
+        {
+            if ( !isSimdInterior(src, integerPart(coords[0]), integerPart(coords[1]))
+                || !isSimdInterior(src, integerPart(coords[2]), integerPart(coords[3])) )
+            {
+                interpolateRowSSE41(src, coords, 2, out);
+                continue;
+            }
+            const std::uint8_t* pa = src.data + integerPart(coords[1]) * src.step + 3 * integerPart(coords[0]);
+            const std::uint8_t* pb = src.data + integerPart(coords[3]) * src.step + 3 * integerPart(coords[2]);
+            const Weights wa(coords[0], coords[1]), wb(coords[2], coords[3]);
+            // pixel a in the low 128 bits, pixel b in the high 128 bits
+            const __m256i h0 = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(interleave(pa), interleave(pb)));
+            const __m256i h1 = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(interleave(pa + src.step), interleave(pb + src.step)));
+            __m256i res = _mm256_add_epi32( _mm256_madd_epi16(h0, pair(packWeights(wa.w00, wa.w01), packWeights(wb.w00, wb.w01))),
+                                            _mm256_madd_epi16(h1, pair(packWeights(wa.w10, wa.w11), packWeights(wb.w10, wb.w11))) );
+            res = _mm256_srli_epi32( _mm256_add_epi32(res, _mm256_set1_epi32(WEIGHT_ROUND)), 2 * WEIGHT_BITS );
+            res = _mm256_packus_epi32(res, res);
+            res = _mm256_packus_epi16(res, res);
+            storePixel(out, (std::uint32_t) _mm_cvtsi128_si32(_mm256_castsi256_si128(res)));
+            storePixel(out + 3, (std::uint32_t) _mm_cvtsi128_si32(_mm256_extracti128_si256(res, 1)));
+        }
+        interpolateRowSSE41(src, coords, n - i, out);
+    }
+
+    /// Interpolates four pixels of a plane with SSE4.1, if they are all inside the image. Both neighbors in a row are loaded
+    /// at once, and blended by a multiply-add with their weights, as in blend().
+    /// @param[in] src source plane
+    /// @param[in] coords fixed point source coordinates of the pixels, interleaved as u, v
+    /// @param[out] out output pixels
+    /// @return false if a pixel or one of its neighbors is outside the image, and nothing was written
+    __attribute__((target("sse4.1")))
+    inline bool interpolatePlanePixelsSSE41(const Source& src, const std::int32_t* coords, std::uint8_t* out)
+    {
+        const __m128i c0 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) coords), _MM_SHUFFLE(3, 1, 2, 0));      //u0 u1 v0 v1
+        const __m128i c1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) (coords + 4)), _MM_SHUFFLE(3, 1, 2, 0));
+        const __m128i u = _mm_unpacklo_epi64(c0, c1), v = _mm_unpackhi_epi64(c0, c1);
+        const __m128i x = _mm_srai_epi32(u, FRAC_BITS), y = _mm_srai_epi32(v, FRAC_BITS);
+        const __m128i isInside = _mm_and_si128( _mm_and_si128(_mm_cmpgt_epi32(x, _mm_set1_epi32(-1)), _mm_cmpgt_epi32(y, _mm_set1_epi32(-1))),
+                                                _mm_and_si128(_mm_cmplt_epi32(x, _mm_set1_epi32(src.cols - 1)), _mm_cmplt_epi32(y, _mm_set1_epi32(src.rows - 1))) );
+        if (_mm_movemask_epi8(isInside) != 0xffff)
+        {
+            return false;
+        }
+        std::uint16_t row0[4], row1[4];     //each pixel with its right neighbor
+        for (int i = 0; i < 4; ++i)
+        {
+            const std::uint8_t* p0 = src.data + integerPart(coords[2 * i + 1]) * src.step + integerPart(coords[2 * i]);
+            std::memcpy(&row0[i], p0, 2);
+            std::memcpy(&row1[i], p0 + src.step, 2);
+        }
+        const __m128i h0 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*) row0));     //p00 p01 of each pixel, as 16 bit pairs
+        const __m128i h1 = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*) row1));
+        // The weights of the left & right neighbors, packed as 16 bit pairs, times the weights of the rows
+        const __m128i weightMask = _mm_set1_epi32(WEIGHT_ONE - 1);
+        const __m128i fx = _mm_and_si128(_mm_srli_epi32(u, FRAC_BITS - WEIGHT_BITS), weightMask);
+        const __m128i fy = _mm_and_si128(_mm_srli_epi32(v, FRAC_BITS - WEIGHT_BITS), weightMask);
+        const __m128i wx = _mm_or_si128(_mm_sub_epi32(_mm_set1_epi32(WEIGHT_ONE), fx), _mm_slli_epi32(fx, 16));
+        __m128i res = _mm_add_epi32( _mm_madd_epi16(h0, _mm_mullo_epi32(wx, _mm_sub_epi32(_mm_set1_epi32(WEIGHT_ONE), fy))),
+                                     _mm_madd_epi16(h1, _mm_mullo_epi32(wx, fy)) );
+        res = _mm_srli_epi32( _mm_add_epi32(res, _mm_set1_epi32(WEIGHT_ROUND)), 2 * WEIGHT_BITS );
+        res = _mm_packus_epi32(res, res);
+        res = _mm_packus_epi16(res, res);
+        const std::uint32_t pixels = (std::uint32_t) _mm_cvtsi128_si32(res);
+        std::memcpy(out, &pixels, 4);
+        return true;
+    }
+
+    /// SSE4.1 implementation of the row interpolation of a plane, four pixels at a time
+    __attribute__((target("sse4.1")))
+    void interpolatePlaneRowSSE41(const Source& src, const std::int32_t* coords, int n, std::uint8_t* out)
+    {
+        int i = 0;
+        for (; i + 4 <= n; i += 4, coords += 8, out += 4)
+        {
+            if (!interpolatePlanePixelsSSE41(src, coords, out))
+            {
+                interpolateRowScalar<1>(src, coords, 4, out);
+            }
+        }
+        interpolateRowScalar<1>(src, coords, n - i, out);
+    }
+
+    /// AVX2 implementation of the row interpolation of a plane, eight pixels at a time. The neighbors in each row are
+    /// gathered 4 bytes at a time, so the pixels need two more columns to their right than in interpolatePlanePixelsSSE41().
+    __attribute__((target("avx2")))
+    void interpolatePlaneRowAVX2(const Source& src, const std::int32_t* coords, int n, std::uint8_t* out)
+    {
+        const __m256i deinterleave = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+        // p00 p01 of each pixel as 16 bit pairs, from the 4 bytes gathered at p00
+        const __m256i neighbors = _mm256_setr_epi8(0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1,
+                                                   0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+        const __m256i weightMask = _mm256_set1_epi32(WEIGHT_ONE - 1);
+        const __m256i weightOne = _mm256_set1_epi32(WEIGHT_ONE);
+        int i = 0;
+        for (; i + 8 <= n; i += 8, coords += 16, out += 8)
+        {
+            const __m256i c0 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*) coords), deinterleave);    //u0-u3 v0-v3
+            const __m256i c1 = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*) (coords + 8)), deinterleave);
+            const __m256i u = _mm256_permute2x128_si256(c0, c1, 0x20), v = _mm256_permute2x128_si256(c0, c1, 0x31);
+            const __m256i x = _mm256_srai_epi32(u, FRAC_BITS), y = _mm256_srai_epi32(v, FRAC_BITS);
+            const __m256i isInside = _mm256_and_si256(
+                _mm256_and_si256(_mm256_cmpgt_epi32(x, _mm256_set1_epi32(-1)), _mm256_cmpgt_epi32(y, _mm256_set1_epi32(-1))),
+                _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(src.cols - 3), x), _mm256_cmpgt_epi32(_mm256_set1_epi32(src.rows - 1), y)) );
+            if (_mm256_movemask_epi8(isInside) != -1)
+            {
+                interpolatePlaneRowSSE41(src, coords, 8, out);
+                continue;
+            }
+            const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(y, _mm256_set1_epi32((std::int32_t) src.step)), x);
+            const __m256i h0 = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*) src.data, offset, 1), neighbors);
+            const __m256i h1 = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*) (src.data + src.step), offset, 1), neighbors);
+            const __m256i fx = _mm256_and_si256(_mm256_srli_epi32(u, FRAC_BITS - WEIGHT_BITS), weightMask);
+            const __m256i fy = _mm256_and_si256(_mm256_srli_epi32(v, FRAC_BITS - WEIGHT_BITS), weightMask);
+            const __m256i wx = _mm256_or_si256(_mm256_sub_epi32(weightOne, fx), _mm256_slli_epi32(fx, 16));
+            __m256i res = _mm256_add_epi32( _mm256_madd_epi16(h0, _mm256_mullo_epi32(wx, _mm256_sub_epi32(weightOne, fy))),
+                                            _mm256_madd_epi16(h1, _mm256_mullo_epi32(wx, fy)) );
+            res = _mm256_srli_epi32( _mm256_add_epi32(res, _mm256_set1_epi32(WEIGHT_ROUND)), 2 * WEIGHT_BITS );
+            res = _mm256_packus_epi32(res, res);
+            res = _mm256_packus_epi16(res, res);
+            const std::uint32_t pixels[2] = {(std::uint32_t) _mm_cvtsi128_si32(_mm256_castsi256_si128(res)),
+                                             (std::uint32_t) _mm_cvtsi128_si32(_mm256_extracti128_si256(res, 1))};
+            std::memcpy(out, pixels, 8);
+        }
+        interpolatePlaneRowSSE41(src, coords, n - i, out);
+    }
+#endif
+
+#ifdef WARP_HAS_NEON
+    /// NEON implementation of the row interpolation
+    void interpolateRowNEON(const Source& src, const std::int32_t* coords, int n, std::uint8_t* out)
+    {
+        const uint32x4_t round = vdupq_n_u32((std::uint32_t) WEIGHT_ROUND);
+        for (int i = 0; i < n; ++i, coords += 2, out += 3)
+        {
+            const int x = integerPart(coords[0]), y = integerPart(coords[1]);
+            if ( (i + 1 == n) || !isSimdInterior(src, x, y) )
+            {
+                interpolatePixel<3>(src, coords[0], coords[1], out);
+                continue;
+            }
+            const std::uint8_t* p0 = src.data + y * src.step + 3 * x;
+            const Weights w(coords[0], coords[1]);
+            const uint8x8_t r0 = vld1_u8(p0);                  //p00 in bytes 0-2, p01 in bytes 3-5
+            const uint8x8_t r1 = vld1_u8(p0 + src.step);
+            const uint16x4_t p00 = vget_low_u16(vmovl_u8(r0));
+            const uint16x4_t p01 = vget_low_u16(vmovl_u8(vext_u8(r0, r0, 3)));
+            const uint16x4_t p10 = vget_low_u16(vmovl_u8(r1));
+            const uint16x4_t p11 = vget_low_u16(vmovl_u8(vext_u8(r1, r1, 3)));
+            uint32x4_t res = vmlal_n_u16(round, p00, (std::uint16_t) w.w00);
+            res = vmlal_n_u16(res, p01, (std::uint16_t) w.w01);
+            res = vmlal_n_u16(res, p10, (std::uint16_t) w.w10);
+            res = vmlal_n_u16(res, p11, (std::uint16_t) w.w11);
+            res = vshrq_n_u32(res, 2 * WEIGHT_BITS);
+            const uint16x4_t res16 = vmovn_u32(res);
+            const uint8x8_t res8 = vmovn_u16(vcombine_u16(res16, res16));
+            storePixel(out, vget_lane_u32(vreinterpret_u32_u8(res8), 0));
+        }
+    }
+#endif
+
+    /// @return the row interpolation function for an instruction set
+    /// @param[in] isa instruction set
+    /// @param[in] channels number of channels of the images, 3 or 1
+    /// @throw std::invalid_argument if the instruction set is not supported on this cpu
+    RowFunction getRowFunction(WarpIsa isa, int channels)
+    {
+        if (!isWarpIsaSupported(isa))
+        {
+            throw std::invalid_argument("Warp kernel instruction set is not supported on this cpu");
+        }
+        if (channels == 1)
+        {
+            switch (isa)
+            {
+#ifdef WARP_HAS_X86
+                case WarpIsa::SSE41:
+                    return interpolatePlaneRowSSE41;
+                case WarpIsa::AVX2:
+                    return interpolatePlaneRowAVX2;
+#endif
+                default:
+                    return interpolateRowScalar<1>;     //NEON has no plane kernel, see hasWarpSimdKernel()
+            }
+        }
+        switch (isa)
+        {
+#ifdef WARP_HAS_X86
+            case WarpIsa::SSE41:
+                return interpolateRowSSE41;
+            case WarpIsa::AVX2:
+                return interpolateRowAVX2;
+#endif
+#ifdef WARP_HAS_NEON
+            case WarpIsa::NEON:
+                return interpolateRowNEON;
+#endif
+            default:
+                return interpolateRowScalar<3>;
+        }
+    }
+
+    /// @return a view of a BGR24 or single-channel image
+    /// @param[in] img image
+    /// @param[in] borderValue value of each channel outside the image
+    Source getSource(const cv::Mat& img, std::uint8_t borderValue)
+    {
+        if ( (img.type() != CV_8UC3) && (img.type() != CV_8UC1) )
+        {
+            throw std::invalid_argument("Warp kernels only support BGR24 images & single-channel planes");
+        }
+        return Source{img.data, img.step, img.cols, img.rows, {borderValue, borderValue, borderValue}};
+    }
+
+    /// Projects a point with the homogeneous coordinates (X, Y, W) to fixed point source coordinates
+    /// @return false if the point is at infinity or had to be clamped, i.e. nearby points cannot be interpolated from it
+    inline bool project(double X, double Y, double W, std::int32_t& u, std::int32_t& v)
+    {
+        if (W == 0.)
+        {
+            u = v = OUTSIDE;
+            return false;
+        }
+        const double iW = 1. / W;
+        const double x = X * iW, y = Y * iW;
+        const bool isInRange = (std::abs(x) < MAX_COORD) && (std::abs(y) < MAX_COORD);
+        u = cvRound( std::max(-MAX_COORD, std::min(MAX_COORD, x)) * (1 << FRAC_BITS) );
+        v = cvRound( std::max(-MAX_COORD, std::min(MAX_COORD, y)) * (1 << FRAC_BITS) );
+        return isInRange;
+    }
+
+    /// Calculates the source coordinates of a destination row. The coordinates are calculated exactly every SPAN pixels,
+    /// and linearly interpolated in between. Each span is also checked at its middle, where the interpolation is furthest
+    /// from the perspective curve, and spans that would be off by more than MAX_SPAN_ERROR are projected exactly pixel by
+    /// pixel. For the board perspectives this never happens, but it keeps strong perspectives as accurate as cv::warpPerspective.
+    /// @param[in] m transform from the destination pixels to the source pixels
+    /// @param[in] y destination row
+    /// @param[in] cols number of pixels in the row
+    /// @param[out] coords fixed point source coordinates, interleaved as u, v
+    void calculateRowCoords(const cv::Matx33d& m, int y, int cols, std::int32_t* coords)
+    {
+        // homogeneous source coordinates of the start of the span, stepped incrementally along the row
+        double X = m(0, 1) * y + m(0, 2), Y = m(1, 1) * y + m(1, 2), W = m(2, 1) * y + m(2, 2);
+        std::int32_t u0, v0;
+        bool isValid0 = project(X, Y, W, u0, v0);
+        for (int x0 = 0; x0 < cols; x0 += SPAN)
+        {
+            const double W0 = W;
+            X += m(0, 0) * SPAN;
+            Y += m(1, 0) * SPAN;
+            W += m(2, 0) * SPAN;
+            std::int32_t u1, v1;
+            const bool isValid1 = project(X, Y, W, u1, v1);
+            const int n = std::min(SPAN, cols - x0);
+            std::int32_t* spanCoords = coords + 2 * x0;
+            bool isLinear = false;
+            std::int32_t du = 0, dv = 0;
+            if ( isValid0 && isValid1 && ((W0 > 0) == (W > 0)) )
+            {
+                du = (u1 - u0) / SPAN;
+                dv = (v1 - v0) / SPAN;
+                std::int32_t um, vm;
+                const bool isValidM = project(X - m(0, 0) * (SPAN / 2), Y - m(1, 0) * (SPAN / 2), W - m(2, 0) * (SPAN / 2), um, vm);
+                isLinear = isValidM && (std::abs(u0 + (SPAN / 2) * du - um) <= MAX_SPAN_ERROR) && (std::abs(v0 + (SPAN / 2) * dv - vm) <= MAX_SPAN_ERROR);
+            }
+            if (isLinear)
+            {
+                for (int i = 0; i < n; ++i)
+                {
+                    spanCoords[2 * i] = u0 + i * du;
+                    spanCoords[2 * i + 1] = v0 + i * dv;
+                }
+            }
+            else
+            {
+                // The span is close to the horizon of the transform, or the perspective curves too much within it, so each pixel is projected exactly
+                for (int i = 0; i < n; ++i)
+                {
+                    const double x = x0 + i;
+                    project(m(0, 0) * x + m(0, 1) * y + m(0, 2), m(1, 0) * x + m(1, 1) * y + m(1, 2), m(2, 0) * x + m(2, 1) * y + m(2, 2),
+                            spanCoords[2 * i], spanCoords[2 * i + 1]);
+                }
+            }
+            u0 = u1;
+            v0 = v1;
+            isValid0 = isValid1;
+        }
+    }
+}   //::<anon>
+
+std::ostream& operator<<(std::ostream& stream, WarpIsa isa)
+{
+    switch (isa)
+    {
+        case WarpIsa::SCALAR:
+            return stream << "scalar";
+        case WarpIsa::SSE41:
+            return stream << "SSE4.1";
+        case WarpIsa::AVX2:
+            return stream << "AVX2";
+        case WarpIsa::NEON:
+            return stream << "NEON";
+    }
+    return stream << "unknown";
+}
+
+bool isWarpIsaSupported(WarpIsa isa)
+{
+    switch (isa)
+    {
+        case WarpIsa::SCALAR:
+            return true;
+#ifdef WARP_HAS_X86
+        case WarpIsa::SSE41:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.1");
+        case WarpIsa::AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+#ifdef WARP_HAS_NEON
+        case WarpIsa::NEON:
+            return true;    //the build targets NEON, so the cpu has it
+#endif
+        default:
+            return false;
+    }
+}
+
+bool hasWarpSimdKernel(WarpIsa isa, int type)
+{
+    switch (isa)
+    {
+        case WarpIsa::SSE41:
+        case WarpIsa::AVX2:
+            return (type == CV_8UC3) || (type == CV_8UC1);
+        case WarpIsa::NEON:
+            return (type == CV_8UC3);
+        default:
+            return false;
+    }
+}
+
+WarpIsa getBestWarpIsa()
+{
+    static const WarpIsa BEST_ISA = [](){
+        for (WarpIsa isa: {WarpIsa::AVX2, WarpIsa::SSE41, WarpIsa::NEON})
+        {
+            if (isWarpIsaSupported(isa))
+            {
+                return isa;
+            }
+        }
+        return WarpIsa::SCALAR;
+    }();
+    return BEST_ISA;
+}
+
+void warpPerspectiveBilinear(const cv::Mat& src, cv::Mat& dst, const cv::Matx33d& invTrfMatrix, int firstRow,
+                             std::uint8_t borderValue/*=0*/, WarpIsa isa/*=getBestWarpIsa()*/)
+{
+    const Source source = getSource(src, borderValue);
+    const RowFunction interpolateRow = getRowFunction(isa, src.channels());
+    assert(dst.type() == src.type());
+    thread_local std::vector<std::int32_t> coords;
+    coords.resize(2 * dst.cols);
+    for (int r = 0; r < dst.rows; ++r)
+    {
+        calculateRowCoords(invTrfMatrix, firstRow + r, dst.cols, coords.data());
+        interpolateRow(source, coords.data(), dst.cols, dst.ptr<std::uint8_t>(r));
+    }
+}
+
+void remapBilinear(const cv::Mat& src, cv::Mat& dst, const cv::Mat& coords, std::uint8_t borderValue/*=0*/, WarpIsa isa/*=getBestWarpIsa()*/)
+{
+    const Source source = getSource(src, borderValue);
+    const RowFunction interpolateRow = getRowFunction(isa, src.channels());
+    assert( (dst.type() == src.type()) && (coords.type() == CV_32SC2) && (coords.size() == dst.size()) );
+    for (int r = 0; r < dst.rows; ++r)
+    {
+        interpolateRow(source, coords.ptr<std::int32_t>(r), dst.cols, dst.ptr<std::uint8_t>(r));
+    }
+}
+
+cv::Mat toFixedPointCoords(const cv::Mat& map)
+{
+    assert(map.type() == CV_32FC2);
+    cv::Mat coords;
+    map.convertTo(coords, CV_32S, 1 << FRAC_BITS);     //rounds, and saturates coordinates far outside the image
+    return coords;
+}
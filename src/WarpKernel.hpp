@@ -0,0 +1,67 @@
+//
+//  WarpKernel.hpp
+//  zoomboard_server
+//
+//  Bilinear warp kernels for BGR24 images & single-channel planes, in fixed point, with SIMD variants chosen at runtime.
+//
+
+#ifndef WarpKernel_hpp
+#define WarpKernel_hpp
+
+#include <cstdint>
+#include <iosfwd>
+#include <opencv2/core.hpp>
+
+/// Instruction sets the warp kernels are implemented for
+enum class WarpIsa
+{
+    SCALAR,     ///< portable reference implementation
+    SSE41,      ///< x86 SSE4.1
+    AVX2,       ///< x86 AVX2
+    NEON        ///< ARM NEON
+};
+
+/// Prints the name of the instruction set
+std::ostream& operator<<(std::ostream& stream, WarpIsa isa);
+
+/// @return the fastest instruction set the warp kernels support on this cpu
+WarpIsa getBestWarpIsa();
+
+/// @return true if the warp kernels can use the given instruction set on this cpu
+/// @param[in] isa instruction set
+bool isWarpIsaSupported(WarpIsa isa);
+
+/// @return true if the warp kernels have a SIMD kernel of the given instruction set for an image type. Otherwise the
+/// instruction set falls back to the scalar kernel for that type, e.g. NEON for single-channel planes.
+/// @param[in] isa instruction set
+/// @param[in] type image type, CV_8UC3 or CV_8UC1
+bool hasWarpSimdKernel(WarpIsa isa, int type);
+
+/// Warps the rows of a BGR24 image or of a single image plane with a perspective transform, using bilinear interpolation.
+/// Pixels that map outside the source image are set to the border value, as in cv::warpPerspective with a constant border.
+/// The source coordinates are stepped incrementally along each row, with an exact division every few pixels only,
+/// and the interpolation is in fixed point, so all instruction sets give the same result bit-for-bit.
+/// @param[in] src source image, CV_8UC3 or CV_8UC1
+/// @param[in, out] dst preallocated destination rows, same type as src; this can be a band of the full destination image
+/// @param[in] invTrfMatrix transform from the destination pixels to the source pixels, i.e. the inverse of the perspective transform
+/// @param[in] firstRow row of the full destination image that the first row of dst corresponds to
+/// @param[in] borderValue value of each channel outside the source image, e.g. 0 for black BGR or luma, 128 for neutral chroma
+/// @param[in] isa instruction set to use, should be supported by this cpu
+void warpPerspectiveBilinear(const cv::Mat& src, cv::Mat& dst, const cv::Matx33d& invTrfMatrix, int firstRow,
+                             std::uint8_t borderValue=0, WarpIsa isa=getBestWarpIsa());
+
+/// Warps the rows of a BGR24 image or of a single image plane using precomputed source coordinates, with bilinear interpolation.
+/// Pixels that map outside the source image are set to the border value.
+/// @param[in] src source image, CV_8UC3 or CV_8UC1
+/// @param[in, out] dst preallocated destination rows, same type as src; this can be a band of the full destination image
+/// @param[in] coords source coordinates of each destination pixel in 16.16 fixed point, CV_32SC2, same size as dst
+/// @param[in] borderValue value of each channel outside the source image
+/// @param[in] isa instruction set to use, should be supported by this cpu
+void remapBilinear(const cv::Mat& src, cv::Mat& dst, const cv::Mat& coords, std::uint8_t borderValue=0, WarpIsa isa=getBestWarpIsa());
+
+/// Converts source coordinates to the 16.16 fixed point format used by remapBilinear
+/// @param[in] map source coordinates of each destination pixel, CV_32FC2
+/// @return source coordinates in 16.16 fixed point, CV_32SC2
+cv::Mat toFixedPointCoords(const cv::Mat& map);
+
+#endif /* WarpKernel_hpp */
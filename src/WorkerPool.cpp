@@ -0,0 +1,170 @@
+//
+//  WorkerPool.cpp
+//  zoomboard_server
+//
+//  Thread pool that splits a job into tasks that run in parallel, e.g. to warp a frame in bands.
+//
+
+#include "WorkerPool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <log4cxx/logger.h>
+#include <log4cxx/mdc.h>
+
+namespace
+{
+    // Initialize logger
+    log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd.workers"));
+}   //::<anon>
+
+/// @class A job that is split into tasks
+class WorkerPool::Job
+{
+private:
+    const std::function<void(int)> task_;   ///< function that runs a task
+    const int nTasks_;                      ///< number of tasks
+    std::atomic_int nextTask_;              ///< index of the next task to hand out
+    std::mutex mutex_;                      ///< guards the completion count & error
+    std::condition_variable cv_;            ///< signals when all tasks are complete
+    int nDone_;                             ///< number of completed tasks
+    std::exception_ptr pErr_;               ///< first error thrown by a task
+public:
+    /// Ctor
+    /// @param[in] nTasks number of tasks
+    /// @param[in] task function that runs a task
+    Job(int nTasks, const std::function<void(int)>& task):
+    task_(task),
+    nTasks_(nTasks),
+    nextTask_(0),
+    mutex_(),
+    cv_(),
+    nDone_(0),
+    pErr_(nullptr)
+    {
+    }
+
+    /// Runs tasks until all tasks are handed out
+    void work()
+    {
+        for (int i = nextTask_++; i < nTasks_; i = nextTask_++)
+        {
+            std::exception_ptr pErr = nullptr;
+            try
+            {
+                task_(i);
+            }
+            catch (...)
+            {
+                pErr = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lk(mutex_);
+            if (pErr && !pErr_)
+            {
+                pErr_ = pErr;
+            }
+            if (++nDone_ == nTasks_)
+            {
+                cv_.notify_all();
+            }
+        }
+    }
+
+    /// Waits until all tasks are complete
+    /// @throw the first exception thrown by a task
+    void wait()
+    {
+        std::unique_lock<std::mutex> lk(mutex_);
+        cv_.wait(lk, [this](){return nDone_ >= nTasks_;});
+        if (pErr_)
+        {
+            std::rethrow_exception(pErr_);
+        }
+    }
+};  //::WorkerPool::Job
+
+WorkerPool::WorkerPool(int nThreads):
+mutex_(),
+cv_(),
+jobs_(),
+doStop_(false),
+threads_()
+{
+    // The thread that runs a job also works on it, so one less background thread is needed
+    for (int i = 1; i < nThreads; ++i)
+    {
+        threads_.emplace_back(&WorkerPool::work, this);
+    }
+    LOG4CXX_DEBUG(logger, "Started worker pool with " << size() << " threads");
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        doStop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread: threads_)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+}
+
+int WorkerPool::size() const noexcept
+{
+    return (int) threads_.size() + 1;
+}
+
+void WorkerPool::run(int nTasks, const std::function<void(int)>& task)
+{
+    if (nTasks <= 0)
+    {
+        return;
+    }
+    auto pJob = std::make_shared<Job>(nTasks, task);
+    if (nTasks > 1 && !threads_.empty())
+    {
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            jobs_.push_back(pJob);
+        }
+        cv_.notify_all();
+    }
+    pJob->work();
+    remove(pJob);
+    pJob->wait();
+}
+
+void WorkerPool::work()
+{
+    log4cxx::MDC::put("threadname", "worker");
+    while (true)
+    {
+        std::shared_ptr<Job> pJob;
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            cv_.wait(lk, [this](){return doStop_ || !jobs_.empty();});
+            if (doStop_)
+            {
+                break;
+            }
+            pJob = jobs_.front();
+        }
+        pJob->work();
+        remove(pJob);
+    }
+}
+
+void WorkerPool::remove(const std::shared_ptr<Job>& pJob)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto it = std::find(jobs_.begin(), jobs_.end(), pJob);
+    if (it != jobs_.end())
+    {
+        jobs_.erase(it);
+    }
+}
@@ -0,0 +1,61 @@
+//
+//  WorkerPool.hpp
+//  zoomboard_server
+//
+//  Thread pool that splits a job into tasks that run in parallel, e.g. to warp a frame in bands.
+//
+
+#ifndef WorkerPool_hpp
+#define WorkerPool_hpp
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// @class Pool of worker threads that split a job, such as warping a frame, into tasks that run in parallel.
+/// Several threads can run jobs on the same pool at the same time; the tasks of each job are handed out in order
+/// to whichever thread is free, and the thread that runs a job also works on its tasks while it waits.
+class WorkerPool
+{
+public:
+    /// Ctor
+    /// @param[in] nThreads number of threads that work on each job, including the thread that calls run().
+    /// If this is 1 or less, all tasks are run on the calling thread.
+    explicit WorkerPool(int nThreads);
+
+    /// Dtor, waits for the worker threads to finish
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /// @return number of threads that work on each job, including the calling thread
+    int size() const noexcept;
+
+    /// Runs a job, and returns when all of its tasks are complete
+    /// @param[in] nTasks number of tasks in the job
+    /// @param[in] task function that runs a task, called with the task index in [0, nTasks)
+    /// @throw the first exception thrown by a task, after all tasks are complete
+    void run(int nTasks, const std::function<void(int)>& task);
+
+private:
+    class Job;
+    mutable std::mutex mutex_;                      ///< guards the job queue
+    std::condition_variable cv_;                    ///< signals new jobs or stop to the workers
+    std::deque< std::shared_ptr<Job> > jobs_;       ///< jobs that still have tasks to hand out
+    bool doStop_;                                   ///< set to true to stop the workers
+    std::vector<std::thread> threads_;              ///< worker threads
+
+    /// Worker thread loop
+    void work();
+
+    /// Removes a job from the queue once all of its tasks have been handed out
+    /// @param[in] pJob job to remove
+    void remove(const std::shared_ptr<Job>& pJob);
+};  //::WorkerPool
+
+#endif /* WorkerPool_hpp */
@@ -0,0 +1,162 @@
+//
+//  bench_frame_bus.cxx
+//  zoomboard_server
+//
+//  Measures how much slow consumers stall the producer of a frame bus, with lossless & latest subscriptions.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <log4cxx/logger.h>
+#include <log4cxx/basicconfigurator.h>
+#include <boost/program_options.hpp>
+#include "ThreadsafeFrame.hpp"
+
+namespace
+{
+    namespace bpo = ::boost::program_options;
+    typedef std::chrono::steady_clock Clock;
+
+    /// @class Parameters of a benchmark run
+    struct BenchOptions
+    {
+        int width;                  ///< frame width
+        int height;                 ///< frame height
+        int nFrames;                ///< number of frames the producer publishes
+        double fps;                 ///< rate the producer publishes frames at
+        double consumerTime;        ///< time each consumer spends on a frame, in ms
+        std::size_t capacity;       ///< queue capacity of each subscription
+    };
+
+    /// @class Results of a benchmark run
+    struct BenchResult
+    {
+        double meanStall;           ///< mean time the producer spent publishing a frame, in ms
+        double maxStall;            ///< longest time the producer spent publishing a frame, in ms
+        double totalStall;          ///< total time the producer spent publishing, in ms
+        std::uint64_t nDropped;     ///< number of frames dropped across all subscriptions
+        std::uint64_t nPopped;      ///< number of frames consumed across all subscriptions
+    };
+
+    /// Publishes frames to a bus with a number of slow consumers
+    /// @param[in] opts benchmark parameters
+    /// @param[in] nConsumers number of consumers
+    /// @param[in] policy queue policy of the consumers
+    /// @return producer stall & dropped frame counts
+    BenchResult run(const BenchOptions& opts, int nConsumers, avtools::ThreadsafeFrame::QueuePolicy policy)
+    {
+        auto pBus = avtools::ThreadsafeFrame::Get(opts.width, opts.height, AV_PIX_FMT_BGR24, avtools::TimeBaseType{1, 1000});
+        std::vector< std::shared_ptr<avtools::ThreadsafeFrame::Subscription> > subs;
+        std::vector<std::thread> consumers;
+        for (int i = 0; i < nConsumers; ++i)
+        {
+            subs.push_back(pBus->subscribe(opts.capacity, policy));
+            auto pSub = subs.back();
+            const auto consumerTime = std::chrono::microseconds((long long) (1000. * opts.consumerTime));
+            consumers.emplace_back([pSub, consumerTime](){
+                std::uint64_t seq = 0;
+                while (pSub->pop(seq))
+                {
+                    std::this_thread::sleep_for(consumerTime);  //a slow consumer, e.g. an encoder, holding on to the frame
+                }
+                pSub->cancel();
+            });
+        }
+
+        BenchResult result{0., 0., 0., 0, 0};
+        const auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1. / opts.fps));
+        auto next = Clock::now();
+        for (int i = 0; i < opts.nFrames; ++i)
+        {
+            std::this_thread::sleep_until(next);
+            next += interval;
+            const auto start = Clock::now();
+            avtools::Frame& frame = pBus->getWritableFrame();
+            std::memset(frame->data[0], i & 0xFF, frame->linesize[0]);  //touch the frame, as a decoder would
+            frame->pts = (std::int64_t) (1000. * i / opts.fps);
+            pBus->publish();
+            const double stall = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            result.totalStall += stall;
+            result.maxStall = std::max(result.maxStall, stall);
+        }
+        pBus->close();
+        for (auto& consumer: consumers)
+        {
+            consumer.join();
+        }
+        result.meanStall = result.totalStall / std::max(1, opts.nFrames);
+        for (const auto& pSub: subs)
+        {
+            const auto stats = pSub->stats();
+            result.nDropped += stats.nDropped;
+            result.nPopped += stats.nPopped;
+        }
+        return result;
+    }
+}   //::<anon>
+
+int main(int argc, const char * argv[])
+{
+    log4cxx::BasicConfigurator::configure();
+    log4cxx::Logger::getRootLogger()->setLevel(log4cxx::Level::getWarn());
+
+    BenchOptions opts;
+    int maxConsumers;
+    bpo::options_description programDesc("Usage: bench_frame_bus [options]");
+    programDesc.add_options()
+    ("help,h", "produce help message")
+    ("width", bpo::value<int>(&opts.width)->default_value(1920), "frame width")
+    ("height", bpo::value<int>(&opts.height)->default_value(1080), "frame height")
+    ("frames,n", bpo::value<int>(&opts.nFrames)->default_value(300), "number of frames to publish for each run")
+    ("fps,f", bpo::value<double>(&opts.fps)->default_value(30.), "rate the producer publishes frames at")
+    ("consumer_ms,c", bpo::value<double>(&opts.consumerTime)->default_value(50.), "time each consumer spends on a frame, in ms")
+    ("queue_size,q", bpo::value<std::size_t>(&opts.capacity)->default_value(2), "queue capacity of each subscription")
+    ("max_consumers,m", bpo::value<int>(&maxConsumers)->default_value(8), "largest number of consumers to run with")
+    ;
+    bpo::variables_map vm;
+    try
+    {
+        bpo::store(bpo::parse_command_line(argc, argv, programDesc), vm);
+        bpo::notify(vm);
+    }
+    catch (std::exception& err)
+    {
+        std::cerr << err.what() << "\n" << programDesc << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (vm.count("help"))
+    {
+        std::cout << programDesc << std::endl;
+        return EXIT_SUCCESS;
+    }
+    if ( (opts.nFrames < 1) || (opts.fps <= 0.) || (opts.capacity < 1) || (maxConsumers < 1) )
+    {
+        std::cerr << "Frames, fps, queue size and consumers should be positive." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << opts.nFrames << " frames of " << opts.width << "x" << opts.height << " at " << opts.fps << " fps, consumers take "
+        << opts.consumerTime << " ms per frame, queue size " << opts.capacity << "\n"
+        << std::setw(10) << "policy" << std::setw(11) << "consumers" << std::setw(16) << "mean stall ms" << std::setw(15) << "max stall ms"
+        << std::setw(17) << "total stall ms" << std::setw(10) << "dropped" << std::setw(10) << "popped" << std::endl;
+    for (const auto policy: {avtools::ThreadsafeFrame::QueuePolicy::LOSSLESS, avtools::ThreadsafeFrame::QueuePolicy::LATEST})
+    {
+        for (int nConsumers = 1; nConsumers <= maxConsumers; nConsumers *= 2)
+        {
+            const BenchResult result = run(opts, nConsumers, policy);
+            std::cout << std::setw(10) << (policy == avtools::ThreadsafeFrame::QueuePolicy::LOSSLESS ? "lossless" : "latest")
+                << std::setw(11) << nConsumers << std::fixed << std::setprecision(3) << std::setw(16) << result.meanStall
+                << std::setw(15) << result.maxStall << std::setw(17) << result.totalStall << std::setw(10) << result.nDropped
+                << std::setw(10) << result.nPopped << std::endl;
+        }
+    }
+    return EXIT_SUCCESS;
+}
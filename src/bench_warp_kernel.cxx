@@ -0,0 +1,121 @@
+//
+//  bench_warp_kernel.cxx
+//  zoomboard_server
+//
+//  Times the warp kernels of each instruction set against cv::warpPerspective, on a board-like perspective.
+//  cv::warpPerspective is timed both with bilinear interpolation, which the kernels reproduce, and with Lanczos interpolation.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "WarpKernel.hpp"
+
+namespace
+{
+    namespace bpo = ::boost::program_options;
+    typedef std::chrono::steady_clock Clock;
+
+    /// Times a function
+    /// @param[in] fn function to time
+    /// @param[in] nIterations number of times to call it, after a warm-up call
+    /// @return mean time per call, in ms
+    double timeIt(const std::function<void()>& fn, int nIterations)
+    {
+        fn();   //warm up the caches & allocations
+        const auto start = Clock::now();
+        for (int i = 0; i < nIterations; ++i)
+        {
+            fn();
+        }
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count() / nIterations;
+    }
+
+    /// @return a transform from the destination pixels to the source pixels, similar to a board seen slightly from the side
+    /// @param[in] size image size
+    cv::Matx33d boardTransform(cv::Size size)
+    {
+        const float w = (float) size.width, h = (float) size.height;
+        const std::vector<cv::Point2f> dstCorners = {cv::Point2f(0, 0), cv::Point2f(w, 0), cv::Point2f(w, h), cv::Point2f(0, h)};
+        const std::vector<cv::Point2f> srcCorners = {cv::Point2f(0.08f * w, 0.12f * h), cv::Point2f(0.95f * w, 0.05f * h),
+                                                     cv::Point2f(0.9f * w, 0.97f * h), cv::Point2f(0.04f * w, 0.85f * h)};
+        return cv::Matx33d(cv::getPerspectiveTransform(dstCorners, srcCorners));
+    }
+}   //::<anon>
+
+int main(int argc, const char * argv[])
+{
+    int width, height, nIterations;
+    bpo::options_description programDesc("Usage: bench_warp_kernel [options]");
+    programDesc.add_options()
+    ("help,h", "produce help message")
+    ("width", bpo::value<int>(&width)->default_value(1920), "image width")
+    ("height", bpo::value<int>(&height)->default_value(1080), "image height")
+    ("iterations,n", bpo::value<int>(&nIterations)->default_value(50), "number of warps to time for each kernel")
+    ;
+    bpo::variables_map vm;
+    try
+    {
+        bpo::store(bpo::parse_command_line(argc, argv, programDesc), vm);
+        bpo::notify(vm);
+    }
+    catch (std::exception& err)
+    {
+        std::cerr << err.what() << "\n" << programDesc << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (vm.count("help"))
+    {
+        std::cout << programDesc << std::endl;
+        return EXIT_SUCCESS;
+    }
+    if ( (width < 1) || (height < 1) || (nIterations < 1) )
+    {
+        std::cerr << "Width, height and iterations should be positive." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    cv::setNumThreads(1);   //the server splits the warp into bands on its own threads, so the kernels are compared on one thread
+    const cv::Size size(width, height);
+    const cv::Matx33d invTrf = boardTransform(size);
+    cv::RNG rng(0x5eed);
+    std::cout << "Mean time per " << width << "x" << height << " warp on one thread over " << nIterations << " iterations, in ms\n"
+        << std::setw(8) << "image" << std::setw(32) << "kernel" << std::setw(10) << "ms" << std::setw(10) << "speedup" << std::endl;
+    for (const int type: {CV_8UC3, CV_8UC1})
+    {
+        cv::Mat src(size, type), dst(size, type);
+        rng.fill(src, cv::RNG::UNIFORM, 0, 256);
+        const char* typeName = (type == CV_8UC3 ? "BGR24" : "plane");
+        const double opencvTime = timeIt([&](){
+            cv::warpPerspective(src, dst, invTrf, size, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+        }, nIterations);
+        const double lanczosTime = timeIt([&](){
+            cv::warpPerspective(src, dst, invTrf, size, cv::INTER_LANCZOS4 | cv::WARP_INVERSE_MAP, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+        }, nIterations);
+        std::cout << std::fixed << std::setprecision(2) << std::setw(8) << typeName << std::setw(32) << "cv::warpPerspective"
+            << std::setw(10) << opencvTime << std::setw(10) << 1. << std::endl
+            << std::setw(8) << typeName << std::setw(32) << "cv::warpPerspective LANCZOS4"
+            << std::setw(10) << lanczosTime << std::setw(10) << opencvTime / lanczosTime << std::endl;
+        for (const WarpIsa isa: {WarpIsa::SCALAR, WarpIsa::SSE41, WarpIsa::AVX2, WarpIsa::NEON})
+        {
+            if (!isWarpIsaSupported(isa))
+            {
+                continue;
+            }
+            const double time = timeIt([&](){
+                warpPerspectiveBilinear(src, dst, invTrf, 0, 0, isa);
+            }, nIterations);
+            std::ostringstream name;
+            name << isa << ( (isa != WarpIsa::SCALAR) && !hasWarpSimdKernel(isa, type) ? " (scalar-only)" : "" );
+            std::cout << std::setw(8) << typeName << std::setw(32) << name.str() << std::setw(10) << time << std::setw(10) << opencvTime / time << std::endl;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -5,24 +5,56 @@
 //  Created by Ender Tekin on 8/7/19.
 //
 
-//#include "correct_perspective.hpp"
+#include "correct_perspective.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ostream>
 #include <vector>
+#ifdef __gnu_linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 #include <log4cxx/logger.h>
 #ifndef NDEBUG
 #include <opencv2/highgui.hpp>
 #endif
 #include "opencv2/imgproc.hpp"
-#include "opencv2/aruco.hpp"
+#include "opencv2/calib3d.hpp"
+#include "common.hpp"
+#include "BoardFinder.hpp"
 #include "libav2opencv.hpp"
 #include "ThreadManager.hpp"
 #include "ThreadsafeFrame.hpp"
+#include "WarpKernel.hpp"
+#include "WorkerPool.hpp"
 
 extern ThreadManager g_ThreadMan;
 
 namespace
 {
     static const cv::Scalar BORDER_COLOR = cv::Scalar(0,0,255);
-    static constexpr float MAX_MARKER_MOVEMENT = 16.f;
+    static constexpr float MAX_MARKER_MOVEMENT = 16.f;             ///< a marker that moves further than this, in pixels, jumps to its new location
+    static constexpr float CORNER_SMOOTHING = 0.25f;               ///< weight of each new measurement of the marker corners
+    static constexpr float CORNER_NOISE = 1.5f;                    ///< largest move of a corner, in pixels, that is taken as detection noise
+    static constexpr int MAX_OUTLIER_RUN = 3;                      ///< a marker that is off by more than the noise this many times in a row has moved
+    static constexpr float TRANSFORM_UPDATE_BUDGET = 0.5f;         ///< smallest mean move of the smoothed corners, in pixels, that changes the transform
+    static constexpr std::size_t WARP_BAND_BYTES = 256 * 1024;     ///< memory touched by each warp band, sized to fit in L2
+    static constexpr int MIN_WARP_BAND_ROWS = 8;                   ///< minimum number of rows in a warp band
+    static constexpr std::uint8_t LUMA_BLACK = 16;                 ///< luma of black in yuv420p, which has limited range
+    static constexpr std::uint8_t CHROMA_NEUTRAL = 128;            ///< chroma of black & gray in yuv420p
+    static constexpr std::chrono::milliseconds MIN_DETECTION_INTERVAL{100};    ///< time between marker detections after the board moves
+    static constexpr std::chrono::milliseconds MAX_DETECTION_INTERVAL{1000};   ///< time between marker detections once the board is still
+    static constexpr int DETECTOR_NICENESS = 10;                   ///< scheduling priority of the marker detector, lower than the warpers & writers
+    static constexpr int MIN_FIT_MARKERS = 3;                      ///< fewest markers the transform is estimated from when some are hidden
+    static constexpr double MAX_FIT_ERROR = 3.;                    ///< largest distance of a corner from the board model, in pixels, to count as an inlier
+    static constexpr double MIN_FIT_INLIER_RATE = 0.75;            ///< fraction of the visible corners that should fit the board model
+    static constexpr std::chrono::seconds STATE_SAVE_INTERVAL{10}; ///< shortest time between saves of the transform to the state file
 
     // Initialize logger
     log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd.perspective"));
@@ -80,85 +112,6 @@ namespace
         }
     }
 
-    class BoardFinder
-    {
-    private:
-        std::vector< std::vector<cv::Point2f> > corners_;   ///< detected corners of the markers
-        std::vector<int> ids_;                              ///< id's of the detected markers
-        cv::Mat cameraMatrix_;                              ///< camera matrix
-        cv::Mat distCoeffs_;                                ///< distortion coefficients
-        cv::Ptr<cv::aruco::Dictionary> pDict_;              ///< pointer to the dictionary of aruco markers
-
-    public:
-
-        BoardFinder(const std::string& calibrationFile):
-        pDict_(nullptr)
-        {
-            corners_.reserve(16);
-            ids_.reserve(4);
-            cv::Mat markers;
-            int markerSz=0;
-            try
-            {
-                cv::FileStorage fs(calibrationFile, cv::FileStorage::READ);
-                fs["markers"] >> markers;
-                fs["marker_size"] >> markerSz;
-                if ( !fs["camera_matrix"].empty() )
-                {
-                    LOG4CXX_DEBUG(logger, "Initializing camera matrix");
-                    fs["camera_matrix"] >> cameraMatrix_;
-                }
-                else
-                {
-                    assert(cameraMatrix_.empty());
-                }
-                if ( !fs["distortion_coefficients"].empty() )
-                {
-                    fs["distortion_coefficients"] >> distCoeffs_;
-                }
-                else
-                {
-                    assert(distCoeffs_.empty());
-                }
-            }
-            catch (std::exception& err)
-            {
-                std::throw_with_nested( std::runtime_error("Unable to read calibration information from " + calibrationFile) );
-            }
-            assert( !markers.empty() && (markerSz > 0) );
-            pDict_ = cv::makePtr<cv::aruco::Dictionary>(markers, markerSz);
-        }
-
-        /// Finds and returns the corners of the aruco markers seen in the image
-        /// @param[in] img input image to search for markers
-        /// @return a vector of markers
-        /// There should be 4 markers, and the returned vector _corners_ is always of size 4
-        /// The markers are sorted such that _corners_[i] always corresponds to the i'th marker.
-        /// If a marker i is not visible, than _corners_[i] is empty.
-        std::vector< std::vector<cv::Point2f> > getCorners(const cv::Mat& img)
-        {
-            //Find markers
-            corners_.clear();
-            ids_.clear();
-            // detect markers
-            cv::aruco::detectMarkers(img, pDict_, corners_, ids_,
-                                     cv::aruco::DetectorParameters::create(), cv::noArray(),
-                                     cameraMatrix_.empty() ? cv::noArray() : cameraMatrix_,
-                                     distCoeffs_.empty() ? cv::noArray() : distCoeffs_
-                                     );
-
-            /// Sort markers
-            std::vector< std::vector<cv::Point2f> > sortedCorners(4);
-            int nMarkersFound = (int) corners_.size();
-            assert(nMarkersFound == ids_.size());
-            for (int n = 0; n < nMarkersFound; ++n)
-            {
-                sortedCorners[ids_[n]] = corners_[n];
-            }
-            return sortedCorners;
-        }
-    };  // BoardFinder
-
     /// Returns the relevant outer corners of the markers.
     /// @param[in] corners detected marker corners
     /// Assumes that the markers are ordered in terms of id (i.e., corners[i] are the corners for marker with id i).
@@ -265,91 +218,968 @@ namespace
         LOG4CXX_DEBUG(logger, "Calculated motion: " << motion);
         return motion;
     }
+
+    /// Smooths the marker corners over time, so that detection noise (e.g. under changing lighting) does not keep moving the transform.
+    /// Each corner moves towards its new measurement by CORNER_SMOOTHING of the difference, which is clipped to CORNER_NOISE pixels,
+    /// so that a single bad measurement has little effect. A marker that moves by more than MAX_MARKER_MOVEMENT, or is off by more
+    /// than CORNER_NOISE for MAX_OUTLIER_RUN measurements in a row, has really moved, and jumps to its measured corners.
+    class CornerFilter
+    {
+    private:
+        std::vector< std::vector<cv::Point2f> > corners_;   ///< smoothed corners of each marker, empty if the marker is not visible
+        std::vector<int> outlierRuns_;                      ///< number of measurements in a row each marker is off by more than the noise
+        std::size_t nJumps_;                                ///< number of times a marker jumped to its measured corners
+
+    public:
+        /// Ctor
+        CornerFilter():
+        corners_(4),
+        outlierRuns_(4, 0),
+        nJumps_(0)
+        {
+        }
+
+        /// Updates the smoothed corners with a new measurement
+        /// @param[in] measured measured corners of the markers, sorted by id, empty for markers that are not visible
+        /// @return smoothed corners of the markers, empty for markers that are not visible
+        const std::vector< std::vector<cv::Point2f> >& update(const std::vector< std::vector<cv::Point2f> >& measured)
+        {
+            assert(measured.size() == 4);
+            for (int i = 0; i < 4; ++i)
+            {
+                if (measured[i].empty() || corners_[i].empty())
+                {
+                    corners_[i] = measured[i];
+                    outlierRuns_[i] = 0;
+                    continue;
+                }
+                assert( (measured[i].size() == 4) && (corners_[i].size() == 4) );
+                float distance = 0.f;
+                for (int j = 0; j < 4; ++j)
+                {
+                    distance += 0.25f * (float) cv::norm(measured[i][j] - corners_[i][j]);
+                }
+                outlierRuns_[i] = (distance > CORNER_NOISE ? outlierRuns_[i] + 1 : 0);
+                if ( (distance > MAX_MARKER_MOVEMENT) || (outlierRuns_[i] >= MAX_OUTLIER_RUN) )
+                {
+                    corners_[i] = measured[i];
+                    outlierRuns_[i] = 0;
+                    ++nJumps_;
+                    continue;
+                }
+                for (int j = 0; j < 4; ++j)
+                {
+                    cv::Point2f d = measured[i][j] - corners_[i][j];
+                    const float norm = (float) cv::norm(d);
+                    if (norm > CORNER_NOISE)
+                    {
+                        d *= CORNER_NOISE / norm;
+                    }
+                    corners_[i][j] += CORNER_SMOOTHING * d;
+                }
+            }
+            return corners_;
+        }
+
+        /// @return number of times a marker jumped to its measured corners
+        inline std::size_t jumps() const {return nJumps_;}
+    };  //::<anon>::CornerFilter
+
+    /// Removes the lens distortion from the marker corners
+    /// @param[in] corners corners in the captured image
+    /// @param[in] cameraMatrix camera matrix, or an empty matrix if the corners should not be changed
+    /// @param[in] distCoeffs lens distortion coefficients
+    /// @return corners in the undistorted image
+    std::vector<cv::Point2f> undistortCorners(const std::vector<cv::Point2f>& corners, const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs)
+    {
+        if (cameraMatrix.empty() || corners.empty())
+        {
+            return corners;
+        }
+        std::vector<cv::Point2f> undistorted;
+        cv::undistortPoints(corners, undistorted, cameraMatrix, distCoeffs, cv::noArray(), cameraMatrix);
+        return undistorted;
+    }
+
+    /// Perspective transform last calculated from all 4 markers, which is saved so that the stream is corrected from its first frame
+    /// after a restart
+    struct TransformState
+    {
+        cv::Mat_<double> trfMatrix;                         ///< perspective transform matrix for the undistorted image, empty if none
+        std::vector< std::vector<cv::Point2f> > corners;    ///< corners of the 4 markers the transform is calculated from, sorted by id
+        cv::Size imgSize;                                   ///< size of the images the transform is calculated for
+    };  //::<anon>::TransformState
+
+    /// Reads the saved transform
+    /// @param[in] stateFile file the transform is saved to, or an empty string if it is not saved
+    /// @param[in] imgSize size of the images the transform should be for
+    /// @param[out] state saved transform
+    /// @return true if a transform for the image size was read, false if there is none or it cannot be read
+    bool loadTransformState(const std::string& stateFile, const cv::Size& imgSize, TransformState& state)
+    {
+        if (stateFile.empty())
+        {
+            return false;
+        }
+        try
+        {
+            cv::FileStorage fs(stateFile, cv::FileStorage::READ);
+            if (!fs.isOpened())
+            {
+                LOG4CXX_DEBUG(logger, "No saved transform found at " << stateFile);
+                return false;
+            }
+            cv::Mat trfMatrix, corners;
+            int width = 0, height = 0;
+            fs["image_width"] >> width;
+            fs["image_height"] >> height;
+            fs["transform"] >> trfMatrix;
+            fs["corners"] >> corners;
+            if ( (cv::Size(width, height) != imgSize) || (trfMatrix.size() != cv::Size(3, 3)) || (corners.total() != 16) || (corners.type() != CV_32FC2) )
+            {
+                LOG4CXX_WARN(logger, "Ignoring the saved transform in " << stateFile << ", it is not for " << imgSize.width << "x" << imgSize.height << " images");
+                return false;
+            }
+            state.trfMatrix = cv::Mat_<double>(trfMatrix);
+            state.imgSize = imgSize;
+            state.corners.assign(4, std::vector<cv::Point2f>());
+            const cv::Point2f* pCorners = corners.ptr<cv::Point2f>();   //read from a file, so continuous
+            for (int i = 0; i < 4; ++i)
+            {
+                state.corners[i].assign(pCorners + 4 * i, pCorners + 4 * (i + 1));
+            }
+            return true;
+        }
+        catch (std::exception& err)
+        {
+            LOG4CXX_WARN(logger, "Unable to read the saved transform from " << stateFile << ": " << err.what());
+            return false;
+        }
+    }
+
+    /// Saves the transform. It is written to a temporary file first, so that a crash does not leave a partial file behind.
+    /// @param[in] stateFile file to save the transform to, or an empty string if it should not be saved
+    /// @param[in] state transform to save
+    void saveTransformState(const std::string& stateFile, const TransformState& state)
+    {
+        if (stateFile.empty() || state.trfMatrix.empty())
+        {
+            return;
+        }
+        assert(state.corners.size() == 4);
+        const std::string tmpFile = stateFile + ".tmp";
+        try
+        {
+            std::vector<cv::Point2f> corners;
+            for (const auto& markerCorners: state.corners)
+            {
+                assert(markerCorners.size() == 4);
+                corners.insert(corners.end(), markerCorners.begin(), markerCorners.end());
+            }
+            {
+                cv::FileStorage fs(tmpFile, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_JSON);
+                fs << "image_width" << state.imgSize.width;
+                fs << "image_height" << state.imgSize.height;
+                fs << "transform" << state.trfMatrix;
+                fs << "corners" << cv::Mat(corners);
+            }
+            if (std::rename(tmpFile.c_str(), stateFile.c_str()) != 0)
+            {
+                throw std::runtime_error(std::strerror(errno));
+            }
+            LOG4CXX_DEBUG(logger, "Saved the transform to " << stateFile);
+        }
+        catch (std::exception& err)
+        {
+            LOG4CXX_WARN(logger, "Unable to save the transform to " << stateFile << ": " << err.what());
+        }
+    }
+
+    /// Locations of the corners of all markers in the corrected image, learned the last time all 4 markers were seen.
+    /// The perspective transform can then be estimated from any 3 markers, e.g. while the presenter stands in front of the 4th one,
+    /// by a robust fit of all their corners to their known locations.
+    class BoardModel
+    {
+    private:
+        std::vector< std::vector<cv::Point2f> > targetCorners_;    ///< corners of each marker in the corrected image, empty until learned
+        cv::Size imgSize_;                                          ///< size of the images the model is learned for
+
+    public:
+        /// Ctor
+        BoardModel():
+        targetCorners_(4),
+        imgSize_()
+        {
+        }
+
+        /// Learns where the corners of the markers end up in the corrected image
+        /// @param[in] corners undistorted corners of the 4 markers, sorted by id
+        /// @param[in] trfMatrix perspective transform calculated from the corners
+        /// @param[in] imgSize size of the images
+        void update(const std::vector< std::vector<cv::Point2f> >& corners, const cv::Mat_<double>& trfMatrix, const cv::Size& imgSize)
+        {
+            assert( (corners.size() == 4) && !trfMatrix.empty() );
+            for (int i = 0; i < 4; ++i)
+            {
+                assert(corners[i].size() == 4);
+                cv::perspectiveTransform(corners[i], targetCorners_[i], trfMatrix);
+            }
+            imgSize_ = imgSize;
+        }
+
+        /// Estimates the perspective transform from the visible markers
+        /// @param[in] corners undistorted corners of the markers, sorted by id, empty for markers that are not visible
+        /// @param[in] imgSize size of the images
+        /// @return the perspective transform, or an empty matrix if too few markers are visible, or they do not fit the model
+        cv::Mat_<double> fit(const std::vector< std::vector<cv::Point2f> >& corners, const cv::Size& imgSize) const
+        {
+            assert(corners.size() == 4);
+            if (imgSize != imgSize_)
+            {
+                return cv::Mat_<double>();
+            }
+            std::vector<cv::Point2f> src, dst;
+            int nMarkers = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                if (!corners[i].empty() && !targetCorners_[i].empty())
+                {
+                    ++nMarkers;
+                    src.insert(src.end(), corners[i].begin(), corners[i].end());
+                    dst.insert(dst.end(), targetCorners_[i].begin(), targetCorners_[i].end());
+                }
+            }
+            if (nMarkers < MIN_FIT_MARKERS)
+            {
+                return cv::Mat_<double>();
+            }
+            std::vector<std::uint8_t> inliers;
+            const cv::Mat trfMatrix = cv::findHomography(src, dst, cv::RANSAC, MAX_FIT_ERROR, inliers);
+            const int nInliers = (int) std::count(inliers.begin(), inliers.end(), 1);
+            LOG4CXX_DEBUG(logger, "Fit the transform to " << nMarkers << " markers, " << nInliers << " of " << src.size() << " corners are inliers");
+            if ( trfMatrix.empty() || (nInliers < MIN_FIT_INLIER_RATE * src.size()) )
+            {
+                return cv::Mat_<double>();
+            }
+            return cv::Mat_<double>(trfMatrix);
+        }
+    };  //::<anon>::BoardModel
+
+    /// @class Timing statistics of the warp
+    class WarpStats
+    {
+    private:
+        typedef std::chrono::steady_clock clock_t;
+        std::vector<double> bandTimes_;     ///< duration of each band of the current frame, in ms
+        clock_t::time_point frameStart_;    ///< start time of the current frame
+        std::size_t nFrames_;               ///< number of warped frames
+        std::size_t nBands_;                ///< total number of warped bands
+        double frameTime_;                  ///< total time spent warping frames, in ms
+        double bandTime_;                   ///< total time spent warping bands, in ms
+        double maxBandTime_;                ///< duration of the slowest band, in ms
+        int nThreads_;                      ///< number of threads warping each frame
+    public:
+        /// Ctor
+        /// @param[in] nThreads number of threads warping each frame
+        WarpStats(int nThreads):
+        bandTimes_(),
+        frameStart_(),
+        nFrames_(0),
+        nBands_(0),
+        frameTime_(0),
+        bandTime_(0),
+        maxBandTime_(0),
+        nThreads_(nThreads)
+        {
+        }
+
+        /// Called before warping a frame
+        /// @param[in] nBands number of bands the frame is split into
+        void startFrame(int nBands)
+        {
+            bandTimes_.assign(nBands, 0.);
+            frameStart_ = clock_t::now();
+        }
+
+        /// Times a band. Each band should be timed by a single thread.
+        /// @param[in] band index of the band
+        /// @param[in] warp function that warps the band
+        template <class Fn>
+        void timeBand(int band, Fn&& warp)
+        {
+            const auto start = clock_t::now();
+            warp();
+            bandTimes_[band] = std::chrono::duration<double, std::milli>(clock_t::now() - start).count();
+        }
+
+        /// Called after all bands of a frame are warped
+        void endFrame()
+        {
+            const double frameTime = std::chrono::duration<double, std::milli>(clock_t::now() - frameStart_).count();
+            ++nFrames_;
+            frameTime_ += frameTime;
+            for (double t: bandTimes_)
+            {
+                bandTime_ += t;
+                maxBandTime_ = std::max(maxBandTime_, t);
+            }
+            nBands_ += bandTimes_.size();
+            LOG4CXX_DEBUG(logger, "Warped " << bandTimes_.size() << " bands in " << frameTime << "ms");
+        }
+
+        /// Prints the statistics
+        friend std::ostream& operator<<(std::ostream& stream, const WarpStats& stats)
+        {
+            if (stats.nFrames_ == 0)
+            {
+                return stream << "no frames warped";
+            }
+            return stream << "frames=" << stats.nFrames_ << ", threads=" << stats.nThreads_
+            << ", bands/frame=" << (double) stats.nBands_ / stats.nFrames_
+            << ", mean frame=" << stats.frameTime_ / stats.nFrames_ << "ms"
+            << ", mean band=" << (stats.nBands_ > 0 ? stats.bandTime_ / stats.nBands_ : 0.) << "ms"
+            << ", max band=" << stats.maxBandTime_ << "ms"
+            << ", parallel efficiency=" << (stats.frameTime_ > 0 ? stats.bandTime_ / (stats.frameTime_ * stats.nThreads_) : 0.);
+        }
+    };  //::<anon>::WarpStats
+
+    /// Calculates where an image is placed when it is scaled into an output image, preserving its aspect ratio and padding
+    /// the rest, the same way the writers' filter graphs do
+    /// @param[in] inSize size of the image
+    /// @param[in] outSize size of the output image
+    /// @return the part of the output image the scaled image covers
+    cv::Rect getLetterbox(const cv::Size& inSize, const cv::Size& outSize)
+    {
+        const double cW = (double) outSize.width / inSize.width;
+        const double cH = (double) outSize.height / inSize.height;
+        if (cW > cH)
+        {
+            const int width = std::min(outSize.width, (int) std::lround(cH * inSize.width));
+            return cv::Rect((outSize.width - width) / 2, 0, width, outSize.height);
+        }
+        else if (cW < cH)
+        {
+            const int height = std::min(outSize.height, (int) std::lround(cW * inSize.height));
+            return cv::Rect(0, (outSize.height - height) / 2, outSize.width, height);
+        }
+        return cv::Rect(cv::Point(0, 0), outSize);
+    }
+
+    /// Composes a perspective transform with scaling, so that the warped image is rendered directly at a different size
+    /// @param[in] trfMatrix perspective transform matrix, or an empty matrix if no transform should be applied
+    /// @param[in] inSize size of the images the transform is for
+    /// @param[in] outSize size of the scaled images
+    /// @return the composed transform, or an empty matrix if no transform should be applied
+    cv::Mat_<double> scaleTransform(const cv::Mat_<double>& trfMatrix, const cv::Size& inSize, const cv::Size& outSize)
+    {
+        if (inSize == outSize)
+        {
+            return trfMatrix;
+        }
+        const cv::Matx33d S((double) outSize.width / inSize.width, 0, 0,  0, (double) outSize.height / inSize.height, 0,  0, 0, 1);
+        const cv::Matx33d H = (trfMatrix.empty() ? cv::Matx33d::eye() : cv::Matx33d(trfMatrix));
+        return cv::Mat_<double>(cv::Mat(S * H));
+    }
+
+    /// @return the part of a yuv420p image plane that corresponds to a region of the luma plane
+    /// @param[in] roi region of the luma plane, with even coordinates & size
+    /// @param[in] plane index of the plane
+    cv::Rect getPlaneRect(const cv::Rect& roi, std::size_t plane)
+    {
+        return (plane == 0 ? roi : cv::Rect(roi.x / 2, roi.y / 2, roi.width / 2, roi.height / 2));
+    }
+
+    /// @return a region shrunk to even coordinates & size, so that it covers whole chroma pixels of a yuv420p image
+    /// @param[in] roi region of the image
+    cv::Rect alignToChroma(const cv::Rect& roi)
+    {
+        return cv::Rect(roi.x & ~1, roi.y & ~1, roi.width & ~1, roi.height & ~1);
+    }
+
+    /// @return the value of black in a plane of an image
+    /// @param[in] nPlanes number of planes of the image, 1 for BGR or 3 for yuv420p
+    /// @param[in] plane index of the plane
+    std::uint8_t getBlack(std::size_t nPlanes, std::size_t plane)
+    {
+        if (nPlanes == 1)
+        {
+            return 0;
+        }
+        return (plane == 0 ? LUMA_BLACK : CHROMA_NEUTRAL);
+    }
+
+    /// Sets the parts of an image outside a region to black
+    /// @param[in, out] planes planes of the image, as returned by getPlanes()
+    /// @param[in] roi region of the first plane to leave as is
+    void setBordersToBlack(std::vector<cv::Mat>& planes, const cv::Rect& roi)
+    {
+        for (std::size_t i = 0; i < planes.size(); ++i)
+        {
+            cv::Mat& img = planes[i];
+            const cv::Rect r = getPlaneRect(roi, i);
+            const cv::Scalar black = cv::Scalar::all(getBlack(planes.size(), i));
+            img.rowRange(0, r.y).setTo(black);
+            img.rowRange(r.y + r.height, img.rows).setTo(black);
+            img(cv::Rect(0, r.y, r.x, r.height)).setTo(black);
+            img(cv::Rect(r.x + r.width, r.y, img.cols - r.x - r.width, r.height)).setTo(black);
+        }
+    }
+
+    /// @return views of the same region of each plane of an image
+    /// @param[in] planes planes of the image, as returned by getPlanes()
+    /// @param[in] roi region of the first plane
+    std::vector<cv::Mat> getRegion(const std::vector<cv::Mat>& planes, const cv::Rect& roi)
+    {
+        std::vector<cv::Mat> region;
+        region.reserve(planes.size());
+        for (std::size_t i = 0; i < planes.size(); ++i)
+        {
+            region.push_back(planes[i](getPlaneRect(roi, i)));
+        }
+        return region;
+    }
+
+    /// @return views of the Y, U & V planes of an I420 image, as stored by cv::cvtColor
+    /// @param[in] img I420 image, with the planes one after the other in a single channel matrix 3/2 as high as the image
+    std::vector<cv::Mat> getI420Planes(const cv::Mat& img)
+    {
+        assert( (img.type() == CV_8UC1) && img.isContinuous() && (img.rows % 3 == 0) && (img.cols % 2 == 0) );
+        const int w = img.cols, h = img.rows * 2 / 3;
+        return {
+            cv::Mat(h, w, CV_8UC1, img.data),
+            cv::Mat(h / 2, w / 2, CV_8UC1, img.data + w * h),
+            cv::Mat(h / 2, w / 2, CV_8UC1, img.data + w * h * 5 / 4)
+        };
+    }
+
+    /// Allocates an image buffer in a pixel format
+    /// @param[in, out] buffer image buffer, reallocated if needed
+    /// @param[in] format pixel format, BGR24 or yuv420p
+    /// @param[in] size size of the image. For yuv420p, the buffer is rounded up to even dimensions.
+    /// @return the planes of the buffer, as returned by getPlanes()
+    std::vector<cv::Mat> allocatePlanes(cv::Mat& buffer, AVPixelFormat format, const cv::Size& size)
+    {
+        if (format != AV_PIX_FMT_YUV420P)
+        {
+            buffer.create(size, CV_8UC3);
+            return {buffer};
+        }
+        const int w = (size.width + 1) & ~1, h = (size.height + 1) & ~1;
+        buffer.create(h * 3 / 2, w, CV_8UC1);
+        return getI420Planes(buffer);
+    }
+
+    /// Converts an image buffer allocated with allocatePlanes() to a frame in another pixel format
+    /// @param[in] buffer image buffer
+    /// @param[in] format pixel format of the buffer
+    /// @param[in, out] scratch buffer used for the conversion
+    /// @param[in, out] frame preallocated frame, in the other pixel format
+    void convertToFrame(const cv::Mat& buffer, AVPixelFormat format, cv::Mat& scratch, avtools::Frame& frame)
+    {
+        if (format == AV_PIX_FMT_YUV420P)
+        {
+            assert(frame->format == PIX_FMT);
+            cv::Mat outImg = getImage(frame);
+            if ( (buffer.cols == outImg.cols) && (buffer.rows * 2 / 3 == outImg.rows) )
+            {
+                cv::cvtColor(buffer, outImg, cv::COLOR_YUV2BGR_I420);
+            }
+            else    //the buffer was rounded up to even dimensions
+            {
+                cv::cvtColor(buffer, scratch, cv::COLOR_YUV2BGR_I420);
+                scratch(cv::Rect(cv::Point(0, 0), outImg.size())).copyTo(outImg);
+            }
+            return;
+        }
+        assert( (frame->format == AV_PIX_FMT_YUV420P) && (frame->width == buffer.cols) && (frame->height == buffer.rows) );
+        cv::cvtColor(buffer, scratch, cv::COLOR_BGR2YUV_I420);
+        const std::vector<cv::Mat> yuvPlanes = getI420Planes(scratch);
+        std::vector<cv::Mat> outPlanes = getPlanes(frame);
+        for (std::size_t i = 0; i < outPlanes.size(); ++i)
+        {
+            yuvPlanes[i].copyTo(outPlanes[i]);
+        }
+    }
+
+    /// @class Maps each output pixel to its location in the input image, combining lens undistortion and the perspective
+    /// transform. Without lens distortion, the source locations are stepped along each row from the perspective transform.
+    /// With lens distortion, they are looked up from a table that is rebuilt only when the transform changes.
+    /// yuv420p images are warped plane by plane: the luma plane at full resolution, and the chroma planes at half resolution.
+    class WarpMap
+    {
+    private:
+        /// @class Map of an image plane
+        struct PlaneMap
+        {
+            cv::Matx33d invTrfMatrix;   ///< inverse of the perspective transform, used if there is no lens distortion
+            cv::Mat coords;             ///< fixed point source coordinates of each pixel, CV_32SC2, used if there is lens distortion
+            std::uint8_t black;         ///< value of the pixels that map outside the input image
+        };
+        cv::Size size_;                     ///< size of the images the map is built for
+        AVPixelFormat format_;              ///< pixel format of the images the map is built for
+        bool isIdentity_;                   ///< true if the images are copied as is
+        std::vector<PlaneMap> planeMaps_;   ///< map of the BGR or luma plane, followed by the map shared by the chroma planes
+
+        /// Builds the map of a plane
+        /// @param[in] H perspective transform matrix for the undistorted plane
+        /// @param[in] K camera matrix of the plane, used if there is lens distortion
+        /// @param[in] distCoeffs lens distortion coefficients, or an empty matrix if the plane should not be undistorted
+        /// @param[in] size size of the plane
+        /// @param[in] black value of the pixels that map outside the input plane
+        static PlaneMap buildPlane(const cv::Matx33d& H, const cv::Matx33d& K, const cv::Mat& distCoeffs, const cv::Size& size, std::uint8_t black)
+        {
+            PlaneMap planeMap{H.inv(), cv::Mat(), black};
+            if (!distCoeffs.empty())
+            {
+                // initUndistortRectifyMap maps each output pixel p to K * distort( (newK * R)^-1 * p ). With newK = I & R = H * K,
+                // the undistorted pixel H^-1 * p is moved to normalized coordinates, distorted, and moved back to pixel coordinates.
+                cv::Mat map;
+                cv::initUndistortRectifyMap(K, distCoeffs, cv::Mat(H * K), cv::Mat::eye(3, 3, CV_64F), size, CV_32FC2, map, cv::noArray());
+                planeMap.coords = toFixedPointCoords(map);
+            }
+            return planeMap;
+        }
+    public:
+        /// Ctor
+        WarpMap():
+        size_(),
+        format_(AV_PIX_FMT_NONE),
+        isIdentity_(true),
+        planeMaps_()
+        {
+        }
+
+        /// Builds the map
+        /// @param[in] trfMatrix perspective transform matrix for undistorted images, or an empty matrix if no transform should be applied
+        /// @param[in] cameraMatrix camera matrix, or an empty matrix if the images should not be undistorted
+        /// @param[in] distCoeffs lens distortion coefficients
+        /// @param[in] size size of the images
+        /// @param[in] format pixel format of the images, BGR24 or yuv420p
+        void build(const cv::Mat_<double>& trfMatrix, const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs, const cv::Size& size, AVPixelFormat format)
+        {
+            LOG4CXX_DEBUG(logger, "Building warp map for transformation matrix: " << trfMatrix );
+            size_ = size;
+            format_ = format;
+            planeMaps_.clear();
+            const bool hasDistortion = !cameraMatrix.empty() && !distCoeffs.empty() && (cv::countNonZero(distCoeffs) > 0);
+            isIdentity_ = trfMatrix.empty() && !hasDistortion;
+            if (isIdentity_)
+            {
+                return;
+            }
+            const cv::Matx33d H = (trfMatrix.empty() ? cv::Matx33d::eye() : cv::Matx33d(trfMatrix));
+            cv::Matx33d K = cv::Matx33d::eye();
+            if (hasDistortion)
+            {
+                cv::Mat K64;
+                cameraMatrix.convertTo(K64, CV_64F);
+                K = cv::Matx33d(K64);
+            }
+            const cv::Mat D = (hasDistortion ? distCoeffs : cv::Mat());
+            if (format != AV_PIX_FMT_YUV420P)
+            {
+                planeMaps_.push_back(buildPlane(H, K, D, size, 0));
+                return;
+            }
+            planeMaps_.push_back(buildPlane(H, K, D, size, LUMA_BLACK));
+            // Chroma pixel c is centered on luma pixel A * c, so the chroma planes are warped by A^-1 * H * A, and their camera matrix is A^-1 * K
+            const cv::Matx33d A(2, 0, 0.5,  0, 2, 0.5,  0, 0, 1);
+            const cv::Matx33d AInv = A.inv();
+            const cv::Size chromaSize((size.width + 1) / 2, (size.height + 1) / 2);
+            planeMaps_.push_back(buildPlane(AInv * H * A, AInv * K, D, chromaSize, CHROMA_NEUTRAL));
+        }
+
+        /// Warps an image, or copies it as is if there is no transform. The image is split into horizontal bands that
+        /// are warped in parallel by the worker pool.
+        /// @param[in] inPlanes planes of the input image, as returned by getPlanes()
+        /// @param[out] outPlanes planes of the output image, preallocated
+        /// @param[in] pool worker pool to warp the bands on
+        /// @param[in, out] stats warp timing statistics
+        void apply(const std::vector<cv::Mat>& inPlanes, std::vector<cv::Mat>& outPlanes, WorkerPool& pool, WarpStats& stats) const
+        {
+            assert( (inPlanes.size() == outPlanes.size()) && !outPlanes.empty() );
+            if (isIdentity_)
+            {
+                for (std::size_t i = 0; i < inPlanes.size(); ++i)
+                {
+                    inPlanes[i].copyTo(outPlanes[i]);
+                }
+                return;
+            }
+            assert( (size_ == outPlanes[0].size()) && (inPlanes.size() == (planeMaps_.size() == 1 ? 1 : 3)) );
+            // Each output row reads its table row & writes its pixels; the source rows it reads are shared with neighboring rows
+            const int nRows = outPlanes[0].rows;
+            std::size_t frameBytes = 0;
+            for (std::size_t i = 0; i < outPlanes.size(); ++i)
+            {
+                const cv::Mat& coords = planeMaps_[std::min(i, planeMaps_.size() - 1)].coords;
+                frameBytes += outPlanes[i].total() * (outPlanes[i].elemSize() + (coords.empty() ? 0 : coords.elemSize()));
+            }
+            const std::size_t rowBytes = frameBytes / std::max(nRows, 1);
+            int bandRows = std::max( MIN_WARP_BAND_ROWS, (int) (WARP_BAND_BYTES / std::max(rowBytes, (std::size_t) 1)) );
+            bandRows = std::min( bandRows, (nRows + pool.size() - 1) / pool.size() );    //give every thread a band
+            if (outPlanes.size() > 1)
+            {
+                bandRows += (bandRows % 2);     //so that the bands cover whole chroma rows
+            }
+            const int nBands = (nRows + bandRows - 1) / bandRows;
+            stats.startFrame(nBands);
+            pool.run(nBands, [&](int band){
+                const cv::Range rows(band * bandRows, std::min(nRows, (band + 1) * bandRows));
+                stats.timeBand(band, [&](){
+                    for (std::size_t i = 0; i < outPlanes.size(); ++i)
+                    {
+                        const PlaneMap& planeMap = planeMaps_[std::min(i, planeMaps_.size() - 1)];
+                        const cv::Range planeRows = (i == 0 ? rows : cv::Range(rows.start / 2, std::min(outPlanes[i].rows, (rows.end + 1) / 2)));
+                        cv::Mat outBand = outPlanes[i].rowRange(planeRows);
+                        if (planeMap.coords.empty())
+                        {
+                            warpPerspectiveBilinear(inPlanes[i], outBand, planeMap.invTrfMatrix, planeRows.start, planeMap.black);
+                        }
+                        else
+                        {
+                            remapBilinear(inPlanes[i], outBand, planeMap.coords.rowRange(planeRows), planeMap.black);
+                        }
+                    }
+                });
+            });
+            stats.endFrame();
+        }
+
+        /// @return size of the images the map is built for, or an empty size if it is not built yet
+        inline cv::Size size() const {return size_;}
+
+        /// @return pixel format of the images the map is built for, or AV_PIX_FMT_NONE if it is not built yet
+        inline AVPixelFormat format() const {return format_;}
+    };  //::<anon>::WarpMap
 } //::<anon>
 
+SharedTransform::SharedTransform():
+mutex_(),
+trfMatrix_(),
+cameraMatrix_(),
+distCoeffs_(),
+imgSize_(),
+version_(0)
+{
+}
+
+void SharedTransform::set(const cv::Mat_<double>& trfMatrix, const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs, const cv::Size& imgSize)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    trfMatrix_ = trfMatrix.clone();
+    cameraMatrix.convertTo(cameraMatrix_, CV_64F);
+    distCoeffs_ = distCoeffs.clone();
+    imgSize_ = imgSize;
+    ++version_;     //published last, so a reader that sees the new version gets the new transform
+}
+
+std::uint64_t SharedTransform::get(const cv::Size& imgSize, cv::Mat_<double>& trfMatrix, cv::Mat& cameraMatrix, cv::Mat& distCoeffs) const
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    distCoeffs = distCoeffs_.clone();
+    if ( imgSize == imgSize_ )
+    {
+        trfMatrix = trfMatrix_.clone();
+        cameraMatrix = cameraMatrix_.clone();
+        return version_.load();
+    }
+    // If D scales from the original image to this one, then the transform for this image is D * H * D^-1, and the camera matrix is D * K.
+    // The distortion coefficients are in normalized coordinates, so they do not change.
+    const double sx = (imgSize_.width > 0 ? (double) imgSize.width / imgSize_.width : 1.);
+    const double sy = (imgSize_.height > 0 ? (double) imgSize.height / imgSize_.height : 1.);
+    const cv::Matx33d D(sx, 0, 0,  0, sy, 0,  0, 0, 1);
+    const cv::Matx33d DInv(1/sx, 0, 0,  0, 1/sy, 0,  0, 0, 1);
+    trfMatrix = (trfMatrix_.empty() ? cv::Mat_<double>() : cv::Mat_<double>(cv::Mat(D * cv::Matx33d(trfMatrix_) * DInv)));
+    cameraMatrix = (cameraMatrix_.empty() ? cv::Mat() : cv::Mat(D * cv::Matx33d(cameraMatrix_)));
+    return version_.load();
+}
+
+std::uint64_t SharedTransform::version() const
+{
+    return version_.load();
+}
 
-std::thread threadedWarp(std::weak_ptr<const avtools::ThreadsafeFrame> pInFrame, std::weak_ptr<avtools::ThreadsafeFrame> pWarpedFrame, const std::string& calibrationFile)
+std::string getStateFile(const std::string& calibrationFile, const std::string& camera, const cv::Size& imgSize)
 {
-    return std::thread([pInFrame, pWarpedFrame, calibrationFile](){
+    std::string cameraName = camera;
+    std::replace_if(cameraName.begin(), cameraName.end(), [](char c){return !std::isalnum((unsigned char) c);}, '_');
+    const fs::path calibrationPath(calibrationFile);
+    const std::string fileName = calibrationPath.stem().string() + "." + cameraName + "."
+        + std::to_string(imgSize.width) + "x" + std::to_string(imgSize.height) + ".state.json";
+    return (calibrationPath.parent_path() / fileName).string();
+}
+
+std::thread threadedDetect(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pInSub, const std::string& calibrationFile,
+                           const std::string& stateFile, const cv::Size& imgSize, std::shared_ptr<SharedTransform> pTransform)
+{
+    assert(pInSub && pTransform);
+    // Read board information & create board finder
+    auto pBoardFinder = std::make_shared<BoardFinder>(calibrationFile);
+    // Publish the saved transform before any frame is warped
+    TransformState savedState;
+    if (loadTransformState(stateFile, imgSize, savedState))
+    {
+        pTransform->set(savedState.trfMatrix, pBoardFinder->cameraMatrix(), pBoardFinder->distCoeffs(), imgSize);
+        LOG4CXX_INFO(logger, "Restored the perspective transform from " << stateFile << ", it will be checked against the first detection");
+    }
+    return std::thread([pInSub, pBoardFinder, stateFile, savedState, pTransform](){
+        typedef std::chrono::steady_clock clock_t;
+        std::size_t nDetections = 0, nTracked = 0, nLost = 0, nChanges = 0, nPartialFits = 0, nKept = 0;
+        double detectionTime = 0, maxDetectionTime = 0, trackingTime = 0, maxTrackingTime = 0;    //in ms
+        CornerFilter cornerFilter;
+        const auto threadStart = clock_t::now();
         try
         {
-            log4cxx::MDC::put("threadname", "warper");
-            // Read board information & create board finder
-            BoardFinder boardFinder(calibrationFile);
+            log4cxx::MDC::put("threadname", "detector");
+#ifdef __gnu_linux__
+            // On Linux, this only changes the priority of the calling thread
+            if (setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), DETECTOR_NICENESS) != 0)
+            {
+                LOG4CXX_WARN(logger, "Unable to lower the priority of the marker detector: " << std::strerror(errno));
+            }
+#endif
+            BoardFinder& boardFinder = *pBoardFinder;
+            BoardModel boardModel;
             std::vector< std::vector<cv::Point2f> > prevCorners(4);    //previously detected marker corners
-            cv::Mat_<double> trfMatrix; //perspective transform matrix
-            // Start the loop - every frame gets checked for markers
+            cv::Mat_<double> trfMatrix; //perspective transform matrix for the undistorted image
+            cv::Size trfSize;           //size of the images the transform is calculated for
+            // A restored transform is used as if it had just been calculated, until the first detection confirms or replaces it
+            bool isRestored = !savedState.trfMatrix.empty();
+            if (isRestored)
+            {
+                trfMatrix = savedState.trfMatrix;
+                trfSize = savedState.imgSize;
+                prevCorners = savedState.corners;
+                std::vector< std::vector<cv::Point2f> > undistorted(4);
+                for (int i = 0; i < 4; ++i)
+                {
+                    undistorted[i] = undistortCorners(savedState.corners[i], boardFinder.cameraMatrix(), boardFinder.distCoeffs());
+                }
+                boardModel.update(undistorted, trfMatrix, trfSize);
+            }
+            TransformState state = savedState;  //last transform calculated from all 4 markers
+            bool isStateSaved = true;
+            clock_t::time_point lastStateSave = clock_t::now();
+            // The corners are smoothed over time, and the transform is only recalculated once they move by more than TRANSFORM_UPDATE_BUDGET.
+            // The markers are searched for in the newest frame, every MIN_DETECTION_INTERVAL after the board moves, backing off to
+            // every MAX_DETECTION_INTERVAL while it stays still.
             // If all markers are visible, a new perspective transform is calculated.
             // If not all markers are visible, but the detected ones are in approximately the same location as before, then the previously calculated transform is used.
-            // If the detected markers are in different locations than before, then no transform is applied
-            avtools::TimeType ts = AV_NOPTS_VALUE;
+            // If the detected markers are in different locations than before, the transform is fit to them if at least 3 are visible,
+            // otherwise the previously calculated transform is kept.
+            // Once all 4 markers are found, they are also tracked in every frame between detections, so that a move of the board
+            // is seen in the next frame. If tracking is lost, the markers are searched for in that frame.
+            std::chrono::milliseconds interval = MIN_DETECTION_INTERVAL;
+            clock_t::time_point nextDetection = clock_t::now();
+            std::uint64_t seq = 0;
             while (!g_ThreadMan.isEnded())
             {
-                auto ppInFrame = pInFrame.lock();
-                if (!ppInFrame)
+                auto pFrame = pInSub->pop(seq);   //wait until fresh frame is available
+                if (!pFrame || g_ThreadMan.isEnded())  //if the wait ended because program ended, quit
+                {
+                    break;
+                }
+                const auto start = clock_t::now();
+                bool isDetected = (start >= nextDetection);
+                if (!isDetected && !boardFinder.isTracking())
                 {
-                    if (g_ThreadMan.isEnded())
+                    continue;
+                }
+                const auto& inFrame = *pFrame;
+                const cv::Mat inImg = getPlanes(inFrame)[0];     //the markers are found in the luma plane of yuv420p frames
+                std::vector< std::vector<cv::Point2f> > corners;
+                if (!isDetected)
+                {
+                    corners = boardFinder.trackCorners(inImg);
+                    if (corners.empty())
                     {
-                        break;
+                        ++nLost;
+                        isDetected = true;
                     }
-                    throw std::runtime_error("Warper received null frame.");
+                    else
+                    {
+                        const double t = std::chrono::duration<double, std::milli>(clock_t::now() - start).count();
+                        ++nTracked;
+                        trackingTime += t;
+                        maxTrackingTime = std::max(maxTrackingTime, t);
+                    }
+                }
+                if (isDetected)
+                {
+                    //Look for markers in this frame
+                    corners = boardFinder.getCorners(inImg);
+                }
+                // See if the smoothed corners have moved since the transform was calculated
+                const auto& smoothedCorners = cornerFilter.update(corners);
+                bool isTransformChanged = (trfSize != inImg.size());  //the lens distortion is corrected even before the markers are found
+                const float movement = calculateMarkerMovement(prevCorners, smoothedCorners);
+                if (isRestored && (movement < FLT_MAX))
+                {
+                    LOG4CXX_INFO(logger, "The markers moved by " << movement << " pixels since the transform was saved, "
+                                 << (movement > TRANSFORM_UPDATE_BUDGET ? "replacing" : "keeping") << " the restored transform");
+                    isRestored = false;
                 }
-                const auto& inFrame = *ppInFrame;
+                if (movement > TRANSFORM_UPDATE_BUDGET)
                 {
-                    auto rLock = inFrame.getReadLock();
-                    inFrame.cv.wait(rLock, [&inFrame, ts](){return g_ThreadMan.isEnded() ||  (inFrame->best_effort_timestamp > ts);});    //wait until fresh frame is available
-                    if (g_ThreadMan.isEnded())  //if the wait ended because program ended, quit
+                    std::vector< std::vector<cv::Point2f> > undistorted(4);
+                    for (int i = 0; i < 4; ++i)
                     {
-                        break;
+                        undistorted[i] = undistortCorners(smoothedCorners[i], boardFinder.cameraMatrix(), boardFinder.distCoeffs());
                     }
-                    ts = inFrame->best_effort_timestamp;
-                    auto ppWarpedFrame = pWarpedFrame.lock();
-                    if (!ppWarpedFrame )
+                    auto boundary = getOuterCorners(undistorted);
+                    if (!boundary.empty())
                     {
-                        throw std::runtime_error("Warper output frame is null");
+                        trfMatrix = getPerspectiveTransformationMatrix(boundary, inImg.size());
+                        boardModel.update(undistorted, trfMatrix, inImg.size());
+                        prevCorners = smoothedCorners;
+                        isTransformChanged = true;
+                        state.trfMatrix = trfMatrix;
+                        state.corners = smoothedCorners;
+                        state.imgSize = inImg.size();
+                        isStateSaved = false;
                     }
-                    auto& warpedFrame = *ppWarpedFrame;
+                    else    // do not have all markers visible to calculate trf matrix
                     {
-                        auto wLock = warpedFrame.getWriteLock();
-                        assert(warpedFrame->best_effort_timestamp < ts);
-                        assert( (av_cmp_q(warpedFrame.timebase, inFrame.timebase) == 0) && (warpedFrame.type == AVMediaType::AVMEDIA_TYPE_VIDEO) && (inFrame.type == AVMediaType::AVMEDIA_TYPE_VIDEO) );
-                        cv::Mat inImg = getImage(inFrame);
-                        //Look for markers in this frame
-                        auto corners = boardFinder.getCorners(inImg);
-                        // See if corners have moved since last time
-                        if (calculateMarkerMovement(prevCorners, corners) > MAX_MARKER_MOVEMENT)
-                        {
-                            auto boundary = getOuterCorners(corners);
-                            if (boundary.empty())   // do not have all markers visible to calculate trf matrix
-                            {
-                                trfMatrix = cv::Mat_<double>();
-                            }
-                            else
-                            {
-                                trfMatrix = getPerspectiveTransformationMatrix(boundary, inImg.size());
-                                prevCorners = corners;
-                            }
-                        }
-
-                        cv::Mat outImg = getImage(warpedFrame);
-                        if (trfMatrix.empty())
+                        cv::Mat_<double> partialTrfMatrix = boardModel.fit(undistorted, inImg.size());
+                        if (!partialTrfMatrix.empty())
                         {
-                            inImg.copyTo(outImg);
+                            trfMatrix = partialTrfMatrix;
+                            prevCorners = smoothedCorners;
+                            isTransformChanged = true;
+                            ++nPartialFits;
                         }
                         else
                         {
-                            LOG4CXX_DEBUG(logger, "Warper using transformation matrix: " << trfMatrix );
-                            cv::warpPerspective(inImg, outImg, trfMatrix, outImg.size(), cv::InterpolationFlags::INTER_LANCZOS4);
-                        }
-                        int ret = av_frame_copy_props(warpedFrame.get(), inFrame.get());
-                        if (ret < 0)
-                        {
-                            throw avtools::MediaError("Unable to copy frame properties", ret);
+                            LOG4CXX_DEBUG(logger, "Too few markers to follow the board, keeping the last transform");
+                            ++nKept;
                         }
-                        LOG4CXX_DEBUG(logger, "Warped frame info: \n" << warpedFrame.info(1));
                     }
-                    warpedFrame.cv.notify_all();    //need to call this manually, normally update() would cll this
                 }
+                if (isTransformChanged)
+                {
+                    trfSize = inImg.size();
+                    pTransform->set(trfMatrix, boardFinder.cameraMatrix(), boardFinder.distCoeffs(), inImg.size());
+                    ++nChanges;
+                    interval = MIN_DETECTION_INTERVAL;
+                    nextDetection = start + interval;   //tracked moves are confirmed by a detection soon after
+                }
+                else if (isDetected)
+                {
+                    interval = std::min(2 * interval, MAX_DETECTION_INTERVAL);
+                    nextDetection = start + interval;
+                }
+                if (!isStateSaved && (start - lastStateSave >= STATE_SAVE_INTERVAL))
+                {
+                    saveTransformState(stateFile, state);
+                    isStateSaved = true;
+                    lastStateSave = start;
+                }
+                if (isDetected)
+                {
+                    const double t = std::chrono::duration<double, std::milli>(clock_t::now() - start).count();
+                    ++nDetections;
+                    detectionTime += t;
+                    maxDetectionTime = std::max(maxDetectionTime, t);
+                    LOG4CXX_DEBUG(logger, "Detected markers in " << t << "ms, next detection in " << interval.count() << "ms");
+                }
+            }
+            if (!isStateSaved)
+            {
+                saveTransformState(stateFile, state);
+            }
+        }
+        catch (std::exception& err)
+        {
+            try
+            {
+                std::throw_with_nested( std::runtime_error("Marker detector thread error") );
+            }
+            catch (...)
+            {
+                g_ThreadMan.addException(std::current_exception());
+                g_ThreadMan.end();
+            }
+        }
+        LOG4CXX_INFO(logger, "Marker detector frame queue: " << pInSub->stats());
+        LOG4CXX_INFO(logger, "Marker detector occlusions: transforms fit to partial boards=" << nPartialFits
+                     << ", moves with too few markers to follow=" << nKept);
+        LOG4CXX_INFO(logger, "Marker detector timing: detections=" << nDetections << ", transform changes=" << nChanges
+                     << ", mean detection=" << (nDetections > 0 ? detectionTime / nDetections : 0.) << "ms, max detection=" << maxDetectionTime
+                     << "ms, tracked frames=" << nTracked << ", tracking lost=" << nLost
+                     << ", mean tracking=" << (nTracked > 0 ? trackingTime / nTracked : 0.) << "ms, max tracking=" << maxTrackingTime << "ms");
+        const double minutes = std::chrono::duration<double, std::ratio<60> >(clock_t::now() - threadStart).count();
+        LOG4CXX_INFO(logger, "Transform updates: " << nChanges << " (" << (minutes > 0. ? nChanges / minutes : 0.) << " per minute), "
+                     << "marker jumps past the corner smoothing=" << cornerFilter.jumps());
+        pInSub->cancel();   //do not let the reader wait on us anymore
+        LOG4CXX_DEBUG(logger, "Exiting thread: isEnded=" << std::boolalpha << g_ThreadMan.isEnded());
+    });
+}
+
+std::thread threadedWarp(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pInSub, std::weak_ptr<avtools::ThreadsafeFrame> pWarpedFrame,
+                               std::shared_ptr<WorkerPool> pPool, std::shared_ptr<const SharedTransform> pTransform)
+{
+    assert(pInSub && pPool && pTransform);
+    return std::thread([pInSub, pWarpedFrame, pPool, pTransform](){
+        WarpStats stats(pPool->size());
+        try
+        {
+            log4cxx::MDC::put("threadname", "warper");
+            LOG4CXX_INFO(logger, "Warping with the " << getBestWarpIsa() << " kernel on " << pPool->size() << " threads");
+            std::uint64_t seq = 0;
+            std::uint64_t version = 0;  //version of the transform the warp map is built for
+            WarpMap warpMap;
+            cv::Size inSize, outSize;   //sizes of the images the warp map is built for
+            cv::Rect roi;               //part of the output image the warped image is scaled into
+            cv::Mat buffer, scratch;    //buffers used if the output is in a different pixel format than the input
+            while (!g_ThreadMan.isEnded())
+            {
+                auto pFrame = pInSub->pop(seq);   //wait until fresh frame is available
+                if (!pFrame || g_ThreadMan.isEnded())  //if the wait ended because program ended, quit
+                {
+                    break;
+                }
+                const auto& inFrame = *pFrame;
+                auto ppWarpedFrame = pWarpedFrame.lock();
+                if (!ppWarpedFrame )
+                {
+                    throw std::runtime_error("Warper output frame is null");
+                }
+                auto& warpedFrame = ppWarpedFrame->getWritableFrame();
+                const std::vector<cv::Mat> inPlanes = getPlanes(inFrame);
+                const AVPixelFormat inFormat = (AVPixelFormat) inFrame->format;
+                const cv::Size frameSize(warpedFrame->width, warpedFrame->height);
+                if ( (pTransform->version() != version) || (inPlanes[0].size() != inSize) || (frameSize != outSize) || (warpMap.format() != inFormat) )
+                {
+                    cv::Mat_<double> trfMatrix;
+                    cv::Mat cameraMatrix, distCoeffs;
+                    version = pTransform->get(inPlanes[0].size(), trfMatrix, cameraMatrix, distCoeffs);
+                    inSize = inPlanes[0].size();
+                    outSize = frameSize;
+                    roi = getLetterbox(inSize, outSize);
+                    if (inFormat == AV_PIX_FMT_YUV420P)
+                    {
+                        roi = alignToChroma(roi);
+                    }
+                    warpMap.build(scaleTransform(trfMatrix, inSize, roi.size()), cameraMatrix, distCoeffs, roi.size(), inFormat);
+                }
+                // The image is warped in the input pixel format, straight into the frame if the output has the same format.
+                // The bars around the letterboxed image are black.
+                const bool isConverted = (warpedFrame->format != inFormat);
+                std::vector<cv::Mat> outPlanes = (isConverted ? allocatePlanes(buffer, inFormat, outSize) : getPlanes(warpedFrame));
+                setBordersToBlack(outPlanes, roi);
+                std::vector<cv::Mat> roiPlanes = getRegion(outPlanes, roi);
+                warpMap.apply(inPlanes, roiPlanes, *pPool, stats);
+                if (isConverted)
+                {
+                    convertToFrame(buffer, inFormat, scratch, warpedFrame);
+                }
+                int ret = av_frame_copy_props(warpedFrame.get(), inFrame.get());
+                if (ret < 0)
+                {
+                    throw avtools::MediaError("Unable to copy frame properties", ret);
+                }
+                ppWarpedFrame->publish();
             }
         }
         catch (std::exception& err)
@@ -364,6 +1194,13 @@ std::thread threadedWarp(std::weak_ptr<const avtools::ThreadsafeFrame> pInFrame,
                 g_ThreadMan.end();
             }
         }
+        LOG4CXX_INFO(logger, "Warper frame queue: " << pInSub->stats());
+        LOG4CXX_INFO(logger, "Warper timing: " << stats);
+        pInSub->cancel();   //do not let the reader wait on us anymore
+        if (auto ppWarpedFrame = pWarpedFrame.lock())
+        {
+            ppWarpedFrame->close();    //let the writers know that no more frames are coming
+        }
         LOG4CXX_DEBUG(logger, "Exiting thread: isEnded=" << std::boolalpha << g_ThreadMan.isEnded());
     });
 }
@@ -0,0 +1,97 @@
+//
+//  correct_perspective.hpp
+//  zoomboard_server
+//
+//  Created by Ender Tekin on 8/7/19.
+//
+
+#ifndef correct_perspective_hpp
+#define correct_perspective_hpp
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <opencv2/core.hpp>
+#include "ThreadsafeFrame.hpp"
+
+class WorkerPool;
+
+/// @class Perspective transform & lens model that are calculated by the marker detector, and shared with the warpers that work on
+/// the same frames, possibly at a different resolution. A new transform is published as a whole: the version changes only once it is
+/// complete, and can be polled by the warpers on every frame without locking.
+class SharedTransform
+{
+private:
+    mutable std::mutex mutex_;              ///< Mutex that guards the transform
+    cv::Mat_<double> trfMatrix_;            ///< perspective transform matrix for undistorted images, empty if no transform should be applied
+    cv::Mat cameraMatrix_;                  ///< camera matrix, empty if the images should not be undistorted
+    cv::Mat distCoeffs_;                    ///< lens distortion coefficients
+    cv::Size imgSize_;                      ///< size of the images the transform is calculated for
+    std::atomic<std::uint64_t> version_;    ///< incremented each time the transform changes
+public:
+    /// Ctor
+    SharedTransform();
+
+    /// Updates the transform
+    /// @param[in] trfMatrix perspective transform matrix for undistorted images, or an empty matrix if no transform should be applied
+    /// @param[in] cameraMatrix camera matrix, or an empty matrix if the images should not be undistorted
+    /// @param[in] distCoeffs lens distortion coefficients
+    /// @param[in] imgSize size of the images the transform is calculated for
+    void set(const cv::Mat_<double>& trfMatrix, const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs, const cv::Size& imgSize);
+
+    /// Returns the transform for images of a given size. The transform is scaled so that it maps the same points.
+    /// @param[in] imgSize image size
+    /// @param[out] trfMatrix the perspective transform matrix, or an empty matrix if no transform should be applied
+    /// @param[out] cameraMatrix the camera matrix, or an empty matrix if the images should not be undistorted
+    /// @param[out] distCoeffs lens distortion coefficients
+    /// @return version of the returned transform
+    std::uint64_t get(const cv::Size& imgSize, cv::Mat_<double>& trfMatrix, cv::Mat& cameraMatrix, cv::Mat& distCoeffs) const;
+
+    /// @return version of the transform, which changes each time the transform is updated. It is 0 until the first update.
+    std::uint64_t version() const;
+};  //::SharedTransform
+
+/// Launches a thread that finds the Aruco markers in the input frames, and publishes the lens distortion & perspective transform
+/// that correct the board. Detection runs at a lower priority than the warpers, on the newest frame only: every 100ms after the
+/// board moves, backing off to once a second while it stays still. The warpers keep using the last published transform meanwhile.
+/// Once all markers are found, their corners are tracked with optical flow in every frame between detections, so that a move of
+/// the board is caught in the next frame; the markers are searched for again as soon as tracking is lost.
+/// If a marker is hidden, the transform is fit to the other 3 markers, using where their corners were the last time all 4 were
+/// seen; with fewer markers, the last transform is kept.
+/// The corners are smoothed over time, and a new transform is only published once the smoothed corners move by a sub-pixel budget.
+/// The last transform calculated from all 4 markers is saved to a state file. If the state file has a transform for the image size,
+/// it is published before the thread starts, so that the first frame is already corrected, and is kept until the first detection
+/// shows that the board has moved.
+/// @param[in] pInSub subscription to the input frames, should keep only the latest frame
+/// @param[in] calibrationFile calibration file that contains info re: camera calibration and aruco markers
+/// @param[in] stateFile file to save the transform to & restore it from, or an empty string to not save it
+/// @param[in] imgSize size of the input frames
+/// @param[in] pTransform the calculated transform is published here
+/// @return a new thread that runs in the background
+/// @throw std::runtime_error if the calibration file cannot be read
+std::thread threadedDetect(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pInSub, const std::string& calibrationFile,
+                           const std::string& stateFile, const cv::Size& imgSize, std::shared_ptr<SharedTransform> pTransform);
+
+/// @return the state file for the transform of a camera, next to the calibration file & named after the camera and image size
+/// @param[in] calibrationFile calibration file
+/// @param[in] camera url or device of the camera
+/// @param[in] imgSize size of the input frames
+std::string getStateFile(const std::string& calibrationFile, const std::string& camera, const cv::Size& imgSize);
+
+/// Launches a thread that corrects the lens distortion & perspective of the input frames, with the transform published by the
+/// marker detector. The transform is applied via precomputed maps that are only rebuilt when it changes.
+/// Each frame is warped in horizontal bands on the worker pool, and published once all bands are done.
+/// The output frames can have a different size than the input frames, in which case the warped image is rendered directly
+/// at the output size, preserving its aspect ratio & padded with black as the writers would do. They can be BGR24 or yuv420p.
+/// @param[in] pInSub subscription to the input frames
+/// @param[in, out] pWarpedFrame transformed output frame, yuv420p frames should have even dimensions
+/// @param[in] pPool worker pool to warp the frames on, can be shared with other warpers
+/// @param[in] pTransform transform published by the marker detector
+/// @return a new thread that runs in the background, updates the warpedFrame when a new inFrame is available.
+std::thread threadedWarp(std::shared_ptr<avtools::ThreadsafeFrame::Subscription> pInSub, std::weak_ptr<avtools::ThreadsafeFrame> pWarpedFrame,
+                         std::shared_ptr<WorkerPool> pPool, std::shared_ptr<const SharedTransform> pTransform);
+
+#endif /* correct_perspective_hpp */
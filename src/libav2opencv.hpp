@@ -7,6 +7,8 @@
 
 #ifndef libav2opencv_h
 #define libav2opencv_h
+#include <string>
+#include <vector>
 #include <opencv2/core.hpp>
 #include "LibAVWrappers.hpp"
 
@@ -33,4 +35,37 @@ inline cv::Mat getImage(avtools::Frame& frame)
 /// Pixel format to process images in OpenCV
 static const AVPixelFormat PIX_FMT = AVPixelFormat::AV_PIX_FMT_BGR24;
 
+/// @return true if frames in a pixel format can be wrapped with getPlanes(), i.e. if the pipeline can process them
+/// @param[in] format pixel format
+inline bool isSupportedPixelFormat(AVPixelFormat format)
+{
+    return (format == AV_PIX_FMT_BGR24) || (format == AV_PIX_FMT_YUV420P);
+}
+
+/// Wraps cv::mats around the planes of a libav frame. As with getImage(), the data is not cloned.
+/// @param[in] frame a decoded video frame, in BGR24 or yuv420p
+/// @return a single CV_8UC3 image for BGR24, or the Y, U & V planes as CV_8UC1 images for yuv420p. The chroma planes have
+/// half the width & height of the luma plane, rounded up.
+/// @throw avtools::MediaError if the frame has a different pixel format
+inline std::vector<cv::Mat> getPlanes(const avtools::Frame& frame)
+{
+    const AVPixelFormat format = (AVPixelFormat) frame->format;
+    if (format == AV_PIX_FMT_BGR24)
+    {
+        return {getImage(frame)};
+    }
+    if (format != AV_PIX_FMT_YUV420P)
+    {
+        throw avtools::MediaError("Images can only be processed in bgr24 or yuv420p, found " + std::string(av_get_pix_fmt_name(format)));
+    }
+    const AVPixFmtDescriptor* pDesc = av_pix_fmt_desc_get(format);
+    const int chromaWidth = AV_CEIL_RSHIFT(frame->width, pDesc->log2_chroma_w);
+    const int chromaHeight = AV_CEIL_RSHIFT(frame->height, pDesc->log2_chroma_h);
+    return {
+        cv::Mat(frame->height, frame->width, CV_8UC1, frame->data[0], frame->linesize[0]),
+        cv::Mat(chromaHeight, chromaWidth, CV_8UC1, frame->data[1], frame->linesize[1]),
+        cv::Mat(chromaHeight, chromaWidth, CV_8UC1, frame->data[2], frame->linesize[2])
+    };
+}
+
 #endif /* libav2opencv_h */
@@ -9,13 +9,17 @@
 #include <cassert>
 #include <csignal>
 #include <cstdio>
+#include <cstdlib>
 #include <string>
 #include <algorithm>
 #include <vector>
 #include <thread>
+#include <atomic>
 #include <mutex>
+#include <chrono>
 #include <functional>
 #include <iostream>
+#include <typeinfo>
 
 #include <log4cxx/logger.h>
 #include <log4cxx/basicconfigurator.h>
@@ -36,26 +40,46 @@ extern "C" {
 #include <libswresample/swresample.h>
 #include <libavutil/log.h>
 #include <libavutil/bprint.h>
+#include <libavutil/parseutils.h>
 }
 #include "common.hpp"
 #include "MediaReader.hpp"
 #include "MediaWriter.hpp"
 #include "Media.hpp"
 #include "ThreadsafeFrame.hpp"
+#include "PacketQueue.hpp"
 #include "ThreadManager.hpp"
-//#include "correct_perspective.hpp"
+#include "correct_perspective.hpp"
+#include "WorkerPool.hpp"
+#include "ScalingLadder.hpp"
+#include "EncodeScheduler.hpp"
 #include "libav2opencv.hpp"
 
 using avtools::MediaError;
 namespace
 {
     namespace bpo = ::boost::program_options;
+    /// Default number of warp threads: the warp scales up to about four cores, and the reader & writers need the rest
+    static const int DEFAULT_WARP_THREADS = (int) std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+    /// Default number of encode threads: one per core, which is also the budget the encoders' own threads are split from
+    static const int DEFAULT_ENCODE_THREADS = (int) std::max(1u, std::thread::hardware_concurrency());
+    /// How often the program end is checked for. ThreadManager::end() is called from the signal handler, so it cannot wake anyone.
+    static constexpr std::chrono::milliseconds END_CHECK_INTERVAL{100};
     /// @class A structure containing the pertinent ffmpeg options
     /// See https://www.ffmpeg.org/ffmpeg-devices.html for the list of codec & stream options
     struct Options
     {
         avtools::Dictionary codecOpts;      ///< codec options
         avtools::Dictionary muxerOpts;      ///< muxer options
+        avtools::Dictionary pipelineOpts;   ///< options for how the stream is fed from the frame bus
+    };
+
+    /// @class Parameters of the frame queue a consumer subscribes with
+    struct QueueOptions
+    {
+        avtools::ThreadsafeFrame::QueuePolicy policy;   ///< what to do when the queue is full
+        std::size_t capacity;                           ///< maximum number of frames in the queue
+        AVRational frameRate;                           ///< rate the consumer uses frames at, or 0 if it uses every frame
     };
 
     /// Prints options stream
@@ -64,7 +88,7 @@ namespace
     /// @return a reference to the output stream
     inline std::ostream& operator<<(std::ostream& stream, const Options& opts)
     {
-        return ( stream << "codec options:\n" << opts.codecOpts << "muxer options:\n" << opts.muxerOpts );
+        return ( stream << "codec options:\n" << opts.codecOpts << "muxer options:\n" << opts.muxerOpts << "pipeline options:\n" << opts.pipelineOpts );
     }
 
     /// Compares two strings
@@ -89,17 +113,79 @@ namespace
     /// @return an options structure with the muxer & codc options filled in from the values in pStr
     Options getOptsFromStream(const AVStream* pStr);
 
+    /// Determines the frame queue to use for an output from its pipeline options.
+    /// If not specified, live (HLS) outputs keep the latest frames, and other outputs are lossless.
+    /// @param[in] url output url
+    /// @param[in] opts output options
+    /// @return queue options to subscribe to the frame bus with
+    /// @throw std::runtime_error if the pipeline options could not be parsed
+    QueueOptions getQueueOptions(const std::string& url, const Options& opts);
+
+    /// Determines the frame queue of a consumer that feeds other consumers, such as a warper or a scaling ladder.
+    /// It has to be lossless if any of its consumers is, should buffer as much as its largest consumer queue, and should
+    /// get frames at the highest rate any of its consumers uses them at.
+    /// @param[in] consumers queue options of the downstream consumers
+    /// @return queue options to subscribe to the frame bus with
+    QueueOptions mergeQueueOptions(const std::vector<QueueOptions>& consumers);
+
+    /// Determines from its pipeline options whether an output remuxes the input's compressed packets without decoding & re-encoding them.
+    /// @param[in] url output url
+    /// @param[in] opts output options
+    /// @return true if "mode" is "passthrough", false if it is "decode" or not specified.
+    /// @throw std::runtime_error if the pipeline options could not be parsed
+    bool isPassthrough(const std::string& url, const Options& opts);
+
+    /// Determines from its pipeline options whether a perspective-corrected output is rendered directly from the decoded frames
+    /// at its own size & pixel format, rather than scaled from a shared full-size warped frame.
+    /// @param[in] url output url
+    /// @param[in] opts output options
+    /// @return true if "render" is "direct", false if it is "shared" or not specified.
+    /// @throw std::runtime_error if the pipeline options could not be parsed
+    bool isDirectRender(const std::string& url, const Options& opts);
+
+    /// Determines the size of the packet queue to use for a passthrough output from its pipeline options.
+    /// @param[in] url output url
+    /// @param[in] opts output options
+    /// @return maximum number of packets to queue for the output
+    /// @throw std::runtime_error if the pipeline options could not be parsed
+    std::size_t getPacketQueueSize(const std::string& url, const Options& opts);
+
+    /// Estimates the cost of encoding an output, as the number of pixels it encodes per second
+    /// @param[in] opts output options
+    /// @param[in] pInStr input video stream, whose size & frame rate are used if the output does not set its own
+    /// @return estimated cost of the output
+    double getEncodeCost(const Options& opts, const AVStream* pInStr);
+
     /// Function that starts a stream reader that reads from a stream int to a threaded frame
     /// @param[in,out] pFrame threadsafe frame to write to
     /// @param[in] rdr an opened media reader
+    /// @param[in,out] pReducedFrame threadsafe frame the reader's reduced-resolution decoder publishes to, if the reader has a reduced-resolution output
     /// @return a new thread that reads frames from the input stream and updates the threaded frame
-    std::thread threadedRead(std::weak_ptr<avtools::ThreadsafeFrame> pFrame, avtools::MediaReader& rdr);
+    std::thread threadedRead(std::weak_ptr<avtools::ThreadsafeFrame> pFrame, avtools::MediaReader& rdr,
+                             std::weak_ptr<avtools::ThreadsafeFrame> pReducedFrame = std::weak_ptr<avtools::ThreadsafeFrame>());
 
-    /// Function that starts a stream writer that writes to a stream from a threaded frame
-    /// @param[in] pFrame threadsafe frame to read from
-    /// @param[in] writer media writer instance
-    /// @return a new thread that reads frames from the input frame and writes to an output file
-    std::thread threadedWrite(std::weak_ptr<const avtools::ThreadsafeFrame> pFrame, avtools::MediaWriter& writer);
+    /// Function that starts a stream reader that only reads compressed packets, without decoding them, when all outputs are passthrough
+    /// @param[in] rdr an opened media reader
+    /// @return a new thread that reads packets from the input stream and pushes them to the reader's packet queues
+    std::thread threadedReadPackets(avtools::MediaReader& rdr);
+
+    /// Function that starts a stream reader that only decodes the reduced-resolution frames, when nothing uses the full-resolution frames
+    /// @param[in] rdr an opened media reader, whose reduced-resolution output is open
+    /// @param[in,out] pReducedFrame threadsafe frame to write the reduced-resolution frames to
+    /// @return a new thread that reads frames from the input stream at the reduced resolution and updates the threaded frame
+    std::thread threadedReadReduced(avtools::MediaReader& rdr, std::weak_ptr<avtools::ThreadsafeFrame> pReducedFrame);
+
+    /// Function that starts a stream writer that remuxes compressed packets from a packet queue
+    /// @param[in] pQueue packet queue to read from
+    /// @param[in] writer passthrough media writer instance
+    /// @return a new thread that reads packets from the queue and writes them to an output file
+    std::thread threadedRemux(std::shared_ptr<avtools::PacketQueue> pQueue, avtools::MediaWriter& writer);
+
+    /// Function that starts a thread that cancels the frame buses when the program ends, so that no producer or consumer keeps waiting on them
+    /// @param[in] buses frame buses to cancel. Empty pointers are skipped.
+    /// @param[in] isJoined set once all other threads have ended, which ends this thread without cancelling the buses
+    /// @return a new thread that waits for the program to end, and then cancels the frame buses
+    std::thread threadedCancel(std::vector< std::shared_ptr<avtools::ThreadsafeFrame> > buses, const std::atomic_bool& isJoined);
 
     /// Callback function for libav log messages - used to direct them to the logger
     /// @see av_log_default_callback, https://github.com/FFmpeg/FFmpeg/blob/n4.1.3/libavutil/log.c
@@ -115,15 +201,46 @@ namespace
     log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("zoombrd"));
     log4cxx::LoggerPtr libavLogger(log4cxx::Logger::getLogger("zoombrd.libav"));
     std::mutex g_libavLogMutex;
-} //::<anon>
 
-/// Launches a thread that creates a warped matrix of the input frame according to the given transform matrix
-/// Defined in @ref correct_perspective.cpp
-/// @param[in] pInFrame input frame
-/// @param[in, out] pWarpedFrame transformed output frame
-/// @param[in] trfMatrix transform matrix
-/// @return a new thread that runs in the background, updates the warpedFrame when a new inFrame is available.
-std::thread threadedWarp(std::weak_ptr<const avtools::ThreadsafeFrame> pInFrame, std::weak_ptr<avtools::ThreadsafeFrame> pWarpedFrame, const std::string& calibrationFile);
+    /// @class Keeps track of how long the reader is spending publishing frames to consumers, and logs it periodically.
+    /// Since consumers work on their own snapshots of frames, this should stay flat regardless of how many consumers there are, or how slow they are.
+    class UpdateLatencyStats
+    {
+    private:
+        static const int N_FRAMES = 300;                ///< number of frames to accumulate statistics over before logging
+        int nFrames_;                                   ///< number of frames since last log
+        std::chrono::steady_clock::duration total_;     ///< total update time since last log
+        std::chrono::steady_clock::duration max_;       ///< maximum update time since last log
+        int nSkipped_;                                  ///< number of frames skipped since last log, because no consumer wanted them
+    public:
+        /// Ctor
+        UpdateLatencyStats(): nFrames_(0), total_(0), max_(0), nSkipped_(0) {}
+
+        /// Counts a frame that was not published, because no consumer wanted it
+        void skip()
+        {
+            ++nSkipped_;
+        }
+
+        /// Adds an update duration, and logs the statistics every N_FRAMES frames
+        /// @param[in] duration time spent updating the frame
+        void add(std::chrono::steady_clock::duration duration)
+        {
+            total_ += duration;
+            max_ = std::max(max_, duration);
+            if (++nFrames_ == N_FRAMES)
+            {
+                using std::chrono::microseconds;
+                using std::chrono::duration_cast;
+                LOG4CXX_INFO(logger, "Frame update latency over " << nFrames_ << " frames: mean = "
+                             << duration_cast<microseconds>(total_).count() / nFrames_ << "us, max = "
+                             << duration_cast<microseconds>(max_).count() << "us, skipped " << nSkipped_ << " frames");
+                nFrames_ = nSkipped_ = 0;
+                total_ = max_ = std::chrono::steady_clock::duration(0);
+            }
+        }
+    };  //::<anon>::UpdateLatencyStats
+} //::<anon>
 
 /// Maintains communication between threads re: exceptions & program end
 ThreadManager g_ThreadMan;
@@ -162,6 +279,9 @@ int main(int argc, const char * argv[])
         ("calibration_file,c", bpo::value<std::string>(), "calibration file to use if using aruco markers, created by calibrate_camera. If one is provided, it is used to search for Aruco markers to use for perspective correction.")
         ("output,o", bpo::value<std::string>()->default_value("output.json"), "output file or configuration file")
         ("input,i", bpo::value<std::string>()->default_value("input.json"), "input file or configuration file.")
+        ("warp_threads,t", bpo::value<int>()->default_value(DEFAULT_WARP_THREADS), "number of threads used to correct the perspective of each frame.")
+        ("encode_threads,e", bpo::value<int>()->default_value(DEFAULT_ENCODE_THREADS), "number of threads the outputs are encoded on. Unless an output sets its own codec threads, this is also split between the outputs' encoders in proportion to their pixel rates.")
+        ("pixel_format,p", bpo::value<std::string>()->default_value("bgr24"), "pixel format the decoded frames are processed in: bgr24, or yuv420p which halves the memory traffic and does not need to be converted for yuv420p outputs.")
     #ifndef NDEBUG
         ("quiet,q", "suppresses messages that are not errors or warnings in debug builds")
     #endif
@@ -215,7 +335,19 @@ int main(int argc, const char * argv[])
     LOG4CXX_DEBUG(logger, "Program arguments:");
     for (auto it: vm)
     {
-        LOG4CXX_DEBUG(logger, it.first << ": " << it.second.as<std::string>());
+        const std::type_info& type = it.second.value().type();
+        if (type == typeid(std::string))
+        {
+            LOG4CXX_DEBUG(logger, it.first << ": " << it.second.as<std::string>());
+        }
+        else if (type == typeid(int))
+        {
+            LOG4CXX_DEBUG(logger, it.first << ": " << it.second.as<int>());
+        }
+        else
+        {
+            LOG4CXX_DEBUG(logger, it.first);    //switch without a value
+        }
     }
 
     const AVStream* pVidStr =  nullptr;
@@ -248,7 +380,12 @@ int main(int argc, const char * argv[])
         assert(inputOpts.size() == 1);
         LOG4CXX_DEBUG(logger, "Opening reader for " << inputOpts.begin()->first);
 
-        avtools::MediaReader rdr(inputOpts.begin()->first, inputOpts.begin()->second.muxerOpts);
+        const AVPixelFormat pixFmt = av_get_pix_fmt(vm["pixel_format"].as<std::string>().c_str());
+        if (!isSupportedPixelFormat(pixFmt))
+        {
+            throw std::runtime_error("Frames can only be processed in bgr24 or yuv420p, found " + vm["pixel_format"].as<std::string>());
+        }
+        avtools::MediaReader rdr(inputOpts.begin()->first, inputOpts.begin()->second.muxerOpts, inputOpts.begin()->second.codecOpts, pixFmt);
         pVidStr = rdr.getVideoStream();
         if ( !pVidStr )
         {
@@ -256,16 +393,19 @@ int main(int argc, const char * argv[])
         }
         LOG4CXX_DEBUG(logger, "Input stream info:\n" << avtools::getStreamInfo(pVidStr) );
 
-        auto pInFrame = avtools::ThreadsafeFrame::Get(pVidStr->codecpar->width, pVidStr->codecpar->height, PIX_FMT, pVidStr->time_base);
-
-        std::cout << "press Ctrl+C to exit..." << std::endl;
-        g_ThreadMan.addThread(threadedRead(pInFrame, rdr));
+        auto pInFrame = avtools::ThreadsafeFrame::Get(pVidStr->codecpar->width, pVidStr->codecpar->height, pixFmt, pVidStr->time_base);
 
         // -----------
         // Open the outputs and start writer threads
         // -----------
         // Open the writer(s)
         std::vector<avtools::MediaWriter> writers;
+        std::vector<QueueOptions> queueOpts;    //frame queue to use for each writer
+        std::vector<bool> isDirect;             //whether each writer is rendered directly by its own warper
+        std::vector<int> encoderThreads;        //number of threads of each writer's encoder, or 0 if the encoder chooses
+        EncodeScheduler scheduler(vm["encode_threads"].as<int>());
+        std::vector<avtools::MediaWriter> remuxers;     //passthrough writers, that remux the compressed input packets
+        std::vector<std::size_t> packetQueueSizes;      //packet queue size to use for each remuxer
         const fs::path output = vm["output"].as<std::string>();
         if ( strequals(output.extension().string(), ".json") )
         {
@@ -276,12 +416,38 @@ int main(int argc, const char * argv[])
             LOG4CXX_INFO(logger, "Using output configuration file: " << output);
 
             std::map<std::string, Options> outputOpts = getOptions(output.string());
+            // The encoders' threads are split from the same budget as the scheduler's, so that they do not oversubscribe the cores
+            std::vector<double> encodeCosts;
+            for (const auto& opt: outputOpts)
+            {
+                if (!isPassthrough(opt.first, opt.second))
+                {
+                    encodeCosts.push_back(getEncodeCost(opt.second, pVidStr));
+                }
+            }
+            const std::vector<int> threadBudget = EncodeScheduler::splitThreads(encodeCosts, vm["encode_threads"].as<int>());
             for (auto opt: outputOpts)
             {
                 LOG4CXX_DEBUG(logger, "Found requested output stream: " << opt.first);
                 setUpOutputLocations(fs::path(opt.first), vm.count("yes"));
+                if (isPassthrough(opt.first, opt.second))
+                {
+                    LOG4CXX_DEBUG(logger, "Opening passthrough writer for URL: " << opt.first <<"\nOptions: " << opt.second);
+                    remuxers.emplace_back(opt.first, pVidStr, opt.second.muxerOpts);
+                    packetQueueSizes.push_back(getPacketQueueSize(opt.first, opt.second));
+                    LOG4CXX_DEBUG(logger, "Output stream info:\n" << avtools::getStreamInfo(remuxers.back().getStream()));
+                    continue;
+                }
+                if (!opt.second.codecOpts.has("threads"))
+                {
+                    opt.second.codecOpts.add("threads", std::to_string(threadBudget[writers.size()]));
+                }
+                encoderThreads.push_back(std::atoi(opt.second.codecOpts["threads"].c_str()));
                 LOG4CXX_DEBUG(logger, "Opening writer for URL: " << opt.first <<"\nOptions: " << opt.second);
                 writers.emplace_back(opt.first, opt.second.codecOpts, opt.second.muxerOpts);
+                queueOpts.push_back(getQueueOptions(opt.first, opt.second));
+                queueOpts.back().frameRate = writers.back().getStream()->avg_frame_rate;
+                isDirect.push_back(isDirectRender(opt.first, opt.second));
                 LOG4CXX_DEBUG(logger, "Output stream info:\n" << avtools::getStreamInfo(writers.back().getStream()));
             }
         }
@@ -289,33 +455,235 @@ int main(int argc, const char * argv[])
         {
             LOG4CXX_INFO(logger, "Using output file: " << output);
             Options outOpts = getOptsFromStream(pVidStr);   //copy required options from the input stream
+            outOpts.codecOpts.add("threads", std::to_string(vm["encode_threads"].as<int>()));
+            encoderThreads.push_back(vm["encode_threads"].as<int>());
             writers.emplace_back(output.string(), outOpts.codecOpts, outOpts.muxerOpts);
+            queueOpts.push_back(getQueueOptions(output.string(), outOpts));
+            queueOpts.back().frameRate = writers.back().getStream()->avg_frame_rate;
+            isDirect.push_back(false);
+        }
+        assert( (queueOpts.size() == writers.size()) && (isDirect.size() == writers.size()) && (encoderThreads.size() == writers.size()) );
+        assert(packetQueueSizes.size() == remuxers.size());
+
+        // Start the passthrough writers. These get the compressed packets as they are read, and do not need the frame bus.
+        if ( !remuxers.empty() && vm.count("calibration_file") )
+        {
+            LOG4CXX_WARN(logger, "Passthrough outputs are not perspective corrected.");
+        }
+        for (std::size_t i = 0; i < remuxers.size(); ++i)
+        {
+            g_ThreadMan.addThread( threadedRemux(rdr.subscribePackets(packetQueueSizes[i]), remuxers[i]) );
+        }
+
+        // Outputs at half the input resolution or less can be fed from frames that are decoded at a reduced resolution,
+        // if the input codec supports it. This is much cheaper than decoding at full resolution and then scaling down.
+        std::vector<bool> isReduced(writers.size(), false);     //whether each writer is fed from the reduced-resolution frames
+        std::shared_ptr<avtools::ThreadsafeFrame> pReducedFrame;
+        {
+            int reducedWidth = 0, reducedHeight = 0;
+            for (std::size_t i = 0; i < writers.size(); ++i)
+            {
+                const AVCodecParameters* pOutPar = writers[i].getStream()->codecpar;
+                if ( (2 * pOutPar->width <= pVidStr->codecpar->width) && (2 * pOutPar->height <= pVidStr->codecpar->height) )
+                {
+                    isReduced[i] = true;
+                    reducedWidth = std::max(reducedWidth, pOutPar->width);
+                    reducedHeight = std::max(reducedHeight, pOutPar->height);
+                }
+            }
+            if ( (reducedWidth > 0) && rdr.openReducedOutput(reducedWidth, reducedHeight) )
+            {
+                pReducedFrame = avtools::ThreadsafeFrame::Get(reducedWidth, reducedHeight, pixFmt, pVidStr->time_base);
+            }
+            else
+            {
+                std::fill(isReduced.begin(), isReduced.end(), false);
+            }
+        }
+
+        // Directly rendered outputs are warped straight from the decoded frames to their own size & pixel format, so their
+        // filter graphs do not need to scale or convert full-size warped frames
+        std::vector< std::shared_ptr<avtools::ThreadsafeFrame> > directFrames(writers.size());   //frames rendered directly for each writer
+        for (std::size_t i = 0; i < writers.size(); ++i)
+        {
+            if (!isDirect[i])
+            {
+                continue;
+            }
+            if (!vm.count("calibration_file"))
+            {
+                LOG4CXX_WARN(logger, "Output " << writers[i].url() << " is only rendered directly with perspective correction.");
+                continue;
+            }
+            const AVCodecParameters* pOutPar = writers[i].getStream()->codecpar;
+            const bool isYUV = (pOutPar->format == AV_PIX_FMT_YUV420P) && (pOutPar->width % 2 == 0) && (pOutPar->height % 2 == 0);
+            directFrames[i] = avtools::ThreadsafeFrame::Get(pOutPar->width, pOutPar->height, isYUV ? AV_PIX_FMT_YUV420P : PIX_FMT, pVidStr->time_base);
+            LOG4CXX_INFO(logger, "Output " << writers[i].url() << " is rendered directly at " << pOutPar->width << "x" << pOutPar->height
+                         << " in " << directFrames[i]->format());
+        }
+
+        // The other yuv420p outputs are rendered by a scaling ladder for each source size, which converts the frames to yuv420p once
+        // and scales them to every output size, cascading from the larger sizes, so their filter graphs neither scale nor convert
+        std::unique_ptr<ScalingLadder> pLadder, pReducedLadder;
+        std::vector< std::shared_ptr<avtools::ThreadsafeFrame> > ladderFrames(writers.size());  //frames rendered by a ladder for each writer
+        std::vector<QueueOptions> ladderConsumers, reducedLadderConsumers;
+        for (std::size_t i = 0; i < writers.size(); ++i)
+        {
+            const AVCodecParameters* pOutPar = writers[i].getStream()->codecpar;
+            const int srcWidth = (isReduced[i] ? pReducedFrame->width() : pVidStr->codecpar->width);
+            const int srcHeight = (isReduced[i] ? pReducedFrame->height() : pVidStr->codecpar->height);
+            const bool isSourceSize = (pOutPar->width == srcWidth) && (pOutPar->height == srcHeight) && (pixFmt == AV_PIX_FMT_YUV420P);
+            if (directFrames[i] || isSourceSize || !ScalingLadder::canRender(pOutPar->width, pOutPar->height, (AVPixelFormat) pOutPar->format))
+            {
+                continue;
+            }
+            auto& pL = (isReduced[i] ? pReducedLadder : pLadder);
+            if (!pL)
+            {
+                pL.reset(new ScalingLadder(srcWidth, srcHeight, pixFmt, pVidStr->time_base));
+            }
+            ladderFrames[i] = pL->getRendition(pOutPar->width, pOutPar->height);
+            (isReduced[i] ? reducedLadderConsumers : ladderConsumers).push_back(queueOpts[i]);
+        }
+        const QueueOptions ladderQueueOpts = mergeQueueOptions(ladderConsumers);
+        const QueueOptions reducedLadderQueueOpts = mergeQueueOptions(reducedLadderConsumers);
+
+        // Build the writers' filter graphs now, so that the first frames do not have to wait for them
+        for (std::size_t i = 0; i < writers.size(); ++i)
+        {
+            if (directFrames[i])
+            {
+                writers[i].prepare(directFrames[i]->width(), directFrames[i]->height(), directFrames[i]->format(), pVidStr->time_base, pVidStr->codecpar->sample_aspect_ratio);
+                continue;
+            }
+            if (ladderFrames[i])
+            {
+                writers[i].prepare(ladderFrames[i]->width(), ladderFrames[i]->height(), ladderFrames[i]->format(), pVidStr->time_base, pVidStr->codecpar->sample_aspect_ratio);
+                continue;
+            }
+            const int width = (isReduced[i] ? pReducedFrame->width() : pVidStr->codecpar->width);
+            const int height = (isReduced[i] ? pReducedFrame->height() : pVidStr->codecpar->height);
+            writers[i].prepare(width, height, pixFmt, pVidStr->time_base, pVidStr->codecpar->sample_aspect_ratio);
         }
 
         // Start writing (and correct perspective if requested)
-        auto pTrfFrame = avtools::ThreadsafeFrame::Get(pVidStr->codecpar->width, pVidStr->codecpar->height, PIX_FMT, pVidStr->time_base);
-        if (vm.count("calibration_file"))
+        auto pTrfFrame = avtools::ThreadsafeFrame::Get(pVidStr->codecpar->width, pVidStr->codecpar->height, pixFmt, pVidStr->time_base);
+        std::shared_ptr<avtools::ThreadsafeFrame> pReducedTrfFrame;
+        if (writers.empty())
+        {
+            LOG4CXX_INFO(logger, "All outputs are passthrough, the input will not be decoded.");
+        }
+        else if (vm.count("calibration_file"))
         {
             LOG4CXX_INFO(logger, "Calibration file found, will use Aruco markers for perspective adjustment.");
-            assert( (AV_NOPTS_VALUE == (*pTrfFrame)->best_effort_timestamp) && (AV_NOPTS_VALUE == (*pTrfFrame)->pts) );
-            g_ThreadMan.addThread( threadedWarp(pInFrame, pTrfFrame, vm["calibration_file"].as<std::string>()) );
+            // Each warper only warps the frames that the writers using its frames will encode
+            std::vector<QueueOptions> warpConsumers, reducedWarpConsumers;
+            for (std::size_t i = 0; i < writers.size(); ++i)
+            {
+                if (!directFrames[i])
+                {
+                    (isReduced[i] ? reducedWarpConsumers : warpConsumers).push_back(queueOpts[i]);
+                }
+            }
+            const bool isWarped = !warpConsumers.empty(), isReducedWarped = !reducedWarpConsumers.empty();
+            const QueueOptions warpQueueOpts = mergeQueueOptions(warpConsumers);
+            const QueueOptions reducedWarpQueueOpts = mergeQueueOptions(reducedWarpConsumers);
+            // The markers are detected at full resolution, on the newest frame only; all warpers use the transform it publishes
+            auto pTransform = std::make_shared<SharedTransform>();
+            const int nWarpThreads = vm["warp_threads"].as<int>();
+            if (nWarpThreads < 1)
+            {
+                throw std::runtime_error("Number of warp threads should be positive, found " + std::to_string(nWarpThreads));
+            }
+            auto pWarpPool = std::make_shared<WorkerPool>(nWarpThreads);
+            if (isReducedWarped)
+            {
+                pReducedTrfFrame = avtools::ThreadsafeFrame::Get(pReducedFrame->width(), pReducedFrame->height(), pixFmt, pVidStr->time_base);
+                g_ThreadMan.addThread( threadedWarp(pReducedFrame->subscribe(reducedWarpQueueOpts.capacity, reducedWarpQueueOpts.policy, reducedWarpQueueOpts.frameRate), pReducedTrfFrame, pWarpPool, pTransform) );
+            }
+            if (isWarped)
+            {
+                g_ThreadMan.addThread( threadedWarp(pInFrame->subscribe(warpQueueOpts.capacity, warpQueueOpts.policy, warpQueueOpts.frameRate), pTrfFrame, pWarpPool, pTransform) );
+            }
+            for (std::size_t i = 0; i < writers.size(); ++i)
+            {
+                if (directFrames[i])
+                {
+                    auto& pSrcFrame = (isReduced[i] ? pReducedFrame : pInFrame);
+                    g_ThreadMan.addThread( threadedWarp(pSrcFrame->subscribe(queueOpts[i].capacity, queueOpts[i].policy, queueOpts[i].frameRate), directFrames[i], pWarpPool, pTransform) );
+                }
+            }
+            // The last transform is saved next to the calibration file, for each camera & resolution, so a restart is corrected from its first frame
+            const std::string calibrationFile = vm["calibration_file"].as<std::string>();
+            const cv::Size inSize(pInFrame->width(), pInFrame->height());
+            if (pLadder)
+            {
+                g_ThreadMan.addThread( pLadder->start(pTrfFrame->subscribe(ladderQueueOpts.capacity, ladderQueueOpts.policy, ladderQueueOpts.frameRate)) );
+            }
+            if (pReducedLadder)
+            {
+                g_ThreadMan.addThread( pReducedLadder->start(pReducedTrfFrame->subscribe(reducedLadderQueueOpts.capacity, reducedLadderQueueOpts.policy, reducedLadderQueueOpts.frameRate)) );
+            }
+            // The markers are tracked at the highest output rate, since no output shows the frames in between
+            g_ThreadMan.addThread( threadedDetect(pInFrame->subscribe(1, avtools::ThreadsafeFrame::QueuePolicy::LATEST, mergeQueueOptions(queueOpts).frameRate), calibrationFile,
+                                                  getStateFile(calibrationFile, inputOpts.begin()->first, inSize), inSize, pTransform) );
             // add writers to writer perspective transformed frames
-            for (auto &writer : writers)
+            for (std::size_t i = 0; i < writers.size(); ++i)
             {
-                g_ThreadMan.addThread( threadedWrite(pTrfFrame, writer) );
+                auto& pFrame = (ladderFrames[i] ? ladderFrames[i] : (directFrames[i] ? directFrames[i] : (isReduced[i] ? pReducedTrfFrame : pTrfFrame)));
+                scheduler.addOutput(pFrame->subscribe(queueOpts[i].capacity, queueOpts[i].policy, queueOpts[i].frameRate), writers[i], encoderThreads[i]);
             }
         }
         else
         {
             LOG4CXX_INFO(logger, "No calibration file provided, continuing without perspective adjustment.");
+            if (pLadder)
+            {
+                g_ThreadMan.addThread( pLadder->start(pInFrame->subscribe(ladderQueueOpts.capacity, ladderQueueOpts.policy, ladderQueueOpts.frameRate)) );
+            }
+            if (pReducedLadder)
+            {
+                g_ThreadMan.addThread( pReducedLadder->start(pReducedFrame->subscribe(reducedLadderQueueOpts.capacity, reducedLadderQueueOpts.policy, reducedLadderQueueOpts.frameRate)) );
+            }
             // add writers to writer input frames
-            for (auto &writer : writers)
+            for (std::size_t i = 0; i < writers.size(); ++i)
             {
-                g_ThreadMan.addThread( threadedWrite(pInFrame, writer) );
+                auto& pFrame = (ladderFrames[i] ? ladderFrames[i] : (isReduced[i] ? pReducedFrame : pInFrame));
+                scheduler.addOutput(pFrame->subscribe(queueOpts[i].capacity, queueOpts[i].policy, queueOpts[i].frameRate), writers[i], encoderThreads[i]);
             }
         }
+        for (auto& thread: scheduler.start())
+        {
+            g_ThreadMan.addThread(std::move(thread));
+        }
+
+        // Start reading only after all consumers have subscribed, so that lossless outputs do not miss the first frames
+        std::cout << "press Ctrl+C to exit..." << std::endl;
+        if (writers.empty())
+        {
+            g_ThreadMan.addThread(threadedReadPackets(rdr));
+        }
+        else if ( pReducedFrame && !pInFrame->hasSubscriptions() )
+        {
+            LOG4CXX_INFO(logger, "Nothing uses the full-resolution frames, only decoding at the reduced resolution.");
+            pInFrame->close();
+            g_ThreadMan.addThread(threadedReadReduced(rdr, pReducedFrame));
+        }
+        else
+        {
+            g_ThreadMan.addThread(threadedRead(pInFrame, rdr, pReducedFrame));
+        }
+
+        // The signal handler cannot wake the threads waiting on the frame buses, so the buses are cancelled from another thread
+        std::vector< std::shared_ptr<avtools::ThreadsafeFrame> > buses{pInFrame, pReducedFrame, pTrfFrame, pReducedTrfFrame};
+        buses.insert(buses.end(), directFrames.begin(), directFrames.end());
+        buses.insert(buses.end(), ladderFrames.begin(), ladderFrames.end());
+        std::atomic_bool isJoined(false);
+        std::thread cancelThread = threadedCancel(std::move(buses), isJoined);
 
         g_ThreadMan.join();
+        isJoined.store(true);
+        cancelThread.join();
         LOG4CXX_DEBUG(logger, "Joined all threads");
 
         // -----------
@@ -405,6 +773,22 @@ namespace
         {
             throw std::runtime_error("Unable to parse codec options for " + node.name());
         }
+
+        //Find pipeline options
+        n = node["pipeline_options"];
+        if (n.empty() || n.isNone())
+        {
+            LOG4CXX_DEBUG(logger, "No pipeline options found for " << node.name());
+        }
+        else if (n.isMap())
+        {
+            //Read all options to dict
+            readMapIntoDict(n, opts.pipelineOpts);
+        }
+        else
+        {
+            throw std::runtime_error("Unable to parse pipeline options for " + node.name());
+        }
         return opts;
     }
 
@@ -504,6 +888,148 @@ namespace
         return opts;
     }
 
+    /// Parses the queue size from the pipeline options
+    /// @param[in] url output url
+    /// @param[in] opts output options
+    /// @param[in] defaultSize queue size to use if none is specified
+    /// @return queue size
+    std::size_t parseQueueSize(const std::string& url, const Options& opts, std::size_t defaultSize)
+    {
+        if (!opts.pipelineOpts.has("queue_size"))
+        {
+            return defaultSize;
+        }
+        try
+        {
+            const int size = std::stoi(opts.pipelineOpts["queue_size"]);
+            if (size <= 0)
+            {
+                throw std::out_of_range("queue size should be positive");
+            }
+            return size;
+        }
+        catch (std::exception& err)
+        {
+            std::throw_with_nested( std::runtime_error("Unable to parse queue size for " + url) );
+        }
+    }
+
+    QueueOptions getQueueOptions(const std::string& url, const Options& opts)
+    {
+        static const std::size_t LOSSLESS_QUEUE_SIZE = 8;  ///< default queue size for lossless outputs
+        static const std::size_t LATEST_QUEUE_SIZE = 2;    ///< default queue size for live outputs
+        const bool isLive = strequals(fs::path(url).extension().string(), ".m3u8");
+        QueueOptions qOpts{isLive ? avtools::ThreadsafeFrame::QueuePolicy::LATEST : avtools::ThreadsafeFrame::QueuePolicy::LOSSLESS, 0, AVRational{0, 1}};
+        if (opts.pipelineOpts.has("queue_policy"))
+        {
+            const std::string policy = opts.pipelineOpts["queue_policy"];
+            if (strequals(policy, "lossless"))
+            {
+                qOpts.policy = avtools::ThreadsafeFrame::QueuePolicy::LOSSLESS;
+            }
+            else if (strequals(policy, "latest"))
+            {
+                qOpts.policy = avtools::ThreadsafeFrame::QueuePolicy::LATEST;
+            }
+            else
+            {
+                throw std::runtime_error("Unknown queue policy \"" + policy + "\" for " + url + ", should be \"lossless\" or \"latest\"");
+            }
+        }
+        qOpts.capacity = parseQueueSize(url, opts, qOpts.policy == avtools::ThreadsafeFrame::QueuePolicy::LOSSLESS ? LOSSLESS_QUEUE_SIZE : LATEST_QUEUE_SIZE);
+        LOG4CXX_DEBUG(logger, "Frame queue for " << url << ": " << (qOpts.policy == avtools::ThreadsafeFrame::QueuePolicy::LOSSLESS ? "lossless" : "latest")
+                      << ", size = " << qOpts.capacity);
+        return qOpts;
+    }
+
+    QueueOptions mergeQueueOptions(const std::vector<QueueOptions>& consumers)
+    {
+        QueueOptions qOpts{avtools::ThreadsafeFrame::QueuePolicy::LATEST, 1, AVRational{0, 1}};
+        bool isEveryFrame = consumers.empty();     //a consumer without a rate uses every frame
+        for (const auto& opts: consumers)
+        {
+            if (opts.policy == avtools::ThreadsafeFrame::QueuePolicy::LOSSLESS)
+            {
+                qOpts.policy = avtools::ThreadsafeFrame::QueuePolicy::LOSSLESS;
+            }
+            qOpts.capacity = std::max(qOpts.capacity, opts.capacity);
+            if ( (opts.frameRate.num <= 0) || (opts.frameRate.den <= 0) )
+            {
+                isEveryFrame = true;
+            }
+            else if ( (qOpts.frameRate.num == 0) || (av_cmp_q(opts.frameRate, qOpts.frameRate) > 0) )
+            {
+                qOpts.frameRate = opts.frameRate;
+            }
+        }
+        if (isEveryFrame)
+        {
+            qOpts.frameRate = AVRational{0, 1};
+        }
+        return qOpts;
+    }
+
+    bool isPassthrough(const std::string& url, const Options& opts)
+    {
+        if (!opts.pipelineOpts.has("mode"))
+        {
+            return false;
+        }
+        const std::string mode = opts.pipelineOpts["mode"];
+        if (strequals(mode, "passthrough"))
+        {
+            return true;
+        }
+        else if (strequals(mode, "decode"))
+        {
+            return false;
+        }
+        throw std::runtime_error("Unknown mode \"" + mode + "\" for " + url + ", should be \"decode\" or \"passthrough\"");
+    }
+
+    bool isDirectRender(const std::string& url, const Options& opts)
+    {
+        if (!opts.pipelineOpts.has("render"))
+        {
+            return false;
+        }
+        const std::string render = opts.pipelineOpts["render"];
+        if (strequals(render, "direct"))
+        {
+            return true;
+        }
+        else if (strequals(render, "shared"))
+        {
+            return false;
+        }
+        throw std::runtime_error("Unknown render \"" + render + "\" for " + url + ", should be \"shared\" or \"direct\"");
+    }
+
+    std::size_t getPacketQueueSize(const std::string& url, const Options& opts)
+    {
+        static const std::size_t PACKET_QUEUE_SIZE = 64;   ///< default packet queue size, a few seconds of video
+        const std::size_t size = parseQueueSize(url, opts, PACKET_QUEUE_SIZE);
+        LOG4CXX_DEBUG(logger, "Packet queue for " << url << ": size = " << size);
+        return size;
+    }
+
+    double getEncodeCost(const Options& opts, const AVStream* pInStr)
+    {
+        assert(pInStr);
+        int width = pInStr->codecpar->width, height = pInStr->codecpar->height;
+        AVRational fps = pInStr->avg_frame_rate;
+        if ( opts.codecOpts.has("video_size") && (av_parse_video_size(&width, &height, opts.codecOpts["video_size"].c_str()) < 0) )
+        {
+            width = pInStr->codecpar->width;
+            height = pInStr->codecpar->height;
+        }
+        if ( opts.muxerOpts.has("framerate") && (av_parse_video_rate(&fps, opts.muxerOpts["framerate"].c_str()) < 0) )
+        {
+            fps = pInStr->avg_frame_rate;
+        }
+        return (double) width * height * ( (fps.num > 0) && (fps.den > 0) ? av_q2d(fps) : 1. );
+    }
+
     int convertAVLevelToLog4CXXLevel(int level)
     {
         switch (level)
@@ -610,19 +1136,25 @@ namespace
     // -------------------------
     // Threaded reader & writer functions
     // -------------------------
-    std::thread threadedRead(std::weak_ptr<avtools::ThreadsafeFrame> pFrame, avtools::MediaReader& rdr)
+    std::thread threadedRead(std::weak_ptr<avtools::ThreadsafeFrame> pFrame, avtools::MediaReader& rdr, std::weak_ptr<avtools::ThreadsafeFrame> pReducedFrame)
     {
-        return std::thread([pFrame, &rdr](){
+        return std::thread([pFrame, &rdr, pReducedFrame](){
             try
             {
                 log4cxx::MDC::put("threadname", "reader");
                 avtools::Frame frame(*rdr.getVideoStream()->codecpar);
+                if (auto ppReducedFrame = pReducedFrame.lock())
+                {
+                    rdr.publishReduced(ppReducedFrame);     //the reader decodes & publishes these on its own thread, and closes the bus when the input ends
+                }
+                UpdateLatencyStats stats;
                 while (!g_ThreadMan.isEnded())
                 {
                     const AVStream* pS = rdr.read(frame);
                     if (!pS)
                     {
-                        g_ThreadMan.end(); //if the reader ends, end program
+                        //if the reader ends, closing the frame bus below lets the consumers drain their queues & end
+                        LOG4CXX_DEBUG(logger, "Reached end of input.");
                         break;
                     }
                     frame->best_effort_timestamp -= pS->start_time;
@@ -634,7 +1166,17 @@ namespace
                     {
                         throw std::runtime_error("Threaded input frame is null.");
                     }
-                    ppFrame->update(frame);
+                    // Frames that no consumer will use are neither converted nor published
+                    if (ppFrame->isWanted(frame->pts))
+                    {
+                        const auto start = std::chrono::steady_clock::now();
+                        ppFrame->update(frame);
+                        stats.add(std::chrono::steady_clock::now() - start);
+                    }
+                    else
+                    {
+                        stats.skip();
+                    }
                 }
             }
             catch (std::exception& err)
@@ -646,50 +1188,95 @@ namespace
                 catch (...)
                 {
                     g_ThreadMan.addException(std::current_exception());
+                    g_ThreadMan.end();
                 }
             }
-            g_ThreadMan.end();
+            if (auto ppFrame = pFrame.lock())
+            {
+                ppFrame->close();   //let the consumers know that no more frames are coming
+            }
+            if (auto ppReducedFrame = pReducedFrame.lock())
+            {
+                ppReducedFrame->close();    //already closed if the input ended, but not if the reader stopped early
+            }
+            rdr.closePacketQueues();
             LOG4CXX_DEBUG(logger, "Exiting thread: isEnded=" << std::boolalpha << g_ThreadMan.isEnded());
         });
     }
 
-    std::thread threadedWrite(std::weak_ptr<const avtools::ThreadsafeFrame> pFrame, avtools::MediaWriter& writer)
+    std::thread threadedReadPackets(avtools::MediaReader& rdr)
     {
-        return std::thread([pFrame, &writer](){
+        return std::thread([&rdr](){
             try
             {
-                log4cxx::MDC::put("threadname", fs::path(writer.url()).stem().string() + " writer");
-                avtools::TimeType ts = AV_NOPTS_VALUE;
+                log4cxx::MDC::put("threadname", "reader");
                 while (!g_ThreadMan.isEnded())
                 {
-                    auto ppFrame = pFrame.lock();
-                    if (!ppFrame)
+                    if (!rdr.readPacket())
                     {
-                        LOG4CXX_DEBUG(logger, "Writer received null frame - closing.");
+                        LOG4CXX_DEBUG(logger, "Reached end of input.");
                         break;
                     }
-                    const auto& inFrame = *ppFrame;
+                }
+            }
+            catch (std::exception& err)
+            {
+                try
+                {
+                    std::throw_with_nested( std::runtime_error("Reader thread error") );
+                }
+                catch (...)
+                {
+                    g_ThreadMan.addException(std::current_exception());
+                    g_ThreadMan.end();
+                }
+            }
+            rdr.closePacketQueues();    //let the remuxers know that no more packets are coming
+            LOG4CXX_DEBUG(logger, "Exiting thread: isEnded=" << std::boolalpha << g_ThreadMan.isEnded());
+        });
+    }
+
+    std::thread threadedReadReduced(avtools::MediaReader& rdr, std::weak_ptr<avtools::ThreadsafeFrame> pReducedFrame)
+    {
+        return std::thread([&rdr, pReducedFrame](){
+            try
+            {
+                log4cxx::MDC::put("threadname", "reader");
+                avtools::Frame reducedFrame(nullptr, AVMEDIA_TYPE_VIDEO, rdr.getVideoStream()->time_base);
+                UpdateLatencyStats stats;
+                while (!g_ThreadMan.isEnded())
+                {
+                    const AVStream* pS = rdr.readReducedOnly(reducedFrame);
+                    if (!pS)
+                    {
+                        //if the reader ends, closing the frame bus below lets the consumers drain their queues & end
+                        LOG4CXX_DEBUG(logger, "Reached end of input.");
+                        break;
+                    }
+                    reducedFrame->best_effort_timestamp -= pS->start_time;
+                    reducedFrame->pts -= pS->start_time;
+                    auto ppReducedFrame = pReducedFrame.lock();
+                    if (!ppReducedFrame)
+                    {
+                        throw std::runtime_error("Threaded reduced-resolution frame is null.");
+                    }
+                    if (ppReducedFrame->isWanted(reducedFrame->pts))
+                    {
+                        const auto start = std::chrono::steady_clock::now();
+                        ppReducedFrame->update(reducedFrame);
+                        stats.add(std::chrono::steady_clock::now() - start);
+                    }
+                    else
                     {
-                        auto lock = inFrame.getReadLock();
-                        LOG4CXX_DEBUG(logger, "Waiting for incoming frame.");
-                        inFrame.cv.wait(lock, [&inFrame, ts](){return g_ThreadMan.isEnded() || (inFrame->best_effort_timestamp > ts);});   //note that we assume the timebase of the incoming frames do not change
-                        if ( !g_ThreadMan.isEnded() )
-                        {
-                            assert(inFrame->best_effort_timestamp > ts);
-                            ts = inFrame->best_effort_timestamp;
-                            LOG4CXX_DEBUG(logger, "Writer received frame:\n" << inFrame.info(1));
-                            //Push frame to filtergraph
-                            writer.write(inFrame);
-                        }
+                        stats.skip();
                     }
                 }
             }
             catch (std::exception& err)
             {
-                LOG4CXX_ERROR(logger, "Caught writer exception: " << err.what());
                 try
                 {
-                    std::throw_with_nested( std::runtime_error("writer thread error") );
+                    std::throw_with_nested( std::runtime_error("Reader thread error") );
                 }
                 catch (...)
                 {
@@ -697,11 +1284,83 @@ namespace
                     g_ThreadMan.end();
                 }
             }
-            //Cleanup writer
-            LOG4CXX_DEBUG(logger, "Closing writer");
-            writer.write(nullptr, avtools::TimeBaseType{});
+            if (auto ppReducedFrame = pReducedFrame.lock())
+            {
+                ppReducedFrame->close();   //let the consumers know that no more frames are coming
+            }
+            rdr.closePacketQueues();
             LOG4CXX_DEBUG(logger, "Exiting thread: isEnded=" << std::boolalpha << g_ThreadMan.isEnded());
         });
     }
 
+    std::thread threadedRemux(std::shared_ptr<avtools::PacketQueue> pQueue, avtools::MediaWriter& writer)
+    {
+        assert(pQueue);
+        return std::thread([pQueue, &writer](){
+            static const int STATS_INTERVAL = 300;  //log queue statistics every this many packets
+            try
+            {
+                log4cxx::MDC::put("threadname", fs::path(writer.url()).stem().string() + " remuxer");
+                avtools::Packet pkt;
+                int nPackets = 0;
+                while (!g_ThreadMan.isEnded())
+                {
+                    if ( !pQueue->pop(pkt) )
+                    {
+                        LOG4CXX_DEBUG(logger, "Remuxer input closed.");
+                        break;
+                    }
+                    writer.writePacket(pkt.get());
+                    pkt.unref();
+                    if (++nPackets == STATS_INTERVAL)
+                    {
+                        LOG4CXX_INFO(logger, "Remuxer packet queue: " << pQueue->stats());
+                        nPackets = 0;
+                    }
+                }
+            }
+            catch (std::exception& err)
+            {
+                LOG4CXX_ERROR(logger, "Caught remuxer exception: " << err.what());
+                try
+                {
+                    std::throw_with_nested( std::runtime_error("remuxer thread error") );
+                }
+                catch (...)
+                {
+                    g_ThreadMan.addException(std::current_exception());
+                    g_ThreadMan.end();
+                }
+            }
+            LOG4CXX_INFO(logger, "Remuxer packet queue: " << pQueue->stats());
+            pQueue->cancel();   //do not let the reader queue packets for us anymore
+            LOG4CXX_DEBUG(logger, "Closing remuxer");
+            writer.writePacket(nullptr);
+            LOG4CXX_DEBUG(logger, "Exiting thread: isEnded=" << std::boolalpha << g_ThreadMan.isEnded());
+        });
+    }
+
+    std::thread threadedCancel(std::vector< std::shared_ptr<avtools::ThreadsafeFrame> > buses, const std::atomic_bool& isJoined)
+    {
+        return std::thread([buses, &isJoined](){
+            log4cxx::MDC::put("threadname", "cancel");
+            while ( !g_ThreadMan.isEnded() && !isJoined.load() )
+            {
+                std::this_thread::sleep_for(END_CHECK_INTERVAL);
+            }
+            if (isJoined.load())
+            {
+                return;
+            }
+            LOG4CXX_DEBUG(logger, "Program ended, cancelling the frame buses");
+            for (const auto& pBus: buses)
+            {
+                if (pBus)
+                {
+                    pBus->cancel();
+                }
+            }
+        });
+    }
+
 }   //::<anon>
@@ -0,0 +1,231 @@
+//
+//  test_warp_kernel.cxx
+//  zoomboard_server
+//
+//  Checks that the SIMD warp kernels give the same result as the scalar kernel bit-for-bit, and that the scalar kernel is
+//  within one level of cv::warpPerspective.
+//
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "WarpKernel.hpp"
+
+namespace
+{
+    static const int N_CASES = 50;                  ///< number of random images & transforms to try for each check
+    static const int BAND_ROWS = 37;                ///< rows of the bands that images are also warped in, to cover firstRow
+    static const double MAX_OPENCV_DIFF = 1;        ///< largest difference allowed from cv::warpPerspective
+    static const double SMOOTHING_SIGMA = 3;        ///< blur of the random images compared with cv::warpPerspective, see randomImage()
+
+    /// Makes a random image
+    /// @param[in, out] rng random number generator
+    /// @param[in] type image type, CV_8UC3 or CV_8UC1
+    /// @param[in] isSmooth if true, the noise is blurred and stretched back to the full range. cv::warpPerspective rounds the source
+    /// coordinates to 1/32 pixel, so the results can only be compared on images without large steps between neighboring pixels.
+    /// @return a random image of random size
+    cv::Mat randomImage(cv::RNG& rng, int type, bool isSmooth)
+    {
+        cv::Mat img(rng.uniform(40, 400), rng.uniform(40, 400), type);
+        rng.fill(img, cv::RNG::UNIFORM, 0, 256);
+        if (isSmooth)
+        {
+            cv::GaussianBlur(img, img, cv::Size(), SMOOTHING_SIGMA);
+            cv::normalize(img, img, 0, 255, cv::NORM_MINMAX);
+        }
+        return img;
+    }
+
+    /// Makes a random transform from the destination pixels to the source pixels
+    /// @param[in, out] rng random number generator
+    /// @param[in] srcSize size of the source image
+    /// @param[in] dstSize size of the destination image
+    /// @param[in] isInside if true, the destination maps to a quadrilateral inside the source image, otherwise the corners
+    /// of the destination can map anywhere around the source, including beyond the horizon of the transform
+    /// @return the transform
+    cv::Matx33d randomTransform(cv::RNG& rng, cv::Size srcSize, cv::Size dstSize, bool isInside)
+    {
+        const float w = (float) srcSize.width, h = (float) srcSize.height;
+        std::vector<cv::Point2f> srcCorners;
+        if (isInside)
+        {
+            // a corner in each third of the source, at least 2 pixels from its edges
+            srcCorners = {
+                cv::Point2f(rng.uniform(2.f, w / 3), rng.uniform(2.f, h / 3)),
+                cv::Point2f(rng.uniform(2 * w / 3, w - 3), rng.uniform(2.f, h / 3)),
+                cv::Point2f(rng.uniform(2 * w / 3, w - 3), rng.uniform(2 * h / 3, h - 3)),
+                cv::Point2f(rng.uniform(2.f, w / 3), rng.uniform(2 * h / 3, h - 3))
+            };
+        }
+        else
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                srcCorners.emplace_back(rng.uniform(-w / 2, 3 * w / 2), rng.uniform(-h / 2, 3 * h / 2));
+            }
+        }
+        const std::vector<cv::Point2f> dstCorners = {
+            cv::Point2f(0, 0), cv::Point2f((float) dstSize.width, 0), cv::Point2f((float) dstSize.width, (float) dstSize.height), cv::Point2f(0, (float) dstSize.height)
+        };
+        return cv::Matx33d(cv::getPerspectiveTransform(dstCorners, srcCorners));
+    }
+
+    /// Warps an image in bands, as the warper threads do
+    /// @param[in] src source image
+    /// @param[in] dstSize size of the destination image
+    /// @param[in] invTrf transform from the destination pixels to the source pixels
+    /// @param[in] borderValue value of each channel outside the source image
+    /// @param[in] isa instruction set to use
+    /// @return the warped image
+    cv::Mat warpInBands(const cv::Mat& src, cv::Size dstSize, const cv::Matx33d& invTrf, std::uint8_t borderValue, WarpIsa isa)
+    {
+        cv::Mat dst(dstSize, src.type());
+        for (int r = 0; r < dst.rows; r += BAND_ROWS)
+        {
+            cv::Mat band = dst.rowRange(r, std::min(r + BAND_ROWS, dst.rows));
+            warpPerspectiveBilinear(src, band, invTrf, r, borderValue, isa);
+        }
+        return dst;
+    }
+
+    /// Reports the result of a check
+    /// @param[in] name name of the check
+    /// @param[in] nFailed number of failed cases
+    /// @param[in] detail detail of the first failure
+    /// @return true if the check passed
+    bool report(const std::string& name, int nFailed, const std::string& detail)
+    {
+        if (nFailed > 0)
+        {
+            std::cout << "FAIL " << name << ": " << nFailed << " of " << N_CASES << " cases, e.g. " << detail << std::endl;
+            return false;
+        }
+        std::cout << "PASS " << name << std::endl;
+        return true;
+    }
+
+    /// Checks that an instruction set warps exactly as the scalar kernel
+    /// @param[in] isa instruction set
+    /// @param[in] type image type, CV_8UC3 or CV_8UC1
+    /// @param[in] seed random seed
+    /// @return true if the check passed
+    bool checkWarpMatchesScalar(WarpIsa isa, int type, std::uint64_t seed)
+    {
+        cv::RNG rng(seed);
+        int nFailed = 0;
+        std::string detail;
+        for (int n = 0; n < N_CASES; ++n)
+        {
+            const cv::Mat src = randomImage(rng, type, (n % 2 == 0));
+            const cv::Size dstSize(rng.uniform(1, 400), rng.uniform(1, 400));
+            const cv::Matx33d invTrf = randomTransform(rng, src.size(), dstSize, (n % 4 < 2));
+            const std::uint8_t borderValue = (std::uint8_t) rng.uniform(0, 256);
+            cv::Mat expected(dstSize, type);
+            warpPerspectiveBilinear(src, expected, invTrf, 0, borderValue, WarpIsa::SCALAR);
+            const cv::Mat actual = warpInBands(src, dstSize, invTrf, borderValue, isa);
+            const double diff = cv::norm(actual, expected, cv::NORM_INF);
+            if ( (diff != 0) && (nFailed++ == 0) )
+            {
+                detail = "case " + std::to_string(n) + " differs by up to " + std::to_string((int) diff);
+            }
+        }
+        std::ostringstream name;
+        name << isa << " warp of " << (type == CV_8UC3 ? "BGR24" : "plane") << " matches scalar";
+        return report(name.str(), nFailed, detail);
+    }
+
+    /// Checks that an instruction set remaps exactly as the scalar kernel
+    /// @param[in] isa instruction set
+    /// @param[in] type image type, CV_8UC3 or CV_8UC1
+    /// @param[in] seed random seed
+    /// @return true if the check passed
+    bool checkRemapMatchesScalar(WarpIsa isa, int type, std::uint64_t seed)
+    {
+        cv::RNG rng(seed);
+        int nFailed = 0;
+        std::string detail;
+        for (int n = 0; n < N_CASES; ++n)
+        {
+            const cv::Mat src = randomImage(rng, type, false);
+            cv::Mat map(rng.uniform(1, 400), rng.uniform(1, 400), CV_32FC2);
+            rng.fill(map, cv::RNG::UNIFORM, cv::Scalar(-2.f, -2.f), cv::Scalar(src.cols + 2.f, src.rows + 2.f));
+            const cv::Mat coords = toFixedPointCoords(map);
+            const std::uint8_t borderValue = (std::uint8_t) rng.uniform(0, 256);
+            cv::Mat expected(map.size(), type), actual(map.size(), type);
+            remapBilinear(src, expected, coords, borderValue, WarpIsa::SCALAR);
+            remapBilinear(src, actual, coords, borderValue, isa);
+            const double diff = cv::norm(actual, expected, cv::NORM_INF);
+            if ( (diff != 0) && (nFailed++ == 0) )
+            {
+                detail = "case " + std::to_string(n) + " differs by up to " + std::to_string((int) diff);
+            }
+        }
+        std::ostringstream name;
+        name << isa << " remap of " << (type == CV_8UC3 ? "BGR24" : "plane") << " matches scalar";
+        return report(name.str(), nFailed, detail);
+    }
+
+    /// Checks that the scalar kernel is within MAX_OPENCV_DIFF of cv::warpPerspective, for destinations that map inside the source
+    /// @param[in] type image type, CV_8UC3 or CV_8UC1
+    /// @param[in] seed random seed
+    /// @return true if the check passed
+    bool checkWarpMatchesOpenCV(int type, std::uint64_t seed)
+    {
+        cv::RNG rng(seed);
+        int nFailed = 0;
+        std::string detail;
+        double maxDiff = 0;
+        for (int n = 0; n < N_CASES; ++n)
+        {
+            const cv::Mat src = randomImage(rng, type, true);
+            const cv::Size dstSize(rng.uniform(1, 400), rng.uniform(1, 400));
+            const cv::Matx33d invTrf = randomTransform(rng, src.size(), dstSize, true);
+            cv::Mat actual(dstSize, type), expected;
+            warpPerspectiveBilinear(src, actual, invTrf, 0, 0, WarpIsa::SCALAR);
+            cv::warpPerspective(src, expected, invTrf, dstSize, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP, cv::BORDER_CONSTANT, cv::Scalar::all(0));
+            const double diff = cv::norm(actual, expected, cv::NORM_INF);
+            maxDiff = std::max(maxDiff, diff);
+            if ( (diff > MAX_OPENCV_DIFF) && (nFailed++ == 0) )
+            {
+                detail = "case " + std::to_string(n) + " differs by up to " + std::to_string((int) diff);
+            }
+        }
+        std::ostringstream name;
+        name << "scalar warp of " << (type == CV_8UC3 ? "BGR24" : "plane") << " is within " << MAX_OPENCV_DIFF
+            << " of cv::warpPerspective (max difference " << maxDiff << ")";
+        return report(name.str(), nFailed, detail);
+    }
+}   //::<anon>
+
+int main(int argc, const char * argv[])
+{
+    const std::uint64_t seed = (argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 0x5eed);
+    std::cout << "Random seed " << seed << ", best instruction set " << getBestWarpIsa() << std::endl;
+    bool isPassed = true;
+    for (const int type: {CV_8UC3, CV_8UC1})
+    {
+        isPassed &= checkWarpMatchesOpenCV(type, seed);
+        for (const WarpIsa isa: {WarpIsa::SSE41, WarpIsa::AVX2, WarpIsa::NEON})
+        {
+            if (!isWarpIsaSupported(isa))
+            {
+                std::cout << "SKIP " << isa << ": not supported by this cpu or build" << std::endl;
+                continue;
+            }
+            if (!hasWarpSimdKernel(isa, type))
+            {
+                std::cout << "SKIP " << isa << " " << (type == CV_8UC3 ? "BGR24" : "plane") << ": scalar-only, no SIMD kernel" << std::endl;
+                continue;
+            }
+            isPassed &= checkWarpMatchesScalar(isa, type, seed);
+            isPassed &= checkRemapMatchesScalar(isa, type, seed);
+        }
+    }
+    return (isPassed ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,174 @@
+//
+//  verify_board_detection.cxx
+//  zoomboard_server
+//
+//  Runs the board finder over a recorded clip of the board, and compares the markers it finds with cv::aruco at full resolution.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <log4cxx/logger.h>
+#include <log4cxx/basicconfigurator.h>
+#include <boost/program_options.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+#include "BoardFinder.hpp"
+
+namespace
+{
+    namespace bpo = ::boost::program_options;
+    typedef std::chrono::steady_clock Clock;
+
+    /// @class Comparison of the board finder with cv::aruco over a clip
+    struct Comparison
+    {
+        int nFrames = 0;                ///< number of frames compared
+        int nTracked = 0;               ///< number of frames the markers were tracked in rather than detected
+        int nMarkers = 0;               ///< number of markers found by both
+        int nMissed = 0;                ///< number of markers only found by cv::aruco
+        int nExtra = 0;                 ///< number of markers only found by the board finder
+        int nOff = 0;                   ///< number of markers found by both with a corner further apart than the allowed difference
+        double meanDiff = 0;            ///< mean of the largest corner difference of each marker, in pixels
+        double maxDiff = 0;             ///< largest corner difference, in pixels
+        double finderTime = 0;          ///< total time the board finder took, in ms
+        double arucoTime = 0;           ///< total time cv::aruco took, in ms
+    };
+
+    /// @return the time since a start time, in ms
+    /// @param[in] start start time
+    inline double getElapsed(const Clock::time_point& start)
+    {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+}   //::<anon>
+
+int main(int argc, const char * argv[])
+{
+    log4cxx::BasicConfigurator::configure();
+    std::string clipFile, calibrationFile;
+    int detectionInterval;
+    double maxDiff;
+    bpo::options_description programDesc("Usage: verify_board_detection [options] -c <calibration_file.json> <clip>");
+    programDesc.add_options()
+    ("help,h", "produce help message")
+    ("calibration,c", bpo::value<std::string>(&calibrationFile)->required(), "calibration file with the markers of the board")
+    ("clip", bpo::value<std::string>(&clipFile)->required(), "recorded clip of the board, as the camera sees it")
+    ("detection_interval,d", bpo::value<int>(&detectionInterval)->default_value(1),
+     "detect the markers every this many frames, and track them in between as the server does")
+    ("max_diff", bpo::value<double>(&maxDiff)->default_value(3.),
+     "largest difference allowed from the corners cv::aruco finds, in pixels, which are themselves only accurate to a pixel or two")
+    ("verbose,v", "log the board finder's debug messages")
+    ;
+    bpo::positional_options_description positionalDesc;
+    positionalDesc.add("clip", 1);
+    bpo::variables_map vm;
+    try
+    {
+        bpo::store(bpo::command_line_parser(argc, argv).options(programDesc).positional(positionalDesc).run(), vm);
+        if (vm.count("help"))
+        {
+            std::cout << programDesc << std::endl;
+            return EXIT_SUCCESS;
+        }
+        bpo::notify(vm);
+    }
+    catch (std::exception& err)
+    {
+        std::cerr << err.what() << "\n" << programDesc << std::endl;
+        return EXIT_FAILURE;
+    }
+    if ( (detectionInterval < 1) || (maxDiff < 0.) )
+    {
+        std::cerr << "The detection interval should be positive, and the largest difference should not be negative." << std::endl;
+        return EXIT_FAILURE;
+    }
+    log4cxx::Logger::getRootLogger()->setLevel(vm.count("verbose") ? log4cxx::Level::getDebug() : log4cxx::Level::getWarn());
+
+    cv::VideoCapture clip(clipFile);
+    if (!clip.isOpened())
+    {
+        std::cerr << "Unable to open " << clipFile << std::endl;
+        return EXIT_FAILURE;
+    }
+    BoardFinder boardFinder(calibrationFile);
+    Comparison result;
+    cv::Mat frame;
+    while (clip.read(frame))
+    {
+        // Find the markers as the detector thread does, detecting them every few frames and tracking them in between
+        auto start = Clock::now();
+        std::vector< std::vector<cv::Point2f> > corners;
+        if ( (result.nFrames % detectionInterval != 0) && boardFinder.isTracking() )
+        {
+            corners = boardFinder.trackCorners(frame);
+            result.nTracked += (corners.empty() ? 0 : 1);
+        }
+        if (corners.empty())
+        {
+            corners = boardFinder.getCorners(frame);
+        }
+        result.finderTime += getElapsed(start);
+        start = Clock::now();
+        const auto arucoCorners = boardFinder.getArucoCorners(frame);
+        result.arucoTime += getElapsed(start);
+
+        for (std::size_t i = 0; i < corners.size(); ++i)
+        {
+            if (corners[i].empty() != arucoCorners[i].empty())
+            {
+                const bool isMissed = corners[i].empty();
+                if (isMissed)
+                {
+                    ++result.nMissed;
+                }
+                else
+                {
+                    ++result.nExtra;
+                }
+                std::cout << "Frame " << result.nFrames << ": marker " << i << " is only found by "
+                    << (isMissed ? "cv::aruco" : "the board finder") << std::endl;
+                continue;
+            }
+            if (corners[i].empty())
+            {
+                continue;
+            }
+            double diff = 0;
+            for (std::size_t j = 0; j < corners[i].size(); ++j)
+            {
+                diff = std::max(diff, cv::norm(corners[i][j] - arucoCorners[i][j]));
+            }
+            ++result.nMarkers;
+            result.meanDiff += diff;
+            result.maxDiff = std::max(result.maxDiff, diff);
+            if (diff > maxDiff)
+            {
+                ++result.nOff;
+                std::cout << "Frame " << result.nFrames << ": the corners of marker " << i << " are " << diff
+                    << " pixels from the ones cv::aruco finds" << std::endl;
+            }
+        }
+        ++result.nFrames;
+    }
+    if (result.nFrames == 0)
+    {
+        std::cerr << "No frames read from " << clipFile << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+        << result.nFrames << " frames of " << clipFile << ", markers tracked in " << result.nTracked << " of them\n"
+        << result.nMarkers << " markers found by both, " << result.nMissed << " only by cv::aruco, " << result.nExtra << " only by the board finder\n"
+        << "Corner difference from cv::aruco: mean " << (result.nMarkers > 0 ? result.meanDiff / result.nMarkers : 0.)
+        << " pixels, largest " << result.maxDiff << " pixels, " << result.nOff << " markers further than " << maxDiff << " pixels\n"
+        << "Mean time per frame: board finder " << result.finderTime / result.nFrames << " ms, cv::aruco at full resolution "
+        << result.arucoTime / result.nFrames << " ms" << std::endl;
+    const bool isPassed = (result.nMissed == 0) && (result.nExtra == 0) && (result.nOff == 0);
+    std::cout << (isPassed ? "PASS" : "FAIL") << std::endl;
+    return (isPassed ? EXIT_SUCCESS : EXIT_FAILURE);
+}